@@ -3,8 +3,13 @@ set -e
 
 minctracc -identity object1_dxyz.mnc object2_dxyz.mnc \
      -est_center -debug -use_bfgs -lsq6 -step 8 8 8 \
-     -clobber output.bfgs1.xfm
+     -clobber output.bfgs1.xfm 2> bfgs1.log
 
+# -debug reports every BFGS iteration: make sure BFGS did the fit
+if ! grep -q "BFGS progress" bfgs1.log; then
+  echo >&2 $0 failed: -use_bfgs did not select the BFGS optimizer.
+  exit 1
+fi
      
 param2xfm -rotation -4 7 10 -translation  5 2 -6 -clobber ideal.test1.xfm
 
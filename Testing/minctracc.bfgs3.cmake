@@ -0,0 +1,29 @@
+#! /bin/sh
+set -e
+
+if [[ -z $MINCTRACC ]];then
+  echo MINCTRACC not set
+  exit 1
+fi
+
+# the analytic gradient of -xcorr has to agree with its central
+# difference estimate at the starting point of the fit
+${MINCTRACC} -identity object1_dxyz.mnc object2_dxyz.mnc \
+    -est_center -xcorr -use_bfgs -lsq6 -step 8 8 8 \
+    -bfgs_check_gradient -bfgs_epsilon 0.001 \
+    -clobber output.bfgs3.xfm > bfgs3.log
+
+difference=`grep "max relative difference" bfgs3.log | awk '{print $NF}'`
+echo $0 gradient difference\: $difference
+
+if [ -z "$difference" ];then
+  echo $0 gradient check was not run
+  exit 1
+fi
+
+#TODO: 0.05 is an estimate, confirm it with a ctest run of a real build
+tresult=$(echo "$difference<0.05" | bc)
+if [ $tresult != 1 ];then
+  echo $0 analytic and central difference gradients differ
+  exit 1
+fi
@@ -0,0 +1,22 @@
+#! /bin/sh
+set -e
+
+# same fit as minctracc.bfgs1.cmake, once serial and once threaded:
+# the transformations must be identical
+
+minctracc -identity object1_dxyz.mnc object2_dxyz.mnc \
+     -est_center -debug -use_bfgs -lsq6 -step 8 8 8 \
+     -threads 1 -clobber output.bfgs4_serial.xfm
+
+minctracc -identity object1_dxyz.mnc object2_dxyz.mnc \
+     -est_center -debug -use_bfgs -lsq6 -step 8 8 8 \
+     -threads 4 -clobber output.bfgs4_threads.xfm
+
+# the comments hold the command line, so compare the transforms only
+grep -v "^%" output.bfgs4_serial.xfm  > output.bfgs4_serial.txt
+grep -v "^%" output.bfgs4_threads.xfm > output.bfgs4_threads.txt
+
+if ! cmp -s output.bfgs4_serial.txt output.bfgs4_threads.txt ;then
+  echo >&2 $0 failed: threaded linear fit differs from serial.
+  exit 1
+fi
@@ -0,0 +1,31 @@
+#! /bin/sh
+set -e
+
+if [[ -z $MINCTRACC ]];then
+  echo MINCTRACC not set
+  exit 1
+fi
+
+# the final xcorr of a nonlinear fit, computed through the fused warp
+# (used by -nonlinear_xcorr_tol) and through general_transform_point(),
+# must agree
+
+${MINCTRACC} -iterations 4 \
+    -identity object1_dxyz.mnc object2_dxyz.mnc \
+    -est_center -step 10 10 10 -nonlin \
+    -nonlinear_check_xcorr -clobber def_check_xcorr.xfm > check_xcorr.log
+
+difference=`grep "xcorr check: fused" check_xcorr.log | awk '{print $NF}'`
+echo $0 xcorr difference\: $difference
+
+if [ -z "$difference" ];then
+  echo $0 xcorr check was not run
+  exit 1
+fi
+
+#TODO: 0.001 is an estimate, confirm it with a ctest run of a real build
+# the difference is printed with %g, which bc does not read
+if ! awk -v d="$difference" 'BEGIN { exit !(d < 0.001) }' ;then
+  echo $0 fused and general xcorr differ
+  exit 1
+fi
@@ -0,0 +1,34 @@
+#! /bin/sh
+set -e
+
+if [[ -z $XCORR_VOL ]];then
+  echo XCORR_VOL not set
+  exit 1
+fi
+
+if [[ -z $MINCTRACC ]];then
+  echo MINCTRACC not set
+  exit 1
+fi
+
+# same fit as minctracc.test2.cmake, once serial and once threaded:
+# the deformation fields must be identical
+
+${MINCTRACC} -iterations 4 \
+    -identity object1_dxyz.mnc object2_dxyz.mnc \
+    -est_center -step 10 10 10 -nonlin \
+    -threads 1 -clobber def_serial.xfm 
+
+${MINCTRACC} -iterations 4 \
+    -identity object1_dxyz.mnc object2_dxyz.mnc \
+    -est_center -step 10 10 10 -nonlin \
+    -threads 4 -clobber def_threads.xfm 
+
+# headers differ (history), so compare the voxel values only
+mincextract -double -normalize def_serial_grid_0.mnc  > def_serial_grid_0.raw
+mincextract -double -normalize def_threads_grid_0.mnc > def_threads_grid_0.raw
+
+if ! cmp -s def_serial_grid_0.raw def_threads_grid_0.raw ;then
+  echo $0 threaded deformation differs from serial
+  exit 1
+fi
@@ -0,0 +1,60 @@
+#! /bin/sh
+set -e
+
+if [[ -z $MINCTRACC ]];then
+  echo MINCTRACC not set
+  exit 1
+fi
+
+# a fit killed after its first checkpoint and continued with -resume
+# must end with the same deformation field as an uninterrupted fit
+
+${MINCTRACC} -iterations 6 \
+    -identity object1_dxyz.mnc object2_dxyz.mnc \
+    -est_center -step 10 10 10 -nonlin \
+    -clobber def_full.xfm > full.log
+
+rm -rf def_checkpoint
+
+${MINCTRACC} -iterations 6 \
+    -identity object1_dxyz.mnc object2_dxyz.mnc \
+    -est_center -step 10 10 10 -nonlin \
+    -checkpoint def_checkpoint -checkpoint_interval 2 \
+    -clobber def_resumed.xfm > /dev/null &
+pid=$!
+
+while [ ! -f def_checkpoint/nonlinear.checkpoint ];do
+  if ! kill -0 $pid 2> /dev/null;then
+    echo $0 fit ended without a checkpoint
+    exit 1
+  fi
+  sleep 0.1
+done
+kill -9 $pid 2> /dev/null || true
+wait $pid || true
+
+${MINCTRACC} -iterations 6 \
+    -identity object1_dxyz.mnc object2_dxyz.mnc \
+    -est_center -step 10 10 10 -nonlin \
+    -checkpoint def_checkpoint -checkpoint_interval 2 -resume \
+    -clobber def_resumed.xfm > resume.log
+
+if ! grep -q "Resuming the fit after iteration" resume.log ;then
+  echo $0 fit was not resumed from the checkpoint
+  exit 1
+fi
+
+# the resumed run reports the correlation before its first iteration
+if [ "`grep "Initial objective" full.log`" != "`grep "Initial objective" resume.log`" ];then
+  echo $0 resumed fit reports another initial correlation
+  exit 1
+fi
+
+# headers differ (history), so compare the voxel values only
+mincextract -double -normalize def_full_grid_0.mnc    > def_full_grid_0.raw
+mincextract -double -normalize def_resumed_grid_0.mnc > def_resumed_grid_0.raw
+
+if ! cmp -s def_full_grid_0.raw def_resumed_grid_0.raw ;then
+  echo $0 resumed deformation differs from the uninterrupted one
+  exit 1
+fi
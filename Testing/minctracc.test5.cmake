@@ -0,0 +1,32 @@
+#! /bin/sh
+set -e
+
+if [[ -z $MINCTRACC ]];then
+  echo MINCTRACC not set
+  exit 1
+fi
+
+# with tolerances that every iteration meets, the nonlinear fit has
+# to stop after -nonlinear_patience iterations and report why
+
+${MINCTRACC} -iterations 30 -verbose 1 \
+    -identity object1_dxyz.mnc object2_dxyz.mnc \
+    -est_center -step 10 10 10 -nonlin \
+    -nonlinear_tol 100 -nonlinear_patience 2 \
+    -clobber def_tol.xfm > tol.log
+
+if ! grep -q "Stopping after iteration 2 of 30: mean additional deformation .* for 2 iteration(s)" tol.log ;then
+  echo $0 -nonlinear_tol did not stop the fit after 2 iterations
+  exit 1
+fi
+
+${MINCTRACC} -iterations 30 -verbose 1 \
+    -identity object1_dxyz.mnc object2_dxyz.mnc \
+    -est_center -step 10 10 10 -nonlin \
+    -nonlinear_xcorr_tol 1.0 -nonlinear_patience 3 \
+    -clobber def_xcorr_tol.xfm > xcorr_tol.log
+
+if ! grep -q "Stopping after iteration 3 of 30: xcorr improvement .* for 3 iteration(s)" xcorr_tol.log ;then
+  echo $0 -nonlinear_xcorr_tol did not stop the fit after 3 iterations
+  exit 1
+fi
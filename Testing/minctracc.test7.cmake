@@ -0,0 +1,37 @@
+#! /bin/sh
+set -e
+
+if [[ -z $XCORR_VOL ]];then
+  echo XCORR_VOL not set
+  exit 1
+fi
+
+if [[ -z $MINCTRACC ]];then
+  echo MINCTRACC not set
+  exit 1
+fi
+
+# the fit of minctracc.test2.cmake, coarse to fine in a single run:
+# 20 mm then 10 mm, the step of minctracc.test2.cmake
+
+${MINCTRACC} -identity object1_dxyz.mnc object2_dxyz.mnc \
+    -est_center -debug -nonlin \
+    -nonlinear_schedule 20:10 -nonlinear_iterations 5:10 \
+    -clobber def_schedule.xfm > schedule.log
+
+if ! grep -q "Level 2 of 2: step 10 mm, 10 iterations" schedule.log ;then
+  echo $0 -nonlinear_schedule did not run its second level
+  exit 1
+fi
+
+mincresample object1.mnc -like object2.mnc -transform def_schedule.xfm object1_schedule_res.mnc -clob
+
+corr_after=`${XCORR_VOL} object1_schedule_res.mnc object2.mnc|cut -c 1-7`
+echo $0 xcorr after\: $corr_after
+#TODO: 0.9800 is an estimate, confirm it with a ctest run of a real build
+tresult=$(echo "$corr_after>=0.9800 && $corr_after<1.0" | bc)
+if [ $tresult != 1 ];then
+  echo $0 Corr test after failed 
+  echo corr_after=\"${corr_after}\"
+  exit 1
+fi
@@ -0,0 +1,32 @@
+#! /bin/sh
+set -e
+
+if [[ -z $XCORR_VOL ]];then
+  echo XCORR_VOL not set
+  exit 1
+fi
+
+if [[ -z $MINCTRACC ]];then
+  echo MINCTRACC not set
+  exit 1
+fi
+
+# the fit of minctracc.test2.cmake with Gauss-Newton steps instead of
+# the simplex for the local deformations
+
+${MINCTRACC} -iterations 10 \
+    -identity object1_dxyz.mnc object2_dxyz.mnc \
+    -est_center -debug -step 10 10 10 -nonlin -local_gn \
+    -clobber def_gn.xfm
+
+mincresample object1.mnc -like object2.mnc -transform def_gn.xfm object1_gn_res.mnc -clob
+
+corr_after=`${XCORR_VOL} object1_gn_res.mnc object2.mnc|cut -c 1-7`
+echo $0 xcorr after\: $corr_after
+#TODO: 0.9500 is an estimate, confirm it with a ctest run of a real build
+tresult=$(echo "$corr_after>=0.9500 && $corr_after<1.0" | bc)
+if [ $tresult != 1 ];then
+  echo $0 Corr test after failed 
+  echo corr_after=\"${corr_after}\"
+  exit 1
+fi
@@ -90,12 +90,6 @@ static void init_the_volume_to_zero(VIO_Volume volume);
 static void get_volume_XYZV_indices(VIO_Volume data, int xyzv[]);
 
 char *prog_name;
-int stat_quad_total;
-int stat_quad_zero;
-int stat_quad_two;
-int stat_quad_plus;
-int stat_quad_minus;
-int stat_quad_semi;
 
 double  ftol                     = 0.005;
 double  simplex_size             = 20.0;
@@ -47,6 +47,7 @@ static char rcsid[]="$Header: /private-cvsroot/registration/mni_autoreg/minctrac
 #endif
 
 #include <volume_io.h>
+#include <quad_max_fit.h>
 
 /* Constants */
 #ifndef TRUE
@@ -76,7 +77,8 @@ VIO_BOOL return_3D_disp_from_quad_fit(VIO_Real r[3][3][3],
 VIO_BOOL return_3D_disp_from_min_quad_fit(VIO_Real r[3][3][3], 
                                                 VIO_Real *dispu, 
                                                 VIO_Real *dispv, 
-                                                VIO_Real *dispw);        
+                                                VIO_Real *dispw,
+                                                Quad_Fit_Stats *stats);        
 
 
 void setup_val(VIO_Real val[3][3][3]) {
@@ -210,7 +212,7 @@ int main(int argc, char *argv[])
     print ("     %12.8f %12.8f %12.8f\n",dir_min[i], dir_mid[i],dir_max[i]);
 
   if (flag) {
-    flag = return_3D_disp_from_min_quad_fit(val, &du, &dv, &dw);
+    flag = return_3D_disp_from_min_quad_fit(val, &du, &dv, &dw, NULL);
 
     if (flag) 
       print ("flag is True (covar matrix is pos def)\n"); 
@@ -57,6 +57,14 @@
 #define OPT_SIMPLEX       0
 #define OPT_BFGS		1
 
+                                /* default step of the finite-difference
+                                   gradient of -use_bfgs (-bfgs_epsilon) */
+#define BFGS_EPSILON_DEFAULT 0.00005
+
+                                /* value of trans_info.use_simplex for
+                                   -local_gn (TRUE: simplex, FALSE: quadratic) */
+#define LOCAL_GAUSS_NEWTON 2
+
 #define SLICE_IND 0
 #define ROW_IND   1
 #define COL_IND   2
@@ -12,12 +12,19 @@ VIO_BOOL get_average_warp_of_neighbours(VIO_General_transform *trans,
 void add_additional_warp_to_current(VIO_General_transform *additional,
                                            VIO_General_transform *current,
                                            VIO_Real weight);
+VIO_BOOL get_warp_voxel_strides(VIO_Volume volume, long strides[]);
+void get_warp_vectors(VIO_Volume volume, int count[], double *vectors);
+void set_warp_vectors(VIO_Volume volume, int start[], int end[], double *vectors);
 void smooth_the_warp(VIO_General_transform *smoothed,
                             VIO_General_transform *current,
-                            VIO_Volume warp_mag, VIO_Real thres) ;
+                            VIO_Volume warp_mag, VIO_Real thres,
+                            VIO_Real smoothing_weight,
+                            int n_threads) ;
 void extrapolate_to_unestimated_nodes(VIO_General_transform *current,
                                              VIO_General_transform *additional,
-                                             VIO_Volume estimated_flag_vol) ;
+                                             VIO_Volume estimated_flag_vol,
+                                             int max_waves,
+                                             int n_threads) ;
 
 VIO_Real get_value_of_point_in_volume(VIO_Real xw, VIO_Real yw, VIO_Real zw, 
                                           VIO_Volume data);
@@ -41,3 +48,8 @@ float xcorr_objective_with_def(VIO_Volume d1,
                                       VIO_Volume m1,
                                       VIO_Volume m2, 
                                       Arg_Data *globals);
+void check_xcorr_objective_with_def(VIO_Volume d1,
+                                    VIO_Volume d2,
+                                    VIO_Volume m1,
+                                    VIO_Volume m2, 
+                                    Arg_Data *globals);
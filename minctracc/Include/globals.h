@@ -26,20 +26,11 @@ extern VIO_Volume  data_dy;
 extern VIO_Volume  data_dz;
 extern VIO_Volume  data_dxyz;
 
-extern double  ftol;
-extern double  simplex_size;
-extern int     iteration_limit;
-extern double  iteration_weight;
-extern double  smoothing_weight;
-extern double  similarity_cost_ratio;
-extern int     number_dimensions;
 extern int     Matlab_num_steps;
-extern int     Diameter_of_local_lattice;
 
 extern int     invert_mapping_flag;
 extern int     clobber_flag;
 
-extern VIO_Real initial_corr, final_corr;
 
 
   
@@ -4,9 +4,22 @@
 #include "minctracc_point_vector.h"
 
 
+/* direct access to the voxels of volumes stored as NC_DOUBLE or NC_FLOAT */
+VIO_BOOL get_volume_voxel_buffer(VIO_Volume volume, 
+                                 double **double_voxels, float **float_voxels,
+                                 long strides[]);
+
+/* the world to voxel transform of a volume, as a 3x4 matrix */
+void get_world_to_voxel_matrix(VIO_Volume volume, VIO_Real m[3][4]);
+
 int trilinear_interpolant(VIO_Volume volume, 
                                  PointR *coord, double *result);
 
+/* trilinear_interpolant(), with the derivatives along the voxel axes */
+int trilinear_interpolant_with_gradient(VIO_Volume volume, 
+                                        PointR *coord, double *result,
+                                        double gradient[]);
+
 int tricubic_interpolant(VIO_Volume volume, 
                                 PointR *coord, double *result);
 
@@ -42,8 +42,8 @@
       Point_x(coord), Point_y(coord), Point_z(coord), \
       &(Point_x(result)), &(Point_y(result)), &(Point_z(result)) )
 
-#define INTERPOLATE_TRUE_VALUE(volume, coord, result) \
-   (*(main_args->interpolant)) (volume, coord, result)
+#define INTERPOLATE_TRUE_VALUE(globals, volume, coord, result) \
+   (*((globals)->interpolant)) (volume, coord, result)
 
 #ifndef DEBUG_PRINT
 #   define DEBUG_PRINT(str) if (main_args->flags.debug) (void) fprintf (stderr,  str  );
@@ -129,6 +129,14 @@ int get_mask_file(char *dst, char *key, char *nextArg);
 
 int get_nonlinear_objective(char *dst, char *key, char *nextArg);
 
+int get_voxel_type(char *dst, char *key, char *nextArg);
+
+int get_grid_type(char *dst, char *key, char *nextArg);
+
+int get_bfgs_epsilon(char *dst, char *key, char *nextArg);
+
+int get_nonlinear_schedule(char *dst, char *key, char *nextArg);
+
 int get_feature_volumes(char *dst, char *key, int argc, char **argv);
 
 void procrustes(int npoints, int ndim, 
@@ -68,6 +68,11 @@ typedef struct {
   VIO_Real max_def_magnitude;        /* maximum size of deformation in def field */
   int use_simplex;
   int use_bfgs;
+  VIO_Real bfgs_epsilon;             /* step of the finite-difference gradient */
+  int bfgs_epsilon_given;            /* -bfgs_epsilon was on the command line   */
+  int bfgs_central;                  /* central instead of forward differences */
+  int bfgs_numerical;                /* finite differences even for xcorr, mi  */
+  int bfgs_check_gradient;           /* compare analytic and numerical gradient */
   int use_super;
   int use_local_smoothing;
   int use_local_isotropic;
@@ -88,6 +93,64 @@ typedef struct {
   int rotation_type;            /* type of rotation quaternion used or not */
 } Program_Transformation;
 
+#define MAX_NONLINEAR_LEVELS 16
+
+typedef struct {                /* see -nonlinear_schedule                    */
+  int    levels;                /* # of levels (0 = a single fit)             */
+  double step[MAX_NONLINEAR_LEVELS];      /* grid step (mm) of each level     */
+  int    iteration_levels;      /* # of values in iterations[] (0 = none)     */
+  int    iterations[MAX_NONLINEAR_LEVELS];/* iterations of each level         */
+  int    blur_levels;           /* # of values in blur[] (0 = none)           */
+  double blur[MAX_NONLINEAR_LEVELS];      /* fwhm (mm) of the blur applied to
+                                             source and target (0 = none)     */
+  int    current;               /* level being fit (0 without a schedule)     */
+} Nonlinear_Schedule;
+
+typedef struct {
+  int    iteration_limit;       /* total number of iterations                 */
+  double iteration_weight;      /* weight given to a single iteration         */
+  double smoothing_weight;      /* weight given to neighbours (stiffness)     */
+  double similarity_cost_ratio; /* obj fn = sim*s_c_r + cost*(1-s_c_r)        */
+  int    sub_lattice_diameter;  /* # of nodes along diameter of sub-lattice   */
+  double source_cache_size;     /* Mb used to keep the source samples of
+                                   the nodes between iterations (0 = none)   */
+  double active_tolerance;      /* re-estimate only the nodes (and their
+                                   neighbours) whose additional deformation
+                                   exceeded this (mm) on the previous
+                                   iteration (0 = all nodes, always)         */
+  Nonlinear_Schedule schedule;  /* coarse to fine levels of the fit          */
+  char   *checkpoint_dir;       /* where the state of the fit is saved
+                                   (NULL = no checkpoints)                   */
+  int    checkpoint_interval;   /* save every this many iterations           */
+  int    resume;                /* continue from the last checkpoint         */
+  double tolerance;             /* stop when the mean additional deformation
+                                   is below this (mm) (0 = never)            */
+  double xcorr_tolerance;       /* or when the xcorr improves by less than
+                                   this (0 = never)                          */
+  int    patience;              /* for this many iterations in a row         */
+  int    extrapolation_waves;   /* layers of unestimated nodes around the
+                                   estimated ones that receive extrapolated
+                                   vectors (0 = all those reached)           */
+  int    check_xcorr;           /* compare the fused and general evaluations
+                                   of the final xcorr                        */
+} Program_Nonlinear;
+
+typedef struct {                /* state of the linear fit in progress,
+                                   set up by optimize_linear_transformation() */
+  VIO_Volume data1, data2;      /* volumes in the order seen by fit_function() */
+  VIO_Volume mask1, mask2;
+  int    inverse_mapping;       /* TRUE if data1 is the target volume         */
+  int    ndim;                  /* # of parameters optimized                  */
+  struct Segment_Table_Struct
+         *segment_table;        /* for variance of ratios                     */
+  VIO_Real **prob_hash_table;   /* for mutual information                     */
+  VIO_Real *prob_fn1;           /*     for vol 1                              */
+  VIO_Real *prob_fn2;           /*     for vol 2                              */
+  struct Lattice_Table_struct
+         *lattice_table;        /* source lattice of xcorr, see
+                                   prepare_lattice_table()                    */
+} Linear_Fit;
+
 struct Arg_Data_struct {
   Program_Filenames      filenames;    /* names of all data filename to be used      */
   Program_Flags          flags;               /* flags (debug, verbose etc...               */ 
@@ -111,6 +174,15 @@ struct Arg_Data_struct {
   double                 speckle;      /* percent noise speckle                      */
   int                    groups;       /* number of groups to use for ratio of variance */
   int                    blur_pdf;     /* number of voxels for blurring in -mi pdfs */
+  int                    threads;      /* number of threads for fitting (0=all)           */
+  Program_Nonlinear      nonlinear;    /* parameters of the nonlinear fit             */
+  nc_type                voxel_type;   /* NC_DOUBLE or NC_FLOAT, for the volumes loaded */
+  nc_type                grid_type;    /* NC_DOUBLE or NC_FLOAT, for the deformation grids */
+  double                 simplex_size; /* radius of the simplex (-simplex)             */
+  double                 ftol;         /* stopping tolerance of the simplex (-tol)     */
+  VIO_Real               initial_corr; /* objective function before the fit           */
+  VIO_Real               final_corr;   /*                    and after it             */
+  Linear_Fit             fit;          /* state of the linear fit in progress         */
 };
 
 
@@ -0,0 +1,237 @@
+/*------------------------------ MNI Header ----------------------------------
+@NAME       : nonlinear_context.h
+@DESCRIPTION: state used to fit a deformation field.
+
+              Nonlinear_Context holds everything that
+              do_non_linear_optimization() communicates to the
+              routines called while estimating the deformation of a
+              node (the data, the local simplex radius, the linear part
+              of the transformation, ...).  One is built per call, so
+              that two registrations may run in the same process.
+
+              Node_Context is the working storage used to estimate the
+              deformation vector of a single node of the deformation
+              grid.  Each thread of do_non_linear_optimization() owns
+              one of these, so that the nodes of a slice may be
+              estimated concurrently.
+@CREATED    : Oct 18, 2026
+-----------------------------------------------------------------------------*/
+
+#ifndef MINCTRACC_NONLINEAR_CONTEXT_H
+#define MINCTRACC_NONLINEAR_CONTEXT_H
+
+#include <volume_io.h>
+#include "minctracc_arg_data.h"
+#include "quad_max_fit.h"
+
+                                /* source samples of a node, see
+                                   source_cache.c                            */
+typedef struct Source_Samples_struct Source_Samples;
+
+typedef struct {
+  long     n_nodes;             /* # of nodes of the deformation grid        */
+  int      n_features;
+  int      len;                 /* # of samples in each sub-lattice          */
+  Source_Samples **nodes;       /* [node], NULL when not cached              */
+  long     n_cached;            /* # of nodes cached                         */
+  long     n_bytes;             /* memory used by the cache                  */
+  long     max_bytes;           /* and its budget                            */
+} Source_Sample_Cache;
+
+                                /* a volume sampled by the optical flow
+                                   objective function, see optical_flow.c    */
+typedef struct {
+  VIO_Volume volume;
+  int      sizes[3];
+  VIO_Real world_to_voxel[3][4];/* voxel = M (x,y,z,1)                       */
+  double   *double_voxels;      /* direct access to the voxels, when         */
+  float    *float_voxels;       /* possible (see get_volume_voxel_buffer())  */
+  long     strides[3];
+} Flow_Volume;
+
+typedef struct {
+  Flow_Volume source;
+  Flow_Volume target;
+  VIO_Real    steps[3];         /* voxel size of the source volume           */
+  VIO_Real    min_deriv;        /* smaller derivatives are ignored           */
+} Optical_Flow_Data;
+
+typedef struct {
+  Arg_Data *globals;            /* data, features and lattice info           */
+  int      number_dimensions;   /* ==2 or ==3                                */
+  int      sub_lattice_diameter;/* # of nodes along diameter of sub-lattice  */
+  VIO_Real simplex_size;        /* the radius of the local simplex (voxels)  */
+  VIO_Real cost_radius;         /* constant used in the cost function        */
+  VIO_Real similarity_cost_ratio;/* obj fn = sim*s_c_r + cost*(1-s_c_r)      */
+  VIO_Real smoothing_weight;    /* weight given to neighbours                */
+  VIO_Real iteration_weight;    /* weight given to a single iteration        */
+  int      iteration_limit;     /* total number of iterations                */
+
+                                /* the input transformation split into a
+                                   linear part and a super-sampled
+                                   non-linear part                           */
+  VIO_General_transform *linear_transform;
+  VIO_General_transform *super_sampled_warp;
+  VIO_Volume            super_sampled_vol;
+
+                                /* eigen value stats of the previous
+                                   iteration, used for non-isotropic
+                                   smoothing                                 */
+  VIO_Real previous_mean_eig_val[3];
+  VIO_Real previous_std_eig_val[3];
+
+                                /* the sub-lattice around the origin, see
+                                   build_sub_lattice_template()              */
+  int      template_len;        /* # of nodes in the template                */
+  float    *template_world[3];  /* world offsets of the nodes (1..len)       */
+  float    **template_voxel[3]; /* [feature][1..len] the same, in voxels of
+                                   the source volume of each feature         */
+
+                                /* source samples kept across iterations     */
+  Source_Sample_Cache source_cache;
+
+                                /* [feature], set for the optical flow
+                                   features only; NULL if there are none     */
+  Optical_Flow_Data *optical_flow;
+
+                                /* world to voxel transforms used to test
+                                   the target position of each node: for
+                                   the target volume of the 1st feature,
+                                   and the target mask of each feature       */
+  VIO_Real target_world_to_voxel[3][4];
+  VIO_Real (*mask_world_to_voxel)[3][4];
+
+                                /* TRUE when the target lattice of all
+                                   features is interpolated at once, see
+                                   go_get_feature_samples_with_offset()      */
+  VIO_BOOL fused_features;
+} Nonlinear_Context;
+
+typedef struct {
+  Nonlinear_Context *nl;        /* the fit this node belongs to              */
+  long     node;                /* index of the node in the grid, -1 if none */
+
+  float    **a1_features;       /* samples in source sub-lattice             */
+  VIO_BOOL **masked_samples;    /* masked samples in source sub-lattice      */
+  float    *sqrt_features;      /* normalization const for correlation       */
+  float    *SX, *SY, *SZ;       /* sample sub-lattice positions in source    */
+  float    *TX, *TY, *TZ;       /* sample sub-lattice positions in target    */
+  float    *VX, *VY, *VZ;       /* the source positions, in voxels           */
+  int      len;                 /* # of samples in sub-lattice               */
+  int      target_sample_count; /* # of non-masked samples in target         */
+
+                                /* tri-linear interpolation of the target
+                                   sub-lattice, shared by all features
+                                   (0..len-1)                                */
+  long     *target_index;       /* offset of the 1st neighbour in the volume */
+  int      *target_inside;      /* whether the node is inside the volume     */
+  double   *target_weight[8];   /* weights of the 8 neighbours               */
+  double   *target_samples;     /* the samples of one feature                */
+  double   *target_active;      /* 1.0 if the feature uses the node, or 0.0  */
+  float    *feature_sim;        /* [feature] similarity at one displacement  */
+
+                                /* principal curvature info from the last
+                                   call to return_locally_smoothed_def()     */
+  VIO_BOOL have_eig;
+  VIO_Real eig_vals[3];
+  VIO_Real conf[3];
+
+                                /* quadratic fits of this thread in the
+                                   current iteration                         */
+  Quad_Fit_Stats quad_stats;
+} Node_Context;
+
+
+/* objective function minimized for a local deformation, evaluated on
+   the sub-lattice stored in *context, with the target lattice
+   displaced by d[1..3] voxels */
+
+VIO_Real local_objective_function(Node_Context *context, float *d);
+
+/* local_objective_function() for each of the 3x3x3 displacements
+   (disp[i],disp[j],disp[k]) of the quadratic fit, computed in one pass
+   over the sub-lattice; in 2D only obj[i][j][1] is set */
+
+void local_objective_stencil(Node_Context *context, float disp[3], int ndim,
+                             VIO_Real obj[3][3][3]);
+
+/* local_objective_function() at d[1..3], with its gradient and an
+   approximation of its hessian (1..3 indices), for -local_gn; FALSE
+   if an objective function has no derivatives */
+
+VIO_BOOL local_objective_gradient(Node_Context *context, float *d,
+                                  VIO_Real *obj, VIO_Real grad[4], VIO_Real hess[4][4]);
+
+/* wrapper for local_objective_function() used by amoeba; function_data
+   must point to the Node_Context of the calling thread */
+
+VIO_Real amoeba_NL_obj_function(void *function_data, float d[]);
+
+/* map the optimized parameter vector p[1..ndim] to grid weights,
+   depending on the lattice count of globals */
+
+void from_param_to_grid_weights(Arg_Data *globals,
+                                VIO_Real p[],
+                                VIO_Real grid[]);
+
+/* source_cache.c */
+
+void init_source_sample_cache(Source_Sample_Cache *cache,
+                              long n_nodes, int n_features, int len,
+                              VIO_Real max_megabytes);
+
+void delete_source_sample_cache(Source_Sample_Cache *cache);
+
+VIO_BOOL get_cached_source_samples(Source_Sample_Cache *cache,
+                                   long node,
+                                   Node_Context *context);
+
+void cache_source_samples(Source_Sample_Cache *cache,
+                          long node,
+                          Node_Context *context);
+
+/* checkpoint.c */
+
+typedef struct {
+  int      level;               /* level of -nonlinear_schedule (0 if none)  */
+  int      iteration;           /* # of iterations done at this level        */
+  int      converged_iterations;/* # of iterations in a row that met
+                                   -nonlinear_tol or -nonlinear_xcorr_tol    */
+  VIO_Real initial_corr;        /* xcorr before the first iteration          */
+  VIO_Real previous_corr;       /* baseline of -nonlinear_xcorr_tol          */
+  VIO_Real previous_mean_eig_val[3];
+  VIO_Real previous_std_eig_val[3];
+  int      count[VIO_N_DIMENSIONS];/* # of nodes of the grid along X, Y, Z   */
+  double   *vectors;            /* the deformation of each node, as returned
+                                   by get_warp_vectors()                     */
+  long     n_active;            /* # of active node flags (0 = all active)   */
+  unsigned char *active;
+} Nonlinear_Checkpoint;
+
+VIO_BOOL write_nonlinear_checkpoint(Nonlinear_Context *nl,
+                                    VIO_Volume current_vol,
+                                    int iteration,
+                                    int converged_iterations,
+                                    VIO_Real previous_corr,
+                                    unsigned char *active,
+                                    long n_nodes);
+
+VIO_BOOL read_nonlinear_checkpoint(Arg_Data *globals,
+                                   Nonlinear_Checkpoint *checkpoint);
+
+void delete_nonlinear_checkpoint(Nonlinear_Checkpoint *checkpoint);
+
+/* optical_flow.c */
+
+void prepare_optical_flow_data(Nonlinear_Context *nl);
+
+void delete_optical_flow_data(Nonlinear_Context *nl);
+
+VIO_Real get_optical_flow_vector(Optical_Flow_Data *flow,
+                                 VIO_Real source_coord[],
+                                 VIO_Real mean_target[],
+                                 VIO_Real def_vector[],
+                                 VIO_Real voxel_displacement[],
+                                 int ndim);
+
+#endif
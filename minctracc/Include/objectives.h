@@ -1,9 +1,36 @@
+#ifndef MINCTRACC_OBJECTIVES_H
+#define MINCTRACC_OBJECTIVES_H
+
 float xcorr_objective(VIO_Volume d1,
                              VIO_Volume d2,
                              VIO_Volume m1,
                              VIO_Volume m2, 
                              Arg_Data *globals);
 
+/* xcorr_objective() and mutual_information_objective() (also for
+   -nmi), with their gradient[0..n_params-1] with respect to the
+   parameters of the transformation.  dA[k] is the derivative of the
+   voxel to voxel transformation (see get_into_voxel_space()) with
+   respect to parameter k. */
+
+float xcorr_objective_with_gradient(VIO_Volume d1,
+                                    VIO_Volume d2,
+                                    VIO_Volume m1,
+                                    VIO_Volume m2, 
+                                    Arg_Data *globals,
+                                    int n_params,
+                                    VIO_Real dA[][3][4],
+                                    VIO_Real gradient[]);
+
+float mutual_information_objective_with_gradient(VIO_Volume d1,
+                                                 VIO_Volume d2,
+                                                 VIO_Volume m1,
+                                                 VIO_Volume m2, 
+                                                 Arg_Data *globals,
+                                                 int n_params,
+                                                 VIO_Real dA[][3][4],
+                                                 VIO_Real gradient[]);
+
 float zscore_objective(VIO_Volume d1,
                               VIO_Volume d2,
                               VIO_Volume m1,
@@ -35,3 +62,30 @@ float normalized_mutual_information_objective(VIO_Volume d1,
                            Arg_Data *globals);
 
 
+/* partial sums of an objective function over a part of the lattice,
+   added in the order of the lattice so that the result does not
+   depend on the number of threads */
+
+typedef struct {
+  VIO_Real sum[3];              /* partial sums of the objective function   */
+  int      count1,count2,count3;/* # of nodes in vol 1, vol 2, both thres'd */
+} Lattice_Sums;
+
+void init_lattice_sums(Lattice_Sums *sums);
+
+/* number of threads evaluating an objective function (-threads) */
+
+int objective_threads(Arg_Data *globals);
+
+
+/* keep the nodes of the lattice in d1 (masked by m1) used by
+   xcorr_objective() in globals->fit until delete_lattice_table() */
+
+void prepare_lattice_table(Arg_Data *globals,
+                           VIO_Volume d1,
+                           VIO_Volume d2,
+                           VIO_Volume m1);
+
+void delete_lattice_table(Arg_Data *globals);
+
+#endif
@@ -5,6 +5,10 @@
 @MODIFIED   : not yet!
 @VERSION    : $Id: quad_max_fit.h,v 1.4 2006-11-29 09:09:32 rotor Exp $
 -----------------------------------------------------------------------------*/
+
+#ifndef MINCTRACC_QUAD_MAX_FIT_H
+#define MINCTRACC_QUAD_MAX_FIT_H
+
     /* local structures */
 
 typedef struct {
@@ -22,6 +26,12 @@ typedef struct {
     uv;
 } deriv_2D_struct;
 
+                        /* outcomes of return_3D_disp_from_min_quad_fit(),
+                           tallied for the debug report of the fit */
+typedef struct {
+  int total, plus, semi, zero, two, minus;
+} Quad_Fit_Stats;
+
 
   void    estimate_3D_derivatives(VIO_Real r[3][3][3], 
                                         deriv_3D_struct *c);             
@@ -47,7 +57,8 @@ VIO_BOOL return_3D_disp_from_quad_fit(VIO_Real r[3][3][3],
 VIO_BOOL return_3D_disp_from_min_quad_fit(VIO_Real r[3][3][3], 
                                                 VIO_Real *dispu, 
                                                 VIO_Real *dispv, 
-                                                VIO_Real *dispw);
+                                                VIO_Real *dispw,
+                                                Quad_Fit_Stats *stats);
 
 VIO_BOOL return_2D_disp_from_quad_fit(VIO_Real r[3][3], 
                                             VIO_Real *dispu, 
@@ -93,3 +104,5 @@ VIO_BOOL return_local_eigen_from_hessian(VIO_Real r[3][3][3],
                                                VIO_Real dir_2[3],
                                                VIO_Real dir_3[3],
                                                VIO_Real val[3]);
+
+#endif
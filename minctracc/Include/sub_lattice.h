@@ -6,24 +6,39 @@
 @VERSION    : $Id: sub_lattice.h,v 1.4 2006-11-29 09:09:32 rotor Exp $
 -----------------------------------------------------------------------------*/
 
+#include "nonlinear_context.h"
 
 void    
-build_source_lattice(VIO_Real x, VIO_Real y, VIO_Real z,
+build_sub_lattice_template(Nonlinear_Context *nl,
+                           VIO_Real width_x, VIO_Real width_y, VIO_Real width_z, 
+                           int nx, int ny, int nz);
+
+void    
+delete_sub_lattice_template(Nonlinear_Context *nl);
+
+void    
+build_source_lattice(Nonlinear_Context *nl,
+                     VIO_Real x, VIO_Real y, VIO_Real z,
                      float PX[], float PY[], float PZ[],
-                     VIO_Real width_x, VIO_Real width_y, VIO_Real width_z, 
-                     int nx, int ny, int nz,
-                     int ndim, int *length);
+                     int *length);
+
+void    
+build_source_voxel_lattice(Nonlinear_Context *nl, int feature,
+                           VIO_Real x, VIO_Real y, VIO_Real z,
+                           float VX[], float VY[], float VZ[]);
 
 void 
 go_get_samples_in_source(VIO_Volume data, VIO_Volume mask,
                          float x[], float y[], float z[],
+                         float vx[], float vy[], float vz[],
                          float samples[],
                          VIO_BOOL masked_samples_in_source[],
                          int len,
                          int inter_type);
 
 float 
-go_get_samples_with_offset(VIO_Volume data, VIO_Volume mask,
+go_get_samples_with_offset(Nonlinear_Context *nl,
+                           VIO_Volume data, VIO_Volume mask,
                            float *x, float *y, float *z,
                            VIO_Real  dx, VIO_Real  dy, VIO_Real dz,
                            int obj_func,
@@ -31,13 +46,47 @@ go_get_samples_with_offset(VIO_Volume data, VIO_Volume mask,
                            float sqrt_s1, float *a1, VIO_BOOL *m1,
                            VIO_BOOL use_nearest_neighbour);
 
+VIO_BOOL
+features_share_geometry(Arg_Data *globals);
+
+void 
+go_get_feature_samples_with_offset(Node_Context *context,
+                                   VIO_Real dx, VIO_Real dy, VIO_Real dz,
+                                   float result[]);
+
+void 
+go_get_stencil_samples_with_offset(Nonlinear_Context *nl,
+                                   VIO_Volume data, VIO_Volume mask,
+                                   float *x, float *y, float *z,
+                                   float disp[3], int ndim,
+                                   int obj_func,
+                                   int len,
+                                   float sqrt_s1, float *a1, VIO_BOOL *m1,
+                                   VIO_BOOL use_nearest_neighbour,
+                                   float result[3][3][3]);
+
+VIO_BOOL 
+go_get_samples_and_gradient(Nonlinear_Context *nl,
+                            VIO_Volume data, VIO_Volume mask,
+                            float *x, float *y, float *z,
+                            VIO_Real  dx, VIO_Real  dy, VIO_Real dz,
+                            int obj_func,
+                            int len,
+                            float sqrt_s1, float *a1, VIO_BOOL *m1,
+                            VIO_BOOL use_nearest_neighbour,
+                            VIO_Real *similarity,
+                            VIO_Real gradient[3],
+                            VIO_Real hessian[3][3]);
+
 void    
-build_target_lattice(float px[], float py[], float pz[],
+build_target_lattice(Nonlinear_Context *nl,
+                     float px[], float py[], float pz[],
                      float tx[], float ty[], float tz[],
                      int len, int dim);
 
 void    
-build_target_lattice_using_super_sampled_def(float px[], float py[], float pz[],
+build_target_lattice_using_super_sampled_def(Nonlinear_Context *nl,
+                                             float px[], float py[], float pz[],
                                              float tx[], float ty[], float tz[],
                                              int len, int dim);
 
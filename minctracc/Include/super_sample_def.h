@@ -94,4 +94,29 @@ void create_super_sampled_data_volumes_by2(VIO_General_transform *orig_deformati
 void interpolate_super_sampled_data_by2( VIO_General_transform *orig_deformation,
                                                 VIO_General_transform *super_sampled);
 
+
+/* the vectors of the deformation grid from which a super-sampled grid
+   was last interpolated by interpolate_super_sampled_data_by2_incremental().
+   vectors must be NULL before the first call. */
+
+typedef struct {
+  int    count[VIO_N_DIMENSIONS];  /* # of nodes along X, Y and Z           */
+  double *vectors;                 /* [x][y][z][3]                          */
+} Super_Sampled_Source;
+
+/*
+   interpolate_super_sampled_data_by2(), called repeatedly on the same
+   *super_sampled as *orig_deformation changes: only the super-sampled
+   nodes that depend on a node of *orig_deformation that has changed
+   since the last call (any node within 2 nodes along each axis) are
+   interpolated again, the others keep their value.  The result is the
+   same as that of interpolate_super_sampled_data_by2().
+*/
+void interpolate_super_sampled_data_by2_incremental(
+    VIO_General_transform *orig_deformation,
+    VIO_General_transform *super_sampled,
+    Super_Sampled_Source  *previous);
+
+void delete_super_sampled_source(Super_Sampled_Source *source);
+
 #endif
@@ -18,6 +18,19 @@ typedef struct {
    VIO_General_transform *voxel_to_voxel_space;
 } Voxel_space_struct;
 
+                                /* the nodes of the lattice (in voxels of
+                                   v1) mapped into voxels of v2: since the
+                                   mapping is affine, the nodes along a
+                                   line of the lattice are equally spaced */
+typedef struct {
+   VIO_Real              start[3];      /* the first node, mapped        */
+   VIO_Real              steps[3][3];   /* [dir] one step along a direction
+                                           of the lattice, mapped        */
+   VIO_BOOL              affine;        /* FALSE if voxel_to_voxel_space is
+                                           projective                    */
+   Voxel_space_struct    *vox;
+} Lattice_Mapping;
+
 Voxel_space_struct* new_voxel_space_struct(void);
 
 void delete_voxel_space_struct( Voxel_space_struct *vox_space);
@@ -39,3 +52,9 @@ void  my_homogenous_transform_point(VIO_Transform  *transform,
                                            VIO_Real       *y_trans,
                                            VIO_Real       *z_trans );
 
+void get_lattice_mapping(Voxel_space_struct *vox, Lattice_Mapping *map);
+
+void map_lattice_line(Lattice_Mapping *map,
+                      int s, int r, int c,
+                      int along, int n,
+                      VIO_Real x[], VIO_Real y[], VIO_Real z[]);
@@ -24,21 +24,11 @@ VIO_Volume  data_dy                  = NULL;
 VIO_Volume  data_dz                  = NULL;
 VIO_Volume  data_dxyz                = NULL;
 
-double  ftol                     = 0.005;
-double  simplex_size             = 20.0;
-int     iteration_limit          = 4;
-double  iteration_weight         = 0.6;
-double  smoothing_weight         = 0.5;
-double  similarity_cost_ratio    = 0.5;
-int     number_dimensions        = 3;
 int     Matlab_num_steps         = 15;
-int     Diameter_of_local_lattice= 5;
 
 int     invert_mapping_flag      = FALSE;
 int     clobber_flag             = FALSE;
 
-VIO_Real initial_corr, final_corr;
-
 Arg_Data main_argsX;
 
 ArgvInfo argTable[] = {
@@ -162,10 +152,10 @@ ArgvInfo argTable[] = {
   {NULL, ARGV_HELP, NULL, NULL,
      "\nOptions for linear optimization."},
   {"-tol", ARGV_FLOAT, (char *) 0, 
-     (char *) &ftol,
+     (char *) &main_argsX.ftol,
      "Stopping criteria tolerance"},
   {"-simplex", ARGV_FLOAT, (char *) 0, 
-     (char *) &simplex_size,
+     (char *) &main_argsX.simplex_size,
      "Radius of simplex volume."},
   {"-w_translations", ARGV_FLOAT, (char *) 3, 
      (char *) &main_argsX.trans_info.weights[0],
@@ -179,8 +169,16 @@ ArgvInfo argTable[] = {
   {"-w_shear", ARGV_FLOAT, (char *) 3, 
      (char *) &main_argsX.trans_info.weights[9],
      "Optimization weight of shears a,b and c."},
-  {"-use_bfgs", ARGV_CONSTANT, (char *) FALSE, (char *) &main_argsX.trans_info.use_bfgs,
+  {"-use_bfgs", ARGV_CONSTANT, (char *) TRUE, (char *) &main_argsX.trans_info.use_bfgs,
      "use BFGS optimizer instead of amoeba "},
+  {"-bfgs_epsilon", ARGV_FUNC, (char *) get_bfgs_epsilon, (char *) 0,
+     "Step used to estimate the gradient for -use_bfgs."},
+  {"-bfgs_central", ARGV_CONSTANT, (char *) TRUE, (char *) &main_argsX.trans_info.bfgs_central,
+     "Estimate the gradient for -use_bfgs with central differences."},
+  {"-bfgs_numerical", ARGV_CONSTANT, (char *) TRUE, (char *) &main_argsX.trans_info.bfgs_numerical,
+     "Estimate the gradient for -use_bfgs by finite differences, even for -xcorr, -mi and -nmi."},
+  {"-bfgs_check_gradient", ARGV_CONSTANT, (char *) TRUE, (char *) &main_argsX.trans_info.bfgs_check_gradient,
+     "Print the analytic and the central difference gradients at the start of -use_bfgs."},
 
   {NULL, ARGV_HELP, NULL, NULL,
      "\nOptions for measurement comparison."},
@@ -222,7 +220,7 @@ ArgvInfo argTable[] = {
 /*      "Estimate the non-lin fit on a 2D slice only."}, */
 /*   {"-3D-non-lin", ARGV_CONSTANT, (char *) 3, (char *) &number_dimensions, */
 /*      "Estimate the non-lin fit on a 3D volume (default)."}, */
-  {"-sub_lattice", ARGV_INT, (char *) 0, (char *) &Diameter_of_local_lattice,
+  {"-sub_lattice", ARGV_INT, (char *) 0, (char *) &main_argsX.nonlinear.sub_lattice_diameter,
      "number of nodes along diameter of local sub-lattice."},
   {"-lattice_diameter", ARGV_FLOAT, (char *) 3, 
      (char *) main_argsX.lattice_width,
@@ -240,6 +238,8 @@ ArgvInfo argTable[] = {
      "use 3D simplex optimization for local deformation (default)."},
   {"-quadratic", ARGV_CONSTANT, (char *) FALSE, (char *) &main_argsX.trans_info.use_simplex,
      "use quadratic fit for local deformation."},
+  {"-local_gn", ARGV_CONSTANT, (char *) LOCAL_GAUSS_NEWTON, (char *) &main_argsX.trans_info.use_simplex,
+     "use Gauss-Newton fit with analytic gradients for local deformation."},
   {"-use_local", ARGV_CONSTANT, (char *) TRUE, (char *) &main_argsX.trans_info.use_local_smoothing,
      "Turn on local smoothing (default = global smoothing)."},
   {"-use_nonisotropic", ARGV_CONSTANT, (char *) FALSE, (char *) &main_argsX.trans_info.use_local_isotropic,
@@ -249,17 +249,63 @@ ArgvInfo argTable[] = {
   {"-no_super", ARGV_CONSTANT, (char *) 0, (char *) &main_argsX.trans_info.use_super,
      "do not super sample deformation field during optimization."},
   {"-iterations", ARGV_INT, (char *) 0, 
-     (char *) &iteration_limit,
+     (char *) &main_argsX.nonlinear.iteration_limit,
      "Number of iterations for non-linear optimization"},
   {"-weight", ARGV_FLOAT, (char *) 0, 
-     (char *) &iteration_weight,
+     (char *) &main_argsX.nonlinear.iteration_weight,
      "Weighting factor for each iteration in nl optimization"},
   {"-stiffness", ARGV_FLOAT, (char *) 0, 
-     (char *) &smoothing_weight,
+     (char *) &main_argsX.nonlinear.smoothing_weight,
      "Weighting factor for smoothing between nl iterations"},
   {"-similarity_cost_ratio", ARGV_FLOAT, (char *) 0, 
-     (char *) &similarity_cost_ratio,
+     (char *) &main_argsX.nonlinear.similarity_cost_ratio,
      "Weighting factor for  r=similarity*w + cost(1*w)"},
+  {"-threads", ARGV_INT, (char *) 0, 
+     (char *) &main_argsX.threads,
+     "Number of threads used to estimate the deformation field and the linear objective functions (0 = all available)."},
+  {"-source_cache", ARGV_FLOAT, (char *) 0, 
+     (char *) &main_argsX.nonlinear.source_cache_size,
+     "Memory (Mb) used to keep the source sub-lattice samples between nl iterations (0 = no cache)."},
+  {"-active_tolerance", ARGV_FLOAT, (char *) 0, 
+     (char *) &main_argsX.nonlinear.active_tolerance,
+     "After the first nl iteration, only re-estimate the nodes that moved more than this (mm), and their neighbours (0 = all nodes)."},
+  {"-nonlinear_schedule", ARGV_FUNC, (char *) get_nonlinear_schedule, 
+     (char *) &main_argsX.nonlinear.schedule,
+     "Grid steps (mm) of a coarse to fine nl fit done in a single run, eg: 16:8:4:2."},
+  {"-nonlinear_iterations", ARGV_FUNC, (char *) get_nonlinear_schedule, 
+     (char *) &main_argsX.nonlinear.schedule,
+     "Iterations at each level of -nonlinear_schedule, eg: 20:20:10:10 (default: -iterations)."},
+  {"-nonlinear_blurs", ARGV_FUNC, (char *) get_nonlinear_schedule, 
+     (char *) &main_argsX.nonlinear.schedule,
+     "FWHM (mm) of the blur applied to source and target at each level of -nonlinear_schedule (0 = none)."},
+  {"-checkpoint", ARGV_STRING, (char *) 0, 
+     (char *) &main_argsX.nonlinear.checkpoint_dir,
+     "Directory where the state of the nl fit is saved, to be continued with -resume."},
+  {"-checkpoint_interval", ARGV_INT, (char *) 0, 
+     (char *) &main_argsX.nonlinear.checkpoint_interval,
+     "Number of nl iterations between checkpoints."},
+  {"-resume", ARGV_CONSTANT, (char *) TRUE, 
+     (char *) &main_argsX.nonlinear.resume,
+     "Continue the nl fit from the last checkpoint saved in the -checkpoint directory."},
+  {"-nonlinear_tol", ARGV_FLOAT, (char *) 0, 
+     (char *) &main_argsX.nonlinear.tolerance,
+     "Stop the nl iterations when the mean additional deformation is below this (mm) (0 = run all iterations)."},
+  {"-nonlinear_xcorr_tol", ARGV_FLOAT, (char *) 0, 
+     (char *) &main_argsX.nonlinear.xcorr_tolerance,
+     "Stop the nl iterations when the xcorr improves by less than this (0 = run all iterations)."},
+  {"-nonlinear_patience", ARGV_INT, (char *) 0, 
+     (char *) &main_argsX.nonlinear.patience,
+     "Number of iterations in a row that must meet -nonlinear_tol or -nonlinear_xcorr_tol before stopping."},
+  {"-nonlinear_extrapolation", ARGV_INT, (char *) 0, 
+     (char *) &main_argsX.nonlinear.extrapolation_waves,
+     "Layers of unestimated nl nodes that receive vectors faded from the estimated ones (0 = all, default 1)."},
+  {"-nonlinear_check_xcorr", ARGV_CONSTANT, (char *) TRUE, 
+     (char *) &main_argsX.nonlinear.check_xcorr,
+     "Print the final nl xcorr computed through the fused warp and through the general transform."},
+  {"-voxel_type", ARGV_FUNC, (char *) get_voxel_type, (char *) 0,
+     "Storage of the data, model and feature volumes {double|float}. float halves the memory used (default: double)."},
+  {"-grid_type", ARGV_FUNC, (char *) get_grid_type, (char *) 0,
+     "Storage of the deformation grids, in memory and in the output {double|float} (default: double)."},
 
   {NULL, ARGV_HELP, NULL, NULL,
      "\nOptions for logging progress. Default = -verbose 1."},
@@ -287,6 +333,11 @@ Arg_Data main_argsX = {
     50.0,
     TRUE,                        /*   use_simplex=TRUE ie use 3d simplex by default */
     FALSE,                       /*   use_bfgs=FALSE i.e don't use BFGS*/
+    BFGS_EPSILON_DEFAULT,        /*   bfgs_epsilon */
+    FALSE,                       /*   bfgs_epsilon_given */
+    FALSE,                       /*   bfgs_central=FALSE i.e forward differences */
+    FALSE,                       /*   bfgs_numerical=FALSE i.e analytic gradient if possible */
+    FALSE,                       /*   bfgs_check_gradient=FALSE */
     2,                                /*   use super sampling of deformation field  */
     FALSE,                        /* use local smoothing       */
     TRUE,                        /* use isotropic smoothing */
@@ -326,7 +377,22 @@ Arg_Data main_argsX = {
   {0.0,0.0},                        /* lower limit of voxels considered                 */
   5.0,                                /* percent noise speckle                            */
   256,                                /* number of groups to use for ratio of variance    */
-  3                                /* pdf blurring size for -mi                        */
+  3,                                /* pdf blurring size for -mi                        */
+  1,                                /* number of threads for fitting                    */
+  {4, 0.6, 0.5, 0.5, 5, 256.0, 0.0, {0}, NULL, 1, FALSE, 0.0, 0.0, 1, 1, FALSE},
+                                    /* iterations, iteration weight, stiffness,
+                                       similarity cost ratio, sub-lattice diameter,
+                                       source sample cache size (Mb), active node
+                                       tolerance, no schedule, no checkpoints every
+                                       iteration, do not resume, run all iterations,
+                                       extrapolate to the next nodes only, no xcorr
+                                       check                                           */
+  NC_DOUBLE,                        /* storage type of the data and feature volumes     */
+  NC_DOUBLE,                        /* storage type of the deformation grids            */
+  20.0,                             /* radius of the simplex                            */
+  0.005,                            /* stopping tolerance of the simplex                */
+  0.0, 0.0,                         /* initial and final objective function values      */
+  {NULL}                            /* no linear fit in progress                        */
 };
 
 Arg_Data *main_args = &main_argsX;
@@ -104,21 +104,10 @@ static char rcsid[]="$Header: /static-cvsroot/registration/mni_autoreg/minctracc
 
 #include "local_macros.h"
 
-extern Arg_Data *main_args;
-
-extern   VIO_Volume   Gdata1, Gdata2, Gmask1, Gmask2;
-extern   int      Ginverse_mapping_flag, Gndim;
-extern   double   simplex_size ;
-extern   Segment_Table  *segment_table;
-
-extern VIO_Real            **prob_hash_table; 
-extern VIO_Real            *prob_fn1;         
-extern VIO_Real            *prob_fn2;         
-
 extern int Matlab_num_steps;
 
-float fit_function(float *params);
-float fit_function_quater(float *params);
+float fit_function(Arg_Data *args, float *params);
+float fit_function_quater(Arg_Data *args, float *params);
 
 void make_zscore_volume(VIO_Volume d1, VIO_Volume m1, 
                                VIO_Real *threshold); 
@@ -187,18 +176,18 @@ void make_matlab_data_file(VIO_Volume d1,
                             globals->start, globals->count, globals->directions);    
   } else if (globals->obj_function == vr_objective) {
     if (globals->smallest_vol == 1) {
-      if (!build_segment_table(&segment_table, d1, globals->groups))
+      if (!build_segment_table(&globals->fit.segment_table, d1, globals->groups))
         print_error_and_line_num("%s",__FILE__, __LINE__,"Could not build segment table for source volume\n");
     }
     else {
-      if (!build_segment_table(&segment_table, d2, globals->groups))
+      if (!build_segment_table(&globals->fit.segment_table, d2, globals->groups))
         print_error_and_line_num("%s",__FILE__, __LINE__,"Could not build segment table for target volume\n");
     }
     if (globals->flags.debug && globals->flags.verbose>1) {
-      print ("groups = %d\n",segment_table->groups);
-      for(i=segment_table->min; i<segment_table->max+1; i++) {
-        print ("%5d: table = %5d, function = %5d\n",i,segment_table->table[i],
-               (segment_table->segment)(i,segment_table) );
+      print ("groups = %d\n",globals->fit.segment_table->groups);
+      for(i=globals->fit.segment_table->min; i<globals->fit.segment_table->max+1; i++) {
+        print ("%5d: table = %5d, function = %5d\n",i,globals->fit.segment_table->table[i],
+               (globals->fit.segment_table->segment)(i,globals->fit.segment_table) );
       }
     }
     
@@ -229,9 +218,9 @@ void make_matlab_data_file(VIO_Volume d1,
         }
       }
 
-      ALLOC(   prob_fn1,   globals->groups);
-      ALLOC(   prob_fn2,   globals->groups);
-      VIO_ALLOC2D( prob_hash_table, globals->groups, globals->groups);
+      ALLOC(   globals->fit.prob_fn1,   globals->groups);
+      ALLOC(   globals->fit.prob_fn2,   globals->groups);
+      VIO_ALLOC2D( globals->fit.prob_hash_table, globals->groups, globals->groups);
 
     } 
 
@@ -299,14 +288,14 @@ if(globals->trans_info.rotation_type == TRANS_ROT)
     if (globals->trans_info.weights[i] != 0.0) ndim++;
 
 
-                                /* set GLOBALS to communicate with the
+                                /* set globals->fit to communicate with the
                                    function to be fitted!              */
-  Gndim = ndim;
-  Gdata1 = d1;
-  Gdata2 = d2;
-  Gmask1 = m1;
-  Gmask2 = m2;
-  Ginverse_mapping_flag = FALSE;
+  globals->fit.ndim = ndim;
+  globals->fit.data1 = d1;
+  globals->fit.data2 = d2;
+  globals->fit.mask1 = m1;
+  globals->fit.mask2 = m2;
+  globals->fit.inverse_mapping = FALSE;
 
 print ("trans: %10.5f %10.5f %10.5f \n",
        globals->trans_info.translations[0],globals->trans_info.translations[1],globals->trans_info.translations[2]);
@@ -360,7 +349,7 @@ print ("scale: %10.5f %10.5f %10.5f \n",
           rots[i]   = globals->trans_info.rotations[i];
         }
 
-        step =  globals->trans_info.weights[j-1] * simplex_size/ Matlab_num_steps;
+        step =  globals->trans_info.weights[j-1] * globals->simplex_size/ Matlab_num_steps;
         
         for(i=-Matlab_num_steps; i<=Matlab_num_steps; i++) {
           
@@ -386,7 +375,7 @@ print ("scale: %10.5f %10.5f %10.5f \n",
                                p,
                                globals->trans_info.weights);
     
-          (void)fprintf (ofd, "%f %f %f\n",i*step, start+i*step, fit_function(p));
+          (void)fprintf (ofd, "%f %f %f\n",i*step, start+i*step, fit_function(globals,p));
         }
 
         (void)fprintf (ofd,"];\n"); 
@@ -469,14 +458,14 @@ if(globals->trans_info.rotation_type == TRANS_QUAT)
     if (globals->trans_info.weights[i] != 0.0) ndim++;
 
 
-                                /* set GLOBALS to communicate with the
+                                /* set globals->fit to communicate with the
                                    function to be fitted!              */
-  Gndim = ndim;
-  Gdata1 = d1;
-  Gdata2 = d2;
-  Gmask1 = m1;
-  Gmask2 = m2;
-  Ginverse_mapping_flag = FALSE;
+  globals->fit.ndim = ndim;
+  globals->fit.data1 = d1;
+  globals->fit.data2 = d2;
+  globals->fit.mask1 = m1;
+  globals->fit.mask2 = m2;
+  globals->fit.inverse_mapping = FALSE;
 
 print ("trans: %10.5f %10.5f %10.5f \n",
        globals->trans_info.translations[0],globals->trans_info.translations[1],globals->trans_info.translations[2]);
@@ -532,7 +521,7 @@ print ("scale: %10.5f %10.5f %10.5f \n",
         }
         quats[3] = globals->trans_info.quaternions[3];
 
-        step =  globals->trans_info.weights[j-1] * simplex_size/ Matlab_num_steps;
+        step =  globals->trans_info.weights[j-1] * globals->simplex_size/ Matlab_num_steps;
         
         for(i=-Matlab_num_steps; i<=Matlab_num_steps; i++) {
           
@@ -559,7 +548,7 @@ print ("scale: %10.5f %10.5f %10.5f \n",
                                       p,
                                       globals->trans_info.weights);
     
-          (void)fprintf (ofd, "%f %f %f\n",i*step, start+i*step, fit_function_quater(p));
+          (void)fprintf (ofd, "%f %f %f\n",i*step, start+i*step, fit_function_quater(globals,p));
         }
 
         (void)fprintf (ofd,"];\n"); 
@@ -576,7 +565,7 @@ print ("scale: %10.5f %10.5f %10.5f \n",
   }
   }
   if (globals->obj_function == vr_objective) {
-    if (!free_segment_table(segment_table)) {
+    if (!free_segment_table(globals->fit.segment_table)) {
       (void)fprintf(stderr, "Can't free segment table.\n");
       (void)fprintf(stderr, "Error in line %d, file %s\n",__LINE__, __FILE__);
     }
@@ -584,9 +573,9 @@ print ("scale: %10.5f %10.5f %10.5f \n",
   if (globals->obj_function == mutual_information_objective || globals->obj_function == normalized_mutual_information_objective )
                                 /* Collignon's mutual information */
     {
-      FREE(   prob_fn1 );
-      FREE(   prob_fn2 );
-      VIO_FREE2D( prob_hash_table);
+      FREE(   globals->fit.prob_fn1 );
+      FREE(   globals->fit.prob_fn2 );
+      VIO_FREE2D( globals->fit.prob_hash_table);
     }
 
 
@@ -50,16 +50,12 @@ VIO_General_transform* minctracc( VIO_Volume source, VIO_Volume target, VIO_Volu
 	VIO_Real min_value, max_value, step[3];
   
  
-	// Kill this (and main_args) to test whether the thread safety is working
-	data = source; model = target;
-	mask_data = sourceMask; mask_model = targetMask;
-	main_args = args;
-	iteration_limit = iterations;
-	iteration_weight = weight;
-	simplex_size = simplexSize;
-	smoothing_weight = stiffness;
-	similarity_cost_ratio = similarity;
-	Diameter_of_local_lattice = sub_lattice;
+	args->simplex_size = simplexSize;
+	args->nonlinear.iteration_limit = iterations;
+	args->nonlinear.iteration_weight = weight;
+	args->nonlinear.smoothing_weight = stiffness;
+	args->nonlinear.similarity_cost_ratio = similarity;
+	args->nonlinear.sub_lattice_diameter = sub_lattice;
 			
 	
 	// SET UP INPUT TRANSFORMATIONS
@@ -121,16 +117,16 @@ VIO_General_transform* minctracc( VIO_Volume source, VIO_Volume target, VIO_Volu
 	}
 	
 	
-	get_volume_separations(data, step);
-	get_volume_sizes(data, sizes);
-	get_volume_minimum_maximum_real_value(data, &min_value, &max_value);
-	get_volume_voxel_range(data, &min_value, &max_value);
-	get_volume_separations(model, step); 
-	get_volume_sizes(model, sizes);
-	get_volume_minimum_maximum_real_value(model, &min_value, &max_value);
-	get_volume_voxel_range(model, &min_value, &max_value);
-
-	if (!init_params( data, model, mask_data, mask_model, args )) {
+	get_volume_separations(source, step);
+	get_volume_sizes(source, sizes);
+	get_volume_minimum_maximum_real_value(source, &min_value, &max_value);
+	get_volume_voxel_range(source, &min_value, &max_value);
+	get_volume_separations(target, step); 
+	get_volume_sizes(target, sizes);
+	get_volume_minimum_maximum_real_value(target, &min_value, &max_value);
+	get_volume_voxel_range(target, &min_value, &max_value);
+
+	if (!init_params( source, target, sourceMask, targetMask, args )) {
 		print_error_and_line_num("%s",__FILE__, __LINE__,"Could not initialize transformation parameters\n");
 	}
 	
@@ -175,7 +171,7 @@ VIO_General_transform* minctracc( VIO_Volume source, VIO_Volume target, VIO_Volu
 	
 	// Go!
 	if (args->trans_info.transform_type != TRANS_PAT) {
-		init_lattice( data, model, mask_data, mask_model, args );
+		init_lattice( source, target, sourceMask, targetMask, args );
 
 		if (args->trans_info.transform_type == TRANS_NONLIN) {
 			build_default_deformation_field(args);
@@ -186,13 +182,13 @@ VIO_General_transform* minctracc( VIO_Volume source, VIO_Volume target, VIO_Volu
 		else {
 			if (args->trans_info.rotation_type == TRANS_ROT ) {
 				
-				if (!optimize_linear_transformation( data, model, mask_data, mask_model, args )) {
+				if (!optimize_linear_transformation( source, target, sourceMask, targetMask, args )) {
 					print_error_and_line_num("Error in optimization of linear transformation\n",__FILE__, __LINE__);
 				}
 			}
 
 			if (args->trans_info.rotation_type == TRANS_QUAT ) {
-				if (!optimize_linear_transformation_quater( data, model, mask_data, mask_model, args )) {
+				if (!optimize_linear_transformation_quater( source, target, sourceMask, targetMask, args )) {
 					print_error_and_line_num("Error in optimization of linear transformation\n",__FILE__, __LINE__);
 				}
 			}
@@ -200,8 +196,8 @@ VIO_General_transform* minctracc( VIO_Volume source, VIO_Volume target, VIO_Volu
 	}
 
 	if (args->flags.verbose>0) {
-		print ("Initial objective function val = %0.8f\n",initial_corr); 
-		print ("Final objective function value = %0.8f\n",final_corr);
+		print ("Initial objective function val = %0.8f\n",args->initial_corr); 
+		print ("Final objective function value = %0.8f\n",args->final_corr);
 	}
 
 	// if I have internally inverted the transform, then flip it back forward before the save.
@@ -238,6 +234,11 @@ void initializeArgs(Arg_Data *args) {
 	args->trans_info.max_def_magnitude = 50.0;
 	args->trans_info.use_simplex = TRUE;
   args->trans_info.use_bfgs = FALSE;
+  args->trans_info.bfgs_epsilon = BFGS_EPSILON_DEFAULT;
+  args->trans_info.bfgs_epsilon_given = FALSE;
+  args->trans_info.bfgs_central = FALSE;
+  args->trans_info.bfgs_numerical = FALSE;
+  args->trans_info.bfgs_check_gradient = FALSE;
 	args->trans_info.use_super = 2;
 	args->trans_info.use_local_smoothing = FALSE;
 	args->trans_info.use_local_isotropic = TRUE;
@@ -290,6 +291,41 @@ void initializeArgs(Arg_Data *args) {
 	args->speckle = 5.0;
 	args->groups = 256;
 	args->blur_pdf = 3;	
+	args->threads = 1;
+
+	// Nonlinear fit
+	args->nonlinear.iteration_limit = 4;
+	args->nonlinear.iteration_weight = 0.6;
+	args->nonlinear.smoothing_weight = 0.5;
+	args->nonlinear.similarity_cost_ratio = 0.5;
+	args->nonlinear.sub_lattice_diameter = 5;
+	args->nonlinear.source_cache_size = 256.0;
+	args->nonlinear.active_tolerance = 0.0;
+	args->nonlinear.schedule.levels = 0;
+	args->nonlinear.schedule.iteration_levels = 0;
+	args->nonlinear.schedule.blur_levels = 0;
+	args->nonlinear.schedule.current = 0;
+	args->nonlinear.checkpoint_dir = NULL;
+	args->nonlinear.checkpoint_interval = 1;
+	args->nonlinear.resume = FALSE;
+	args->nonlinear.tolerance = 0.0;
+	args->nonlinear.xcorr_tolerance = 0.0;
+	args->nonlinear.patience = 1;
+	args->nonlinear.extrapolation_waves = 1;
+	args->nonlinear.check_xcorr = FALSE;
+
+	args->voxel_type = NC_DOUBLE;
+	args->grid_type = NC_DOUBLE;
+
+	// Linear fit
+	args->simplex_size = 20.0;
+	args->ftol = 0.005;
+	args->initial_corr = 0.0; args->final_corr = 0.0;
+	args->fit.data1 = NULL; args->fit.data2 = NULL; args->fit.mask1 = NULL; args->fit.mask2 = NULL;
+	args->fit.inverse_mapping = FALSE; args->fit.ndim = 0;
+	args->fit.segment_table = NULL;
+	args->fit.prob_hash_table = NULL; args->fit.prob_fn1 = NULL; args->fit.prob_fn2 = NULL;
+	args->fit.lattice_table = NULL;
 }
 
 /* Command line argument "-nonlinear" may be followed by an optional
@@ -331,6 +367,121 @@ int get_nonlinear_objective(char *dst, char *key, char* nextArg)
 }
 
 
+/* Command line argument "-voxel_type" is followed by "double" or
+ * "float", the type used to store the data, model and (non label)
+ * feature volumes.  Return 1 so that ParseArgv skips that argument.
+ */
+int get_voxel_type(char *dst, char *key, char* nextArg)
+{
+    if (nextArg != NULL && strcmp( "double", nextArg ) == 0 ) {
+        main_args->voxel_type = NC_DOUBLE;
+    } else if (nextArg != NULL && strcmp( "float", nextArg ) == 0 ) {
+        main_args->voxel_type = NC_FLOAT;
+    } else {
+        print_error_and_line_num("%s must be followed by double or float.\n",
+                                 __FILE__, __LINE__, key);
+    }
+
+    return 1;
+}
+
+
+/* Command line argument "-grid_type" is followed by "double" or
+ * "float", the type used to store the deformation grids of the
+ * nonlinear fit (and of the output transform).  Return 1 so that
+ * ParseArgv skips that argument.
+ */
+int get_grid_type(char *dst, char *key, char* nextArg)
+{
+    if (nextArg != NULL && strcmp( "double", nextArg ) == 0 ) {
+        main_args->grid_type = NC_DOUBLE;
+    } else if (nextArg != NULL && strcmp( "float", nextArg ) == 0 ) {
+        main_args->grid_type = NC_FLOAT;
+    } else {
+        print_error_and_line_num("%s must be followed by double or float.\n",
+                                 __FILE__, __LINE__, key);
+    }
+
+    return 1;
+}
+
+
+/* Command line argument "-bfgs_epsilon" is followed by the (positive)
+ * step of the finite-difference gradient of -use_bfgs.  Remember that
+ * it was given, to warn when the analytic gradient ignores it.  Return
+ * 1 so that ParseArgv skips that argument.
+ */
+int get_bfgs_epsilon(char *dst, char *key, char* nextArg)
+{
+    char *end;
+    double epsilon;
+
+    epsilon = (nextArg != NULL) ? strtod(nextArg, &end) : 0.0;
+    if (nextArg == NULL || end == nextArg || *end != '\0' || epsilon <= 0.0)
+        print_error_and_line_num("%s must be followed by a positive step.\n",
+                                 __FILE__, __LINE__, key);
+
+    main_args->trans_info.bfgs_epsilon = epsilon;
+    main_args->trans_info.bfgs_epsilon_given = TRUE;
+
+    return 1;
+}
+
+
+/* Command line arguments "-nonlinear_schedule", "-nonlinear_iterations"
+ * and "-nonlinear_blurs" are followed by a colon separated list of
+ * values, one per level, stored in the Nonlinear_Schedule pointed to
+ * by dst.  Return 1 so that ParseArgv skips that argument.
+ */
+int get_nonlinear_schedule(char *dst, char *key, char* nextArg)
+{
+    Nonlinear_Schedule *schedule = (Nonlinear_Schedule *)dst;
+    double  values[MAX_NONLINEAR_LEVELS];
+    char    *ptr, *end;
+    int     n, i;
+
+    if (nextArg == NULL)
+        print_error_and_line_num("%s must be followed by a list of values, eg: 16:8:4:2\n",
+                                 __FILE__, __LINE__, key);
+
+    n   = 0;
+    ptr = nextArg;
+    while (*ptr != '\0') {
+        if (n >= MAX_NONLINEAR_LEVELS)
+            print_error_and_line_num("%s: no more than %d levels allowed.\n",
+                                     __FILE__, __LINE__, key, MAX_NONLINEAR_LEVELS);
+        values[n] = strtod(ptr, &end);
+        if (end == ptr || (*end != ':' && *end != '\0') || values[n] < 0.0)
+            print_error_and_line_num("%s: cannot read '%s' as a list of values, eg: 16:8:4:2\n",
+                                     __FILE__, __LINE__, key, nextArg);
+        n++;
+        ptr = (*end == ':') ? end+1 : end;
+    }
+
+    if (strcmp(key, "-nonlinear_schedule") == 0) {
+        for(i=0; i<n; i++) {
+            if (values[i] <= 0.0)
+                print_error_and_line_num("%s: steps must be greater than 0.\n",
+                                         __FILE__, __LINE__, key);
+            schedule->step[i] = values[i];
+        }
+        schedule->levels = n;
+    }
+    else if (strcmp(key, "-nonlinear_iterations") == 0) {
+        for(i=0; i<n; i++) 
+            schedule->iterations[i] = (int)values[i];
+        schedule->iteration_levels = n;
+    }
+    else {
+        for(i=0; i<n; i++) 
+            schedule->blur[i] = values[i];
+        schedule->blur_levels = n;
+    }
+
+    return 1;
+}
+
+
 int free_features(Feature_volumes *features)
 {
 
@@ -431,6 +582,43 @@ void add_a_feature_for_matching(Feature_volumes *features,
 
 
 
+/* read the volumes of the features added by get_feature_volumes(),
+   after all the options are parsed so that -voxel_type applies
+   wherever it is given on the command line.  Labels are loaded as is. */
+
+static void load_feature_volumes(Feature_volumes *features, nc_type voxel_type)
+{
+  int i;
+  nc_type type;
+  VIO_Status status;
+
+  for(i=0; i<features->number_of_features; i++) {
+
+    type = (features->obj_func[i] == NONLIN_LABEL) ? NC_UNSPECIFIED : voxel_type;
+
+    if (features->data[i] == (VIO_Volume)NULL) {
+      status = input_volume(features->data_name[i], 3, default_dim_names, 
+                            type, FALSE, 0.0, 0.0,
+                            TRUE, &features->data[i], 
+                            (minc_input_options *)NULL );
+      if (status != VIO_OK)
+        print_error_and_line_num("Cannot input feature %s.\n",
+                                 __FILE__, __LINE__, features->data_name[i]);
+    }
+
+    if (features->model[i] == (VIO_Volume)NULL) {
+      status = input_volume(features->model_name[i], 3, default_dim_names, 
+                            type, FALSE, 0.0, 0.0,
+                            TRUE, &features->model[i], 
+                            (minc_input_options *)NULL );
+      if (status != VIO_OK)
+        print_error_and_line_num("Cannot input feature %s.\n",
+                                 __FILE__, __LINE__, features->model_name[i]);
+    }
+  }
+}
+
+
 /* MINCTRACCOLDFASHIONED keeps the same interface as the old minctracc main().  The new minctracc
   main() forwards its argc and argv to this function.  Eventually maybe I'll fix this to feed through
   the new minctracc function.
@@ -512,6 +700,36 @@ int minctraccOldFashioned ( int argc, char* argv[] )
   if(main_args->trans_info.use_bfgs)
     main_args->optimize_type=OPT_BFGS;
 
+                                /* the analytic gradient needs no step */
+  if (main_args->trans_info.use_bfgs && !main_args->trans_info.bfgs_numerical &&
+      (main_args->trans_info.bfgs_central || main_args->trans_info.bfgs_epsilon_given) &&
+      !main_args->trans_info.bfgs_check_gradient &&
+      (main_args->obj_function == xcorr_objective ||
+       main_args->obj_function == mutual_information_objective ||
+       main_args->obj_function == normalized_mutual_information_objective))
+    (void)fprintf(stderr, "\nWARNING: -bfgs_epsilon and -bfgs_central are ignored with the analytic\n         gradient of -xcorr, -mi and -nmi; add -bfgs_numerical to use them.\n\n");
+
+  if (main_args->nonlinear.checkpoint_dir != NULL &&
+      main_args->nonlinear.checkpoint_interval < 1)
+    print_error_and_line_num("-checkpoint_interval must be at least 1 (%d)\n",
+                             __FILE__, __LINE__, main_args->nonlinear.checkpoint_interval);
+
+  if (main_args->nonlinear.patience < 1)
+    print_error_and_line_num("-nonlinear_patience must be at least 1 (%d)\n",
+                             __FILE__, __LINE__, main_args->nonlinear.patience);
+
+  if (main_args->nonlinear.extrapolation_waves < 0)
+    print_error_and_line_num("-nonlinear_extrapolation must be at least 0 (%d)\n",
+                             __FILE__, __LINE__, main_args->nonlinear.extrapolation_waves);
+
+                                /* with a coarse to fine schedule, the
+                                   deformation grid is first built with
+                                   the step of the first level */
+  if (main_args->nonlinear.schedule.levels > 0)
+    for(i=0; i<3; i++)
+      main_args->step[i] = (main_args->step[i] < 0.0 ? -1.0 : 1.0) *
+        main_args->nonlinear.schedule.step[0];
+
   if (parse_flag || 
       (measure_matlab_flag && argc!=3) ||
       (!measure_matlab_flag && argc!=4)) {
@@ -744,7 +962,7 @@ int minctraccOldFashioned ( int argc, char* argv[] )
   ALLOC(data,1);
 
   status = input_volume( main_args->filenames.data, 3, default_dim_names, 
-                         NC_DOUBLE, FALSE, 0.0, 0.0,
+                         main_args->voxel_type, FALSE, 0.0, 0.0,
                          TRUE, &data, (minc_input_options *)NULL );
 
   if (status != VIO_OK)
@@ -753,7 +971,7 @@ int minctraccOldFashioned ( int argc, char* argv[] )
   data_dxyz = data;
  
   status = input_volume( main_args->filenames.model, 3, default_dim_names, 
-                         NC_DOUBLE, FALSE, 0.0, 0.0,
+                         main_args->voxel_type, FALSE, 0.0, 0.0,
                          TRUE, &model, (minc_input_options *)NULL );
   if (status != VIO_OK)
     print_error_and_line_num("Cannot input volume '%s'",
@@ -802,6 +1020,8 @@ int minctraccOldFashioned ( int argc, char* argv[] )
     }
 
 
+  load_feature_volumes(&(main_args->features), main_args->voxel_type);
+
                                 /* shift features to be able to
                                    insert the main source/target
                                    volumes first. */
@@ -982,9 +1202,9 @@ int minctraccOldFashioned ( int argc, char* argv[] )
       
     }
 
-    if (number_dimensions==3 && main_args->flags.verbose>0) {
-      print ("Initial objective function val = %0.8f\n",initial_corr); 
-      print ("Final objective function value = %0.8f\n",final_corr);
+    if (main_args->flags.verbose>0) {
+      print ("Initial objective function val = %0.8f\n",main_args->initial_corr); 
+      print ("Final objective function value = %0.8f\n",main_args->final_corr);
     }
 
   }
@@ -1196,7 +1416,8 @@ int get_mask_file(char *dst, char *key, char *nextArg)
               nextArg - argument following key
 @OUTPUT     : (nothing) 
 @RETURNS    : TRUE so that ParseArgv will discard nextArg
-@DESCRIPTION: Routine called by ParseArgv to read in a binary mask file
+@DESCRIPTION: Routine called by ParseArgv to add a feature to main_args;
+              its volumes are read later by load_feature_volumes()
 @METHOD     : 
 @GLOBALS    : 
 @CALLS      : 
@@ -1217,7 +1438,6 @@ int get_feature_volumes(char *dst, char *key, int argc, char **argv)
     *end_ptr;
   VIO_Real
     tmp;
-  VIO_Status status;
 
   VIO_Volume 
     data_vol,
@@ -1294,48 +1514,11 @@ int get_feature_volumes(char *dst, char *key, int argc, char **argv)
         
     }
 
-    if (obj_func == NONLIN_LABEL) { /* if the feature is a label, then load data as is */
-
-      status = input_volume(data_name, 3, default_dim_names, 
-			    NC_UNSPECIFIED, FALSE, 0.0, 0.0,
-			    TRUE, &data_vol, 
-			    (minc_input_options *)NULL );
-      if (status != VIO_OK) {
-	(void)fprintf(stderr, "Cannot input feature %s.\n",data_name);
-	return(-1);
-      } 
-      status = input_volume(model_name, 3, default_dim_names, 
-			    NC_UNSPECIFIED, FALSE, 0.0, 0.0,
-			    TRUE, &model_vol, 
-			    (minc_input_options *)NULL );
-      if (status != VIO_OK) {
-	(void)fprintf(stderr, "Cannot input feature %s.\n",model_name);
-	return(-1);
-      } 
-
-    }
-    else {			/* if feature is not a label, then force load as DOUBLEs */
-
-      status = input_volume(data_name, 3, default_dim_names, 
-			    NC_DOUBLE, FALSE, 0.0, 0.0,
-			    TRUE, &data_vol, 
-			    (minc_input_options *)NULL );
-      if (status != VIO_OK) {
-	(void)fprintf(stderr, "Cannot input feature %s.\n",data_name);
-	return(-1);
-      } 
-      status = input_volume(model_name, 3, default_dim_names, 
-			    NC_DOUBLE, FALSE, 0.0, 0.0,
-			    TRUE, &model_vol, 
-			    (minc_input_options *)NULL );
-      if (status != VIO_OK) {
-	(void)fprintf(stderr, "Cannot input feature %s.\n",model_name);
-	return(-1);
-      } 
-
-    }
-
-
+                                /* the volumes are loaded by
+                                   load_feature_volumes() once all the
+                                   options (e.g. -voxel_type) are known */
+    data_vol  = (VIO_Volume)NULL;
+    model_vol = (VIO_Volume)NULL;
 
     add_a_feature_for_matching(&(main_args->features),
                                data_vol, model_vol, data_mask, model_mask,
@@ -225,9 +225,11 @@ static void resample_the_deformation_field(Arg_Data *globals)
                              __FILE__, __LINE__);
   }
 
-  /* build a vector volume to store the Grid VIO_Transform */
+  /* build a vector volume to store the Grid VIO_Transform, as doubles
+     or floats (-grid_type).  The warps of the fit are copies of it, and
+     keep its type. */
 
-  new_field = create_volume(4, dim_name_vector_vol, NC_DOUBLE, TRUE, 0.0, 0.0);
+  new_field = create_volume(4, dim_name_vector_vol, globals->grid_type, TRUE, 0.0, 0.0);
 
   get_volume_XYZV_indices(new_field, xyzv);
 
@@ -406,14 +408,16 @@ static void append_new_default_deformation_field(Arg_Data *globals)
    VectorR
     XYZdirections[ VIO_MAX_DIMENSIONS ];
 
-  /* build a vector volume to store the Grid VIO_Transform */
+  /* build a vector volume to store the Grid VIO_Transform, as doubles
+     or floats (-grid_type).  The warps of the fit are copies of it, and
+     keep its type. */
 
    /*  ALLOC(new_field,1); not needed since create volume allocs it
        internally and returns a pointer*/
 
   if (globals->flags.debug) { print ("In append_new_default_deformation_field...\n"); }
 
-  new_field = create_volume(4, dim_name_vector_vol, NC_DOUBLE, TRUE, 0.0, 0.0);
+  new_field = create_volume(4, dim_name_vector_vol, globals->grid_type, TRUE, 0.0, 0.0);
 
   get_volume_XYZV_indices(new_field, xyzv);
 
@@ -140,8 +140,6 @@ static char rcsid[]="$Header: /static-cvsroot/registration/mni_autoreg/minctracc
 #include "make_rots.h"
 #include "quaternion.h"
 
-extern Arg_Data *main_args;
-
 #include "local_macros.h"
 #include <Proglib.h>
 
@@ -166,6 +164,7 @@ void set_up_lattice(VIO_Volume data,       /* in: volume  */
 @INPUT      : d1: one volume of data (already in memory).
               m1: its corresponding mask volume
               step: an 3 element array of step sizes in x,ya nd z directions
+              globals: for the interpolant (and debug flag)
                 
 @OUTPUT     : centroid - vector giving centroid of points. This vector
                          must be defined by the calling routine.
@@ -181,7 +180,8 @@ void set_up_lattice(VIO_Volume data,       /* in: volume  */
 @MODIFIED   : 
               
 ---------------------------------------------------------------------------- */
-VIO_BOOL vol_cog(VIO_Volume d1, VIO_Volume m1, float *centroid, double *step)
+VIO_BOOL vol_cog(VIO_Volume d1, VIO_Volume m1, float *centroid, double *step,
+                 Arg_Data *globals)
 {
 
 
@@ -261,7 +261,7 @@ VIO_BOOL vol_cog(VIO_Volume d1, VIO_Volume m1, float *centroid, double *step)
 
         if (point_not_masked(m1, Point_x(col), Point_y(col), Point_z(col))) {        
           
-          if (INTERPOLATE_TRUE_VALUE( d1, &voxel, &true_value )) {
+          if (INTERPOLATE_TRUE_VALUE( globals, d1, &voxel, &true_value )) {
             
 
             sx +=  Point_x(col) * true_value;
@@ -299,6 +299,7 @@ VIO_BOOL vol_cog(VIO_Volume d1, VIO_Volume m1, float *centroid, double *step)
 @INPUT      : d1: one volume of data (already in memory).
               m1: its corresponding mask volume
               step: an 3 element array of step sizes in x,ya nd z directions
+              globals: for the interpolant (and debug flag)
               centroid - vector giving centroid of points. This vector
                          must be defined by the calling routine.  
 @OUTPUT     : covar    - covariance matrix (in zero offset form).
@@ -317,7 +318,8 @@ VIO_BOOL vol_cog(VIO_Volume d1, VIO_Volume m1, float *centroid, double *step)
 @MODIFIED   : 
               
 ---------------------------------------------------------------------------- */
-VIO_BOOL vol_cov(VIO_Volume d1, VIO_Volume m1, float *centroid, float **covar, double *step)
+VIO_BOOL vol_cov(VIO_Volume d1, VIO_Volume m1, float *centroid, float **covar, double *step,
+                 Arg_Data *globals)
 {
 
 
@@ -396,7 +398,7 @@ VIO_BOOL vol_cov(VIO_Volume d1, VIO_Volume m1, float *centroid, float **covar, d
         
         if (point_not_masked(m1, Point_x(col), Point_y(col), Point_z(col))) {        
           
-          if (INTERPOLATE_TRUE_VALUE( d1, &voxel, &true_value )) {
+          if (INTERPOLATE_TRUE_VALUE( globals, d1, &voxel, &true_value )) {
             
             sxx += (Point_x( col )-centroid[1]) * (Point_x( col )-centroid[1]) * true_value;
             syy += (Point_y( col )-centroid[2]) * (Point_y( col )-centroid[2]) * true_value;
@@ -435,6 +437,7 @@ VIO_BOOL vol_cov(VIO_Volume d1, VIO_Volume m1, float *centroid, float **covar, d
 @INPUT      : d1: one volume of data (already in memory).
               m1: its corresponding mask volume
               step: an 3 element array of step sizes in x,ya nd z directions
+              globals: for the interpolant (and debug flag)
                 
 @OUTPUT     : centroid - vector giving centroid of points. This vector
                          must be defined by the calling routine.
@@ -454,7 +457,8 @@ VIO_BOOL vol_cov(VIO_Volume d1, VIO_Volume m1, float *centroid, float **covar, d
 @MODIFIED   : Thu May 27 16:50:50 EST 1993 lc
                  rewrite for minc files and david's library
 ---------------------------------------------------------------------------- */
-VIO_BOOL vol_to_cov(VIO_Volume d1, VIO_Volume m1, float *centroid, float **covar, double *step)
+VIO_BOOL vol_to_cov(VIO_Volume d1, VIO_Volume m1, float *centroid, float **covar, double *step,
+                    Arg_Data *globals)
 {
   int
     i,count[VIO_MAX_DIMENSIONS];
@@ -465,7 +469,7 @@ VIO_BOOL vol_to_cov(VIO_Volume d1, VIO_Volume m1, float *centroid, float **covar
   VectorR
     directions[VIO_MAX_DIMENSIONS];  
 
-  if (main_args->flags.debug) {
+  if (globals->flags.debug) {
 
     set_up_lattice(d1, step,
                    start, wstart, count, local_step, directions);
@@ -483,9 +487,9 @@ VIO_BOOL vol_to_cov(VIO_Volume d1, VIO_Volume m1, float *centroid, float **covar
   }
 
 
-  if ( vol_cog(d1, m1, centroid, step) )
+  if ( vol_cog(d1, m1, centroid, step, globals) )
     
-    return ( vol_cov( d1, m1, centroid, covar, step) );
+    return ( vol_cov( d1, m1, centroid, covar, step, globals) );
 
   else
     
@@ -504,6 +508,7 @@ VIO_BOOL vol_to_cov(VIO_Volume d1, VIO_Volume m1, float *centroid, float **covar
                 two mask volumes for data (already in memory).
               step: an 3 element array of step sizes in x,y and z directions
               verbose: =0 for quiet, >1 otherwise
+              globals: for the interpolant
                 
 @OUTPUT     : c1,c2    - vector giving volume centroids. This vector
                          must be defined by the calling routine.
@@ -546,7 +551,8 @@ static  VIO_BOOL init_transformation(
                                      float *c2,         /* centroid of masked d1 */
                                      float *scale,      /* scaling from d1 to d2 */
                                      int forced_center,
-                                     Transform_Flags *flags) /* flags for estimation */
+                                     Transform_Flags *flags, /* flags for estimation */
+                                     Arg_Data *globals)      /* for the interpolant  */
 {
   float
     dir,
@@ -583,13 +589,13 @@ static  VIO_BOOL init_transformation(
   /* =========  calculate COG and COV for volume 1   =======  */
                                 /* if center already set, then don't recalculate */
   if ( !forced_center) {
-    stat = vol_cog(d1, m1, c1, step);
+    stat = vol_cog(d1, m1, c1, step, globals);
     if (verbose>0 && stat) print ("COG of v1: %f %f %f\n",c1[1],c1[2],c1[3]);
   }
   else {
     if (verbose>0) print ("COG of v1 forced: %f %f %f\n",c1[1],c1[2],c1[3]);
   }
-  if (!stat || !vol_cov(d1, m1, c1, cov1, step ) ) {
+  if (!stat || !vol_cov(d1, m1, c1, cov1, step, globals ) ) {
     print_error_and_line_num("%s", __FILE__, __LINE__,"Cannot calculate the COG or COV of volume 1.\n" );
     return(FALSE);
   }
@@ -598,7 +604,7 @@ static  VIO_BOOL init_transformation(
   /* =========  calculate COG and COV for volume 2 only if needed:   =======  */
 
   if (flags->estimate_trans || flags->estimate_rots || flags->estimate_scale) {
-    if (! vol_to_cov(d2, m2, c2, cov2, step ) ) {
+    if (! vol_to_cov(d2, m2, c2, cov2, step, globals ) ) {
       print_error_and_line_num("%s", __FILE__, __LINE__,"Cannot calculate the COG or COV of volume 2.\n" );
       return(FALSE);
     }
@@ -855,7 +861,8 @@ static  VIO_BOOL init_transformation_quater(
                                             float *c2,         /* centroid of masked d1 */
                                             float *scale,      /* scaling from d1 to d2 */
                                             int forced_center,
-                                            Transform_Flags *flags) /* flags for estimation */
+                                            Transform_Flags *flags, /* flags for estimation */
+                                            Arg_Data *globals)      /* for the interpolant  */
 {
   float
     dir,
@@ -896,14 +903,14 @@ static  VIO_BOOL init_transformation_quater(
 
                                 /* if center already set, then don't recalculate */
   if ( !forced_center) {
-    stat = vol_cog(d1, m1, c1, step);
+    stat = vol_cog(d1, m1, c1, step, globals);
     if (verbose>0 && stat) print ("COG of v1: %f %f %f\n",c1[1],c1[2],c1[3]);
   }
   else {
     if (verbose>0) print ("COG of v1 forced: %f %f %f\n",c1[1],c1[2],c1[3]);
   }
 
-  if (!stat || !vol_cov(d1, m1, c1, cov1, step ) ) {
+  if (!stat || !vol_cov(d1, m1, c1, cov1, step, globals ) ) {
     print_error_and_line_num("%s", __FILE__, __LINE__,"Cannot calculate the COG or COV of volume 1\n." );
     return(FALSE);
   }
@@ -911,7 +918,7 @@ static  VIO_BOOL init_transformation_quater(
   /* =========  calculate COG and COV for volume 2 only if needed:   =======  */
 
   if (flags->estimate_trans || flags->estimate_quats || flags->estimate_scale) {
-    if (! vol_to_cov(d2, m2, c2, cov2, step ) ) {
+    if (! vol_to_cov(d2, m2, c2, cov2, step, globals ) ) {
       print_error_and_line_num("%s", __FILE__, __LINE__,"Cannot calculate the COG or COV of volume 2\n." );
       return(FALSE);
     }
@@ -1260,14 +1267,14 @@ VIO_BOOL init_params(VIO_Volume d1,
         {
           if (!init_transformation(d1,d2,m1,m2, globals->step, globals->flags.verbose,
                                    trans,rots,ang,c1,c2,sc, center_forced,
-                                   &(globals->trans_flags)))
+                                   &(globals->trans_flags), globals))
             return(FALSE);
         }
       else
         {
           if (!init_transformation_quater(d1,d2,m1,m2, globals->step, globals->flags.verbose,
                                           trans,ang,quats,c1,c2,sc, center_forced,
-                                          &(globals->trans_flags)))
+                                          &(globals->trans_flags), globals))
             return(FALSE);
         }
       
@@ -1385,7 +1392,7 @@ VIO_BOOL init_params(VIO_Volume d1,
           VIO_ALLOC2D(cov1 ,4,4);
           ALLOC(c1   ,4);
           
-          if (! vol_cog(d1, m1,  c1, globals->step ) ) 
+          if (! vol_cog(d1, m1,  c1, globals->step, globals ) ) 
             {
               print_error_and_line_num("%s", __FILE__, __LINE__,"Cannot calculate the COG of volume 1\n." );
               return(FALSE);
@@ -1453,12 +1460,12 @@ VIO_BOOL init_params(VIO_Volume d1,
         if(globals->trans_info.rotation_type == TRANS_ROT)
           if (!init_transformation(d1,d2,m1,m2, globals->step, globals->flags.verbose,
                                    trans,rots,ang,c1,c2,sc, 
-                                   center_forced,&(globals->trans_flags)))
+                                   center_forced,&(globals->trans_flags), globals))
             return(FALSE);      
         if(globals->trans_info.rotation_type == TRANS_QUAT)
           if (!init_transformation_quater(d1,d2,m1,m2, globals->step, globals->flags.verbose,
                                           trans,ang,quats,c1,c2,sc, 
-                                          center_forced,&(globals->trans_flags)))
+                                          center_forced,&(globals->trans_flags), globals))
             return(FALSE);      
       
         for(i=0; i<3; i++) 
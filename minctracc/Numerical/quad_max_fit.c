@@ -80,12 +80,10 @@
 
 #define MINIMUM_DET_ALLOWED 0.00000001
 
-extern int stat_quad_total;
-extern int stat_quad_zero;
-extern int stat_quad_two;
-extern int stat_quad_plus;
-extern int stat_quad_minus;
-extern int stat_quad_semi;
+/* the tallies belong to the caller (one per thread of
+   do_non_linear_optimization), and may be NULL */
+#define TALLY_QUAD_STAT( stats, field ) \
+  do { if ((stats) != NULL) (stats)->field++; } while (0)
 
     /* local prototypes */
 
@@ -289,7 +287,8 @@ VIO_BOOL return_3D_disp_from_quad_fit(VIO_Real r[3][3][3],
 VIO_BOOL return_3D_disp_from_min_quad_fit(VIO_Real r[3][3][3], 
                                                 VIO_Real *dispu, 
                                                 VIO_Real *dispv, 
-                                                VIO_Real *dispw)        
+                                                VIO_Real *dispw,
+                                                Quad_Fit_Stats *stats)        
 {
   deriv_3D_struct 
     d;                        /* the 1st and second order derivatives */
@@ -304,7 +303,7 @@ VIO_BOOL return_3D_disp_from_min_quad_fit(VIO_Real r[3][3][3],
   *dispu = *dispv = *dispw = 0.0;
   estimate_3D_derivatives_new(r,&d);
   hack_to_min_val = FALSE;
-  stat_quad_total++;
+  TALLY_QUAD_STAT(stats, total);
 
   /*    /          \    the values that form the matrix A come from the  */
   /*    | uu uv uw |    second order derivatives in 'd'.  If this matrix */
@@ -322,7 +321,7 @@ VIO_BOOL return_3D_disp_from_min_quad_fit(VIO_Real r[3][3][3],
            d.uw * (d.uv*d.vw - d.vv*d.uw) ;               
                                                        
     if ( fabs( detA ) <= MINIMUM_DET_ALLOWED ) {
-      hack_to_min_val = TRUE; stat_quad_zero++;
+      hack_to_min_val = TRUE; TALLY_QUAD_STAT(stats, zero);
     }
     else {
                                 /* a = inv(A) */
@@ -345,20 +344,20 @@ VIO_BOOL return_3D_disp_from_min_quad_fit(VIO_Real r[3][3][3],
       *dispw = -a[2][0]*d.u - a[2][1]*d.v - a[2][2]*d.w;
 
       if ( fabs( *dispu ) < 2.0 && fabs( *dispv ) < 2.0 && fabs( *dispw ) < 2.0 ) {        
-        stat_quad_plus++; return (TRUE);
+        TALLY_QUAD_STAT(stats, plus); return (TRUE);
       }
       else {
-        hack_to_min_val = TRUE; stat_quad_two++;    
+        hack_to_min_val = TRUE; TALLY_QUAD_STAT(stats, two);    
       }
     }
   }
   else {
     if (positive_3D_semidefinite(&d)) {
-      stat_quad_semi++;
+      TALLY_QUAD_STAT(stats, semi);
       /* get_disp_from_positive_semidefinite(&d, dispu, dispv, dispw); */
     }
     else{
-      stat_quad_minus++;;
+      TALLY_QUAD_STAT(stats, minus);
       hack_to_min_val = TRUE;    
     }
   }
@@ -0,0 +1,218 @@
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : checkpoint.c
+@DESCRIPTION: checkpoints of the nonlinear fit (-checkpoint, -resume).
+
+              Every -checkpoint_interval iterations, and at the end of
+              each level of the fit, the state that carries from one
+              iteration to the next is written to
+              <dir>/nonlinear.checkpoint:
+
+                - the level of -nonlinear_schedule (0 without one) and
+                  the number of iterations done at this level,
+                - the number of iterations in a row that met
+                  -nonlinear_tol or -nonlinear_xcorr_tol,
+                - the cross-correlation before the first iteration
+                  (initial_corr) and the one -nonlinear_xcorr_tol
+                  compares the next iteration with,
+                - the eigen value statistics used for non-isotropic
+                  smoothing (previous_mean_eig_val, previous_std_eig_val),
+                - the nodes to estimate in the next iteration
+                  (-active_tolerance),
+                - the deformation vector of every node of the grid,
+                  as doubles, so that nothing is lost in the round trip.
+
+              The fit uses no random numbers, so there is no generator
+              state to keep.  With -resume and the same command line,
+              the fit continues after the last checkpoint and ends with
+              the same deformation as an uninterrupted run.
+
+              The file is written under a temporary name, then renamed,
+              so that a run stopped while writing leaves the previous
+              checkpoint intact.
+@CREATED    : Oct 18, 2026
+---------------------------------------------------------------------------- */
+
+#include <config.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <volume_io.h>
+#include <Proglib.h>
+#include "constants.h"
+#include "nonlinear_context.h"
+#include "deform_support.h"
+
+#define CHECKPOINT_FILE    "nonlinear.checkpoint"
+#define CHECKPOINT_MAGIC   "minctracc nonlinear checkpoint 3\n"
+
+static char *checkpoint_file_name(char *dir, char *suffix)
+{
+  char *name;
+
+  ALLOC(name, strlen(dir) + strlen(CHECKPOINT_FILE) + strlen(suffix) + 2);
+  (void)sprintf(name, "%s/%s%s", dir, CHECKPOINT_FILE, suffix);
+
+  return(name);
+}
+
+
+/* save the state of the fit after iteration iterations of the current
+   level, converged_iterations of which, in a row, met the stopping
+   criteria, and previous_corr the xcorr that -nonlinear_xcorr_tol
+   compares the next iteration with.  active[0..n_nodes-1] are the nodes to estimate in the next
+   iteration, NULL if all are.  A failure to save is reported, but
+   does not stop the fit. */
+
+VIO_BOOL write_nonlinear_checkpoint(Nonlinear_Context *nl,
+                                    VIO_Volume current_vol,
+                                    int iteration,
+                                    int converged_iterations,
+                                    VIO_Real previous_corr,
+                                    unsigned char *active,
+                                    long n_nodes)
+{
+  Arg_Data
+    *globals = nl->globals;
+  char
+    *name, *tmp_name;
+  FILE
+    *file;
+  int
+    level,
+    sizes[VIO_MAX_DIMENSIONS],
+    count[VIO_N_DIMENSIONS];
+  long
+    n_vectors, n_active;
+  double
+    *vectors;
+  VIO_BOOL
+    ok;
+
+  if (mkdir(globals->nonlinear.checkpoint_dir, 0777) != 0 && errno != EEXIST) {
+    print ("Error creating checkpoint directory %s\n", globals->nonlinear.checkpoint_dir);
+    return(FALSE);
+  }
+
+  get_volume_sizes(current_vol, sizes);
+  n_vectors = (long)sizes[0] * sizes[1] * sizes[2] * sizes[3];
+  ALLOC(vectors, n_vectors);
+  get_warp_vectors(current_vol, count, vectors);
+  n_vectors = (long)count[VIO_X] * count[VIO_Y] * count[VIO_Z] * 3;
+
+  level    = globals->nonlinear.schedule.current;
+  n_active = (active != NULL) ? n_nodes : 0;
+
+  name     = checkpoint_file_name(globals->nonlinear.checkpoint_dir, "");
+  tmp_name = checkpoint_file_name(globals->nonlinear.checkpoint_dir, ".tmp");
+
+  file = fopen(tmp_name, "wb");
+  ok = (file != NULL);
+
+  if (ok) {
+    ok = (fputs(CHECKPOINT_MAGIC, file) != EOF &&
+          fwrite(&level,     sizeof(int), 1, file) == 1 &&
+          fwrite(&iteration, sizeof(int), 1, file) == 1 &&
+          fwrite(&converged_iterations, sizeof(int), 1, file) == 1 &&
+          fwrite(&globals->initial_corr, sizeof(VIO_Real), 1, file) == 1 &&
+          fwrite(&previous_corr, sizeof(VIO_Real), 1, file) == 1 &&
+          fwrite(nl->previous_mean_eig_val, sizeof(VIO_Real), 3, file) == 3 &&
+          fwrite(nl->previous_std_eig_val,  sizeof(VIO_Real), 3, file) == 3 &&
+          fwrite(count,      sizeof(int), VIO_N_DIMENSIONS, file) == VIO_N_DIMENSIONS &&
+          fwrite(vectors,    sizeof(double), n_vectors, file) == n_vectors &&
+          fwrite(&n_active,  sizeof(long), 1, file) == 1 &&
+          (n_active == 0 ||
+           fwrite(active, sizeof(unsigned char), n_active, file) == n_active));
+    if (fclose(file) != 0)
+      ok = FALSE;
+  }
+
+  if (ok)
+    ok = (rename(tmp_name, name) == 0);
+
+  if (!ok)
+    print ("Error saving checkpoint %s\n", name);
+  else if (globals->flags.verbose>0)
+    print ("Checkpoint saved: level %d, iteration %d\n", level+1, iteration);
+
+  FREE(vectors);
+  FREE(tmp_name);
+  FREE(name);
+
+  return(ok);
+}
+
+
+/* read the last checkpoint saved in -checkpoint's directory.  Returns
+   FALSE if there is none; a checkpoint that cannot be read is an
+   error. */
+
+VIO_BOOL read_nonlinear_checkpoint(Arg_Data *globals,
+                                   Nonlinear_Checkpoint *checkpoint)
+{
+  char
+    *name,
+    magic[sizeof(CHECKPOINT_MAGIC)];
+  FILE
+    *file;
+  long
+    n_vectors;
+  VIO_BOOL
+    ok;
+
+  checkpoint->vectors = NULL;
+  checkpoint->active  = NULL;
+
+  name = checkpoint_file_name(globals->nonlinear.checkpoint_dir, "");
+  file = fopen(name, "rb");
+  if (file == NULL) {
+    FREE(name);
+    return(FALSE);
+  }
+
+  ok = (fread(magic, 1, strlen(CHECKPOINT_MAGIC), file) == strlen(CHECKPOINT_MAGIC) &&
+        strncmp(magic, CHECKPOINT_MAGIC, strlen(CHECKPOINT_MAGIC)) == 0 &&
+        fread(&checkpoint->level,     sizeof(int), 1, file) == 1 &&
+        fread(&checkpoint->iteration, sizeof(int), 1, file) == 1 &&
+        fread(&checkpoint->converged_iterations, sizeof(int), 1, file) == 1 &&
+        fread(&checkpoint->initial_corr,  sizeof(VIO_Real), 1, file) == 1 &&
+        fread(&checkpoint->previous_corr, sizeof(VIO_Real), 1, file) == 1 &&
+        fread(checkpoint->previous_mean_eig_val, sizeof(VIO_Real), 3, file) == 3 &&
+        fread(checkpoint->previous_std_eig_val,  sizeof(VIO_Real), 3, file) == 3 &&
+        fread(checkpoint->count, sizeof(int), VIO_N_DIMENSIONS, file) == VIO_N_DIMENSIONS &&
+        checkpoint->count[VIO_X] > 0 && checkpoint->count[VIO_Y] > 0 &&
+        checkpoint->count[VIO_Z] > 0);
+
+  if (ok) {
+    n_vectors = (long)checkpoint->count[VIO_X] * checkpoint->count[VIO_Y] *
+      checkpoint->count[VIO_Z] * 3;
+    ALLOC(checkpoint->vectors, n_vectors);
+    ok = (fread(checkpoint->vectors, sizeof(double), n_vectors, file) == n_vectors &&
+          fread(&checkpoint->n_active, sizeof(long), 1, file) == 1 &&
+          checkpoint->n_active >= 0);
+  }
+
+  if (ok && checkpoint->n_active > 0) {
+    ALLOC(checkpoint->active, checkpoint->n_active);
+    ok = (fread(checkpoint->active, sizeof(unsigned char), checkpoint->n_active, file) ==
+          checkpoint->n_active);
+  }
+
+  (void)fclose(file);
+
+  if (!ok)
+    print_error_and_line_num("Cannot read the checkpoint %s\n",
+                             __FILE__, __LINE__, name);
+  FREE(name);
+
+  return(TRUE);
+}
+
+void delete_nonlinear_checkpoint(Nonlinear_Checkpoint *checkpoint)
+{
+  if (checkpoint->vectors != NULL)
+    FREE(checkpoint->vectors);
+  if (checkpoint->active != NULL)
+    FREE(checkpoint->active);
+}
@@ -57,47 +57,12 @@
 #include "constants.h"
 #include <minctracc_arg_data.h>           /* definition of the global data struct      */
 #include <Proglib.h>
+#include <nonlinear_context.h>       /* state of the fit and of each node     */
+#include <sub_lattice.h>
 
-
-/* GLOBALS used within these functions: */
-
-extern int 
-  number_dimensions;            /* from do_nonlinear.c */
-extern Arg_Data 
-  *Gglobals;                    /* from do_nonlinear.c */
-extern float
-  *Gsqrt_features,
-  **Ga1_features,
-  *TX, *TY, *TZ;                /* from do_nonlinear.c */
-extern VIO_BOOL 
-  **masked_samples_in_source;  /* from do_nonlinear.c */
-extern int 
-  Glen;                         /* from do_nonlinear.c */
-extern VIO_Real                     /* from do_nonlinear.c */
-  Gtarget_vox_x, Gtarget_vox_y, Gtarget_vox_z,
-  Gproj_d1,  Gproj_d1x,  Gproj_d1y,  Gproj_d1z, 
-  Gproj_d2,  Gproj_d2x,  Gproj_d2y,  Gproj_d2z;
-extern double
-  similarity_cost_ratio;
-extern VIO_Real     
-  Gcost_radius;                 /* from do_nonlinear.c */
 int 
   nearest_neighbour_interpolant(VIO_Volume volume, 
                                 PointR *coord, double *result);
-int target_sample_count=0;
-
-void from_param_to_grid_weights(
-   VIO_Real p[],
-   VIO_Real grid[]);
-
-
-float go_get_samples_with_offset(VIO_Volume data, VIO_Volume model_mask,
-                                        float *x, float *y, float *z,
-                                        VIO_Real  dx, VIO_Real  dy, VIO_Real dz,
-                                        int obj_func,
-                                        int len, int *sample_count,
-                                        float sqrt_s1, float *a1, VIO_BOOL *m1,
-                                        VIO_BOOL use_nearest_neighbour);
 
 
 /* This is the COST FUNCTION TO BE MINIMIZED.
@@ -120,6 +85,40 @@ static VIO_Real cost_fn(float x, float y, float z, VIO_Real max_length)
   return(d);
 }
 
+/* gradient and hessian of cost_fn() at (d[0],d[1],d[2]):
+   with v = |d|^3, cost = 0.2 v / (max_length - v) */
+
+static void cost_fn_derivatives(VIO_Real d[3], VIO_Real max_length,
+                                VIO_Real grad[3], VIO_Real hess[3][3])
+{
+  VIO_Real len, v, dc, d2c, grad_v[3];
+  int i,j;
+
+  len = sqrt(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]);
+  v   = len * len * len;
+
+  for(i=0; i<3; i++) {
+    grad[i] = 0.0;
+    for(j=0; j<3; j++) hess[i][j] = 0.0;
+  }
+
+  if (len == 0.0 || v >= max_length)
+    return;
+
+  dc  = 0.2 * max_length / ((max_length - v)*(max_length - v));
+  d2c = 2.0 * dc / (max_length - v);
+
+  for(i=0; i<3; i++) 
+    grad_v[i] = 3.0 * len * d[i];
+
+  for(i=0; i<3; i++) {
+    grad[i] = dc * grad_v[i];
+    for(j=0; j<3; j++)
+      hess[i][j] = d2c * grad_v[i] * grad_v[j] + 
+        dc * 3.0 * ((i==j ? len : 0.0) + d[i]*d[j]/len);
+  }
+}
+
 /* This is the SIMILARITY FUNCTION TO BE MAXIMIZED.
 
       it is maximum when source and target data are most similar.
@@ -136,12 +135,14 @@ static VIO_Real cost_fn(float x, float y, float z, VIO_Real max_length)
          D[3] stores the zdisp
 */
 
-static VIO_Real similarity_fn(float *d)
+static VIO_Real similarity_fn(Node_Context *context, float *d)
 {
   int i;
   VIO_Real
     norm,
     s, func_sim;
+  Arg_Data
+    *globals = context->nl->globals;
    
   /* note: here the displacement order for go_get_samples_with_offset
      is 3,2,1 (=Z,Y,X) since the source and target volumes are stored in
@@ -152,30 +153,40 @@ static VIO_Real similarity_fn(float *d)
      and d[2] in 2D (d[3] stays const=0). */
   
   s = norm = 0.0;
+
+                                /* when the features share their geometry,
+                                   the target lattice is interpolated once
+                                   for all of them */
+  if (context->nl->fused_features)
+    go_get_feature_samples_with_offset(context, d[3], d[2], d[1], context->feature_sim);
     
-  for(i=0; i<Gglobals->features.number_of_features; i++)  {
+  for(i=0; i<globals->features.number_of_features; i++)  {
 
                                 /* ignore OPTICAL FLOW objective functions, since it is
                                    computed directly and _not_ optimized */
 
-    if (Gglobals->features.obj_func[i] != NONLIN_OPTICALFLOW) {
-      func_sim = 
-        (VIO_Real)go_get_samples_with_offset(Gglobals->features.model[i],
-                Gglobals->features.model_mask[i],
-                                         TX,TY,TZ,
+    if (globals->features.obj_func[i] != NONLIN_OPTICALFLOW) {
+      if (context->nl->fused_features)
+        func_sim = (VIO_Real)context->feature_sim[i];
+      else
+        func_sim = 
+        (VIO_Real)go_get_samples_with_offset(context->nl,
+                                         globals->features.model[i],
+                globals->features.model_mask[i],
+                                         context->TX,context->TY,context->TZ,
                                          d[3], d[2], d[1],
-                                         Gglobals->features.obj_func[i],
-                                         Glen, &target_sample_count,
-                                         Gsqrt_features[i], Ga1_features[i],
-                masked_samples_in_source[i],
-                                         Gglobals->interpolant==nearest_neighbour_interpolant);
+                                         globals->features.obj_func[i],
+                                         context->len, &context->target_sample_count,
+                                         context->sqrt_features[i], context->a1_features[i],
+                context->masked_samples[i],
+                                         globals->interpolant==nearest_neighbour_interpolant);
       
 
-      norm += fabs(Gglobals->features.weight[i]);
-      s += Gglobals->features.weight[i] * func_sim;
+      norm += fabs(globals->features.weight[i]);
+      s += globals->features.weight[i] * func_sim;
       
       /*
-        if ((Gglobals->features.obj_func[i]==NONLIN_CHAMFER) && (func_sim > 1.5))
+        if ((globals->features.obj_func[i]==NONLIN_CHAMFER) && (func_sim > 1.5))
         do nothing, do not add the chamfer distance info 
       */
       
@@ -196,7 +207,7 @@ static VIO_Real similarity_fn(float *d)
    this is the objective function that needs to be minimized 
    to give a local deformation
 */
-VIO_Real local_objective_function(float *d)
+VIO_Real local_objective_function(Node_Context *context, float *d)
      
 {
   VIO_Real
@@ -204,21 +215,178 @@ VIO_Real local_objective_function(float *d)
     cost, 
     r;
   
-  similarity = (VIO_Real)similarity_fn( d );
-  cost       = (VIO_Real)cost_fn( d[1], d[2], d[3], Gcost_radius );
+  Nonlinear_Context
+    *nl = context->nl;
+  
+  similarity = (VIO_Real)similarity_fn( context, d );
+  cost       = (VIO_Real)cost_fn( d[1], d[2], d[3], nl->cost_radius );
   
   r = 1.0 - 
-      similarity * similarity_cost_ratio + 
-      cost       * (1.0-similarity_cost_ratio);
+      similarity * nl->similarity_cost_ratio + 
+      cost       * (1.0-nl->similarity_cost_ratio);
 
   return(r);
 }
 
 
+/* 
+   local_objective_function() at d[1..3], with its gradient grad[1..3]
+   and an approximation of its hessian hess[1..3][1..3] (Gauss-Newton
+   for the similarity, see go_get_samples_and_gradient()), used by the
+   -local_gn fit.  Returns FALSE when one of the objective functions
+   has no derivatives.
+*/
+VIO_BOOL local_objective_gradient(Node_Context *context, float *d,
+                                  VIO_Real *obj, VIO_Real grad[4], VIO_Real hess[4][4])
+{
+  int f,i,j;
+  VIO_Real
+    norm, s, sim, w,
+    disp[3],
+    g[3], h[3][3];
+  Nonlinear_Context
+    *nl = context->nl;
+  Arg_Data
+    *globals = nl->globals;
+
+  s = norm = 0.0;
+  for(i=1; i<=3; i++) {
+    grad[i] = 0.0;
+    for(j=1; j<=3; j++) hess[i][j] = 0.0;
+  }
+
+  for(f=0; f<globals->features.number_of_features; f++)  {
+
+    if (globals->features.obj_func[f] != NONLIN_OPTICALFLOW) {
+      if (!go_get_samples_and_gradient(nl,
+                                       globals->features.model[f],
+                                       globals->features.model_mask[f],
+                                       context->TX,context->TY,context->TZ,
+                                       d[3], d[2], d[1],
+                                       globals->features.obj_func[f],
+                                       context->len,
+                                       context->sqrt_features[f], context->a1_features[f],
+                                       context->masked_samples[f],
+                                       globals->interpolant==nearest_neighbour_interpolant,
+                                       &sim, g, h))
+        return(FALSE);
+
+      w     = globals->features.weight[f];
+      norm += fabs(w);
+      s    += w * sim;
+                                /* g[] and h[][] are in d[3],d[2],d[1] order */
+      for(i=0; i<3; i++) {
+        grad[3-i] += w * g[i];
+        for(j=0; j<3; j++)
+          hess[3-i][3-j] += w * h[i][j];
+      }
+    }
+  }
+
+  if (norm <= 0.0) 
+    print_error_and_line_num("The feature weights are null.", 
+                             __FILE__, __LINE__);
+
+  s = s / norm;
+  for(i=1; i<=3; i++) {
+    grad[i] *= nl->similarity_cost_ratio / norm;
+    for(j=1; j<=3; j++)
+      hess[i][j] *= nl->similarity_cost_ratio / norm;
+  }
+
+  for(i=0; i<3; i++)
+    disp[i] = d[i+1];
+  cost_fn_derivatives(disp, nl->cost_radius, g, h);
+  for(i=0; i<3; i++) {
+    grad[i+1] += g[i] * (1.0-nl->similarity_cost_ratio);
+    for(j=0; j<3; j++)
+      hess[i+1][j+1] += h[i][j] * (1.0-nl->similarity_cost_ratio);
+  }
+
+  *obj = 1.0 - 
+    s * nl->similarity_cost_ratio + 
+    (VIO_Real)cost_fn( d[1], d[2], d[3], nl->cost_radius ) * (1.0-nl->similarity_cost_ratio);
+
+  return(TRUE);
+}
+
+
+/* 
+   evaluate local_objective_function() for the 27 displacements
+   d = (disp[i], disp[j], disp[k]) of the quadratic fit stencil, storing
+   the result in obj[i][j][k].  The similarity of all 27 displacements
+   is computed in a single pass over the sub-lattice.  When ndim==2,
+   d[3] stays 0 (disp[1] must be 0.0) and only obj[i][j][1] is set.
+*/
+void local_objective_stencil(Node_Context *context, float disp[3], int ndim,
+                             VIO_Real obj[3][3][3])
+{
+  int f,i,j,k,klo,khi;
+  float 
+    func_sim[3][3][3];
+  VIO_Real
+    norm,
+    s[3][3][3],
+    cost;
+  Nonlinear_Context
+    *nl = context->nl;
+  Arg_Data
+    *globals = nl->globals;
+
+  klo = (ndim==2) ? 1 : 0;
+  khi = (ndim==2) ? 1 : 2;
+
+  norm = 0.0;
+  for(i=0; i<3; i++)
+    for(j=0; j<3; j++)
+      for(k=0; k<3; k++)
+        s[i][j][k] = 0.0;
+
+  for(f=0; f<globals->features.number_of_features; f++)  {
+
+    if (globals->features.obj_func[f] != NONLIN_OPTICALFLOW) {
+      go_get_stencil_samples_with_offset(nl,
+                                         globals->features.model[f],
+                                         globals->features.model_mask[f],
+                                         context->TX,context->TY,context->TZ,
+                                         disp, ndim,
+                                         globals->features.obj_func[f],
+                                         context->len,
+                                         context->sqrt_features[f], context->a1_features[f],
+                                         context->masked_samples[f],
+                                         globals->interpolant==nearest_neighbour_interpolant,
+                                         func_sim);
+
+      norm += fabs(globals->features.weight[f]);
+      for(i=0; i<3; i++)
+        for(j=0; j<3; j++)
+          for(k=klo; k<=khi; k++)
+            s[i][j][k] += globals->features.weight[f] * (VIO_Real)func_sim[i][j][k];
+    }
+  }
+
+  if (norm <= 0.0) 
+    print_error_and_line_num("The feature weights are null.", 
+                             __FILE__, __LINE__);
+
+  for(i=0; i<3; i++)
+    for(j=0; j<3; j++)
+      for(k=klo; k<=khi; k++) {
+        if (norm > 0.0)
+          s[i][j][k] = s[i][j][k] / norm;
+        cost = (VIO_Real)cost_fn( disp[i], disp[j], disp[k], nl->cost_radius );
+        obj[i][j][k] = 1.0 - 
+          s[i][j][k] * nl->similarity_cost_ratio + 
+          cost       * (1.0-nl->similarity_cost_ratio);
+      }
+}
+
+
 /*  
-    amoeba_NL_obj_function() is minimized in the amoeba() optimization function
+    amoeba_NL_obj_function() is minimized in the amoeba() optimization function,
+    function_data is the Node_Context of the node being optimized
 */
-VIO_Real amoeba_NL_obj_function(void * dummy, float d[])
+VIO_Real amoeba_NL_obj_function(void * function_data, float d[])
 {
   int i;
   float p[4];
@@ -226,19 +394,21 @@ VIO_Real amoeba_NL_obj_function(void * dummy, float d[])
     real_d[VIO_N_DIMENSIONS],
     grid_weights[VIO_N_DIMENSIONS],
     obj_func_val;
+  Node_Context
+    *context = (Node_Context *)function_data;
   
-  for(i=0; i<number_dimensions; i++)
+  for(i=0; i<context->nl->number_dimensions; i++)
     real_d[i] = d[i];
 
 
-  from_param_to_grid_weights( real_d, grid_weights);
+  from_param_to_grid_weights( context->nl->globals, real_d, grid_weights);
 
 
   for(i=0; i<VIO_N_DIMENSIONS; i++)
     p[i+1] = (float)grid_weights[i];
 
 
-  obj_func_val =  local_objective_function(p);
+  obj_func_val =  local_objective_function(context, p);
 
 
   return ( obj_func_val );
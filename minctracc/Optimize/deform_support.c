@@ -234,15 +234,13 @@ static char rcsid[]="$Header: /static-cvsroot/registration/mni_autoreg/minctracc
 #include "local_macros.h"
 #include "constants.h"
 #include "interpolation.h"
-
-extern Arg_Data *main_args;
+#include "objectives.h"
 
 #define DERIV_FRAC      0.6
 #define FRAC1           0.5
 #define FRAC2           0.0833333
 #define ABSOLUTE_MAX_DEFORMATION       50.0
 
-extern double smoothing_weight;
 extern char *my_XYZ_dim_names;
 
 void get_volume_XYZV_indices(VIO_Volume data, int xyzv[]);
@@ -561,6 +559,144 @@ void add_additional_warp_to_current(VIO_General_transform *additional,
                                             
 
 
+/*******************************************************************
+  procedures: get_warp_vectors, set_warp_vectors
+
+    desc: copy the deformation vectors of a GRID_TRANSFORM displacement
+          volume to (or from) a contiguous buffer of
+          count[X]*count[Y]*count[Z] nodes of 3 components, stored in
+          [x][y][z][component] order whatever the dimension order of
+          the volume.  count[] is returned in X, Y, Z order.
+
+          NC_DOUBLE and NC_FLOAT volumes (the deformation volumes built
+          by minctracc) are read directly from their voxel array, other
+          types through volume_io.
+*/
+
+VIO_BOOL get_warp_voxel_strides(VIO_Volume volume, 
+                                long strides[])
+{
+  int
+    i,
+    sizes[VIO_MAX_DIMENSIONS];
+
+  if (get_volume_n_dimensions(volume) != 4 || VOXEL_DATA(volume) == NULL ||
+      (get_volume_data_type(volume) != VIO_DOUBLE && 
+       get_volume_data_type(volume) != VIO_FLOAT))
+    return(FALSE);
+
+  get_volume_sizes(volume, sizes);
+  strides[3] = 1;
+  for(i=2; i>=0; i--)
+    strides[i] = strides[i+1] * sizes[i+1];
+
+  return(TRUE);
+}
+
+void get_warp_vectors(VIO_Volume volume, int count[], double *vectors)
+{
+  int
+    i,
+    sizes[VIO_MAX_DIMENSIONS],
+    xyzv[VIO_MAX_DIMENSIONS],
+    index[VIO_MAX_DIMENSIONS];
+  long
+    node, offset,
+    strides[VIO_MAX_DIMENSIONS];
+  double
+    *double_voxels;
+  float
+    *float_voxels;
+
+  get_volume_sizes(volume, sizes);
+  get_volume_XYZV_indices(volume, xyzv);
+  for(i=0; i<VIO_N_DIMENSIONS; i++)
+    count[i] = sizes[ xyzv[i] ];
+
+  double_voxels = NULL;
+  float_voxels  = NULL;
+  if (get_warp_voxel_strides(volume, strides)) {
+    if (get_volume_data_type(volume) == VIO_DOUBLE)
+      double_voxels = &((double ****)VOXEL_DATA(volume))[0][0][0][0];
+    else
+      float_voxels  = &((float ****)VOXEL_DATA(volume))[0][0][0][0];
+  }
+
+  for(i=0; i<VIO_MAX_DIMENSIONS; i++) index[i]=0;
+
+  node = 0;
+  for(index[xyzv[VIO_X]]=0; index[xyzv[VIO_X]]<count[VIO_X]; index[xyzv[VIO_X]]++)
+    for(index[xyzv[VIO_Y]]=0; index[xyzv[VIO_Y]]<count[VIO_Y]; index[xyzv[VIO_Y]]++)
+      for(index[xyzv[VIO_Z]]=0; index[xyzv[VIO_Z]]<count[VIO_Z]; index[xyzv[VIO_Z]]++) {
+        for(index[xyzv[VIO_Z+1]]=0; index[xyzv[VIO_Z+1]]<3; index[xyzv[VIO_Z+1]]++) {
+          if (double_voxels != NULL || float_voxels != NULL) {
+            offset = index[0]*strides[0] + index[1]*strides[1] + 
+                     index[2]*strides[2] + index[3]*strides[3];
+            vectors[node*3 + index[xyzv[VIO_Z+1]]] = (double_voxels != NULL) ? 
+              double_voxels[offset] : (double)float_voxels[offset];
+          }
+          else
+            vectors[node*3 + index[xyzv[VIO_Z+1]]] = 
+              get_volume_real_value(volume, index[0],index[1],index[2],index[3],index[4]);
+        }
+        node++;
+      }
+}
+
+/* store the vectors of the nodes in start[]..end[]-1 (X, Y, Z order,
+   as returned by get_voxel_spatial_loop_limits()) only */
+
+void set_warp_vectors(VIO_Volume volume, int start[], int end[], double *vectors)
+{
+  int
+    i,
+    sizes[VIO_MAX_DIMENSIONS],
+    xyzv[VIO_MAX_DIMENSIONS],
+    index[VIO_MAX_DIMENSIONS];
+  long
+    node, offset,
+    strides[VIO_MAX_DIMENSIONS];
+  double
+    *double_voxels;
+  float
+    *float_voxels;
+
+  get_volume_sizes(volume, sizes);
+  get_volume_XYZV_indices(volume, xyzv);
+
+  double_voxels = NULL;
+  float_voxels  = NULL;
+  if (get_warp_voxel_strides(volume, strides)) {
+    if (get_volume_data_type(volume) == VIO_DOUBLE)
+      double_voxels = &((double ****)VOXEL_DATA(volume))[0][0][0][0];
+    else
+      float_voxels  = &((float ****)VOXEL_DATA(volume))[0][0][0][0];
+  }
+
+  for(i=0; i<VIO_MAX_DIMENSIONS; i++) index[i]=0;
+
+  for(index[xyzv[VIO_X]]=start[VIO_X]; index[xyzv[VIO_X]]<end[VIO_X]; index[xyzv[VIO_X]]++)
+    for(index[xyzv[VIO_Y]]=start[VIO_Y]; index[xyzv[VIO_Y]]<end[VIO_Y]; index[xyzv[VIO_Y]]++)
+      for(index[xyzv[VIO_Z]]=start[VIO_Z]; index[xyzv[VIO_Z]]<end[VIO_Z]; index[xyzv[VIO_Z]]++) {
+        node = ((long)index[xyzv[VIO_X]] * sizes[xyzv[VIO_Y]] + index[xyzv[VIO_Y]]) * 
+          sizes[xyzv[VIO_Z]] + index[xyzv[VIO_Z]];
+        for(index[xyzv[VIO_Z+1]]=0; index[xyzv[VIO_Z+1]]<3; index[xyzv[VIO_Z+1]]++) {
+          if (double_voxels != NULL || float_voxels != NULL) {
+            offset = index[0]*strides[0] + index[1]*strides[1] + 
+                     index[2]*strides[2] + index[3]*strides[3];
+            if (double_voxels != NULL)
+              double_voxels[offset] = vectors[node*3 + index[xyzv[VIO_Z+1]]];
+            else
+              float_voxels[offset]  = (float)vectors[node*3 + index[xyzv[VIO_Z+1]]];
+          }
+          else
+            set_volume_real_value(volume, index[0],index[1],index[2],index[3],index[4],
+                                  vectors[node*3 + index[xyzv[VIO_Z+1]]]);
+        }
+      }
+}
+
+
 /*******************************************************************
   procedure: smooth_the_warp
 
@@ -576,11 +712,60 @@ void add_additional_warp_to_current(VIO_General_transform *additional,
           where: sw   = smoothing_weight
                  mean = neighbourhood mean deformation
                  def  = estimate def for current node
+
+          the mean is taken over the 26 neighbours of the node (those
+          inside the grid), as in get_average_warp_vector_from_neighbours()
+          with avg_type==2.  Since the 3x3x3 neighbourhood is clipped
+          along each axis independently, its sum is computed separably
+          on a copy of the field: three passes of a 3 tap box filter
+          (one per axis) give the sum of the 27 nodes, from which the
+          node itself is removed.  The X slabs are processed by
+          n_threads threads (-threads).
+
+          as before, only the nodes within get_voxel_spatial_loop_limits()
+          are written to smoothed.
 */
 
+/* sum each vector with its neighbours along one axis of a
+   [x][y][z][3] buffer of count[] nodes, over n_threads threads */
+
+static void box_sum_along_axis(double *in, double *out, int count[], int axis,
+                               int n_threads)
+{
+  long
+    strides[3];
+  int
+    i;
+
+  strides[VIO_Z] = 3;
+  strides[VIO_Y] = 3L * count[VIO_Z];
+  strides[VIO_X] = 3L * count[VIO_Z] * count[VIO_Y];
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(n_threads) schedule(static)
+#endif
+  for(i=0; i<count[VIO_X]; i++) {
+    int  j, k, c, pos;
+    long node;
+
+    for(j=0; j<count[VIO_Y]; j++)
+      for(k=0; k<count[VIO_Z]; k++) {
+        node = i*strides[VIO_X] + j*strides[VIO_Y] + k*strides[VIO_Z];
+        pos  = (axis==VIO_X) ? i : ((axis==VIO_Y) ? j : k);
+        for(c=0; c<3; c++) {
+          out[node+c] = in[node+c];
+          if (pos > 0)               out[node+c] += in[node - strides[axis] + c];
+          if (pos < count[axis]-1)   out[node+c] += in[node + strides[axis] + c];
+        }
+      }
+  }
+}
+
 void smooth_the_warp(VIO_General_transform *smoothed,
                             VIO_General_transform *current,
-                            VIO_Volume warp_mag, VIO_Real thres) 
+                            VIO_Volume warp_mag, VIO_Real thres,
+                            VIO_Real smoothing_weight,
+                            int n_threads) 
 {
   int
     count_smoothed[VIO_MAX_DIMENSIONS],
@@ -589,17 +774,16 @@ void smooth_the_warp(VIO_General_transform *smoothed,
     xyzv[VIO_MAX_DIMENSIONS],
     xyzv_current[VIO_MAX_DIMENSIONS],
     xyzv_mag[VIO_MAX_DIMENSIONS],
-    mag_index[VIO_MAX_DIMENSIONS],
-    index[VIO_MAX_DIMENSIONS],
+    count[VIO_N_DIMENSIONS],
     start[VIO_MAX_DIMENSIONS], 
     end[VIO_MAX_DIMENSIONS],
     i;
-  VIO_Real 
-    value[3], 
-    wx, wy, wz, 
-    mx, my, mz,smoothing;
-  VIO_progress_struct
-    progress;
+  long
+    n_nodes;
+  double
+    *vectors,
+    *sums,
+    *tmp;
   
   
   if (get_volume_n_dimensions(smoothed->displacement_volume) != 
@@ -637,85 +821,62 @@ void smooth_the_warp(VIO_General_transform *smoothed,
   }
   
   for(i=0; i<VIO_MAX_DIMENSIONS; i++) {
-    index[i]=0;
     start[i] = 0;
     end[i] = 0;
   }
   
   get_voxel_spatial_loop_limits(smoothed->displacement_volume, start, end);
-  start[VIO_Z+1] = 0;
-  end[VIO_Z+1] = 3;
-  
-  
-  initialize_progress_report( &progress, FALSE, 
-			      (end[VIO_X]-start[VIO_X])*
-			      (end[VIO_Y]-start[VIO_Y]) + 1,
-			      "Smoothing deformations" );
-  
-  
-  for(index[xyzv[VIO_X]]=start[VIO_X]; index[xyzv[VIO_X]]<end[VIO_X]; index[xyzv[VIO_X]]++) {
-    for(index[xyzv[VIO_Y]]=start[VIO_Y]; index[xyzv[VIO_Y]]<end[VIO_Y]; index[xyzv[VIO_Y]]++) {
-      for(index[xyzv[VIO_Z]]=start[VIO_Z]; index[xyzv[VIO_Z]]<end[VIO_Z]; index[xyzv[VIO_Z]]++) {
-	
-        for(i=0; i<get_volume_n_dimensions(warp_mag); i++){
-          mag_index[ xyzv_mag[i] ] = index[ xyzv[i] ];
-	}
-	
-	
-	/* go get the current warp vector for
-	   this node. */
-	
-	for(index[xyzv[VIO_Z+1]]=start[VIO_Z+1]; index[xyzv[VIO_Z+1]]<end[VIO_Z+1]; index[xyzv[VIO_Z+1]]++) {
-	  
-	  value[index[ xyzv[VIO_Z+1] ]] = 
-	    get_volume_real_value(current->displacement_volume,
-				  index[0],index[1],index[2],
-				  index[3],index[4]);
-	  
-	}
-	/* store the current warp in wx, wy,wz */
-	
-	wx = value[VIO_X]; wy = value[VIO_Y]; wz = value[VIO_Z]; 
-	
-	index[ xyzv[VIO_Z+1]] = 0;
-	
-	/* if we can get a neighbourhood mean
-	   warp vector, then we average it
-	   with the current warp vector */
-	
-	if ( get_average_warp_vector_from_neighbours(current,
-						     index, 2 ,
-						     &mx, &my, &mz) ) {
-	  
-	  wx = (1.0 - smoothing_weight) * value[VIO_X] + smoothing_weight * mx;
-	  wy = (1.0 - smoothing_weight) * value[VIO_Y] + smoothing_weight * my;
-	  wz = (1.0 - smoothing_weight) * value[VIO_Z] + smoothing_weight * mz;
-	  value[VIO_X] = wx; 
-	  value[VIO_Y] = wy; 
-	  value[VIO_Z] = wz; 
-	  
-	} 
-          
-                                /* now put the averaged vector into
-                                   the smoothed volume */
- 
-	for(index[xyzv[VIO_Z+1]]=start[VIO_Z+1]; index[xyzv[VIO_Z+1]]<end[VIO_Z+1]; index[xyzv[VIO_Z+1]]++)  
-	  set_volume_real_value(smoothed->displacement_volume,
-				index[0],index[1],index[2],
-				index[3],index[4],
-				value[index[ xyzv[VIO_Z+1] ]] );  
-      }
 
-          
-    }
-    update_progress_report( &progress,
-			    ((end[ VIO_Y ]-start[ VIO_Y ])*
-			     (index[ xyzv[VIO_X]  ]-start[ VIO_X ])) +
-			    (index[ xyzv[VIO_Y] ]-start[ VIO_X ])  +    1  );
+                                /* copy the field, and sum each 3x3x3
+                                   neighbourhood, one axis at a time  */
+  for(i=0; i<VIO_N_DIMENSIONS; i++)
+    count[i] = count_current[ xyzv[i] ];
+  n_nodes = (long)count[VIO_X] * count[VIO_Y] * count[VIO_Z];
+
+  ALLOC(vectors, n_nodes*3);
+  ALLOC(sums,    n_nodes*3);
+  ALLOC(tmp,     n_nodes*3);
+
+  get_warp_vectors(current->displacement_volume, count, vectors);
+
+  box_sum_along_axis(vectors, sums, count, VIO_Z, n_threads);
+  box_sum_along_axis(sums,    tmp,  count, VIO_Y, n_threads);
+  box_sum_along_axis(tmp,     sums, count, VIO_X, n_threads);
+
+                                /* average the node with the mean of
+                                   its neighbours, leaving the result
+                                   in tmp */
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(n_threads) schedule(static)
+#endif
+  for(i=start[VIO_X]; i<end[VIO_X]; i++) {
+    int  j, k, c, n;
+    long node;
+
+    for(j=start[VIO_Y]; j<end[VIO_Y]; j++)
+      for(k=start[VIO_Z]; k<end[VIO_Z]; k++) {
+        node = ((long)i*count[VIO_Y] + j)*count[VIO_Z] + k;
+
+                                /* # of neighbours in the grid */
+        n = ((i>0) + (i<count[VIO_X]-1) + 1) *
+            ((j>0) + (j<count[VIO_Y]-1) + 1) *
+            ((k>0) + (k<count[VIO_Z]-1) + 1) - 1;
+
+        for(c=0; c<3; c++) {
+          if (n > 0)
+            tmp[node*3+c] = (1.0 - smoothing_weight) * vectors[node*3+c] + 
+              smoothing_weight * (sums[node*3+c] - vectors[node*3+c]) / n;
+          else
+            tmp[node*3+c] = vectors[node*3+c];
+        }
+      }
   }
 
+  set_warp_vectors(smoothed->displacement_volume, start, end, tmp);
 
-  terminate_progress_report( &progress );
+  FREE(tmp);
+  FREE(sums);
+  FREE(vectors);
 }
 
 
@@ -747,38 +908,134 @@ void smooth_the_warp(VIO_General_transform *smoothed,
 
    note estimated_flag_vol is created to be accessed in [VIO_X][VIO_Y][VIO_Z] order.
 
+   The unestimated nodes are visited in order of their (chessboard)
+   distance to the nearest estimated node, in waves: wave 1 are the
+   nodes next to an estimated node, wave 2 those next to wave 1, and
+   so on.  The additional vector of a wave 1 node is the sum of the
+   additional vectors of its estimated neighbours, divided by 26.
+   With max_waves > 1 (-nonlinear_extrapolation), or 0 for no limit,
+   a wave d node gets the sum of the vectors of its wave d-1
+   neighbours / 26, so that the estimations fade out as they move
+   away from the estimated nodes; by default (max_waves == 1) the
+   nodes further away get no extrapolated vector.  The neighbourhood
+   mean of the current warp is then added to every unestimated node.
+
+   The work is done on copies of the fields (see get_warp_vectors()),
+   and after a single pass over the flags, the cost depends on the
+   number of unestimated nodes only.  The nodes of a wave, and the
+   X slabs of the flag pass, are shared by n_threads threads
+   (-threads).
+
       */
 
+#define WAVE_OUTSIDE   -2       /* unestimated, outside the loop limits */
+#define WAVE_UNREACHED -1       /* unestimated, not reached (yet)       */
+
+/* sum the vectors of the 26 neighbours of node in the [x][y][z][3]
+   buffer vectors, counting only those of wave[]==from_wave (all of
+   them when wave==NULL); returns the number of vectors summed */
+
+static int sum_of_neighbour_vectors(double *vectors, int *wave, int from_wave,
+                                    int count[], long node, double sum[])
+{
+  int
+    i, j, k, di, dj, dk, c, n;
+  long
+    neighbour;
+
+  k = (int)(node % count[VIO_Z]);
+  j = (int)((node / count[VIO_Z]) % count[VIO_Y]);
+  i = (int)(node / ((long)count[VIO_Z] * count[VIO_Y]));
+
+  sum[0] = sum[1] = sum[2] = 0.0;
+  n = 0;
+
+  for(di=-1; di<=1; di++) {
+    if (i+di < 0 || i+di >= count[VIO_X]) continue;
+    for(dj=-1; dj<=1; dj++) {
+      if (j+dj < 0 || j+dj >= count[VIO_Y]) continue;
+      for(dk=-1; dk<=1; dk++) {
+        if (k+dk < 0 || k+dk >= count[VIO_Z]) continue;
+        if (di==0 && dj==0 && dk==0) continue;
+
+        neighbour = ((long)(i+di)*count[VIO_Y] + (j+dj))*count[VIO_Z] + (k+dk);
+        if (wave != NULL && wave[neighbour] != from_wave) continue;
+
+        for(c=0; c<3; c++)
+          sum[c] += vectors[neighbour*3+c];
+        n++;
+      }
+    }
+  }
+
+  return(n);
+}
+
+/* append to queue[*n_queue...] the unreached neighbours of node, which
+   become part of wave new_wave */
+
+static void add_unreached_neighbours(int *wave, int new_wave, int count[], long node,
+                                     long *queue, long *n_queue)
+{
+  int
+    i, j, k, di, dj, dk;
+  long
+    neighbour;
+
+  k = (int)(node % count[VIO_Z]);
+  j = (int)((node / count[VIO_Z]) % count[VIO_Y]);
+  i = (int)(node / ((long)count[VIO_Z] * count[VIO_Y]));
+
+  for(di=-1; di<=1; di++) {
+    if (i+di < 0 || i+di >= count[VIO_X]) continue;
+    for(dj=-1; dj<=1; dj++) {
+      if (j+dj < 0 || j+dj >= count[VIO_Y]) continue;
+      for(dk=-1; dk<=1; dk++) {
+        if (k+dk < 0 || k+dk >= count[VIO_Z]) continue;
+
+        neighbour = ((long)(i+di)*count[VIO_Y] + (j+dj))*count[VIO_Z] + (k+dk);
+        if (wave[neighbour] == WAVE_UNREACHED) {
+          wave[neighbour] = new_wave;
+          queue[(*n_queue)++] = neighbour;
+        }
+      }
+    }
+  }
+}
+
 void extrapolate_to_unestimated_nodes(VIO_General_transform *current,
                                              VIO_General_transform *additional,
-                                             VIO_Volume estimated_flag_vol) 
+                                             VIO_Volume estimated_flag_vol,
+                                             int max_waves,
+                                             int n_threads) 
 {
 
   int 
     many,
     total,
     extrapolated,
-    count,
+    d,
+    count[VIO_N_DIMENSIONS],
     count_additional[VIO_MAX_DIMENSIONS],
     count_current[VIO_MAX_DIMENSIONS],
     count_flag[VIO_MAX_DIMENSIONS],
     xyzv[VIO_MAX_DIMENSIONS],
     xyzv_current[VIO_MAX_DIMENSIONS],
     xyzv_flag[VIO_MAX_DIMENSIONS],
-    flag_index[VIO_MAX_DIMENSIONS],
-    index[VIO_MAX_DIMENSIONS],
     start[VIO_MAX_DIMENSIONS], 
     end[VIO_MAX_DIMENSIONS],
-    start2[VIO_MAX_DIMENSIONS], 
-    end2[VIO_MAX_DIMENSIONS],
-    voxel2[VIO_MAX_DIMENSIONS],
     i;
-  VIO_Real 
-    current_deform[VIO_N_DIMENSIONS], 
-    additional_deform[VIO_N_DIMENSIONS], 
-    mx, my, mz;
-  VIO_progress_struct
-    progress;
+  int
+    *wave;
+  unsigned char
+    *next_to_estimated;
+  long
+    n_nodes, n_queue, wave_start, wave_end, q;
+  long
+    *queue;
+  double
+    *additional_vectors,
+    *current_vectors;
 
   extrapolated = many = total = 0;
 
@@ -826,145 +1083,149 @@ void extrapolate_to_unestimated_nodes(VIO_General_transform *current,
                                    volume and extrapolate the estimated
                                    vectors from the additional volume */
   for(i=0; i<VIO_MAX_DIMENSIONS; i++) {
-    index[i] = 0;
     start[i] = 0;
     end[i]   = 0;
   }
   
   get_voxel_spatial_loop_limits(additional->displacement_volume, start, end);
-  start[VIO_Z+1] = 0;
-  end[VIO_Z+1]   = 3;
- 
-  initialize_progress_report( &progress, FALSE, 
-                             (end[VIO_X]-start[VIO_X])*
-                             (end[VIO_Y]-start[VIO_Y]) + 1,
-                             "Extrapolating estimations" );
 
+  for(i=0; i<VIO_N_DIMENSIONS; i++)
+    count[i] = count_current[ xyzv[i] ];
+  n_nodes = (long)count[VIO_X] * count[VIO_Y] * count[VIO_Z];
+  total   = (end[VIO_X]-start[VIO_X]) * (end[VIO_Y]-start[VIO_Y]) * (end[VIO_Z]-start[VIO_Z]);
 
-  for(index[xyzv[VIO_X]]=start[VIO_X]; index[xyzv[VIO_X]]<end[VIO_X]; index[xyzv[VIO_X]]++) {
-    for(index[xyzv[VIO_Y]]=start[VIO_Y]; index[xyzv[VIO_Y]]<end[VIO_Y]; index[xyzv[VIO_Y]]++) {
-      for(index[xyzv[VIO_Z]]=start[VIO_Z]; index[xyzv[VIO_Z]]<end[VIO_Z]; index[xyzv[VIO_Z]]++) {
+  ALLOC(wave, n_nodes);
+  ALLOC(next_to_estimated, n_nodes);
 
-        for(i=0; i<get_volume_n_dimensions(estimated_flag_vol); i++)
-          flag_index[ xyzv_flag[i] ] = index[ xyzv[i] ];
-        
-        total++;
+                                /* wave 0 are the estimated nodes       */
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(n_threads) schedule(static) reduction(+:many)
+#endif
+  for(i=0; i<count[VIO_X]; i++) {
+    int  j, k, inside;
+    long node;
+
+    for(j=0; j<count[VIO_Y]; j++)
+      for(k=0; k<count[VIO_Z]; k++) {
+        node = ((long)i*count[VIO_Y] + j)*count[VIO_Z] + k;
+        inside = (i>=start[VIO_X] && i<end[VIO_X] &&
+                  j>=start[VIO_Y] && j<end[VIO_Y] &&
+                  k>=start[VIO_Z] && k<end[VIO_Z]);
+
+        if (get_volume_real_value(estimated_flag_vol, i, j, k, 0, 0) >= 0.5)
+          wave[node] = 0;
+        else if (inside) {
+          wave[node] = WAVE_UNREACHED;
+          many++;
+        }
+        else
+          wave[node] = WAVE_OUTSIDE;
+      }
+  }
 
+  if (many == 0) {
+    FREE(next_to_estimated);
+    FREE(wave);
+    print ("There were %d out of %d extrapolated (%d left) (%d extrapolated)\n",many,total,total-many, extrapolated);
+    return;
+  }
 
-        if (  get_volume_real_value(estimated_flag_vol, 
-                                    index[ xyzv[VIO_X] ],
-                                    index[ xyzv[VIO_Y] ],
-                                    index[ xyzv[VIO_Z] ],
-                                    0, 0) < 1.0) {
+  ALLOC(queue, many);
+  ALLOC(additional_vectors, n_nodes*3);
+  ALLOC(current_vectors,    n_nodes*3);
 
-          /* 
-             then, this node has not been estimated at this iteration,
-             so we have to interpolate a deformation value from
-             neighbouring nodes, and then apply the proper local
-             smoothing. 
+  get_warp_vectors(additional->displacement_volume, count, additional_vectors);
+  get_warp_vectors(current->displacement_volume,    count, current_vectors);
 
-             local smoothing is defined to be the average deformation of
-             the 26 8-connected neighbours and is computed in the loop
-             below
-          */
+                                /* find wave 1 */
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(n_threads) schedule(static)
+#endif
+  for(i=0; i<count[VIO_X]; i++) {
+    int    j, k;
+    long   node;
+    double sum[3];
+
+    for(j=0; j<count[VIO_Y]; j++)
+      for(k=0; k<count[VIO_Z]; k++) {
+        node = ((long)i*count[VIO_Y] + j)*count[VIO_Z] + k;
+        next_to_estimated[node] = (wave[node] == WAVE_UNREACHED &&
+                                   sum_of_neighbour_vectors(additional_vectors, wave, 0,
+                                                            count, node, sum) > 0);
+      }
+  }
 
-          many++;
-                                /* go get the current warp vector for
-                                   this node. */
-          
-          for(index[xyzv[VIO_Z+1]]=start[VIO_Z+1]; index[xyzv[VIO_Z+1]]<end[VIO_Z+1]; index[xyzv[VIO_Z+1]]++) {
+  n_queue = 0;
+  for(q=0; q<n_nodes; q++)
+    if (next_to_estimated[q]) {
+      wave[q] = 1;
+      queue[n_queue++] = q;
+    }
 
-            current_deform[index[ xyzv[VIO_Z+1] ]] = 
-              get_volume_real_value(current->displacement_volume,
-                                    index[0],index[1],index[2],
-                                    index[3],index[4]);
+                                /* the vectors of a wave only depend on
+                                   those of the previous one */
+  wave_start = 0;
+  for(d=1; wave_start < n_queue; d++) {
+    wave_end = n_queue;
 
-          }
-                                /* get an average of the current additional 
-                                   deformation */
-
-          for(i=0; i<VIO_N_DIMENSIONS; i++) {
-            start2[i] = index[ xyzv[i] ] - 1;
-            if (start2[i]<0) start2[i]=0;
-            end2[i] = index[ xyzv[i] ] + 1;
-            if (end2[i]> count_flag[ xyzv_flag[i] ]-1) end2[i] =  count_flag[ xyzv_flag[i] ]-1;
-          }
-    
-          for(i=0; i<VIO_N_DIMENSIONS; i++)   additional_deform[i]= 0.0;
-          for(i=0; i<VIO_MAX_DIMENSIONS; i++) voxel2[i]=0;
-          count = 0;
-
-          for(voxel2[xyzv[VIO_X]]=start2[VIO_X]; voxel2[xyzv[VIO_X]]<=end2[VIO_X]; voxel2[xyzv[VIO_X]]++)
-            for(voxel2[xyzv[VIO_Y]]=start2[VIO_Y]; voxel2[xyzv[VIO_Y]]<=end2[VIO_Y]; voxel2[xyzv[VIO_Y]]++)
-              for(voxel2[xyzv[VIO_Z]]=start2[VIO_Z]; voxel2[xyzv[VIO_Z]]<=end2[VIO_Z]; voxel2[xyzv[VIO_Z]]++) {
-
-                if (get_volume_real_value(estimated_flag_vol, 
-                                    voxel2[ xyzv[VIO_X] ],
-                                    voxel2[ xyzv[VIO_Y] ],
-                                    voxel2[ xyzv[VIO_Z] ],
-                                    0, 0) >= 0.5) {
-
-                  if (!((voxel2[ xyzv[VIO_X]] == index[ xyzv[VIO_X] ]) &&
-                        (voxel2[ xyzv[VIO_Y]] == index[ xyzv[VIO_Y] ]) &&
-                        (voxel2[ xyzv[VIO_Z]] == index[ xyzv[VIO_Z] ]))   ) {
-                    
-                    for(voxel2[xyzv[VIO_Z+1]]=0; voxel2[xyzv[VIO_Z+1]]<VIO_N_DIMENSIONS; voxel2[xyzv[VIO_Z+1]]++) {
-                      additional_deform[ voxel2[ xyzv[VIO_Z+1] ] ] += 
-                        get_volume_real_value(additional->displacement_volume,
-                                              voxel2[0],voxel2[1],voxel2[2],
-                                              voxel2[3],voxel2[4]);
-                    }
-                    ++count;
-                  }
-                }
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(n_threads) schedule(static)
+#endif
+    for(q=wave_start; q<wave_end; q++) {
+      int    c;
+      long   node = queue[q];
+      double sum[3];
+
+      (void)sum_of_neighbour_vectors(additional_vectors, wave, d-1, count, node, sum);
+      for(c=0; c<3; c++)
+        additional_vectors[node*3+c] = sum[c] / 26.0;
+    }
 
-                
-              }
+    if (max_waves == 0 || d < max_waves)
+      for(q=wave_start; q<wave_end; q++)
+        add_unreached_neighbours(wave, d+1, count, queue[q], queue, &n_queue);
 
-          if (count>0) {
-            extrapolated++;
-            for(i=0; i<VIO_N_DIMENSIONS; i++)
-              additional_deform[i] /= 26.0;
-          }
+    wave_start = wave_end;
+  }
+  extrapolated = (int)n_queue;
 
-                                /* if we can get a neighbourhood mean
-                                   warp vector from the previous iterations, 
-                                   then we average it with the previous warp 
+                                /* the unreached nodes get no extrapolated
                                    vector */
-          index[ xyzv[VIO_Z+1]] = 0;
-          if ( get_average_warp_vector_from_neighbours(current,
-                                                       index, 2 ,
-                                                       &mx, &my, &mz) ) {
+  for(q=0; q<n_nodes; q++)
+    if (wave[q] == WAVE_UNREACHED) {
+      additional_vectors[q*3+0] = additional_vectors[q*3+1] = 
+        additional_vectors[q*3+2] = 0.0;
+      queue[n_queue++] = q;
+    }
 
-            /* additional_deform += sw*mean + (1-sw)*current - current
+                                /* if we can get a neighbourhood mean warp
+                                   vector from the previous iterations, then
+                                   we average it with the previous warp vector
 
-               with sw = 0.5 gives: */
-            
-            additional_deform[VIO_X] += (mx - current_deform[VIO_X])/2.0; 
-            additional_deform[VIO_Y] += (my - current_deform[VIO_Y])/2.0; 
-            additional_deform[VIO_Z] += (mz - current_deform[VIO_Z])/2.0; 
-          } 
+                                   additional_deform += sw*mean + (1-sw)*current - current
 
-          
-                                /* now put the averaged vector into
-                                   the additional volume */
-
-          for(index[xyzv[VIO_Z+1]]=start[VIO_Z+1]; index[xyzv[VIO_Z+1]]<end[VIO_Z+1]; index[xyzv[VIO_Z+1]]++)  
-            set_volume_real_value(additional->displacement_volume,
-                                  index[0],index[1],index[2],
-                                  index[3],index[4],
-                                  additional_deform[index[ xyzv[VIO_Z+1] ]] );  
-        }
-          
-      }
-      update_progress_report( &progress,
-                             ((end[ VIO_Y ]-start[ VIO_Y ])*
-                              (index[ xyzv[VIO_X]  ]-start[ VIO_X ])) +
-                             (index[ xyzv[VIO_Y] ]-start[ VIO_X ])  +    1  );
-    }
+                                   with sw = 0.5 */
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(n_threads) schedule(static)
+#endif
+  for(q=0; q<n_queue; q++) {
+    int    c, n;
+    long   node = queue[q];
+    double mean[3];
+
+    n = sum_of_neighbour_vectors(current_vectors, NULL, 0, count, node, mean);
+    if (n > 0)
+      for(c=0; c<3; c++)
+        additional_vectors[node*3+c] += (mean[c]/n - current_vectors[node*3+c])/2.0;
   }
 
-  terminate_progress_report( &progress );
+  set_warp_vectors(additional->displacement_volume, start, end, additional_vectors);
+
+  FREE(current_vectors);
+  FREE(additional_vectors);
+  FREE(queue);
+  FREE(next_to_estimated);
+  FREE(wave);
 
   print ("There were %d out of %d extrapolated (%d left) (%d extrapolated)\n",many,total,total-many, extrapolated);
 
@@ -1105,50 +1366,212 @@ void build_two_perpendicular_vectors(VIO_Real orig[],
                 __FILE__, __LINE__);
 }
 
-float xcorr_objective_with_def(VIO_Volume d1,
-                                      VIO_Volume d2,
-                                      VIO_Volume m1,
-                                      VIO_Volume m2, 
-                                      Arg_Data *globals)
+/*******************************************************************
+  procedure: xcorr_objective_with_def
+
+    desc: global cross-correlation (1 - xcorr) of the data and model
+          volumes over the lattice of globals, through the current
+          transformation.
+
+    meth: when the transformation is made of linear transforms
+          followed by a single deformation grid (as it is during a
+          nonlinear fit), the linear transforms are reduced to one
+          affine matrix and the grid is sampled by tri-linear
+          interpolation, straight from its voxels (see
+          get_fused_warp()).  The slices of the lattice are then
+          shared by the -threads threads, each slice keeping its own
+          sums, added in slice order so that the result does not
+          depend on the number of threads.  Any other transformation
+          goes through general_transform_point(), one point at a time.
+
+          This makes the evaluation cheap enough to be done after
+          each iteration (-nonlinear_xcorr_tol).
+          check_xcorr_objective_with_def() compares the two ways
+          (-nonlinear_check_xcorr).
+*/
+
+typedef struct {
+  VIO_Real affine[3][4];        /* the linear transforms, world to world    */
+  VIO_Real world_to_grid[3][4]; /* world to (X,Y,Z) voxel of the grid       */
+  int      count[VIO_N_DIMENSIONS];
+  long     strides[VIO_N_DIMENSIONS+1];/* of X, Y, Z and the vector dim     */
+  double   *double_voxels;      /* the voxels of the grid, one of them       */
+  float    *float_voxels;       /* is set                                    */
+} Fused_Warp;
+
+/* apply the 3x4 matrix m to (x,y,z) */
+
+static void apply_3x4_matrix(VIO_Real m[3][4], VIO_Real x, VIO_Real y, VIO_Real z,
+                             VIO_Real result[])
 {
+  int i;
 
-  VectorR
-    slice_dir,
-    row_dir,
-    col_dir,
-    vector_step;
+  for(i=0; i<3; i++)
+    result[i] = m[i][0]*x + m[i][1]*y + m[i][2]*z + m[i][3];
+}
 
-  PointR
-    starting_position,
-    slice,
-    row,
-    col,
-    pos2,
-    voxel;
+/* set up *warp for the transformation, if it is a chain of linear
+   transforms ending with a (non inverted) deformation grid whose
+   voxels can be read directly.  Returns FALSE otherwise. */
 
-  double
-    tx,ty,tz;
+static VIO_BOOL get_fused_warp(VIO_General_transform *transformation,
+                               Fused_Warp *warp)
+{
+  VIO_General_transform
+    *grid;
+  VIO_Volume
+    volume;
   int
-    r,c,s;
+    i, j, t, n,
+    sizes[VIO_MAX_DIMENSIONS],
+    xyzv[VIO_MAX_DIMENSIONS];
+  long
+    strides[VIO_MAX_DIMENSIONS];
+  VIO_Real
+    point[4][3],
+    voxel[VIO_MAX_DIMENSIONS],
+    origin[VIO_N_DIMENSIONS];
+
+  n = get_n_concated_transforms(transformation);
+  if (transformation->inverse_flag)
+    return(FALSE);
+
+  grid = get_nth_general_transform(transformation, n-1);
+  if (get_transform_type(grid) != GRID_TRANSFORM || grid->inverse_flag)
+    return(FALSE);
+  for(t=0; t<n-1; t++)
+    if (get_transform_type(get_nth_general_transform(transformation, t)) != LINEAR)
+      return(FALSE);
+
+  volume = grid->displacement_volume;
+  if (!get_warp_voxel_strides(volume, strides))
+    return(FALSE);
 
+  get_volume_sizes(volume, sizes);
+  get_volume_XYZV_indices(volume, xyzv);
+  for(i=0; i<VIO_N_DIMENSIONS; i++) {
+    warp->count[i]   = sizes[ xyzv[i] ];
+    warp->strides[i] = strides[ xyzv[i] ];
+    if (warp->count[i] < 2)
+      return(FALSE);
+  }
+  warp->strides[VIO_Z+1] = strides[ xyzv[VIO_Z+1] ];
+
+  warp->double_voxels = NULL;
+  warp->float_voxels  = NULL;
+  if (get_volume_data_type(volume) == VIO_DOUBLE)
+    warp->double_voxels = &((double ****)VOXEL_DATA(volume))[0][0][0][0];
+  else
+    warp->float_voxels  = &((float ****)VOXEL_DATA(volume))[0][0][0][0];
+
+                                /* the linear part, from the images of
+                                   the origin and of the unit vectors */
+  for(j=0; j<4; j++) {
+    for(i=0; i<3; i++)
+      point[j][i] = (i+1 == j) ? 1.0 : 0.0;
+    for(t=0; t<n-1; t++)
+      general_transform_point(get_nth_general_transform(transformation, t),
+                              point[j][0], point[j][1], point[j][2],
+                              &point[j][0], &point[j][1], &point[j][2]);
+  }
+  for(i=0; i<3; i++) {
+    warp->affine[i][3] = point[0][i];
+    for(j=0; j<3; j++)
+      warp->affine[i][j] = point[j+1][i] - point[0][i];
+  }
+
+                                /* and the world to voxel transform of
+                                   the grid, in X, Y, Z order */
+  convert_world_to_voxel(volume, 0.0, 0.0, 0.0, voxel);
+  for(i=0; i<3; i++) {
+    origin[i] = voxel[ xyzv[i] ];
+    warp->world_to_grid[i][3] = origin[i];
+  }
+  for(j=0; j<3; j++) {
+    convert_world_to_voxel(volume,
+                           (j==0) ? 1.0 : 0.0,
+                           (j==1) ? 1.0 : 0.0,
+                           (j==2) ? 1.0 : 0.0, voxel);
+    for(i=0; i<3; i++)
+      warp->world_to_grid[i][j] = voxel[ xyzv[i] ] - origin[i];
+  }
+
+  return(TRUE);
+}
+
+/* transform the world point (x,y,z) by the fused warp: the affine part,
+   then the displacement of the grid, interpolated tri-linearly (0
+   outside of the grid) */
+
+static void fused_warp_point(Fused_Warp *warp, VIO_Real x, VIO_Real y, VIO_Real z,
+                             VIO_Real result[])
+{
+  VIO_Real
+    pos[3], frac[3], weight;
+  int
+    i, v, c, ind[3];
+  long
+    offset;
+
+  apply_3x4_matrix(warp->affine, x, y, z, result);
+  apply_3x4_matrix(warp->world_to_grid, result[0], result[1], result[2], pos);
+
+  for(i=0; i<3; i++) {
+    if (pos[i] < 0.0 || pos[i] > warp->count[i]-1)
+      return;
+    ind[i] = (int)pos[i];
+    if (ind[i] >= warp->count[i]-1)
+      ind[i] = warp->count[i]-2;
+    frac[i] = pos[i] - ind[i];
+  }
+
+  for(v=0; v<8; v++) {
+    weight = (((v>>2)&1) ? frac[0] : 1.0-frac[0]) *
+             (((v>>1)&1) ? frac[1] : 1.0-frac[1]) *
+             (( v    &1) ? frac[2] : 1.0-frac[2]);
+    if (weight == 0.0)
+      continue;
+
+    offset = (ind[0] + ((v>>2)&1)) * warp->strides[0] +
+             (ind[1] + ((v>>1)&1)) * warp->strides[1] +
+             (ind[2] + ( v    &1)) * warp->strides[2];
+    for(c=0; c<3; c++)
+      result[c] += weight * ((warp->double_voxels != NULL) ?
+                             warp->double_voxels[offset + c*warp->strides[3]] :
+                             (VIO_Real)warp->float_voxels[offset + c*warp->strides[3]]);
+  }
+}
+
+static float xcorr_with_def(VIO_Volume d1,
+                            VIO_Volume d2,
+                            VIO_Volume m1,
+                            VIO_Volume m2, 
+                            Arg_Data *globals,
+                            VIO_BOOL allow_fused)
+{
+
+  PointR
+    starting_position;
   VIO_Real
     sign_x,sign_y,sign_z,
-    value1, value2;
-  
+    world_to_voxel1[3][4],
+    world_to_voxel2[3][4];
   VIO_Real
     s1,s2,s3;                   /* to store the sums for f1,f2,f3 */
   float 
     result;                                /* the result */
   int 
+    s,
     count1,count2;
-
-
-
-
+  Lattice_Sums
+    *slice_sums;                /* the sums of each slice of the lattice */
+  Fused_Warp
+    warp;
+  VIO_BOOL
+    fused;
 
   fill_Point( starting_position, globals->start[VIO_X], globals->start[VIO_Y], globals->start[VIO_Z]);
 
-
   s1 = s2 = s3 = 0.0;
   count1 = count2 = 0;
 
@@ -1156,12 +1579,36 @@ float xcorr_objective_with_def(VIO_Volume d1,
   if (globals->step[VIO_Y] > 0 ) sign_y = 1.0; else sign_y = -1.0;
   if (globals->step[VIO_Z] > 0 ) sign_z = 1.0; else sign_z = -1.0;
 
+  fused = allow_fused && get_fused_warp(globals->trans_info.transformation, &warp);
+  get_world_to_voxel_matrix(d1, world_to_voxel1);
+  get_world_to_voxel_matrix(d2, world_to_voxel2);
+
+  ALLOC(slice_sums, globals->count[VIO_Z]+1);
+
+                                /* the slices are shared by the -threads
+                                   threads when the warp is fused (the
+                                   general transform code is not thread
+                                   safe), each with its own sums */
+#ifdef _OPENMP
+#pragma omp parallel for if(fused) num_threads(objective_threads(globals)) schedule(dynamic)
+#endif
   for(s=0; s<=globals->count[VIO_Z]; s++) {
+    VectorR
+      vector_step;
+    PointR
+      slice, row, col, pos2, voxel;
+    VIO_Real
+      value1, value2, target[3], vox[3];
+    int
+      r, c;
+    Lattice_Sums
+      *sums = &slice_sums[s];
+
+    init_lattice_sums(sums);
 
     SCALE_VECTOR( vector_step, globals->directions[VIO_Z], s*sign_z);
     ADD_POINT_VECTOR( slice, starting_position, vector_step );
 
-
     for(r=0; r<=globals->count[VIO_Y]; r++) {
       
       SCALE_VECTOR( vector_step, globals->directions[VIO_Y], r*sign_y);
@@ -1169,38 +1616,37 @@ float xcorr_objective_with_def(VIO_Volume d1,
       
       SCALE_POINT( col, row, 1.0); /* init first col position */
       for(c=0; c<=globals->count[VIO_X]; c++) {
-        
-
-        convert_3D_world_to_voxel(d1, Point_x(col), Point_y(col), Point_z(col), &tx, &ty, &tz);
 
-  
-        
-        fill_Point( voxel, tx, ty, tz ); /* build the voxel POINT */
+        apply_3x4_matrix(world_to_voxel1, Point_x(col), Point_y(col), Point_z(col), vox);
+        fill_Point( voxel, vox[0], vox[1], vox[2] ); /* build the voxel POINT */
         
         if (point_not_masked(m1, Point_x(col), Point_y(col), Point_z(col))) {
           
-          if (INTERPOLATE_TRUE_VALUE( d1, &voxel, &value1 )) {
+          if (INTERPOLATE_TRUE_VALUE( globals, d1, &voxel, &value1 )) {
 
-            count1++;
+            sums->count1++;
 
-            DO_TRANSFORM(pos2, globals->trans_info.transformation, col);
-            
-            convert_3D_world_to_voxel(d2, Point_x(pos2), Point_y(pos2), Point_z(pos2), &tx, &ty, &tz);
+            if (fused) {
+              fused_warp_point(&warp, Point_x(col), Point_y(col), Point_z(col), target);
+              fill_Point( pos2, target[0], target[1], target[2] );
+            }
+            else
+              DO_TRANSFORM(pos2, globals->trans_info.transformation, col);
             
-            fill_Point( voxel, tx, ty, tz ); /* build the voxel POINT */
+            apply_3x4_matrix(world_to_voxel2, Point_x(pos2), Point_y(pos2), Point_z(pos2), vox);
+            fill_Point( voxel, vox[0], vox[1], vox[2] ); /* build the voxel POINT */
         
             if (point_not_masked(m2, Point_x(pos2), Point_y(pos2), Point_z(pos2))) {
               
-              if (INTERPOLATE_TRUE_VALUE( d2, &voxel, &value2 )) {
-
+              if (INTERPOLATE_TRUE_VALUE( globals, d2, &voxel, &value2 )) {
 
                 if (value1 > globals->threshold[0] && value2 > globals->threshold[1] ) {
                   
-                  count2++;
+                  sums->count2++;
 
-                  s1 += value1*value2;
-                  s2 += value1*value1;
-                  s3 += value2*value2;
+                  sums->sum[0] += value1*value2;
+                  sums->sum[1] += value1*value1;
+                  sums->sum[2] += value2*value2;
                   
                 } 
                 
@@ -1219,6 +1665,16 @@ float xcorr_objective_with_def(VIO_Volume d1,
       } /* for c */
     } /* for r */
   } /* for s */
+
+                                /* add the slices, in order */
+  for(s=0; s<=globals->count[VIO_Z]; s++) {
+    s1 += slice_sums[s].sum[0];
+    s2 += slice_sums[s].sum[1];
+    s3 += slice_sums[s].sum[2];
+    count1 += slice_sums[s].count1;
+    count2 += slice_sums[s].count2;
+  }
+  FREE(slice_sums);
   
   result = 1.0 - s1 / (sqrt((double)s2)*sqrt((double)s3));
   
@@ -1228,3 +1684,38 @@ float xcorr_objective_with_def(VIO_Volume d1,
   
 }
 
+float xcorr_objective_with_def(VIO_Volume d1,
+                                      VIO_Volume d2,
+                                      VIO_Volume m1,
+                                      VIO_Volume m2, 
+                                      Arg_Data *globals)
+{
+  return(xcorr_with_def(d1, d2, m1, m2, globals, TRUE));
+}
+
+/* print xcorr_objective_with_def() computed through the fused warp and
+   through general_transform_point(), and their difference */
+
+void check_xcorr_objective_with_def(VIO_Volume d1,
+                                    VIO_Volume d2,
+                                    VIO_Volume m1,
+                                    VIO_Volume m2, 
+                                    Arg_Data *globals)
+{
+  Fused_Warp
+    warp;
+  float
+    fused, general;
+
+  if (!get_fused_warp(globals->trans_info.transformation, &warp)) {
+    print ("xcorr check: the transformation cannot be fused\n");
+    return;
+  }
+
+  fused   = xcorr_with_def(d1, d2, m1, m2, globals, TRUE);
+  general = xcorr_with_def(d1, d2, m1, m2, globals, FALSE);
+
+  print ("xcorr check: fused %10.8f general %10.8f difference %g\n",
+         fused, general, fabs((double)fused - (double)general));
+}
+
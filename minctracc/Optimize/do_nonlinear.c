@@ -357,7 +357,6 @@
 static char rcsid[]="$Header: /static-cvsroot/registration/mni_autoreg/minctracc/Optimize/do_nonlinear.c,v 96.31 2011-02-24 20:02:35 louis Exp $";
 #endif
 
-#include "globals.h"
 
 #include <config.h>                /* MAXtype and MIN defs                      */
 #include <float.h>
@@ -365,6 +364,7 @@ static char rcsid[]="$Header: /static-cvsroot/registration/mni_autoreg/minctracc
 #include <amoeba.h>                /* simplex optimization struct               */
 
 #include <stdlib.h>                /* to get header info for drand48()          */
+#include <string.h>                /* memset()                                  */
 #include <minctracc_arg_data.h>                /* definition of the global data struct      */
 #include <Proglib.h>        /* def of print_error_and_..                 */
 #include <deform_support.h>        /* prototypes for routines called
@@ -382,107 +382,46 @@ time_t time(time_t *tloc);
 #include <sub_lattice.h>        /* prototypes for sub_lattice manipulation   */
 #include <extras.h>             /* prototypes for extra convienience routines*/
 #include <quad_max_fit.h>       /* prototypes for quadratic fitting routines */
+#include <nonlinear_context.h>  /* state of the fit and of each node         */
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 
-int stat_quad_total=0;            /* these are used as globals to tally stats  */
-int stat_quad_zero=0;             /* in Numerical/quad_max_stats.c             */
-int stat_quad_two=0;              /* (mostly for debugging)                    */
-int stat_quad_plus=0;
-int stat_quad_minus=0;
-int stat_quad_semi=0;
-int sample_count=0;             /* this is the value returned from the go_get_
-                                   samples when sub-lattice contains masked nodes*/
-
-
-
-                                /* these globals are used to tally stats over
-                                   do_non_linear_optimization() and 
-                                   return_locally_smoothed_def               */
-static stats_struct
-   stat_def_mag,
-   stat_num_funks,
-   stat_conf0,
-   stat_conf1,
-   stat_conf2,
-   stat_eigval0,
-   stat_eigval1,
-   stat_eigval2;
-
-                                /* these Globals are used to communicate to
-                                   the correlation functions over top the
-                                   SIMPLEX optimization routine */
-
-float  *Gsqrt_features=NULL;                /* normalization const for correlation       */
-float  **Ga1_features=NULL;                /* samples in source sub-lattice             */
-VIO_BOOL **masked_samples_in_source=NULL;   /* masked samples in source sub-lattice */
-float  *TX=NULL; 
-float  *TY=NULL; 
-float  *TZ=NULL;                /* sample sub-lattice positions in target    */
-
-static float *SX=NULL; 
-static float *SY=NULL; 
-static float *SZ=NULL;                /* sample sub-lattice positions in source    */
-
-int 
-  Glen = 0;                                /* # of samples in sub-lattice               */
-
-
-         /* these Globals are used to communicate the projection */
-         /* values over top the SIMPLEX optimization  routine    */ 
-
-VIO_Real  Gtarget_vox_x = 0.0;
-VIO_Real  Gtarget_vox_y = 0.0;
-VIO_Real  Gtarget_vox_z = 0.0;
-VIO_Real  Gproj_d1      = 0.0;
-VIO_Real  Gproj_d1x     = 0.0;
-VIO_Real  Gproj_d1y     = 0.0;
-VIO_Real  Gproj_d1z     = 0.0;
-VIO_Real  Gproj_d2      = 0.0;
-VIO_Real  Gproj_d2x     = 0.0;
-VIO_Real  Gproj_d2y     = 0.0;
-VIO_Real  Gproj_d2z     = 0.0;
 
-        /* Globals used for local simplex Optimization  */
-static VIO_Real     Gsimplex_size=0.0;        /* the radius of the local simplex           */
-VIO_Real     Gcost_radius=0.0;        /* constant used in the cost function        */
 
-        /* Globals used to split the input transformation into a
-           linear part and a super-sampled non-linear part */
 
-VIO_General_transform *Gsuper_sampled_warp = NULL;
-VIO_General_transform *Glinear_transform = NULL;
-VIO_Volume  Gsuper_sampled_vol;
+                                /* the result of the estimation of a single
+                                   node, kept until all nodes of the slice
+                                   have been estimated so that the
+                                   deformation volumes and the stats are
+                                   updated in node order, whatever the
+                                   number of threads used.                   */
+#define NODE_NOT_ESTIMATED 0    /* masked, below threshold or no neighbours  */
+#define NODE_NO_DEF        1    /* estimation tried, no deformation found    */
+#define NODE_ESTIMATED     2
+#define NODE_CONVERGED     3    /* not re-estimated, see -active_tolerance   */
 
+typedef struct {
+  int      status;
+  int      nfunks;              /* # of obj function evaluations             */
+  VIO_Real result;              /* magnitude of the additional warp          */
+  VIO_Real additional[3];       /* value to store in additional_vol          */
+  VIO_Real another[3];          /* value to store in another_vol             */
+  VIO_BOOL have_eig;            /* eig_vals and conf are valid               */
+  VIO_Real eig_vals[3];
+  VIO_Real conf[3];
+} Node_Estimate;
 
         /* VIO_Volume order definition for super sampled data */
 static char *my_XYZ_dim_names[] = { MIxspace, MIyspace, MIzspace };
 
 
-        /* program Global data used to store all info regarding data
-           and transformations  */
-Arg_Data *Gglobals;
-
-
-       /* constants defined on command line to control optimization */
-extern double     smoothing_weight;      /* weight given to neighbours       */
-extern double     iteration_weight;      /* wght given to a singer iteration */
-extern double     similarity_cost_ratio; /* obj fn = sim * s+c+r -
-                                                     cost * (1-s_c_r)        */
-extern int        iteration_limit;       /* total number of iterations       */
-extern int        number_dimensions;     /* ==2 or ==3                       */
-extern double     ftol;                         /* stopping tolerence for simplex   */
-extern VIO_Real       initial_corr, final_corr;
-                                         /* value of correlation before/after
-                                            optimization                     */
-
-                                /* diameter of the local neighbourhood
-                                   sub-lattice, in number of elements-1 */
-
-extern int        Diameter_of_local_lattice;
-#define MAX_G_LEN (Diameter_of_local_lattice)*\
-                  (Diameter_of_local_lattice)*\
-                  (Diameter_of_local_lattice)
+                                /* number of elements in the local
+                                   neighbourhood sub-lattice, for a diameter
+                                   of d elements                             */
+#define MAX_G_LEN( d ) ((d)*(d)*(d))
 
 
                                 /* absolute maximum range for deformation
@@ -512,10 +451,6 @@ extern int        Diameter_of_local_lattice;
 #define  MAX( x, y )  ( ((x) >= (y)) ? (x) : (y) )
 #define  MAX3( x, y, z )  ( ((x) >= (y)) ? MAX( x, z ) : MAX( y, z ) )
 
-static VIO_Real
-previous_mean_eig_val[3] = {DEFAULT_MEAN_E0,DEFAULT_MEAN_E1,DEFAULT_MEAN_E2};
-static VIO_Real
-   previous_std_eig_val[3]  = {DEFAULT_STD_E0,DEFAULT_STD_E1,DEFAULT_STD_E2};
 
         /* prototypes function definitions */
 
@@ -533,13 +468,44 @@ static VIO_Real
 
  void  terminate_amoeba( amoeba_struct  *amoeba );
 
- VIO_Real amoeba_NL_obj_function(void * dummy, float d[]);
-
 #define AMOEBA_ITERATION_LIMIT  400 /* max number of iterations for amoeba */
 
- VIO_Real local_objective_function(float *x);
-
-static VIO_Real get_deformation_vector_for_node(VIO_Real spacing, VIO_Real threshold1, 
+#define GN_ITERATION_LIMIT       20 /* max number of steps of -local_gn     */
+#define GN_STEP_TOLERANCE      0.01 /* -local_gn stops on steps below this
+                                       (voxels)                             */
+#define GN_INITIAL_DAMPING     1e-3 /* Levenberg-Marquardt damping of the   */
+#define GN_MAX_DAMPING          1e4 /* -local_gn steps                      */
+
+static Node_Context *create_node_context(Nonlinear_Context *nl, int max_len);
+
+static void delete_node_context(Node_Context *context, int number_of_features);
+
+static void mark_active_neighbourhood(unsigned char *active,
+                                      int node[], int size[]);
+
+static long mark_eligible_nodes(Nonlinear_Context *nl,
+                                VIO_Volume current_vol,
+                                int xyzv[], int start[], int end[],
+                                VIO_Real threshold2,
+                                unsigned char *active,
+                                unsigned char *eligible,
+                                int n_threads);
+
+static void estimate_deformation_of_node(Node_Context *context,
+                                         Node_Estimate *estimate,
+                                         int index[],
+                                         int xyzv[],
+                                         int start[],
+                                         int end[],
+                                         VIO_General_transform *current_warp,
+                                         VIO_Real spacing,
+                                         VIO_Real threshold1,
+                                         int iteration,
+                                         int ndim,
+                                         VIO_BOOL sub_lattice_needed);
+
+static VIO_Real get_deformation_vector_for_node(Node_Context *context,
+                                             VIO_Real spacing, VIO_Real threshold1, 
                                              VIO_Real source_coord[],
                                              VIO_Real mean_target[],
                                              VIO_Real def_vector[],
@@ -549,7 +515,8 @@ static VIO_Real get_deformation_vector_for_node(VIO_Real spacing, VIO_Real thres
                                              int ndim,
                                              VIO_BOOL sub_lattice_needed);
 
-static double return_locally_smoothed_def(int  isotropic_smoothing,
+static double return_locally_smoothed_def(Node_Context *context,
+                                         int  isotropic_smoothing,
                                          int  ndim,
                                          VIO_Real smoothing_wght,
                                          VIO_Real iteration_wght,
@@ -563,6 +530,7 @@ static double return_locally_smoothed_def(int  isotropic_smoothing,
 
 
 static VIO_BOOL get_best_start_from_neighbours(
+                                               Nonlinear_Context *nl,
                                                VIO_Real threshold1, 
                                                VIO_Real source[],
                                                VIO_Real mean_target[],
@@ -600,7 +568,8 @@ int nearest_neighbour_interpolant(VIO_Volume volume,
 static VIO_BOOL is_a_sub_lattice_needed (char obj_func[],
                                          int  number_of_features);
 
-static VIO_BOOL build_lattices(VIO_Real spacing, 
+static VIO_BOOL build_lattices(Node_Context *context,
+                               VIO_Real spacing, 
                                VIO_Real threshold, 
                                VIO_Real source_coord[],
                                VIO_Real mean_target[],
@@ -608,26 +577,9 @@ static VIO_BOOL build_lattices(VIO_Real spacing,
                                VIO_Real def_vector[],
                                int ndim);
 
-void    build_target_lattice(float px[], float py[], float pz[],
-                                    float tx[], float ty[], float tz[],
-                                     int len, int dim);
-
-void    build_target_lattice_using_super_sampled_def(
-                                     float px[], float py[], float pz[],
-                                     float tx[], float ty[], float tz[],
-                                     int len, int dim);
-
 
-static VIO_Real get_optical_flow_vector(VIO_Real threshold1, 
-                                     VIO_Real source_coord[],
-                                     VIO_Real mean_target[],
-                                     VIO_Real def_vector[],
-                                     VIO_Real voxel_displacement[],
-                                     VIO_Volume data,
-                                     VIO_Volume model,
-                                     int ndim);
-
-static VIO_Real get_chamfer_vector(VIO_Real threshold1, 
+static VIO_Real get_chamfer_vector(Nonlinear_Context *nl,
+                                VIO_Real threshold1, 
                                 VIO_Real source_coord[],
                                 VIO_Real mean_target[],
                                 VIO_Real def_vector[],
@@ -636,20 +588,20 @@ static VIO_Real get_chamfer_vector(VIO_Real threshold1,
                                 VIO_Volume chamfer,
                                 int ndim);
 
-void from_param_to_grid_weights(VIO_Real p[],
-                                       VIO_Real grid[]);
-
-void from_grid_weights_to_param(VIO_Real grid[],
+void from_grid_weights_to_param(Arg_Data *globals,
+                                       VIO_Real grid[],
                                        VIO_Real p[]);
 
-void map_def_to_grid_space(VIO_Real dx,
+void map_def_to_grid_space(Arg_Data *globals,
+                                  VIO_Real dx,
                                   VIO_Real dy,
                                   VIO_Real dz,
                                   VIO_Real *g0,
                                   VIO_Real *g1,
                                   VIO_Real *g2);
 
-void map_def_from_grid_space(VIO_Real g0,
+void map_def_from_grid_space(Arg_Data *globals,
+                                    VIO_Real g0,
                                     VIO_Real g1,
                                     VIO_Real g2,
                                     VIO_Real *dx,
@@ -675,6 +627,9 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
       current_vol,                /* volume pointer to current_warp transform           */
       additional_mag;                /* volume storing mag of additional_warp vectors      */
 
+   Super_Sampled_Source
+      super_source;                /* current_warp when last super-sampled              */
+
   
    long
       iteration_start_time,        /* variables to time each iteration                   */
@@ -692,12 +647,59 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
       end[VIO_MAX_DIMENSIONS],        /* ending limit of index[]                      */
       debug_sizes[VIO_MAX_DIMENSIONS],
       iters,                        /* iteration counter */
-      i,j,k,ff,ff_count,
+      i,j,k,
       nodes_done, nodes_tried,        /* variables to calc stats on deformation estim  */
       nodes_seen, over,
-      nfunks, nfunk1, nodes1,
+      nfunk1, nodes1,
+      n_threads,                /* number of threads estimating nodes            */
+      node, n_slice_nodes,        /* nodes in the current X slice                  */
+      grid_size[3],                /* # of nodes along X, Y and Z                   */
+      grid_node[3],
+      warp_sizes[VIO_MAX_DIMENSIONS],        /* the whole grid, for -resume                   */
+      warp_start[3], warp_end[3],
+      first_iteration,                /* 0, or the iteration resumed with -resume     */
+      converged_iterations,        /* # of iterations in a row that met the
+                                   stopping criteria (-nonlinear_tol)            */
       sub_lattice_needed;
 
+   long
+      n_active,                        /* # of nodes estimated in this iteration        */
+      n_eligible;                /* # of active nodes inside the target mask      */
+
+   unsigned char
+      *active_nodes,                /* nodes to estimate in this iteration, and      */
+      *next_active_nodes,        /* in the next one (NULL: estimate all nodes)    */
+      *eligible_nodes;                /* active nodes whose target passes the mask and
+                                   threshold tests, for this iteration           */
+
+   Nonlinear_Context
+      nl_context,                /* state of this fit, shared by all threads      */
+      *nl;
+
+   Nonlinear_Checkpoint
+      checkpoint;                /* read with -resume                             */
+
+   Node_Context
+      **contexts;                /* sub-lattice storage, one per thread           */
+
+   stats_struct                        /* stats tallied over each iteration from the
+                                   Node_Estimate of each node                    */
+      stat_def_mag,
+      stat_num_funks,
+      stat_conf0,
+      stat_conf1,
+      stat_conf2,
+      stat_eigval0,
+      stat_eigval1,
+      stat_eigval2;
+
+   Quad_Fit_Stats                /* the quad fit stats of all the threads          */
+      quad_stats;
+
+   Node_Estimate
+      *estimate,
+      *slice_estimates;                /* results for all the nodes of an X slice       */
+
    VIO_Real 
 
      step_magnitude[VIO_N_DIMENSIONS],
@@ -713,72 +715,108 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
       
                                 /* variables to calc stats on deformation estim  */
       mag, mean_disp_mag, std, 
+      previous_corr,                /* xcorr before this iteration                   */
+      resumed_initial_corr,        /* initial_corr and previous_corr of the run     */
+      resumed_previous_corr,        /* saved in the checkpoint, with -resume         */
 
-      another_vector[3],        
       current_def_vector[3],        /* the current deformation vector for a  node    */
-      result_def_vector[3],        /* the smoothed deformation vector for a node    */
-      def_vector[3],                /* the additional deformation estimated for node,
-                                   for these three vectors in real world coords
-                                   index [0] stores the x disp, and [2] the z disp */
-      voxel_displacement[VIO_N_DIMENSIONS],    /* the additional displacement, in voxel coords 
-                                   with [0] storing the displacement of the
-                                   fastest varying index, and [2] the slowest in
-                                   the data voluming = xdim and zdim respectively*/
       wx,wy,wz,                        /* temporary storage for a world coordinate      */
-      source_node[3],                /* world coordinate of source node               */
       target_node[3],                /* world coordinate of corresponding target node */
-      mean_target[3],                /* mean deformed pos, determined by neighbors    */
-      mean_vector[3],                /* mean deformed vector, determined by neighbors */
       threshold1,                /* intensity thresh for source vol               */
-      threshold2,                /* intensity thresh for target vol               */
-      result,                        /* magnitude of additional warp vector           */
-      eig1;
+      threshold2;                /* intensity thresh for target vol               */
 
    VIO_progress_struct                /* to print out program progress report */
       progress;
 
    VIO_STR filenamestring;
-   VIO_BOOL condition;
-
-  /*******************************************************************************/
 
-           /* set up globals for communication with other routines */
+   VIO_BOOL
+      resumed,                        /* the fit continues from a checkpoint           */
+      stopped;                        /* the fit converged before iteration_limit      */
+   char
+      stop_reason[256];
 
+  /*******************************************************************************/
 
+           /* set up the context used to communicate with other routines */
+
+   nl = &nl_context;
+   nl->globals               = globals;
+   nl->iteration_limit       = globals->nonlinear.iteration_limit;
+   nl->iteration_weight      = globals->nonlinear.iteration_weight;
+   nl->smoothing_weight      = globals->nonlinear.smoothing_weight;
+   nl->similarity_cost_ratio = globals->nonlinear.similarity_cost_ratio;
+   nl->sub_lattice_diameter  = globals->nonlinear.sub_lattice_diameter;
+   nl->simplex_size          = 0.0;
+   nl->cost_radius           = 0.0;
+   nl->linear_transform      = NULL;
+   nl->super_sampled_warp    = NULL;
+   nl->super_sampled_vol     = NULL;
+   nl->optical_flow          = NULL;
+   nl->mask_world_to_voxel   = NULL;
+   nl->fused_features        = (globals->interpolant != nearest_neighbour_interpolant &&
+                                features_share_geometry(globals));
+   super_source.vectors      = NULL;
+   nl->previous_mean_eig_val[0] = DEFAULT_MEAN_E0;
+   nl->previous_mean_eig_val[1] = DEFAULT_MEAN_E1;
+   nl->previous_mean_eig_val[2] = DEFAULT_MEAN_E2;
+   nl->previous_std_eig_val[0]  = DEFAULT_STD_E0;
+   nl->previous_std_eig_val[1]  = DEFAULT_STD_E1;
+   nl->previous_std_eig_val[2]  = DEFAULT_STD_E2;
 
-   Gglobals= globals;
    current_def_vector[0]=current_def_vector[1]=current_def_vector[2]=0.0;
    
    /* pour eviter d'avoir une option -2Dnonlin ou 3d le fcalcul se fait directement */
    num_of_dims_to_optimize = 0;
    for(i=0; i<VIO_N_DIMENSIONS; i++) {
-     if (Gglobals->count[i] > 1) 
+     if (globals->count[i] > 1) 
        num_of_dims_to_optimize++ ;
    }
-   number_dimensions = num_of_dims_to_optimize; /* to communicate to
-                                                   amoeba_NL_obj_function
-                                                   through the
-                                                   external variable */
+   nl->number_dimensions = num_of_dims_to_optimize; 
+
+
+                                /* decide how many threads will share
+                                   the estimation of the nodes          */
+   n_threads = 1;
+#ifdef _OPENMP
+   if (globals->threads > 0)
+     n_threads = globals->threads;
+   else
+     n_threads = omp_get_max_threads();
+#else
+   if (globals->threads != 1 && globals->flags.verbose>0)
+     print ("Not built with OpenMP, ignoring -threads %d\n", globals->threads);
+#endif
 
+   /* allocate the sub-lattice storage needed by each thread */
 
-   /* allocate space required for some globals */
+   if (globals->features.number_of_features > 0) {
+      ALLOC(contexts, n_threads);
+      for(i=0; i<n_threads; i++)
+        contexts[i] = create_node_context(nl, 
+                                          MAX_G_LEN(nl->sub_lattice_diameter)+1);
 
-   if (Gglobals->features.number_of_features > 0) {
-      VIO_ALLOC2D (Ga1_features, Gglobals->features.number_of_features, MAX_G_LEN+1);
-      VIO_ALLOC2D (masked_samples_in_source, Gglobals->features.number_of_features, MAX_G_LEN+1);
-      ALLOC( Gsqrt_features, Gglobals->features.number_of_features);
+      sub_lattice_needed = is_a_sub_lattice_needed (globals->features.obj_func,
+                                                    globals->features.number_of_features);
 
-      sub_lattice_needed = is_a_sub_lattice_needed (Gglobals->features.obj_func,
-                                                    Gglobals->features.number_of_features);
+                                /* the shape of the sub-lattice is the
+                                   same for all nodes, build it once     */
+      build_sub_lattice_template(nl,
+                                 globals->lattice_width[VIO_X],
+                                 globals->lattice_width[VIO_Y],
+                                 globals->lattice_width[VIO_Z],
+                                 nl->sub_lattice_diameter,  
+                                 nl->sub_lattice_diameter,  
+                                 nl->sub_lattice_diameter);
 
       if (globals->flags.debug) {
-        print ("There are %d feature pairs\n",Gglobals->features.number_of_features);
-        for(i=0; i<Gglobals->features.number_of_features; i++) {
+        print ("There are %d feature pairs\n",globals->features.number_of_features);
+        for(i=0; i<globals->features.number_of_features; i++) {
           print ("%d: [%d] [%7.5f] %s <-> %s\n", i, 
-                 Gglobals->features.obj_func[i],
-                 Gglobals->features.weight[i],
-                 Gglobals->features.data_name[i],
-                 Gglobals->features.model_name[i]);
+                 globals->features.obj_func[i],
+                 globals->features.weight[i],
+                 globals->features.data_name[i],
+                 globals->features.model_name[i]);
         }
         if (sub_lattice_needed) 
           print ("A sub-lattice is needed for at least one feature\n");
@@ -786,9 +824,9 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
           print ("No sub-lattice needed.  Should be a fast run!\n");
 
         print ( "Sub-lattice dia     = %f %f %f\n",
-                  Gglobals->lattice_width[0],
-                  Gglobals->lattice_width[1],
-                  Gglobals->lattice_width[2]);
+                  globals->lattice_width[0],
+                  globals->lattice_width[1],
+                  globals->lattice_width[2]);
 
       } 
    }
@@ -797,12 +835,18 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
                               __FILE__, __LINE__);
    }
 
-   ALLOC(SX,MAX_G_LEN+1);        /* and coordinates in source volume  */
-   ALLOC(SY,MAX_G_LEN+1);
-   ALLOC(SZ,MAX_G_LEN+1);
-   ALLOC(TX,MAX_G_LEN+1);        /* and coordinates in target volume  */
-   ALLOC(TY,MAX_G_LEN+1);
-   ALLOC(TZ,MAX_G_LEN+1);
+                                /* -local_gn needs derivatives of all
+                                   the objective functions */
+   if (globals->trans_info.use_simplex == LOCAL_GAUSS_NEWTON) {
+     for(i=0; i<globals->features.number_of_features; i++) {
+       if (globals->features.obj_func[i] != NONLIN_XCORR &&
+           globals->features.obj_func[i] != NONLIN_CORRCOEFF &&
+           globals->features.obj_func[i] != NONLIN_SQDIFF &&
+           globals->features.obj_func[i] != NONLIN_DIFF)
+         print_error_and_line_num("-local_gn supports only the xcorr, corrcoeff, sqdiff and diff objective functions (feature %d)\n",
+                                  __FILE__, __LINE__, i);
+     }
+   }
 
    /* split the total transformation into the first linear part and the
       last non-linear def.  */  
@@ -816,7 +860,7 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
                                __FILE__, __LINE__);
    }
                                 /* set up linear part of transformation   */
-   Glinear_transform = all_until_last; 
+   nl->linear_transform = all_until_last; 
 
                                 /* print some debugging info    */
    if (globals->flags.debug) {        
@@ -884,20 +928,20 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
    /* test simplex size against size of data voxels */
 
    get_volume_separations(additional_vol, steps);
-   get_volume_separations(Gglobals->features.model[0], steps_data);
+   get_volume_separations(globals->features.model[0], steps_data);
    
    if (steps_data[0]!=0.0) {
-                                /* Gsimplex_size is in voxel units
+                                /* the simplex size is in voxel units
                                    in the data volume.             */
 
      for(i=0; i<VIO_N_DIMENSIONS; i++) {step_magnitude[i] = fabs(steps_data[i]); }
 
-      Gsimplex_size= fabs(steps[xyzv[VIO_X]]) / MAX3(step_magnitude[0],step_magnitude[1],step_magnitude[2]);  
+      nl->simplex_size= fabs(steps[xyzv[VIO_X]]) / MAX3(step_magnitude[0],step_magnitude[1],step_magnitude[2]);  
 
-      if (fabs(Gsimplex_size) < fabs(steps_data[0]) && globals->flags.verbose>0) {
+      if (fabs(nl->simplex_size) < fabs(steps_data[0]) && globals->flags.verbose>0) {
          print ("*** WARNING ***\n");
          print ("Simplex size will be smaller than data voxel size (%f < %f)\n",
-                Gsimplex_size,steps_data[0]);
+                nl->simplex_size,steps_data[0]);
       }
    }
    else
@@ -913,6 +957,129 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
   get_voxel_spatial_loop_limits(additional_vol, 
                                 start, end);
 
+  ALLOC(slice_estimates, (end[VIO_Y]-start[VIO_Y])*(end[VIO_Z]-start[VIO_Z]));
+
+                                /* the nodes are tested against the target
+                                   mask and threshold in voxel space */
+  ALLOC(eligible_nodes, (long)(end[VIO_X]-start[VIO_X]) *
+                        (end[VIO_Y]-start[VIO_Y]) * (end[VIO_Z]-start[VIO_Z]));
+  if (globals->features.number_of_features > 0) {
+    get_world_to_voxel_matrix(globals->features.model[0], nl->target_world_to_voxel);
+    ALLOC(nl->mask_world_to_voxel, globals->features.number_of_features);
+    for(i=0; i<globals->features.number_of_features; i++)
+      if (globals->features.model_mask[i] != NULL)
+        get_world_to_voxel_matrix(globals->features.model_mask[i], nl->mask_world_to_voxel[i]);
+  }
+
+                                /* the source samples of a node do not
+                                   change between iterations, keep
+                                   them if memory allows             */
+  if (globals->features.number_of_features > 0 && sub_lattice_needed)
+    init_source_sample_cache(&(nl->source_cache),
+                             (long)(end[VIO_X]-start[VIO_X]) *
+                             (end[VIO_Y]-start[VIO_Y]) * (end[VIO_Z]-start[VIO_Z]),
+                             globals->features.number_of_features,
+                             nl->template_len,
+                             globals->nonlinear.source_cache_size);
+  else
+    init_source_sample_cache(&(nl->source_cache), 0, 0, 0, 0.0);
+
+                                /* with -active_tolerance, keep track of the
+                                   nodes that still move; all nodes are
+                                   active for the first iteration       */
+  for(i=0; i<3; i++)
+    grid_size[i] = end[i]-start[i];
+  n_active = (long)grid_size[VIO_X] * grid_size[VIO_Y] * grid_size[VIO_Z];
+
+  active_nodes = next_active_nodes = NULL;
+  if (globals->nonlinear.active_tolerance > 0.0 && n_active > 0) {
+    ALLOC(active_nodes,      n_active);
+    ALLOC(next_active_nodes, n_active);
+    for(i=0; i<n_active; i++) {
+      active_nodes[i]      = TRUE;
+      next_active_nodes[i] = FALSE;
+    }
+  }
+
+                                /* with -resume, start from the state saved
+                                   in the last checkpoint of this level   */
+  first_iteration      = 0;
+  converged_iterations = 0;
+  resumed              = FALSE;
+  resumed_initial_corr = resumed_previous_corr = 0.0;
+
+  if (globals->nonlinear.resume && globals->nonlinear.checkpoint_dir != NULL) {
+
+    if (!read_nonlinear_checkpoint(globals, &checkpoint)) {
+      print ("No checkpoint in %s, starting the fit from the beginning\n",
+             globals->nonlinear.checkpoint_dir);
+      globals->nonlinear.resume = FALSE;
+    }
+    else {
+      if (checkpoint.level == globals->nonlinear.schedule.current) {
+
+                                /* the whole grid, borders included */
+        get_volume_sizes(current_vol, warp_sizes);
+        for(i=0; i<3; i++) {
+          warp_start[i] = 0;
+          warp_end[i]   = warp_sizes[ xyzv[i] ];
+        }
+
+        if (checkpoint.count[VIO_X] != warp_end[VIO_X] ||
+            checkpoint.count[VIO_Y] != warp_end[VIO_Y] ||
+            checkpoint.count[VIO_Z] != warp_end[VIO_Z])
+          print_error_and_line_num("The checkpoint grid (%d x %d x %d nodes) does not match the grid of this fit (%d x %d x %d)\n",
+                                   __FILE__, __LINE__,
+                                   checkpoint.count[VIO_X], checkpoint.count[VIO_Y], checkpoint.count[VIO_Z],
+                                   warp_end[VIO_X], warp_end[VIO_Y], warp_end[VIO_Z]);
+
+        if ((active_nodes == NULL) != (checkpoint.n_active == 0) ||
+            (active_nodes != NULL && checkpoint.n_active != n_active))
+          print_error_and_line_num("The checkpoint was saved with a different -active_tolerance\n",
+                                   __FILE__, __LINE__);
+
+        set_warp_vectors(current_vol, warp_start, warp_end, checkpoint.vectors);
+
+        for(i=0; i<3; i++) {
+          nl->previous_mean_eig_val[i] = checkpoint.previous_mean_eig_val[i];
+          nl->previous_std_eig_val[i]  = checkpoint.previous_std_eig_val[i];
+        }
+
+        if (active_nodes != NULL) {
+          n_active = 0;
+          for(i=0; i<checkpoint.n_active; i++) {
+            active_nodes[i] = checkpoint.active[i];
+            if (active_nodes[i]) n_active++;
+          }
+        }
+
+        first_iteration      = checkpoint.iteration;
+        converged_iterations = checkpoint.converged_iterations;
+        resumed_initial_corr  = checkpoint.initial_corr;
+        resumed_previous_corr = checkpoint.previous_corr;
+        resumed              = TRUE;
+        globals->nonlinear.resume = FALSE;
+
+        if (globals->flags.verbose>0)
+          print ("Resuming the fit after iteration %d\n", first_iteration);
+
+                                /* the intensity normalization done for
+                                   optical flow after each iteration */
+        if (first_iteration > 0 && first_iteration < nl->iteration_limit)
+          for(i=0; i<globals->features.number_of_features; i++)
+            if (globals->features.obj_func[i] == NONLIN_OPTICALFLOW)
+              normalize_data_to_match_target(globals->features.data[i],
+                                             globals->features.data_mask[i],
+                                             globals->features.thresh_data[i],
+                                             globals->features.model[i],
+                                             globals->features.model_mask[i],
+                                             globals->features.thresh_model[i],
+                                             globals);
+      }
+      delete_nonlinear_checkpoint(&checkpoint);
+    }
+  }
+
                                 /* build a super-sampled version of the
                                    current transformation, if needed     */
 
@@ -956,11 +1123,11 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
 
 
 
-    ALLOC(Gsuper_sampled_warp,1);
+    ALLOC(nl->super_sampled_warp,1);
     create_super_sampled_data_volumes(current_warp, 
-                                      Gsuper_sampled_warp,
+                                      nl->super_sampled_warp,
                                       globals->trans_info.use_super);
-    Gsuper_sampled_vol = Gsuper_sampled_warp->displacement_volume;
+    nl->super_sampled_vol = nl->super_sampled_warp->displacement_volume;
 
 
 
@@ -975,15 +1142,15 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
         wst[i]=0.0;
       }
 
-      convert_voxel_to_world(Gsuper_sampled_warp->displacement_volume, 
+      convert_voxel_to_world(nl->super_sampled_warp->displacement_volume, 
                              voxel,
                              &wx, &wy, &wz);
-      get_volume_sizes(Gsuper_sampled_warp->displacement_volume, 
+      get_volume_sizes(nl->super_sampled_warp->displacement_volume, 
                        debug_sizes);
-      get_volume_separations(Gsuper_sampled_warp->displacement_volume, 
+      get_volume_separations(nl->super_sampled_warp->displacement_volume, 
                              debug_steps);
-      get_volume_starts(Gsuper_sampled_warp->displacement_volume, st);
-      get_volume_translation(Gsuper_sampled_warp->displacement_volume, voxel, wst);
+      get_volume_starts(nl->super_sampled_warp->displacement_volume, st);
+      get_volume_translation(nl->super_sampled_warp->displacement_volume, voxel, wst);
       print ("After super sampling:\n");
       print ("super sizes: %7d  %7d  %7d  %7d  %7d\n",
              debug_sizes[0],debug_sizes[1],debug_sizes[2],debug_sizes[3],debug_sizes[4]);
@@ -1001,11 +1168,11 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
                                 /* set up other parameters needed
                                    for non linear fitting */
 
-  Gcost_radius = 8*Gsimplex_size*Gsimplex_size*Gsimplex_size;
+  nl->cost_radius = 8*nl->simplex_size*nl->simplex_size*nl->simplex_size;
 
 
- /*   set_feature_value_threshold(Gglobals->features.data[0],  */
-/*                               Gglobals->features.model[0], */
+ /*   set_feature_value_threshold(globals->features.data[0],  */
+/*                               globals->features.model[0], */
 /*                               &(globals->threshold[0]),  */
 /*                               &(globals->threshold[1]), */
 /*                               &threshold1, */
@@ -1015,27 +1182,34 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
  threshold2 = globals->threshold[1];
  
 
-  initial_corr = xcorr_objective_with_def(Gglobals->features.data[0], 
-                                          Gglobals->features.model[0],
-                                          Gglobals->features.data_mask[0], 
-                                          Gglobals->features.model_mask[0],
-                                          globals );
+                                /* a resumed fit reports the correlation
+                                   before its first iteration, not the
+                                   one of the grid it resumes from */
+  if (resumed)
+    globals->initial_corr = resumed_initial_corr;
+  else
+    globals->initial_corr = xcorr_objective_with_def(globals->features.data[0], 
+                                                     globals->features.model[0],
+                                                     globals->features.data_mask[0], 
+                                                     globals->features.model_mask[0],
+                                                     globals );
 
 
 
 
   if (globals->flags.debug) {        
     print("\n\nDebug info from do_nonlinear_optimization---------------\n");
-    print("Initial corr         = %f\n",initial_corr);
+    print("Initial corr         = %f\n",globals->initial_corr);
     print("Source vol threshold = %f\n", threshold1);
     print("Target vol threshold = %f\n", threshold2);
-    print("Iteration limit      = %d\n", iteration_limit);
-    print("Iteration weight     = %f\n", iteration_weight);
+    print("Iteration limit      = %d\n", nl->iteration_limit);
+    print("Iteration weight     = %f\n", nl->iteration_weight);
     print("xyzv                 = %3d %3d %3d %3d \n",
           xyzv[VIO_X], xyzv[VIO_Y], xyzv[VIO_Z], xyzv[VIO_Z+1]);
-    print("number_dimensions    = %d\n",number_dimensions);
+    print("number_dimensions    = %d\n",nl->number_dimensions);
     print("num_of_dims_to_opt   = %d\n",num_of_dims_to_optimize);
-    print("smoothing_weight     = %f\n",smoothing_weight);
+    print("threads              = %d\n",n_threads);
+    print("smoothing_weight     = %f\n",nl->smoothing_weight);
     print("loop                 = (%d %d) (%d %d) (%d %d)\n",
           start[0],end[0],start[1],end[1],start[2],end[2]);
     print("current_def_vector   = %f %f %f\n",current_def_vector[VIO_X], current_def_vector[VIO_Y],current_def_vector[VIO_Z]);
@@ -1043,28 +1217,33 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
     
     print ("\nFitting STRATEGY ----------\n");
     
-    if ( Gglobals->trans_info.use_magnitude) {
+    if ( globals->trans_info.use_magnitude) {
 
      for(i=0; i<VIO_N_DIMENSIONS; i++) {step_magnitude[i] = fabs(steps_data[i]); }
 
-      if ( Gglobals->trans_info.use_simplex) {
+      if ( globals->trans_info.use_simplex == LOCAL_GAUSS_NEWTON) {
+        print ("  This fit will use local Gauss-Newton optimization and\n");
+        print ("  Search radius = %7.2f (voxels) or %7.2f(mm)\n",
+               nl->simplex_size, 
+               nl->simplex_size * MAX3(step_magnitude[0],step_magnitude[1],step_magnitude[2]));      }
+      else if ( globals->trans_info.use_simplex) {
         print ("  This fit will use local simplex optimization and\n");
         print ("  Simplex radius = %7.2f (voxels) or %7.2f(mm)\n",
-               Gsimplex_size, 
-               Gsimplex_size * MAX3(step_magnitude[0],step_magnitude[1],step_magnitude[2]));      }
+               nl->simplex_size, 
+               nl->simplex_size * MAX3(step_magnitude[0],step_magnitude[1],step_magnitude[2]));      }
       else {
         print ("  This fit will use local quadratic fitting and\n");
         print ("  Search/quad fit radius= %7.2f (data voxels) or %7.2f(mm)\n",
-               Gsimplex_size /2.0, 
-               Gsimplex_size * MAX3(step_magnitude[0],step_magnitude[1],step_magnitude[2])/2.0);
+               nl->simplex_size /2.0, 
+               nl->simplex_size * MAX3(step_magnitude[0],step_magnitude[1],step_magnitude[2])/2.0);
       }
     }
     else {
         print ("  This fit will use optical flow for direct fitting\n");        
     }
 
-    if (Gglobals->trans_info.use_local_smoothing) {
-      if ( Gglobals->trans_info.use_local_isotropic) 
+    if (globals->trans_info.use_local_smoothing) {
+      if ( globals->trans_info.use_local_isotropic) 
         print ("    local isotroptic smoothing.\n");
       else
         print ("    local non-isotroptic smoothing.\n");
@@ -1074,32 +1253,32 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
     }
     
 
-    if (Gglobals->interpolant==nearest_neighbour_interpolant) 
+    if (globals->interpolant==nearest_neighbour_interpolant) 
       print ("  The similarity function will be evaluated using NN interpolation\n");
     else
       print ("  The similarity function will be evaluated using tri-linear interpolation\n");
     
-    if ( Gglobals->trans_info.use_magnitude) {
+    if ( globals->trans_info.use_magnitude) {
       print ("    on a ellipsoidal sub-lattice with a radii of\n");
-      print ("    %d nodes across the diameter\n",             Diameter_of_local_lattice);
+      print ("    %d nodes across the diameter\n",             nl->sub_lattice_diameter);
       print ("    %7.2f,%7.2f,%7.2f  (data voxels),\n",
              globals->lattice_width[VIO_X]/steps_data[VIO_X],
              globals->lattice_width[VIO_Y]/steps_data[VIO_Y],
              globals->lattice_width[VIO_Z]/steps_data[VIO_Z]);
 
       print ("    %7.2f %7.2f %7.2f (mm) width \n",
-             Gglobals->lattice_width[VIO_X],    Gglobals->lattice_width[VIO_Y],   Gglobals->lattice_width[VIO_Z]);
+             globals->lattice_width[VIO_X],    globals->lattice_width[VIO_Y],   globals->lattice_width[VIO_Z]);
 
-      if (Diameter_of_local_lattice > 1) {
+      if (nl->sub_lattice_diameter > 1) {
         print ("    %7.2f %7.2f %7.2f (data voxels) per node \n",
-               globals->lattice_width[VIO_X]/steps_data[VIO_X]/(Diameter_of_local_lattice-1),
-               globals->lattice_width[VIO_Y]/steps_data[VIO_Y]/(Diameter_of_local_lattice-1),
-               globals->lattice_width[VIO_Z]/steps_data[VIO_Z]/(Diameter_of_local_lattice-1)
+               globals->lattice_width[VIO_X]/steps_data[VIO_X]/(nl->sub_lattice_diameter-1),
+               globals->lattice_width[VIO_Y]/steps_data[VIO_Y]/(nl->sub_lattice_diameter-1),
+               globals->lattice_width[VIO_Z]/steps_data[VIO_Z]/(nl->sub_lattice_diameter-1)
                );
         print ("    %7.2f %7.2f %7.2f (mm) per node \n",
-               globals->lattice_width[VIO_X]/(Diameter_of_local_lattice-1),
-               globals->lattice_width[VIO_Y]/(Diameter_of_local_lattice-1),
-               globals->lattice_width[VIO_Z]/(Diameter_of_local_lattice-1)
+               globals->lattice_width[VIO_X]/(nl->sub_lattice_diameter-1),
+               globals->lattice_width[VIO_Y]/(nl->sub_lattice_diameter-1),
+               globals->lattice_width[VIO_Z]/(nl->sub_lattice_diameter-1)
                );
       }
       
@@ -1141,8 +1320,10 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
   */
 
    mean_disp_mag = 0.0;
+   previous_corr = resumed ? resumed_previous_corr : globals->initial_corr;
+   stopped       = FALSE;
 
-   for(iters=0; iters<iteration_limit; iters++) 
+   for(iters=first_iteration; iters<nl->iteration_limit; iters++) 
      {
        
        iteration_start_time = time(NULL);
@@ -1152,29 +1333,34 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
            
            temp_start_time = time(NULL);
            
-           interpolate_super_sampled_data_by2(current_warp,
-                                          Gsuper_sampled_warp);
+           interpolate_super_sampled_data_by2_incremental(current_warp,
+                                                          nl->super_sampled_warp,
+                                                          &super_source);
            if (globals->flags.debug){
              report_time(temp_start_time, "TIME:Interpolating super-sampled data");
              }
 
          }  
 
+                                /* the source intensities are normalized
+                                   between iterations for optical flow */
+       prepare_optical_flow_data(nl);
+
 	   if (globals->flags.verbose>1) print("Initializing deformation grid to 0...\n");
        init_the_volume_to_zero(estimated_flag_vol);
 
        if (globals->flags.debug){ 
-        print("Iteration %2d of %2d\n",iters+1, iteration_limit);
+        print("Iteration %2d of %2d\n",iters+1, nl->iteration_limit);
        }
-       if (globals->flags.verbose>1) print("Iteration %2d of %2d\n",iters+1, iteration_limit);
+       if (globals->flags.verbose>1) print("Iteration %2d of %2d\n",iters+1, nl->iteration_limit);
+
+       if (active_nodes != NULL && globals->flags.verbose>0)
+         print("Iteration %2d: %ld of %ld nodes active\n", iters+1, n_active,
+               (long)grid_size[VIO_X] * grid_size[VIO_Y] * grid_size[VIO_Z]);
 
        /* for various stats on this iteration*/
-       stat_quad_total = 0;
-       stat_quad_zero  = 0;
-       stat_quad_two   = 0;
-       stat_quad_plus  = 0;
-       stat_quad_minus = 0;
-       stat_quad_semi  = 0;
+       for(i=0; i<n_threads; i++)
+         memset(&contexts[i]->quad_stats, 0, sizeof(Quad_Fit_Stats));
 
        nodes_done      = 0; 
        nodes_tried     = 0; 
@@ -1194,6 +1380,11 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
 
 
 
+       n_eligible = mark_eligible_nodes(nl, current_vol, xyzv, start, end, threshold2,
+                                        active_nodes, eligible_nodes, n_threads);
+       if (globals->flags.debug)
+         print("Iteration %2d: %ld nodes inside the target mask\n", iters+1, n_eligible);
+
        initialize_progress_report( &progress, FALSE, 
                                    (end[VIO_X]-start[VIO_X])*(end[VIO_Y]-start[VIO_Y]) + 1,
                                    "Estimating deformations" );
@@ -1210,185 +1401,160 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
            
            timer1 = time(NULL);               /* for stats on this slice */
            nfunk1 = 0; nodes1 = 0;
-           
-           for(index[xyzv[VIO_Y]]=start[VIO_Y]; index[xyzv[VIO_Y]]<end[VIO_Y]; index[xyzv[VIO_Y]]++) 
+
+           /* estimate all the nodes of this slice.  Each node only reads
+              current_warp (left untouched until all nodes have been
+              estimated), so the nodes may be shared between threads,
+              each thread using its own sub-lattice storage. */
+
+           n_slice_nodes = (end[VIO_Y]-start[VIO_Y])*(end[VIO_Z]-start[VIO_Z]);
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(n_threads) schedule(dynamic)
+#endif
+           for(node=0; node<n_slice_nodes; node++) 
              {
-             
-               for(index[xyzv[VIO_Z]]=start[VIO_Z]; index[xyzv[VIO_Z]]<end[VIO_Z]; index[xyzv[VIO_Z]]++) 
+               int
+                 thread, dim,
+                 node_index[VIO_MAX_DIMENSIONS];
+
+               thread = 0;
+#ifdef _OPENMP
+               thread = omp_get_thread_num();
+#endif
+               for(dim=0; dim<VIO_MAX_DIMENSIONS; dim++) node_index[dim]=index[dim];
+               node_index[xyzv[VIO_Y]] = start[VIO_Y] + node / (end[VIO_Z]-start[VIO_Z]);
+               node_index[xyzv[VIO_Z]] = start[VIO_Z] + node % (end[VIO_Z]-start[VIO_Z]);
+
+               contexts[thread]->node = (long)(index[xyzv[VIO_X]]-start[VIO_X]) * n_slice_nodes + node;
+
+               if (active_nodes != NULL && !active_nodes[ contexts[thread]->node ])
                  {
-               
-                   nodes_seen++;          
-                                        /* get the lattice coordinate 
-                                           of the current index node  */
-                   for(i=0; i<VIO_MAX_DIMENSIONS; i++) voxel[i]=index[i];
+                   slice_estimates[node].status   = NODE_CONVERGED;
+                   slice_estimates[node].nfunks   = 0;
+                   slice_estimates[node].result   = 0.0;
+                   slice_estimates[node].have_eig = FALSE;
+                   continue;
+                 }
 
-                   convert_voxel_to_world(current_vol, 
-                                          voxel,
-                                          &(target_node[VIO_X]), &(target_node[VIO_Y]), &(target_node[VIO_Z]));
+               if (!eligible_nodes[ contexts[thread]->node ])
+                 {
+                   slice_estimates[node].status   = NODE_NOT_ESTIMATED;
+                   slice_estimates[node].nfunks   = 0;
+                   slice_estimates[node].result   = 0.0;
+                   slice_estimates[node].have_eig = FALSE;
+                   continue;
+                 }
 
-                   for(index[xyzv[VIO_Z+1]]=start[VIO_Z+1]; index[xyzv[VIO_Z+1]]<end[VIO_Z+1]; index[xyzv[VIO_Z+1]]++) 
-                     current_def_vector[ index[ xyzv[VIO_Z+1] ] ] = 
-                     get_volume_real_value(current_vol,
-                                           index[0],index[1],index[2],index[3],index[4]);
+               estimate_deformation_of_node(contexts[thread],
+                                            &(slice_estimates[node]),
+                                            node_index, xyzv, start, end,
+                                            current_warp,
+                                            steps[xyzv[VIO_X]],
+                                            threshold1,
+                                            iters, num_of_dims_to_optimize,
+                                            sub_lattice_needed);
+             }
 
-                                        /* add the warp to get the target 
-                                           lattice position in world coords */
+           /* now store the estimates and tally the stats, in node order */
 
-                   wx = target_node[VIO_X] + current_def_vector[VIO_X]; 
-                   wy = target_node[VIO_Y] + current_def_vector[VIO_Y]; 
-                   wz = target_node[VIO_Z] + current_def_vector[VIO_Z];
-         
-                   ff_count = 0;
-
-                   for(ff=0; ff<Gglobals->features.number_of_features; ff++){
-                     if (point_not_masked(Gglobals->features.model_mask[ff], wx, wy, wz) )
-                       ff_count++;
-                   }
-
-                   condition = ff_count &&
-                     get_value_of_point_in_volume(wx,wy,wz,Gglobals->features.model[0]) > threshold2;
-
-                   if (condition) {
-
-                                         /* now get the mean warped position of 
-                                            the target's neighbours */
-                     
-                     index[ xyzv[VIO_Z+1] ] = 0;
-                     if (get_average_warp_of_neighbours(current_warp,
-                                                        index, mean_target)) {
-                       
-                                        /* what is the offset to the mean_target? */
-                     
-                       // this is a tad dumb is it not?
-                       for(i=VIO_X; i<=VIO_Z; i++)
-                         mean_vector[i] = mean_target[i] - target_node[i];
-                       
-                                        /* get the targets homolog in the
-                                           world coord system of the source
-                                           data volume                      */
-
-                       general_inverse_transform_point(Glinear_transform,
-                                                       target_node[VIO_X], target_node[VIO_Y], target_node[VIO_Z],
-                                                       &(source_node[VIO_X]),&(source_node[VIO_Y]),&(source_node[VIO_Z])); 
-
-                                               /* find the best deformation for
-                                           this node                        */
-                       
-
-                       result = get_deformation_vector_for_node(steps[xyzv[VIO_X]], 
-                                                                threshold1,
-                                                                source_node,
-                                                                mean_target,
-                                                                def_vector,
-                                                                voxel_displacement,
-                                                                iters, iteration_limit, 
-                                                                &nfunks,
-                                                                num_of_dims_to_optimize,
-                                                                sub_lattice_needed);
-                     
-                     
-                       if (result < 0.0) 
-                         {
-                           nodes_tried++;
-                           result = 0.0;
-                         } 
-                       else 
-                         {
+           for(node=0; node<n_slice_nodes; node++)
+             {
+               estimate = &(slice_estimates[node]);
+
+               index[xyzv[VIO_Y]] = start[VIO_Y] + node / (end[VIO_Z]-start[VIO_Z]);
+               index[xyzv[VIO_Z]] = start[VIO_Z] + node % (end[VIO_Z]-start[VIO_Z]);
+
+               nodes_seen++;
+
+               if (estimate->status == NODE_NO_DEF)
+                 {
+                   nodes_tried++;
+                 }
+               else if (estimate->status == NODE_CONVERGED)
+                 {
+                                         /* no additional deformation, but
+                                            do not extrapolate one either */
+                   if (globals->trans_info.use_local_smoothing)
+                     set_volume_real_value(estimated_flag_vol,
+                                           index[xyzv[VIO_X]],index[xyzv[VIO_Y]],index[xyzv[VIO_Z]],0,0,
+                                           1.0);
+                 }
+               else if (estimate->status == NODE_ESTIMATED)
+                 {
                                           /* store the deformation vector */
 
-                           eig1 = 0.0;
-                           if (Gglobals->trans_info.use_local_smoothing) 
-                             {
-                               eig1 = return_locally_smoothed_def(
-                                                                  Gglobals->trans_info.use_local_isotropic,
-                                                                  number_dimensions,
-                                                                  smoothing_weight,
-                                                                  iteration_weight,
-                                                                  result_def_vector,
-                                                                  current_def_vector,
-                                                                  mean_vector,
-                                                                  def_vector,
-                                                                  another_vector,
-                                                                  voxel_displacement);
-
-                                            /* Remember that I can't modify current_vol just
-                                             yet, so I have to set additional_vol to a value,
-                                             that when added to current_vol (below) I will
-                                             have the correct result!  */
-
-                               for(i=VIO_X; i<=VIO_Z; i++)
-                                 result_def_vector[ i ] -= current_def_vector[ i ];
-                               
-
-                               for(index[xyzv[VIO_Z+1]]=start[VIO_Z+1]; index[xyzv[VIO_Z+1]]<end[VIO_Z+1]; index[xyzv[VIO_Z+1]]++)  
-                                 {
-                                   set_volume_real_value(additional_vol,
-                                                         index[0],index[1],index[2],
-                                                         index[3],index[4],
-                                                         result_def_vector[index[ xyzv[VIO_Z+1]]]);
-                                   set_volume_real_value(another_vol,
-                                                         index[0],index[1],index[2],
-                                                         index[3],index[4],
-                                                         another_vector[ index[ xyzv[VIO_Z+1] ] ]);
-                                 }
-
-                             }
-                           else 
-                             {                /* then prepare for global smoothing, (this will
-                                           actually be done after all nodes 
-                                           have been estimated  */
-                               
-                               for(index[xyzv[VIO_Z+1]]=start[VIO_Z+1]; index[xyzv[VIO_Z+1]]<end[VIO_Z+1]; index[xyzv[VIO_Z+1]]++) 
-                                 set_volume_real_value(additional_vol,
-                                                       index[0],index[1],index[2],
-                                                       index[3],index[4],
-                                                       def_vector[ index[ xyzv[VIO_Z+1] ] ]);
-
-                             }
+                   for(index[xyzv[VIO_Z+1]]=start[VIO_Z+1]; index[xyzv[VIO_Z+1]]<end[VIO_Z+1]; index[xyzv[VIO_Z+1]]++)
+                     {
+                       set_volume_real_value(additional_vol,
+                                             index[0],index[1],index[2],
+                                             index[3],index[4],
+                                             estimate->additional[ index[ xyzv[VIO_Z+1] ] ]);
+                       if (globals->trans_info.use_local_smoothing)
+                         set_volume_real_value(another_vol,
+                                               index[0],index[1],index[2],
+                                               index[3],index[4],
+                                               estimate->another[ index[ xyzv[VIO_Z+1] ] ]);
+                     }
                                          /* store the def magnitude */
 
-                           set_volume_real_value(additional_mag,
-                                                 index[xyzv[VIO_X]],index[xyzv[VIO_Y]],index[xyzv[VIO_Z]],0,0,
-                                                 result);
+                   set_volume_real_value(additional_mag,
+                                         index[xyzv[VIO_X]],index[xyzv[VIO_Y]],index[xyzv[VIO_Z]],0,0,
+                                         estimate->result);
                                          /* set the 'node estimated' flag */
-                           set_volume_real_value(estimated_flag_vol,
-                                                 index[xyzv[VIO_X]],index[xyzv[VIO_Y]],index[xyzv[VIO_Z]],0,0,
-                                                 1.0);
-                           
+                   set_volume_real_value(estimated_flag_vol,
+                                         index[xyzv[VIO_X]],index[xyzv[VIO_Y]],index[xyzv[VIO_Z]],0,0,
+                                         1.0);
+
                                          /* tally up some statistics for this iteration */
-                           if (fabs(result) > 0.95*steps[xyzv[VIO_X]]) over++;
-                           
-                           nfunk_total += nfunks;
-                           nfunk1      += nfunks; 
-                           nodes1++;        
-                           nodes_done++;
-                           
-                           tally_stats(&stat_def_mag,   result);
-                           tally_stats(&stat_num_funks, nfunks);
-                           
-                         } /* of else (result<0) */
-
-                     } /* if get_average_warp_of_neighbours */
-            
-                   } /* point not masked and val in volume2 > threshold 2 */
-          
-            
-                 }  /* forless on Z index */
-          
-               update_progress_report( &progress, 
-                                       (end[VIO_Y]-start[VIO_Y])*(index[ xyzv[VIO_X]]-start[VIO_X])+
-                                       (index[ xyzv[VIO_Y]]-start[VIO_Y])+1 );
-             } /* forless on Y index */
+                   if (estimate->have_eig)
+                     {
+                       tally_stats(&stat_eigval0, estimate->eig_vals[0]);
+                       tally_stats(&stat_eigval1, estimate->eig_vals[1]);
+                       tally_stats(&stat_eigval2, estimate->eig_vals[2]);
+                       tally_stats(&stat_conf0, estimate->conf[0]);
+                       tally_stats(&stat_conf1, estimate->conf[1]);
+                       tally_stats(&stat_conf2, estimate->conf[2]);
+                     }
+
+                   if (fabs(estimate->result) > 0.95*steps[xyzv[VIO_X]]) over++;
+
+                   nfunk_total += estimate->nfunks;
+                   nfunk1      += estimate->nfunks;
+                   nodes1++;
+                   nodes_done++;
+
+                   tally_stats(&stat_def_mag,   estimate->result);
+                   tally_stats(&stat_num_funks, estimate->nfunks);
+
+                                         /* this node, and the neighbours
+                                            whose start depends on it, are
+                                            re-estimated next iteration */
+                   if (active_nodes != NULL &&
+                       fabs(estimate->result) > globals->nonlinear.active_tolerance)
+                     {
+                       for(i=0; i<3; i++)
+                         grid_node[i] = index[xyzv[i]] - start[i];
+                       mark_active_neighbourhood(next_active_nodes, grid_node, grid_size);
+                     }
+                 }
+
+               if ((node+1) % (end[VIO_Z]-start[VIO_Z]) == 0)
+                 update_progress_report( &progress,
+                                         (end[VIO_Y]-start[VIO_Y])*(index[ xyzv[VIO_X]]-start[VIO_X])+
+                                         (index[ xyzv[VIO_Y]]-start[VIO_Y])+1 );
+             }
+
            timer2 = time(NULL);
 
-           if (globals->flags.debug && globals->flags.verbose>1) 
+           if (globals->flags.debug && globals->flags.verbose>1)
              print ("xslice: (%3d:%3d) = %d sec -- nodes=%d av funks %f\n",
-                    index[ xyzv[VIO_X] ] +1-start[VIO_X], 
-                    end[VIO_X]-start[VIO_X], 
-                    timer2-timer1, 
+                    index[ xyzv[VIO_X] ] +1-start[VIO_X],
+                    end[VIO_X]-start[VIO_X],
+                    timer2-timer1,
                     nodes1,
                     nodes1==0? 0.0:(float)nfunk1/(float)nodes1);
-      
+
          } /* forless on X index */
 
        if (globals->flags.debug) 
@@ -1397,8 +1563,8 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
            stat_title();
            report_stats(&stat_num_funks);
            report_stats(&stat_def_mag);
-           if (Gglobals->trans_info.use_local_smoothing && 
-               !Gglobals->trans_info.use_local_isotropic) 
+           if (globals->trans_info.use_local_smoothing && 
+               !globals->trans_info.use_local_isotropic) 
              {
                report_stats(&stat_eigval0);
                report_stats(&stat_eigval1);
@@ -1408,15 +1574,25 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
                report_stats(&stat_conf2);
           
              }
-           if (!Gglobals->trans_info.use_simplex) 
+           if (!globals->trans_info.use_simplex) 
              {
+               memset(&quad_stats, 0, sizeof(Quad_Fit_Stats));
+               for(i=0; i<n_threads; i++) 
+                 {
+                   quad_stats.total += contexts[i]->quad_stats.total;
+                   quad_stats.plus  += contexts[i]->quad_stats.plus;
+                   quad_stats.semi  += contexts[i]->quad_stats.semi;
+                   quad_stats.zero  += contexts[i]->quad_stats.zero;
+                   quad_stats.two   += contexts[i]->quad_stats.two;
+                   quad_stats.minus += contexts[i]->quad_stats.minus;
+                 }
                print ("quad fit stats: tot + ~ 0 2 -: %5d %5d %5d %5d %5d %5d\n",
-                      stat_quad_total,
-                      stat_quad_plus,
-                      stat_quad_semi,
-                      stat_quad_zero,
-                      stat_quad_two,
-                      stat_quad_minus);
+                      quad_stats.total,
+                      quad_stats.plus,
+                      quad_stats.semi,
+                      quad_stats.zero,
+                      quad_stats.two,
+                      quad_stats.minus);
              }
        
            print ("Nodes seen = %d: [no def = %d], [w/def = %d (over = %d)]\n",
@@ -1445,21 +1621,21 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
          }
 
 
-       if (Gglobals->trans_info.use_local_smoothing && 
-           !Gglobals->trans_info.use_local_isotropic) 
+       if (globals->trans_info.use_local_smoothing && 
+           !globals->trans_info.use_local_isotropic) 
          {
-           previous_mean_eig_val[0] = stat_get_mean(&stat_eigval0);
-           previous_mean_eig_val[1] = stat_get_mean(&stat_eigval1);
-           previous_mean_eig_val[2] = stat_get_mean(&stat_eigval2);
-           previous_std_eig_val[0]  = stat_get_standard_deviation(&stat_eigval0);
-           previous_std_eig_val[1]  = stat_get_standard_deviation(&stat_eigval1);
-           previous_std_eig_val[2]  = stat_get_standard_deviation(&stat_eigval2);
+           nl->previous_mean_eig_val[0] = stat_get_mean(&stat_eigval0);
+           nl->previous_mean_eig_val[1] = stat_get_mean(&stat_eigval1);
+           nl->previous_mean_eig_val[2] = stat_get_mean(&stat_eigval2);
+           nl->previous_std_eig_val[0]  = stat_get_standard_deviation(&stat_eigval0);
+           nl->previous_std_eig_val[1]  = stat_get_standard_deviation(&stat_eigval1);
+           nl->previous_std_eig_val[2]  = stat_get_standard_deviation(&stat_eigval2);
          }
                                          /* update the current warp, so that the
                                            next iteration will use all the data
                                            calculated thus far.           */
        
-       if (Gglobals->trans_info.use_local_smoothing) 
+       if (globals->trans_info.use_local_smoothing) 
          {
            /* extrapolate (and smooth) the newly estimated deformation vectors
               (stored in additional vol) to un-estimated nodes, leaving the
@@ -1471,7 +1647,9 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
            
            extrapolate_to_unestimated_nodes(current_warp,
                                             additional_warp,
-                                            estimated_flag_vol);
+                                            estimated_flag_vol,
+                                            globals->nonlinear.extrapolation_waves,
+                                            n_threads);
            if (globals->flags.debug) 
              report_time(temp_start_time, "TIME:Extrapolating the current warp");
            
@@ -1497,7 +1675,7 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
            temp_start_time = time(NULL);
            add_additional_warp_to_current(additional_warp,
                                           current_warp,
-                                           iteration_weight);
+                                           nl->iteration_weight);
            if (globals->flags.debug) 
              report_time(temp_start_time, "TIME:Adding additional to current");
        
@@ -1511,11 +1689,13 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
            
            smooth_the_warp(another_warp, /* try smoothing twice to get better def fields? or we could smooth once, and then use Pierrick's nlmeans*/
                            additional_warp,
-                            additional_mag, -1.0);
+                            additional_mag, -1.0, nl->smoothing_weight,
+                            n_threads);
 
            smooth_the_warp(current_warp,   
                            another_warp,
-                            additional_mag, -1.0);
+                            additional_mag, -1.0, nl->smoothing_weight,
+                            n_threads);
            
            if (globals->flags.debug) 
               report_time(temp_start_time, "TIME:Smoothing the current warp");
@@ -1528,21 +1708,85 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
 
        init_the_volume_to_zero(additional_vol);
        init_the_volume_to_zero(additional_mag);
+
+                                /* and its active nodes */
+       if (active_nodes != NULL) 
+         {
+           unsigned char *tmp_active;
+
+           tmp_active        = active_nodes;
+           active_nodes      = next_active_nodes;
+           next_active_nodes = tmp_active;
+
+           n_active = 0;
+           for(i=0; i<(long)grid_size[VIO_X] * grid_size[VIO_Y] * grid_size[VIO_Z]; i++) 
+             {
+               if (active_nodes[i]) n_active++;
+               next_active_nodes[i] = FALSE;
+             }
+         }
  
  
        if (globals->flags.debug && 
            globals->flags.verbose == 3) {
 
          save_data(globals->filenames.output_trans, 
-                   iters+1, iteration_limit,  
+                   iters+1, nl->iteration_limit,  
                    globals->trans_info.transformation);
          
        }
 
+                                /* stop when the field no longer changes:
+                                   -nonlinear_tol on the mean additional
+                                   deformation of the estimated nodes,
+                                   -nonlinear_xcorr_tol on the improvement
+                                   of the global xcorr, met for
+                                   -nonlinear_patience iterations in a row */
+
+       if (globals->nonlinear.tolerance > 0.0 || globals->nonlinear.xcorr_tolerance > 0.0) 
+         {
+           VIO_BOOL converged = FALSE;
+
+           if (globals->nonlinear.tolerance > 0.0) 
+             {
+               mean_disp_mag = (stat_def_mag.count > 0) ? stat_get_mean(&stat_def_mag) : 0.0;
+               if (mean_disp_mag < globals->nonlinear.tolerance) 
+                 {
+                   converged = TRUE;
+                   (void)sprintf(stop_reason, "mean additional deformation %f < %f mm",
+                                 mean_disp_mag, globals->nonlinear.tolerance);
+                 }
+             }
+
+           if (globals->nonlinear.xcorr_tolerance > 0.0) 
+             {
+               globals->final_corr = xcorr_objective_with_def(globals->features.data[0], globals->features.model[0],
+                                                              globals->features.data_mask[0], globals->features.model_mask[0],
+                                                              globals );
+               if (globals->final_corr - previous_corr < globals->nonlinear.xcorr_tolerance) 
+                 {
+                   converged = TRUE;
+                   (void)sprintf(stop_reason, "xcorr improvement %f < %f",
+                                 globals->final_corr - previous_corr, globals->nonlinear.xcorr_tolerance);
+                 }
+               previous_corr = globals->final_corr;
+             }
+
+           converged_iterations = converged ? converged_iterations+1 : 0;
+
+           if (converged_iterations >= globals->nonlinear.patience && iters+1 < nl->iteration_limit) 
+             {
+               stopped = TRUE;
+               if (globals->flags.verbose>0)
+                 print ("Stopping after iteration %d of %d: %s for %d iteration(s)\n",
+                        iters+1, nl->iteration_limit, stop_reason, converged_iterations);
+             }
+         }
+
                                 /* re-apply intensity normalization if doing
                                    optical flow fitting. */
 
-       if (iters+1 < iteration_limit) 
+       if (iters+1 < nl->iteration_limit && !stopped) 
          {
            for(i=0; i<globals->features.number_of_features; i++) 
              {
@@ -1563,15 +1807,25 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
              }
          }
 
+                                /* save the state of the fit; once stopped,
+                                   the level is saved as complete */
+       if (globals->nonlinear.checkpoint_dir != NULL &&
+           ((iters+1) % globals->nonlinear.checkpoint_interval == 0 ||
+            iters+1 == nl->iteration_limit || stopped))
+         (void)write_nonlinear_checkpoint(nl, current_vol, 
+                                          stopped ? nl->iteration_limit : iters+1,
+                                          converged_iterations, previous_corr, active_nodes,
+                                          (long)grid_size[VIO_X] * grid_size[VIO_Y] * grid_size[VIO_Z]);
+
        if (globals->flags.debug) 
          {
            
            
-           final_corr = xcorr_objective_with_def(Gglobals->features.data[0], Gglobals->features.model[0],
-                                                 Gglobals->features.data_mask[0], Gglobals->features.model_mask[0],
-                                                 globals );
+           globals->final_corr = xcorr_objective_with_def(globals->features.data[0], globals->features.model[0],
+                                                          globals->features.data_mask[0], globals->features.model_mask[0],
+                                                          globals );
            print("initial corr %f ->  this step %f\n",
-                 initial_corr,final_corr);
+                 globals->initial_corr,globals->final_corr);
            
            report_time(iteration_start_time, "TIME:This iteration");
            
@@ -1580,7 +1834,8 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
 
        terminate_progress_report( &progress );
 
-
+       if (stopped)
+         break;
      }
   
 
@@ -1590,11 +1845,18 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
                                    haven't already done so just above in
                                    the debug statement */
    if (!globals->flags.debug)
-     final_corr = xcorr_objective_with_def(Gglobals->features.data[0], 
-                                           Gglobals->features.model[0],
-                                           Gglobals->features.data_mask[0], 
-                                           Gglobals->features.model_mask[0],
-                                           globals );
+     globals->final_corr = xcorr_objective_with_def(globals->features.data[0], 
+                                                    globals->features.model[0],
+                                                    globals->features.data_mask[0], 
+                                                    globals->features.model_mask[0],
+                                                    globals );
+
+   if (globals->nonlinear.check_xcorr)
+     check_xcorr_objective_with_def(globals->features.data[0], 
+                                    globals->features.model[0],
+                                    globals->features.data_mask[0], 
+                                    globals->features.model_mask[0],
+                                    globals );
    
 
 
@@ -1605,8 +1867,9 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
 
    if (globals->trans_info.use_super>0) 
      {
-       delete_general_transform(Gsuper_sampled_warp);
-       FREE(Gsuper_sampled_warp);
+       delete_general_transform(nl->super_sampled_warp);
+       FREE(nl->super_sampled_warp);
+       delete_super_sampled_source(&super_source);
      }
 
    (void)delete_general_transform(additional_warp);
@@ -1616,12 +1879,28 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
    FREE(another_warp); 
 
   
-   if (Gglobals->features.number_of_features>0) 
+   if (globals->features.number_of_features>0) 
      {
-       VIO_FREE2D(Ga1_features);
-       VIO_FREE2D(masked_samples_in_source);
-       FREE(Gsqrt_features);
+       for(i=0; i<n_threads; i++)
+         delete_node_context(contexts[i], globals->features.number_of_features);
+       FREE(contexts);
+       delete_sub_lattice_template(nl);
      }
+   if (globals->flags.debug && nl->source_cache.n_cached > 0)
+     print ("Source sample cache: %ld nodes, %.1f Mb\n",
+            nl->source_cache.n_cached,
+            (double)nl->source_cache.n_bytes / (1024.0*1024.0));
+   delete_source_sample_cache(&(nl->source_cache));
+   delete_optical_flow_data(nl);
+   if (nl->mask_world_to_voxel != NULL)
+     FREE(nl->mask_world_to_voxel);
+   FREE(eligible_nodes);
+   if (active_nodes != NULL) 
+     {
+       FREE(active_nodes);
+       FREE(next_active_nodes);
+     }
+   FREE(slice_estimates);
  
    delete_general_transform(all_until_last);
    FREE(all_until_last);
@@ -1629,14 +1908,6 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
    delete_volume(additional_mag);
    delete_volume(estimated_flag_vol);
 
-   FREE(TX );
-   FREE(TY );
-   FREE(TZ );
-   FREE(SX );
-   FREE(SY );
-   FREE(SZ );
-    
-
 
    return (VIO_OK);
 
@@ -1644,6 +1915,373 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
 
 
 
+/* flag node[0..2] of a grid of size[0..2] nodes as active, along with
+   its 26 neighbours (node ids are numbered X slowest, Z fastest) */
+
+static void mark_active_neighbourhood(unsigned char *active,
+                                      int node[], int size[])
+{
+  int i,j,k;
+
+  for(i=node[VIO_X]-1; i<=node[VIO_X]+1; i++) {
+    if (i<0 || i>=size[VIO_X]) continue;
+    for(j=node[VIO_Y]-1; j<=node[VIO_Y]+1; j++) {
+      if (j<0 || j>=size[VIO_Y]) continue;
+      for(k=node[VIO_Z]-1; k<=node[VIO_Z]+1; k++) {
+        if (k<0 || k>=size[VIO_Z]) continue;
+        active[ ((long)i*size[VIO_Y] + j)*size[VIO_Z] + k ] = TRUE;
+      }
+    }
+  }
+}
+
+
+
+/* is (wx,wy,wz), the target position of a node, inside the target mask
+   of one of the features and above threshold2 in the target volume?
+   This is point_not_masked() and get_value_of_point_in_volume(), with
+   the world to voxel transforms kept in nl. */
+
+static VIO_BOOL target_position_is_eligible(Nonlinear_Context *nl,
+                                            VIO_Real wx, VIO_Real wy, VIO_Real wz,
+                                            VIO_Real threshold2)
+{
+  Arg_Data
+    *globals = nl->globals;
+  VIO_Real
+    (*m)[4],
+    v[3],
+    value;
+  PointR
+    voxel;
+  int
+    i, ff;
+  VIO_BOOL
+    not_masked;
+
+  not_masked = FALSE;
+  for(ff=0; ff<globals->features.number_of_features && !not_masked; ff++) {
+    if (globals->features.model_mask[ff] == NULL) 
+      not_masked = TRUE;
+    else {
+      m = nl->mask_world_to_voxel[ff];
+      for(i=0; i<3; i++)
+        v[i] = m[i][0]*wx + m[i][1]*wy + m[i][2]*wz + m[i][3];
+      not_masked = voxel_point_not_masked(globals->features.model_mask[ff], v[0], v[1], v[2]);
+    }
+  }
+
+  if (!not_masked)
+    return(FALSE);
+
+  m = nl->target_world_to_voxel;
+  for(i=0; i<3; i++)
+    v[i] = m[i][0]*wx + m[i][1]*wy + m[i][2]*wz + m[i][3];
+  fill_Point(voxel, v[0], v[1], v[2]);
+
+  if (!trilinear_interpolant(globals->features.model[0], &voxel, &value))
+    return(FALSE);
+
+  return(value > threshold2);
+}
+
+
+/* flag the active nodes (all nodes if active==NULL) of the grid whose
+   current target position passes the mask and threshold tests of
+   target_position_is_eligible(); the others are not estimated in this
+   iteration.  Node ids are numbered X slowest, Z fastest.  Returns the
+   number of eligible nodes. */
+
+static long mark_eligible_nodes(Nonlinear_Context *nl,
+                                VIO_Volume current_vol,
+                                int xyzv[], int start[], int end[],
+                                VIO_Real threshold2,
+                                unsigned char *active,
+                                unsigned char *eligible,
+                                int n_threads)
+{
+  long
+    n_eligible;
+  int
+    x;
+
+  n_eligible = 0;
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(n_threads) schedule(dynamic) reduction(+:n_eligible)
+#endif
+  for(x=start[VIO_X]; x<end[VIO_X]; x++) {
+    int
+      i, y, z,
+      index[VIO_MAX_DIMENSIONS];
+    long
+      node;
+    VIO_Real
+      voxel[VIO_MAX_DIMENSIONS],
+      world[3];
+
+    for(i=0; i<VIO_MAX_DIMENSIONS; i++) index[i]=0;
+    index[ xyzv[VIO_X] ] = x;
+
+    for(y=start[VIO_Y]; y<end[VIO_Y]; y++) {
+      for(z=start[VIO_Z]; z<end[VIO_Z]; z++) {
+
+        node = ((long)(x-start[VIO_X]) * (end[VIO_Y]-start[VIO_Y]) + (y-start[VIO_Y])) *
+          (end[VIO_Z]-start[VIO_Z]) + (z-start[VIO_Z]);
+
+        eligible[node] = FALSE;
+        if (active != NULL && !active[node])
+          continue;
+
+        index[ xyzv[VIO_Y] ] = y;
+        index[ xyzv[VIO_Z] ] = z;
+        index[ xyzv[VIO_Z+1] ] = 0;
+        for(i=0; i<VIO_MAX_DIMENSIONS; i++) voxel[i]=index[i];
+
+        convert_voxel_to_world(current_vol, voxel,
+                               &(world[VIO_X]), &(world[VIO_Y]), &(world[VIO_Z]));
+
+                                /* add the warp to get the target 
+                                   lattice position in world coords */
+        for(i=0; i<3; i++) {
+          index[ xyzv[VIO_Z+1] ] = i;
+          world[i] += get_volume_real_value(current_vol,
+                                            index[0],index[1],index[2],index[3],index[4]);
+        }
+
+        if (target_position_is_eligible(nl, world[VIO_X], world[VIO_Y], world[VIO_Z], threshold2)) {
+          eligible[node] = TRUE;
+          n_eligible++;
+        }
+      }
+    }
+  }
+
+  return(n_eligible);
+}
+
+
+/* allocate the sub-lattice storage needed to estimate one node at a time,
+   for the features of the fit described by nl */
+
+static Node_Context *create_node_context(Nonlinear_Context *nl, int max_len)
+{
+  Node_Context *context;
+  int i, number_of_features;
+
+  number_of_features = nl->globals->features.number_of_features;
+
+  ALLOC(context, 1);
+
+  context->nl = nl;
+  context->node = -1;
+  memset(&context->quad_stats, 0, sizeof(Quad_Fit_Stats));
+
+  VIO_ALLOC2D(context->a1_features,    number_of_features, max_len);
+  VIO_ALLOC2D(context->masked_samples, number_of_features, max_len);
+  ALLOC(context->sqrt_features, number_of_features);
+
+  ALLOC(context->SX, max_len);        /* coordinates in source volume  */
+  ALLOC(context->SY, max_len);
+  ALLOC(context->SZ, max_len);
+  ALLOC(context->TX, max_len);        /* and coordinates in target volume  */
+  ALLOC(context->TY, max_len);
+  ALLOC(context->TZ, max_len);
+  ALLOC(context->VX, max_len);        /* and source voxel coordinates  */
+  ALLOC(context->VY, max_len);
+  ALLOC(context->VZ, max_len);
+
+  ALLOC(context->target_index,   max_len);
+  ALLOC(context->target_inside,  max_len);
+  for(i=0; i<8; i++)
+    ALLOC(context->target_weight[i], max_len);
+  ALLOC(context->target_samples, max_len);
+  ALLOC(context->target_active,  max_len);
+  ALLOC(context->feature_sim,    number_of_features);
+
+  context->len = 0;
+  context->target_sample_count = 0;
+  context->have_eig = FALSE;
+
+  return(context);
+}
+
+static void delete_node_context(Node_Context *context, int number_of_features)
+{
+  int i;
+
+  VIO_FREE2D(context->a1_features);
+  VIO_FREE2D(context->masked_samples);
+  FREE(context->sqrt_features);
+
+  FREE(context->SX);
+  FREE(context->SY);
+  FREE(context->SZ);
+  FREE(context->TX);
+  FREE(context->TY);
+  FREE(context->TZ);
+  FREE(context->VX);
+  FREE(context->VY);
+  FREE(context->VZ);
+
+  FREE(context->target_index);
+  FREE(context->target_inside);
+  for(i=0; i<8; i++)
+    FREE(context->target_weight[i]);
+  FREE(context->target_samples);
+  FREE(context->target_active);
+  FREE(context->feature_sim);
+
+  FREE(context);
+}
+
+
+/* estimate the additional deformation needed at the node index[] of
+   current_warp.  Nothing global is modified here: the result is left
+   in *estimate, so that this may be called for several nodes at once,
+   as long as each thread uses its own *context. */
+
+static void estimate_deformation_of_node(Node_Context *context,
+                                         Node_Estimate *estimate,
+                                         int index[],
+                                         int xyzv[],
+                                         int start[],
+                                         int end[],
+                                         VIO_General_transform *current_warp,
+                                         VIO_Real spacing,
+                                         VIO_Real threshold1,
+                                         int iteration,
+                                         int ndim,
+                                         VIO_BOOL sub_lattice_needed)
+{
+  VIO_Volume
+    current_vol;
+  VIO_Real
+    voxel[VIO_MAX_DIMENSIONS],
+    current_def_vector[3],        /* the current deformation vector for a  node    */
+    result_def_vector[3],        /* the smoothed deformation vector for a node    */
+    def_vector[3],                /* the additional deformation estimated for node */
+    another_vector[3],
+    voxel_displacement[VIO_N_DIMENSIONS],
+    source_node[3],                /* world coordinate of source node               */
+    target_node[3],                /* world coordinate of corresponding target node */
+    mean_target[3],                /* mean deformed pos, determined by neighbors    */
+    mean_vector[3],                /* mean deformed vector, determined by neighbors */
+    result;
+  int
+    i, nfunks;
+  Nonlinear_Context
+    *nl = context->nl;
+
+  estimate->status   = NODE_NOT_ESTIMATED;
+  estimate->nfunks   = 0;
+  estimate->result   = 0.0;
+  estimate->have_eig = FALSE;
+
+  current_vol = current_warp->displacement_volume;
+
+  for(i=0; i<3; i++) {
+    current_def_vector[i] = 0.0;
+    another_vector[i] = 0.0;
+  }
+                                        /* get the lattice coordinate 
+                                           of the current index node  */
+  for(i=0; i<VIO_MAX_DIMENSIONS; i++) voxel[i]=index[i];
+
+  convert_voxel_to_world(current_vol, 
+                         voxel,
+                         &(target_node[VIO_X]), &(target_node[VIO_Y]), &(target_node[VIO_Z]));
+
+  for(index[xyzv[VIO_Z+1]]=start[VIO_Z+1]; index[xyzv[VIO_Z+1]]<end[VIO_Z+1]; index[xyzv[VIO_Z+1]]++) 
+    current_def_vector[ index[ xyzv[VIO_Z+1] ] ] = 
+      get_volume_real_value(current_vol,
+                            index[0],index[1],index[2],index[3],index[4]);
+
+                                /* the node passed the target mask and
+                                   threshold tests of mark_eligible_nodes();
+                                   now get the mean warped position of 
+                                   the target's neighbours */
+  index[ xyzv[VIO_Z+1] ] = 0;
+  if (!get_average_warp_of_neighbours(current_warp, index, mean_target))
+    return;
+
+                                /* what is the offset to the mean_target? */
+  for(i=VIO_X; i<=VIO_Z; i++)
+    mean_vector[i] = mean_target[i] - target_node[i];
+
+                                /* get the targets homolog in the
+                                   world coord system of the source
+                                   data volume                      */
+  general_inverse_transform_point(nl->linear_transform,
+                                  target_node[VIO_X], target_node[VIO_Y], target_node[VIO_Z],
+                                  &(source_node[VIO_X]),&(source_node[VIO_Y]),&(source_node[VIO_Z])); 
+
+                                /* find the best deformation for
+                                   this node                        */
+  result = get_deformation_vector_for_node(context,
+                                           spacing, 
+                                           threshold1,
+                                           source_node,
+                                           mean_target,
+                                           def_vector,
+                                           voxel_displacement,
+                                           iteration, nl->iteration_limit, 
+                                           &nfunks,
+                                           ndim,
+                                           sub_lattice_needed);
+
+  if (result < 0.0) {
+    estimate->status = NODE_NO_DEF;
+    return;
+  }
+
+  if (nl->globals->trans_info.use_local_smoothing) {
+
+    context->have_eig = FALSE;
+    (void)return_locally_smoothed_def(context,
+                                      nl->globals->trans_info.use_local_isotropic,
+                                      nl->number_dimensions,
+                                      nl->smoothing_weight,
+                                      nl->iteration_weight,
+                                      result_def_vector,
+                                      current_def_vector,
+                                      mean_vector,
+                                      def_vector,
+                                      another_vector,
+                                      voxel_displacement);
+
+                                /* Remember that I can't modify current_vol just
+                                   yet, so I have to set additional_vol to a value,
+                                   that when added to current_vol (below) I will
+                                   have the correct result!  */
+    for(i=VIO_X; i<=VIO_Z; i++) {
+      estimate->additional[i] = result_def_vector[i] - current_def_vector[i];
+      estimate->another[i]    = another_vector[i];
+    }
+
+    if (context->have_eig) {
+      estimate->have_eig = TRUE;
+      for(i=0; i<3; i++) {
+        estimate->eig_vals[i] = context->eig_vals[i];
+        estimate->conf[i]     = context->conf[i];
+      }
+    }
+  }
+  else {                        /* then prepare for global smoothing, (this will
+                                   actually be done after all nodes 
+                                   have been estimated  */
+    for(i=VIO_X; i<=VIO_Z; i++) {
+      estimate->additional[i] = def_vector[i];
+      estimate->another[i]    = 0.0;
+    }
+  }
+
+  estimate->status = NODE_ESTIMATED;
+  estimate->result = result;
+  estimate->nfunks = nfunks;
+}
+
+
 /*   look though the list of object functions requested,
      and set is_a_sub_lattice_needed=TRUE if any obj function
      is used other than Optical Flow
@@ -1723,7 +2361,7 @@ static VIO_BOOL is_a_sub_lattice_needed (char obj_func[],
 
 /* return a value representing confidence, with the value between 0 and 1 */
 
-static double confidence_function(double x) {
+static double confidence_function(Nonlinear_Context *nl, double x) {
 
   
   double t;
@@ -1732,23 +2370,23 @@ static double confidence_function(double x) {
   t = 0.5;
                                 /* double linear */
   if 
-    (x > previous_mean_eig_val[0]) t = 1.0;
+    (x > nl->previous_mean_eig_val[0]) t = 1.0;
   else { 
     if  
 
-      (x < previous_mean_eig_val[2]) t = 0.0;
+      (x < nl->previous_mean_eig_val[2]) t = 0.0;
 
     else {
 
-      if (x > previous_mean_eig_val[1]) /* first linear part */
+      if (x > nl->previous_mean_eig_val[1]) /* first linear part */
 
-        t = 0.5 + 0.5 * (x -  previous_mean_eig_val[1]) / 
-          (  previous_mean_eig_val[0] - previous_mean_eig_val[1]);
+        t = 0.5 + 0.5 * (x -  nl->previous_mean_eig_val[1]) / 
+          (  nl->previous_mean_eig_val[0] - nl->previous_mean_eig_val[1]);
 
       else                              /* second linear part */
 
-        t = 0.5 * (x -  previous_mean_eig_val[2]) / 
-          (  previous_mean_eig_val[1] - previous_mean_eig_val[2]);
+        t = 0.5 * (x -  nl->previous_mean_eig_val[2]) / 
+          (  nl->previous_mean_eig_val[1] - nl->previous_mean_eig_val[2]);
 
     }
   }
@@ -1757,7 +2395,8 @@ static double confidence_function(double x) {
 
 }
 
-static double return_locally_smoothed_def(int isotropic_smoothing,
+static double return_locally_smoothed_def(Node_Context *context,
+                                           int isotropic_smoothing,
                                            int  ndim,
                                            VIO_Real smoothing_wght,
                                            VIO_Real iteration_wght,
@@ -1784,7 +2423,7 @@ static double return_locally_smoothed_def(int isotropic_smoothing,
     flag,i,j,k;
 
   float 
-    pos_vector[4];
+    stencil_disp[3];
 
   eps = 0.0001; /* SMALL_EPSILON_VALUE*/
   eig_vals[0] = 0.0;
@@ -1828,8 +2467,8 @@ static double return_locally_smoothed_def(int isotropic_smoothing,
     /* use a quadratic approximation to the objective function around
        the local neighbourhood to determine the smoothing directions.
        This will use the global information already stored for
-       evaluation of the similarity function, with the exception of
-       one change: TX, TY, TZ store the voxel coordinates of the
+       evaluation of the similarity function (in *context), with the
+       exception of one change: TX, TY, TZ store the voxel coordinates of the
        target lattice centered on the previous target node (remember
        that TX holds the slowest varying data index).  These values
        have to be updated with the value in voxel_displacement in
@@ -1841,10 +2480,10 @@ static double return_locally_smoothed_def(int isotropic_smoothing,
       voxel_displacement[i] *= iteration_wght;
     }
                       /* update target lattice position */
-    for(i=1; i<Glen; i++) {
-      TX[i] += voxel_displacement[2]; /* slowest varying index for data */
-      TY[i] += voxel_displacement[1];
-      TZ[i] += voxel_displacement[0]; /* fastest index */
+    for(i=1; i<context->len; i++) {
+      context->TX[i] += voxel_displacement[2]; /* slowest varying index for data */
+      context->TY[i] += voxel_displacement[1];
+      context->TZ[i] += voxel_displacement[0]; /* fastest index */
     }
 
     flag = FALSE;
@@ -1859,20 +2498,17 @@ static double return_locally_smoothed_def(int isotropic_smoothing,
       /* build up the 3x3x3 matrix of local correlation values,
          and get the principal directions */
 
-      Smin = DBL_MAX;
       for(i=-1; i<=1; i++)
-        for(j=-1; j<=1; j++)
-          for(k=-1; k<=1; k++) {
-            pos_vector[1] = (float) (i * Gsimplex_size)/2.0;
-            pos_vector[2] = (float) (j * Gsimplex_size)/2.0;
-            pos_vector[3] = (float) (k * Gsimplex_size)/2.0;
-
-            local_corr3D[i+1][j+1][k+1] = local_objective_function(pos_vector); 
+        stencil_disp[i+1] = (float) (i * context->nl->simplex_size)/2.0;
 
-            if ( local_corr3D[i+1][j+1][k+1] < Smin)
-              Smin = local_corr3D[i+1][j+1][k+1];
+      local_objective_stencil(context, stencil_disp, ndim, local_corr3D);
 
-          }
+      Smin = DBL_MAX;
+      for(i=0; i<3; i++)
+        for(j=0; j<3; j++)
+          for(k=0; k<3; k++)
+            if ( local_corr3D[i][j][k] < Smin)
+              Smin = local_corr3D[i][j][k];
 
       flag = return_local_eigen_from_hessian(local_corr3D, 
                                              eig_vecs[0], eig_vecs[1], eig_vecs[2], eig_vals);
@@ -1884,14 +2520,15 @@ static double return_locally_smoothed_def(int isotropic_smoothing,
 
 
       for(i=0; i<3; i++)
-        conf[i] = confidence_function( eig_vals[i] );
-
-      tally_stats(&stat_eigval0, eig_vals[0]);
-      tally_stats(&stat_eigval1, eig_vals[1]);
-      tally_stats(&stat_eigval2, eig_vals[2]);
-      tally_stats(&stat_conf0, conf[0]);
-      tally_stats(&stat_conf1, conf[1]);
-      tally_stats(&stat_conf2, conf[2]);
+        conf[i] = confidence_function( context->nl, eig_vals[i] );
+
+                                /* keep them for the stats, tallied by
+                                   the caller in node order */
+      context->have_eig = TRUE;
+      for(i=0; i<3; i++) {
+        context->eig_vals[i] = eig_vals[i];
+        context->conf[i]     = conf[i];
+      }
                 
                                 /* project the diff onto each of the 
                                    eigen vecs [i] */
@@ -1955,6 +2592,7 @@ static double return_locally_smoothed_def(int isotropic_smoothing,
 */
 
 static VIO_BOOL get_best_start_from_neighbours(
+                           Nonlinear_Context *nl,
                            VIO_Real threshold1, 
                            VIO_Real source[],
                            VIO_Real mean_target[],
@@ -1968,7 +2606,7 @@ static VIO_BOOL get_best_start_from_neighbours(
 
 
   mag_normal1 = get_value_of_point_in_volume(source[VIO_X],source[VIO_Y],source[VIO_Z], 
-                                             Gglobals->features.data[0]);
+                                             nl->globals->features.data[0]);
 
   if (mag_normal1 < threshold1)
     return(FALSE);        
@@ -1978,7 +2616,7 @@ static VIO_BOOL get_best_start_from_neighbours(
 
 /* possible problem: does the following work for a 2D grid transformation? 
  */
-    general_transform_point(Gglobals->trans_info.transformation, 
+    general_transform_point(nl->globals->trans_info.transformation, 
                             source[VIO_X],source[VIO_Y],source[VIO_Z], 
                             &(target[VIO_X]),&(target[VIO_Y]),&(target[VIO_Z]));
 
@@ -1997,111 +2635,6 @@ static VIO_BOOL get_best_start_from_neighbours(
   }  
 }
 
-/* use optical flow to compute the deformation (def_vector) required
-to warp the source_coord onto the mean_target using the intensities of
-the source_coord in the source volume and the mean_target coord in the
-target volume, as well as the 1st intensity derivatives in the source
-volume.  
-
-inputs:
-    threshold1,
-    source_coord
-    mean_target
-    ndim
-
-outputs:
-    def_vector         (in world coords)
-    voxel_displacement (in voxel coords)
-    num_functions      (for number of function evaluations)
-
-Based on Horn and Schunck Artificial Intell 17 (1981) 185-203
-*/
-
-#define Min_deriv  0.02
-
-static VIO_Real get_optical_flow_vector(VIO_Real threshold1, 
-                                     VIO_Real source_coord[],
-                                     VIO_Real mean_target[],
-                                     VIO_Real def_vector[],
-                                     VIO_Real voxel_displacement[],
-                                     VIO_Volume data,
-                                     VIO_Volume model,
-                                     int ndim)
-{ 
-  VIO_Real
-    val[VIO_MAX_DIMENSIONS],        /* the interpolated intensity value     */
-    result,                        /* the magnitude of the estimated def   */
-    min,max,thresh,             /* volume real min, max and estimate on smallest
-                                   derivative */
-    xp, yp, zp,                        /* temp storage for coordinate position */
-    mag,
-    dx[VIO_MAX_DIMENSIONS],                /* derivative in X (world-coord)        */
-    dy[VIO_MAX_DIMENSIONS],                /*     "         Y                      */
-    dz[VIO_MAX_DIMENSIONS],                /*     "         Z                      */
-    steps[VIO_MAX_DIMENSIONS];
-  int
-    i;                                /* a counter                            */
-
-    get_volume_separations(data, steps);
-  
-    xp = mean_target[0];        /* get intensity and derivatives        */
-    yp = mean_target[1];        /* in target volume                     */
-    zp = mean_target[2];
-    evaluate_volume_in_world(model,
-                             xp, yp, zp,
-                             0, TRUE, 0.0, val,
-                             dx,dy,dz,
-                             NULL,NULL,NULL,NULL,NULL,NULL);
-    Gproj_d2 = val[0];
-    
-    xp = source_coord[0];        /* get intensity only                   */
-    yp = source_coord[1];        /* in source volume                     */
-    zp = source_coord[2];
-    evaluate_volume_in_world(data,
-                             xp, yp, zp,
-                             0, TRUE, 0.0, val,
-                             NULL,NULL,NULL,
-                             NULL,NULL,NULL,
-                             NULL,NULL,NULL);
-    Gproj_d1 = val[0];
-    
-                                /* compute deformations directly!       */
-
-    thresh = Min_deriv * (get_volume_real_max(data) - get_volume_real_min(data)); 
-				/* should compute a better
-				   threshold value here, possibly based on a histogram of the
-				   grandient magnitudes across the 3D lattice. */
-
-    mag = sqrt (dx[0]*dx[0] + dy[0]*dy[0] + dz[0]*dz[0]);
-      
-
-    if (fabs(dx[0]) > thresh)   /* fastest (X) */
-      def_vector[0] = ((Gproj_d1 - Gproj_d2) /  dx[0]);
-    else
-      def_vector[0] = 0.0;
-    
-    if (fabs(dy[0]) > thresh)
-      def_vector[1] = ((Gproj_d1 - Gproj_d2) /  dy[0]);
-    else
-      def_vector[1] = 0.0;
-    
-    if (fabs(dz[0]) > thresh && ndim==3)  /* slowest  (Z) */
-      def_vector[2] = ((Gproj_d1 - Gproj_d2) /  dz[0]);
-    else
-      def_vector[2] = 0.0;
-    
-    
-    for(i=0; i<3; i++)            /* build the real-world displacement */
-      voxel_displacement[i] = def_vector[i]  * steps[i];
-    
-    result = sqrt (def_vector[0]*def_vector[0] +
-                   def_vector[1]*def_vector[1] +
-                   def_vector[2]*def_vector[2]);
-    
-    return(result);
-
-}
-
 /* compute the deformation only if the source_coord is on a surface voxel
 
    use the chamfer volume (an approximation for distance) to determine how
@@ -2121,7 +2654,8 @@ static VIO_Real get_optical_flow_vector(VIO_Real threshold1,
 
 #define MAX_CAPTURE 3.8                
 
-static VIO_Real get_chamfer_vector(VIO_Real capture_limit, 
+static VIO_Real get_chamfer_vector(Nonlinear_Context *nl,
+                                VIO_Real capture_limit, 
                                 VIO_Real source_coord[],
                                 VIO_Real mean_target[],
                                 VIO_Real def_vector[],
@@ -2216,7 +2750,7 @@ print ("%5.3f: %7.2f %7.2f %7.2f -> %7.2f %7.2f %7.2f [%7.2f %7.2f %7.2f ]",
         /* sx,sy,sz is now on the closest surface in the data volume,
            we now need the equivalent target coord */
 
-        general_transform_point(Gglobals->trans_info.transformation, 
+        general_transform_point(nl->globals->trans_info.transformation, 
                               sx,sy,sz,  &tx,&ty,&tz);
 
 
@@ -2284,7 +2818,8 @@ print ("%5.3f: %7.2f %7.2f %7.2f -> %7.2f %7.2f %7.2f [%7.2f %7.2f %7.2f ]",
   return(result);
 }
 
-static VIO_BOOL build_lattices(VIO_Real spacing, 
+static VIO_BOOL build_lattices(Node_Context *context,
+                               VIO_Real spacing, 
                                VIO_Real threshold, 
                                VIO_Real source_coord[],
                                VIO_Real mean_target[],
@@ -2300,6 +2835,14 @@ static VIO_BOOL build_lattices(VIO_Real spacing,
     xp,yp,zp;
   int 
     i,j;
+  float
+    *SX, *SY, *SZ,
+    *TX, *TY, *TZ;
+  Nonlinear_Context
+    *nl = context->nl;
+
+  SX = context->SX;  SY = context->SY;  SZ = context->SZ;
+  TX = context->TX;  TY = context->TY;  TZ = context->TZ;
 
   /* if there is no gradient magnitude strong enough to grab onto,
      then set a negative magnitude deformation and skip the optimization 
@@ -2316,7 +2859,7 @@ static VIO_BOOL build_lattices(VIO_Real spacing,
 
   result = TRUE;
 
-  if (!get_best_start_from_neighbours(threshold,
+  if (!get_best_start_from_neighbours(nl, threshold,
                                       source_coord, mean_target, target_coord,
                                       def_vector)) {
     
@@ -2338,21 +2881,17 @@ static VIO_BOOL build_lattices(VIO_Real spacing,
           build the list of world coordinates representing nodes in the
           sub-lattice within the source volume                       
 
-       The spherical sub-lattice will have Glen points in the source
+       The spherical sub-lattice will have context->len points in the source
        volume, note: sub-lattice diameter= 1.5*fwhm 
        (here specified as 3*spacing = 2*(fwhm/2) to specify radius 
        in build_source_lattice) 
 
-       note that SX, SY, SZ, TX,TY,TZ, and Glen are all globals
+       note that SX, SY, SZ, TX,TY,TZ and the length all live in *context
     */
 
-    build_source_lattice(xp, yp, zp, 
+    build_source_lattice(nl, xp, yp, zp, 
                          SX, SY, SZ,
-                         Gglobals->lattice_width[VIO_X],Gglobals->lattice_width[VIO_Y],Gglobals->lattice_width[VIO_Z],
-                         Diameter_of_local_lattice,  
-                         Diameter_of_local_lattice,  
-                         Diameter_of_local_lattice,
-                         ndim, &Glen);
+                         &(context->len));
 
     /* -------------------------------------------------------------- */
     /* BUILD THE TARGET VOLUME LOCAL NEIGHBOURHOOD INFO */
@@ -2361,11 +2900,11 @@ static VIO_BOOL build_lattices(VIO_Real spacing,
        current transformation, in order to build a deformed lattice
        (in the WORLD COORDS of the target volume) */
 
-    if (Gglobals->trans_info.use_super>0) 
-      build_target_lattice_using_super_sampled_def(
-                  SX,SY,SZ, TX,TY,TZ, Glen, ndim);
+    if (nl->globals->trans_info.use_super>0) 
+      build_target_lattice_using_super_sampled_def(nl,
+                  SX,SY,SZ, TX,TY,TZ, context->len, ndim);
     else 
-      build_target_lattice(SX,SY,SZ, TX,TY,TZ, Glen, ndim);
+      build_target_lattice(nl, SX,SY,SZ, TX,TY,TZ, context->len, ndim);
       
 
     /* -------------------------------------------------------------- */
@@ -2385,8 +2924,8 @@ static VIO_BOOL build_lattices(VIO_Real spacing,
                 ydim, and TZ the voxel xdim coordinate.  BIZARRE I know,
                 but it works... */
 
-    for(i=1; i<=Glen; i++) {
-      convert_3D_world_to_voxel(Gglobals->features.model[0], 
+    for(i=1; i<=context->len; i++) {
+      convert_3D_world_to_voxel(nl->globals->features.model[0], 
                                 (VIO_Real)TX[i],(VIO_Real)TY[i],(VIO_Real)TZ[i], 
                                 &pos[0], &pos[1], &pos[2]);
 
@@ -2404,8 +2943,8 @@ static VIO_BOOL build_lattices(VIO_Real spacing,
     /* re-build the source lattice (without local neighbour warp),
        that will be used in the optimization below                    */
 
-    if (Gglobals->trans_info.use_magnitude) {
-      for(i=1; i<=Glen; i++) {
+    if (nl->globals->trans_info.use_magnitude) {
+      for(i=1; i<=context->len; i++) {
         SX[i] += source_coord[VIO_X] - xp;
         SY[i] += source_coord[VIO_Y] - yp;
         SZ[i] += source_coord[VIO_Z] - zp;
@@ -2422,60 +2961,75 @@ static VIO_BOOL build_lattices(VIO_Real spacing,
        will use the sublattice in the optimization 
     */
 
-    for(i=0; i<Gglobals->features.number_of_features; i++) {
+    /* the source samples only depend on the position of the node in
+       the source volume, which is the same at each iteration: reuse
+       them when they have been cached (see source_cache.c) */
 
-      if (Gglobals->features.obj_func[i] != NONLIN_OPTICALFLOW && Gglobals->features.obj_func[i] != NONLIN_CHAMFER)
+    if (!get_cached_source_samples(&(nl->source_cache), context->node, context)) {
 
-        go_get_samples_in_source(Gglobals->features.data[i], 
-                                 Gglobals->features.data_mask[i],
-                                 SX,SY,SZ, Ga1_features[i], 
-                                 masked_samples_in_source[i], Glen, 
-                                 (Gglobals->interpolant==nearest_neighbour_interpolant ? -1 : 0)
-                                 );
-    }
+      for(i=0; i<nl->globals->features.number_of_features; i++) {
 
-    /* -------------------------------------------------------------- */
-    /* calc one of the normalization coefficients for the similarity
-       measure, when using the magnitude data.  This saves a few CPU cycles
-       in go_get_samples_with_offset(), since the constants only have to be
-       eval'd once for the source volume. Note that this variable is not
-       used when doing OPTICAL FLOW. */
-
-    for(i=0; i<Gglobals->features.number_of_features; i++) {
-
-      switch (Gglobals->features.obj_func[i]) {
-      case NONLIN_XCORR:
-        Gsqrt_features[i] = 0.0;
-        for(j=1; j<=Glen; j++) {
-          if ( masked_samples_in_source[i][j] ==0)
-            Gsqrt_features[i] += Ga1_features[i][j]*Ga1_features[i][j];
+        if (nl->globals->features.obj_func[i] != NONLIN_OPTICALFLOW && nl->globals->features.obj_func[i] != NONLIN_CHAMFER) {
+
+          build_source_voxel_lattice(nl, i, xp, yp, zp,
+                                     context->VX, context->VY, context->VZ);
+
+          go_get_samples_in_source(nl->globals->features.data[i], 
+                                   nl->globals->features.data_mask[i],
+                                   SX,SY,SZ, 
+                                   context->VX, context->VY, context->VZ,
+                                   context->a1_features[i], 
+                                   context->masked_samples[i], context->len, 
+                                   (nl->globals->interpolant==nearest_neighbour_interpolant ? -1 : 0)
+                                   );
         }
-         
-        Gsqrt_features[i] = sqrt((double)Gsqrt_features[i]);
-        break;
-      case NONLIN_DIFF:
-        Gsqrt_features[i] = (VIO_Real)Glen;
-        break;
-      case NONLIN_LABEL:
-        Gsqrt_features[i] = (VIO_Real)Glen;
-        break;
-      case NONLIN_CHAMFER:
-        Gsqrt_features[i] = 0;
-        break;
-      case NONLIN_OPTICALFLOW:
-        Gsqrt_features[i] = 0;
-        break;
-      case NONLIN_CORRCOEFF:
-        Gsqrt_features[i] = (VIO_Real)Glen;
-        break;
-      case NONLIN_SQDIFF:
-        Gsqrt_features[i] = (VIO_Real)Glen;
-        break;
+      }
 
-      default:
-        print_error_and_line_num("Objective function %d not supported in build_lattices",
-                                 __FILE__, __LINE__,Gglobals->features.obj_func[i]);
+      /* -------------------------------------------------------------- */
+      /* calc one of the normalization coefficients for the similarity
+         measure, when using the magnitude data.  This saves a few CPU cycles
+         in go_get_samples_with_offset(), since the constants only have to be
+         eval'd once for the source volume. Note that this variable is not
+         used when doing OPTICAL FLOW. */
+
+      for(i=0; i<nl->globals->features.number_of_features; i++) {
+
+        switch (nl->globals->features.obj_func[i]) {
+        case NONLIN_XCORR:
+          context->sqrt_features[i] = 0.0;
+          for(j=1; j<=context->len; j++) {
+            if ( context->masked_samples[i][j] ==0)
+              context->sqrt_features[i] += context->a1_features[i][j]*context->a1_features[i][j];
+          }
+         
+          context->sqrt_features[i] = sqrt((double)context->sqrt_features[i]);
+          break;
+        case NONLIN_DIFF:
+          context->sqrt_features[i] = (VIO_Real)context->len;
+          break;
+        case NONLIN_LABEL:
+          context->sqrt_features[i] = (VIO_Real)context->len;
+          break;
+        case NONLIN_CHAMFER:
+          context->sqrt_features[i] = 0;
+          break;
+        case NONLIN_OPTICALFLOW:
+          context->sqrt_features[i] = 0;
+          break;
+        case NONLIN_CORRCOEFF:
+          context->sqrt_features[i] = (VIO_Real)context->len;
+          break;
+        case NONLIN_SQDIFF:
+          context->sqrt_features[i] = (VIO_Real)context->len;
+          break;
+
+        default:
+          print_error_and_line_num("Objective function %d not supported in build_lattices",
+                                   __FILE__, __LINE__,nl->globals->features.obj_func[i]);
+        }
       }
+
+      cache_source_samples(&(nl->source_cache), context->node, context);
     }
     
   }
@@ -2484,6 +3038,147 @@ static VIO_BOOL build_lattices(VIO_Real spacing,
 
 
 
+/**********************************************************
+  solve a[0..n-1][0..n-1] x = b, for n <= 3, by gaussian elimination
+  with partial pivoting.  returns FALSE if a is singular.
+*/
+static VIO_BOOL solve_small_system(int n, VIO_Real a[3][3], VIO_Real b[3], VIO_Real x[3])
+{
+  int i,j,k,pivot;
+  VIO_Real t;
+
+  for(k=0; k<n; k++) {
+    pivot = k;
+    for(i=k+1; i<n; i++)
+      if (fabs(a[i][k]) > fabs(a[pivot][k])) pivot = i;
+    if (fabs(a[pivot][k]) < 1e-20)
+      return(FALSE);
+    if (pivot != k) {
+      for(j=0; j<n; j++) {
+        t = a[k][j]; a[k][j] = a[pivot][j]; a[pivot][j] = t;
+      }
+      t = b[k]; b[k] = b[pivot]; b[pivot] = t;
+    }
+    for(i=k+1; i<n; i++) {
+      t = a[i][k] / a[k][k];
+      for(j=k; j<n; j++)
+        a[i][j] -= t * a[k][j];
+      b[i] -= t * b[k];
+    }
+  }
+
+  for(i=n-1; i>=0; i--) {
+    t = b[i];
+    for(j=i+1; j<n; j++)
+      t -= a[i][j] * x[j];
+    x[i] = t / a[i][i];
+  }
+
+  return(TRUE);
+}
+
+/**********************************************************
+  -local_gn: find the local deformation (in voxels, x,y,z order like
+  voxel_displacement[] of the simplex) that minimizes
+  local_objective_function(), with Gauss-Newton steps built from the
+  gradient and approximate hessian returned by
+  local_objective_gradient(), damped a la Levenberg-Marquardt.  Each
+  step costs a single pass over the sub-lattice (counted as one
+  function evaluation in *nfunk), and a node typically converges in a
+  handful of steps.  The deformation is limited to max_disp voxels
+  along each axis.
+
+  returns FALSE if the objective function has no derivatives.
+*/
+static VIO_BOOL gauss_newton_local_fit(Node_Context *context,
+                                       VIO_Real max_disp,
+                                       VIO_Real voxel_displacement[],
+                                       int *nfunk)
+{
+  Arg_Data
+    *globals = context->nl->globals;
+  float
+    d[4], trial[4];
+  VIO_Real
+    obj, trial_obj,
+    grad[4], hess[4][4],
+    trial_grad[4], trial_hess[4][4],
+    a[3][3], b[3], step[3],
+    lambda, change;
+  int
+    axes[3], n, i, j, iter;
+  VIO_BOOL
+    ok;
+
+                                /* the axes that may deform, as in
+                                   from_param_to_grid_weights() */
+  n = 0;
+  for(i=0; i<VIO_N_DIMENSIONS; i++)
+    if (globals->count[i] > 1) 
+      axes[n++] = i+1;
+
+  for(i=0; i<4; i++)
+    d[i] = 0.0;
+
+  *nfunk = 1;
+  if (!local_objective_gradient(context, d, &obj, grad, hess))
+    return(FALSE);
+
+  lambda = GN_INITIAL_DAMPING;
+
+  for(iter=0; iter<GN_ITERATION_LIMIT && n>0; iter++) {
+
+    for(i=0; i<n; i++) {
+      b[i] = -grad[ axes[i] ];
+      for(j=0; j<n; j++)
+        a[i][j] = hess[ axes[i] ][ axes[j] ];
+      a[i][i] *= (1.0 + lambda);
+    }
+
+    if (!solve_small_system(n, a, b, step))
+      break;
+
+    for(i=0; i<4; i++)
+      trial[i] = d[i];
+    change = 0.0;
+    for(i=0; i<n; i++) {
+      trial[ axes[i] ] = d[ axes[i] ] + step[i];
+      if (trial[ axes[i] ] >  max_disp) trial[ axes[i] ] =  max_disp;
+      if (trial[ axes[i] ] < -max_disp) trial[ axes[i] ] = -max_disp;
+      if (fabs(trial[ axes[i] ] - d[ axes[i] ]) > change)
+        change = fabs(trial[ axes[i] ] - d[ axes[i] ]);
+    }
+
+    if (change < GN_STEP_TOLERANCE)
+      break;
+
+    (*nfunk)++;
+    ok = local_objective_gradient(context, trial, &trial_obj, trial_grad, trial_hess);
+
+    if (ok && trial_obj < obj) {        /* accept the step */
+      obj = trial_obj;
+      for(i=1; i<4; i++) {
+        d[i]    = trial[i];
+        grad[i] = trial_grad[i];
+        for(j=1; j<4; j++)
+          hess[i][j] = trial_hess[i][j];
+      }
+      lambda /= 10.0;
+    }
+    else {                              /* be more careful */
+      lambda *= 10.0;
+      if (lambda > GN_MAX_DAMPING)
+        break;
+    }
+  }
+
+  for(i=0; i<3; i++)
+    voxel_displacement[i] = d[i+1];
+
+  return(TRUE);
+}
+
+
 /**********************************************************
 
   get_deformation_vector_for_node will return the magnitude of the
@@ -2496,8 +3191,8 @@ static VIO_BOOL build_lattices(VIO_Real spacing,
   into the target space for eventual use when the objective function
   must be evaluated for different possible offsets.
 
-  Either "Nelder Mead Simplex" or "Quadratic Obj Func Fitting" will be
-  used to determine the best deformation vector (additional offset)
+  Either "Nelder Mead Simplex", "Quadratic Obj Func Fitting" or
+  "Gauss-Newton" (-local_gn) will be used to determine the best deformation vector (additional offset)
   that maximises local neighboughood correlation between source and
   target volumes.
 
@@ -2511,6 +3206,8 @@ static VIO_BOOL build_lattices(VIO_Real spacing,
   volume of the ameoba has been reduced below a pre-selected
   tolerence.
 
+  If Gauss-Newton: see gauss_newton_local_fit().
+
   The necessary additional offset is returned in def_vector[].
 
   note that the value of the spacing coming in is FWHM/2 for the data
@@ -2520,7 +3217,8 @@ static VIO_BOOL build_lattices(VIO_Real spacing,
 */
 
 
-static VIO_Real get_deformation_vector_for_node(VIO_Real spacing, 
+static VIO_Real get_deformation_vector_for_node(Node_Context *context,
+                                             VIO_Real spacing, 
                                              VIO_Real threshold1, 
                                              VIO_Real source_coord[],
                                              VIO_Real mean_target[],
@@ -2549,7 +3247,7 @@ static VIO_Real get_deformation_vector_for_node(VIO_Real spacing,
     result,
     target_coord[3];
   float 
-    pos_vector[4];
+    stencil_disp[3];
   int 
     flag,
     nfunk,
@@ -2558,6 +3256,8 @@ static VIO_Real get_deformation_vector_for_node(VIO_Real spacing,
     the_amoeba;
   VIO_Real
     *parameters;
+  Nonlinear_Context
+    *nl = context->nl;
 
                                 /* initialize for no deformation */
   result = 0.0;                        
@@ -2567,7 +3267,7 @@ static VIO_Real get_deformation_vector_for_node(VIO_Real spacing,
                                 /* build sub-lattice if necessary */
   if (sub_lattice_needed) {
 
-    if ( ! build_lattices(spacing, threshold1, 
+    if ( ! build_lattices(context, spacing, threshold1, 
                           source_coord, mean_target, target_coord, def_vector,
                           ndim) ){
       result = -DBL_MAX;
@@ -2580,15 +3280,15 @@ static VIO_Real get_deformation_vector_for_node(VIO_Real spacing,
 
   optical_partial_weight = other_partial_weight = total_weight = 0.0;
 
-  for(i=0; i<Gglobals->features.number_of_features; i++) {
+  for(i=0; i<nl->globals->features.number_of_features; i++) {
 
-    if ((Gglobals->features.obj_func[i] == NONLIN_OPTICALFLOW) || 
-        (Gglobals->features.obj_func[i] == NONLIN_CHAMFER) )
-      optical_partial_weight += Gglobals->features.weight[i];
+    if ((nl->globals->features.obj_func[i] == NONLIN_OPTICALFLOW) || 
+        (nl->globals->features.obj_func[i] == NONLIN_CHAMFER) )
+      optical_partial_weight += nl->globals->features.weight[i];
     else
-      other_partial_weight += Gglobals->features.weight[i];
+      other_partial_weight += nl->globals->features.weight[i];
 
-    total_weight += Gglobals->features.weight[i];
+    total_weight += nl->globals->features.weight[i];
   }
 
   if (total_weight == 0.0) {
@@ -2606,44 +3306,45 @@ static VIO_Real get_deformation_vector_for_node(VIO_Real spacing,
     /*  FIND BEST DEFORMATION VECTOR
         now find the best local deformation that maximises the local
         neighbourhood correlation between the source values stored in
-        **Ga1_features at positions Sx, SY, SZ with the homologous 
+        context->a1_features at positions SX, SY, SZ with the homologous 
         values at positions TX,TY,TZ in the target volume */
     
-    if ( !Gglobals->trans_info.use_simplex) {
+    if ( nl->globals->trans_info.use_simplex == LOCAL_GAUSS_NEWTON) {
+
+      /* ----------------------------------------------------------- */
+      /*  USE GAUSS-NEWTON steps to find best deformation vector     */
+
+      if (!gauss_newton_local_fit(context, nl->simplex_size, voxel_displacement, &nfunk)) {
+        result = -DBL_MAX;
+        voxel_displacement[0] = 0.0;
+        voxel_displacement[1] = 0.0;
+        voxel_displacement[2] = 0.0;
+      }
+      *num_functions += nfunk;
+    }
+    else if ( !nl->globals->trans_info.use_simplex) {
       
       /* ----------------------------------------------------------- */
       /*  USE QUADRATIC FITTING to find best deformation vector      */
       
+      for(i=-1; i<=1; i++)        /* displacements of the 3x3x3 stencil */
+        stencil_disp[i+1] = (float) i * nl->simplex_size/2.0;
+
       if (ndim==3) { /* build up the 3x3x3 matrix of local correlation values */
         
-        for(i=-1; i<=1; i++) {
-          
-          pos_vector[1] = (float) i * Gsimplex_size/2.0;
-          for(j=-1; j<=1; j++) {
-            
-            pos_vector[2] = (float) j * Gsimplex_size/2.0;
-            for(k=-1; k<=1; k++) {
-              pos_vector[3] = (float) k * Gsimplex_size/2.0;
-              local_corr3D[i+1][j+1][k+1] = local_objective_function(pos_vector); 
-            }
-          }
-        }
+        local_objective_stencil(context, stencil_disp, ndim, local_corr3D);
         *num_functions += 27;
-        flag = return_3D_disp_from_min_quad_fit(local_corr3D, &du, &dv, &dw);
+        flag = return_3D_disp_from_min_quad_fit(local_corr3D, &du, &dv, &dw,
+                                                &context->quad_stats);
         
       }
       else {
         /* build up the 3x3 matrix of local correlation values */
         
-        pos_vector[3] = 0.0;        /* since 2D */
-        
-        for(i=-1; i<=1; i++) {
-          pos_vector[1] = (float) i * Gsimplex_size/2.0;
-          for(j=-1; j<=1; j++) {
-            pos_vector[2] = (float) j * Gsimplex_size/2.0;
-            local_corr2D[i+1][j+1] = 1.0 - local_objective_function(pos_vector); 
-          }
-        }
+        local_objective_stencil(context, stencil_disp, ndim, local_corr3D);
+        for(i=0; i<3; i++)        /* since 2D, no displacement along d[3] */
+          for(j=0; j<3; j++)
+            local_corr2D[i][j] = 1.0 - local_corr3D[i][j][1]; 
         *num_functions += 9;
         
         flag = return_2D_disp_from_quad_fit(local_corr2D,  &du, &dv);
@@ -2654,9 +3355,9 @@ static VIO_Real get_deformation_vector_for_node(VIO_Real spacing,
 
       
       if ( flag ) {
-        voxel_displacement[0] = dw * Gsimplex_size/2.0;        /* fastest (X) data index */
-        voxel_displacement[1] = dv * Gsimplex_size/2.0;        /* Y */
-        voxel_displacement[2] = du * Gsimplex_size/2.0;        /* slowest, Z */
+        voxel_displacement[0] = dw * nl->simplex_size/2.0;        /* fastest (X) data index */
+        voxel_displacement[1] = dv * nl->simplex_size/2.0;        /* Y */
+        voxel_displacement[2] = du * nl->simplex_size/2.0;        /* slowest, Z */
       }
       else {
         result = -DBL_MAX;
@@ -2685,13 +3386,13 @@ static VIO_Real get_deformation_vector_for_node(VIO_Real spacing,
                                    note that the simplex is in voxel
                                    coordinates of the data volume...
                                 */
-      simplex_size = Gsimplex_size * 
+      simplex_size = nl->simplex_size * 
         (0.5 + 
          0.5*((VIO_Real)(total_iters-iteration)/(VIO_Real)total_iters));
       
       initialize_amoeba(&the_amoeba, ndim, parameters, 
                         simplex_size, amoeba_NL_obj_function, 
-                        NULL, (VIO_Real)ftol);
+                        (void *)context, (VIO_Real)context->nl->globals->ftol);
       
       
       nfunk = 4;                /* since 4 eval's needed to init the amoeba */
@@ -2722,7 +3423,7 @@ static VIO_Real get_deformation_vector_for_node(VIO_Real spacing,
 
 
 
-        from_param_to_grid_weights( parameters, voxel_displacement);
+        from_param_to_grid_weights( nl->globals, parameters, voxel_displacement);
        
 
       
@@ -2766,7 +3467,7 @@ static VIO_Real get_deformation_vector_for_node(VIO_Real spacing,
     }
     else {
       
-      convert_3D_world_to_voxel(Gglobals->features.model[0], 
+      convert_3D_world_to_voxel(nl->globals->features.model[0], 
                                 target_coord[VIO_X],target_coord[VIO_Y],target_coord[VIO_Z], 
                                 &voxel[0], &voxel[1], &voxel[2]);
       
@@ -2775,7 +3476,7 @@ static VIO_Real get_deformation_vector_for_node(VIO_Real spacing,
          in z,y,x order and the voxel displacement is in x,y,z
          order. */
 
-      convert_3D_voxel_to_world(Gglobals->features.model[0], 
+      convert_3D_voxel_to_world(nl->globals->features.model[0], 
                                 (VIO_Real)(voxel[0]+voxel_displacement[2]),   /* voxel[z]+voxel_displacement[z] */
                                 (VIO_Real)(voxel[1]+voxel_displacement[1]),   /* voxel[y]+voxel_displacement[y] */
                                 (VIO_Real)(voxel[2]+voxel_displacement[0]),   /* voxel[x]+voxel_displacement[x] */
@@ -2816,36 +3517,34 @@ static VIO_Real get_deformation_vector_for_node(VIO_Real spacing,
 
     temp_total_weight = 0;
 
-    for(i=0; i<Gglobals->features.number_of_features; i++) {
+    for(i=0; i<nl->globals->features.number_of_features; i++) {
       
-      if (Gglobals->features.obj_func[i] == NONLIN_OPTICALFLOW ||  
-          Gglobals->features.obj_func[i] == NONLIN_CHAMFER)  {
+      if (nl->globals->features.obj_func[i] == NONLIN_OPTICALFLOW ||  
+          nl->globals->features.obj_func[i] == NONLIN_CHAMFER)  {
         
-        if (Gglobals->features.obj_func[i] == NONLIN_OPTICALFLOW) {
-          result =  get_optical_flow_vector(threshold1, 
+        if (nl->globals->features.obj_func[i] == NONLIN_OPTICALFLOW) {
+          result =  get_optical_flow_vector(&(nl->optical_flow[i]),
                                             source_coord, mean_target,
                                             real_def, vox_def,
-                                            Gglobals->features.data[i],
-                                            Gglobals->features.model[i],
                                             ndim);
 
 	}
         else                   /* must be CHAMFER */
-          result =  get_chamfer_vector(spacing,   
+          result =  get_chamfer_vector(nl, spacing,   
                                        source_coord, mean_target,
                                        real_def, vox_def,
-                                       Gglobals->features.data[i],
-                                       Gglobals->features.model[i],
+                                       nl->globals->features.data[i],
+                                       nl->globals->features.model[i],
                                        ndim);
         if (result > 0.0) {
           *num_functions += 1;
                                 /* add in the weighted deformations */
 
-          temp_total_weight += Gglobals->features.weight[i];
+          temp_total_weight += nl->globals->features.weight[i];
           
           for(j=0; j<3; j++) {
-            optical_def_vector[j]         += real_def[j] * Gglobals->features.weight[i];
-            optical_voxel_displacement[j] += vox_def[j]  * Gglobals->features.weight[i];
+            optical_def_vector[j]         += real_def[j] * nl->globals->features.weight[i];
+            optical_voxel_displacement[j] += vox_def[j]  * nl->globals->features.weight[i];
           }
         } 
 
@@ -2875,6 +3574,7 @@ Procedure from_param_to_grid_weights() will map the optimized parameter vector t
 */
 
 void from_param_to_grid_weights(
+   Arg_Data *globals,
    VIO_Real p[],
    VIO_Real grid[])
 
@@ -2885,7 +3585,7 @@ void from_param_to_grid_weights(
   j=0;
   for(i=0; i<VIO_N_DIMENSIONS; i++)
     {
-      if(Gglobals->count[i]>1) 
+      if(globals->count[i]>1) 
         {
           grid[i]=p[j];
           j++;
@@ -2902,6 +3602,7 @@ Procedure from_grid_weights_to_param() will inverse the procedure from_param_to_
 */
 
 void from_grid_weights_to_param(
+    Arg_Data *globals,
     VIO_Real grid[],
     VIO_Real p[])
 {
@@ -2921,7 +3622,8 @@ void from_grid_weights_to_param(
 Procedure map_def_to_grid_space() will map a world-space deformation vector (dx,dy,dz) to the coordinate system of the grid (g0,g1,g2) 
 */
 
-void map_def_to_grid_space( VIO_Real dx,
+void map_def_to_grid_space( Arg_Data *globals,
+                                   VIO_Real dx,
                                    VIO_Real dy,
                                    VIO_Real dz,
                                    VIO_Real *g0,
@@ -2935,13 +3637,13 @@ void map_def_to_grid_space( VIO_Real dx,
  
   for(i=0; i<VIO_N_DIMENSIONS; i++)
     {
-      voxel_mag[i] = fabs(Gglobals->step[i]);
+      voxel_mag[i] = fabs(globals->step[i]);
     }
 
   for(i=0; i<VIO_N_DIMENSIONS; i++)
-    g[i] = (Point_x(Gglobals->directions[i])/voxel_mag[i])*dx +  
-           (Point_y(Gglobals->directions[i])/voxel_mag[i])*dy +  
-           (Point_z(Gglobals->directions[i])/voxel_mag[i])*dz;
+    g[i] = (Point_x(globals->directions[i])/voxel_mag[i])*dx +  
+           (Point_y(globals->directions[i])/voxel_mag[i])*dy +  
+           (Point_z(globals->directions[i])/voxel_mag[i])*dz;
     
   *g0=g[0]; *g1=g[1]; *g2=g[2];
 
@@ -2951,7 +3653,8 @@ void map_def_to_grid_space( VIO_Real dx,
 Procedure map_def_from_grid_space() will map the deformation in the grid coordinate system on to the world coordinate system.
 */
 
-void map_def_from_grid_space(VIO_Real g0,
+void map_def_from_grid_space(Arg_Data *globals,
+                                    VIO_Real g0,
                                     VIO_Real g1,
                                     VIO_Real g2,
                                     VIO_Real *dx,
@@ -2971,14 +3674,14 @@ void map_def_from_grid_space(VIO_Real g0,
   
   for(i=0; i<VIO_N_DIMENSIONS; i++)
     {
-      voxel_mag[i] = fabs(Gglobals->step[i]);
+      voxel_mag[i] = fabs(globals->step[i]);
     }
   
   for(i=0; i<VIO_N_DIMENSIONS; i++)
     {
-      *dx += (Point_x(Gglobals->directions[i])/voxel_mag[i])*g[i];
-      *dy += (Point_y(Gglobals->directions[i])/voxel_mag[i])*g[i];
-      *dz += (Point_z(Gglobals->directions[i])/voxel_mag[i])*g[i];
+      *dx += (Point_x(globals->directions[i])/voxel_mag[i])*g[i];
+      *dy += (Point_y(globals->directions[i])/voxel_mag[i])*g[i];
+      *dz += (Point_z(globals->directions[i])/voxel_mag[i])*g[i];
     }
   
 }
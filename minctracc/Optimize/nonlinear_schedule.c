@@ -0,0 +1,206 @@
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : nonlinear_schedule.c
+@DESCRIPTION: coarse to fine fitting of the deformation field in a single
+              run of minctracc (-nonlinear_schedule).
+
+              Each level of the schedule is a call to
+              do_non_linear_optimization() with its own grid step,
+              number of iterations and blurring of the source and target
+              volumes.  Between levels, the deformation field found so far
+              is resampled in memory onto the grid of the next level, so
+              the volumes are read once and only the final transformation
+              is written.
+@CREATED    : Oct 18, 2026
+---------------------------------------------------------------------------- */
+
+#include <config.h>
+#include <volume_io.h>
+#include <Proglib.h>
+#include "constants.h"
+#include "minctracc_point_vector.h"
+#include "minctracc_arg_data.h"
+#include "init_lattice.h"
+#include "super_sample_def.h"
+#include "nonlinear_context.h"
+
+VIO_Status do_non_linear_optimization(Arg_Data *globals);
+
+void build_default_deformation_field(Arg_Data *globals);
+
+void get_volume_XYZV_indices(VIO_Volume data, int xyzv[]);
+
+VIO_Volume blur_volume(VIO_Volume d1, VIO_Real fwhm);
+
+
+/* bring the deformation grid of globals->trans_info.transformation to
+   a step of new_step mm.  When the step is halved, the grid is
+   super-sampled by 2 (with the cubic interpolation of
+   interpolate_super_sampled_data_by2()), otherwise it is resampled by
+   build_default_deformation_field(), as when a previous transformation
+   is given with -transformation. */
+
+static void set_deformation_grid_step(Arg_Data *globals, VIO_Real new_step)
+{
+  VIO_General_transform
+    *grid,
+    *super_sampled;
+  VIO_Real
+    old_step,
+    steps[VIO_MAX_DIMENSIONS];
+  int
+    i,
+    xyzv[VIO_MAX_DIMENSIONS];
+
+  for(i=0; i<3; i++)
+    globals->step[i] = (globals->step[i] < 0.0 ? -1.0 : 1.0) * new_step;
+
+  grid = get_nth_general_transform(globals->trans_info.transformation,
+                                   get_n_concated_transforms(globals->trans_info.transformation)-1);
+
+  if (get_transform_type(grid) != GRID_TRANSFORM) {
+    build_default_deformation_field(globals);
+    return;
+  }
+
+  get_volume_XYZV_indices(grid->displacement_volume, xyzv);
+  get_volume_separations(grid->displacement_volume, steps);
+  old_step = fabs(steps[xyzv[VIO_X]]);
+
+  if (fabs(old_step - new_step) < 1e-6 * new_step)
+    return;
+
+  if (fabs(old_step - 2.0*new_step) < 1e-6 * new_step) {
+
+    if (globals->flags.debug)
+      print ("Super-sampling the deformation grid from %f to %f mm\n", old_step, new_step);
+
+    ALLOC(super_sampled, 1);
+    create_super_sampled_data_volumes_by2(grid, super_sampled);
+    interpolate_super_sampled_data_by2(grid, super_sampled);
+
+    delete_volume(grid->displacement_volume);
+    grid->displacement_volume = super_sampled->displacement_volume;
+    FREE(super_sampled);
+  }
+  else {
+
+    if (globals->flags.debug)
+      print ("Resampling the deformation grid from %f to %f mm\n", old_step, new_step);
+
+    build_default_deformation_field(globals);
+  }
+}
+
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : do_non_linear_schedule
+@INPUT      : globals - with globals->nonlinear.schedule.levels > 0, and the
+                 deformation grid built for the first level
+@OUTPUT     : globals->trans_info.transformation
+@RETURNS    : VIO_OK if all levels were fit, the status of the first level
+              that failed otherwise.
+@DESCRIPTION: fit the deformation field at each level of the schedule, from
+              the coarsest to the finest.  At each level:
+                - the deformation grid is brought to the step of the level,
+                - the sub-lattice diameter (-lattice_diameter, given for the
+                  first level) is scaled with the step,
+                - the number of iterations is taken from
+                  -nonlinear_iterations (default: -iterations),
+                - the source and target volumes are blurred by the fwhm
+                  given with -nonlinear_blurs (default: not blurred),
+                - the sampling lattice is rebuilt for the new step.
+              With -resume, the levels done before the last checkpoint
+              are skipped: only their grids are rebuilt, so that the
+              grid of the level resumed has the same geometry as in the
+              interrupted run.
+@CREATED    : Oct 18, 2026
+---------------------------------------------------------------------------- */
+VIO_Status do_non_linear_schedule(Arg_Data *globals)
+{
+  Nonlinear_Schedule
+    *schedule = &(globals->nonlinear.schedule);
+  VIO_Volume
+    orig_data,
+    orig_model;
+  VIO_Real
+    lattice_width[3];
+  VIO_Status
+    status;
+  Nonlinear_Checkpoint
+    checkpoint;
+  int
+    i, level, first_level,
+    iteration_limit;
+
+  if (schedule->iteration_levels > 0 && schedule->iteration_levels != schedule->levels)
+    print_error_and_line_num("-nonlinear_iterations has %d values, -nonlinear_schedule has %d levels.",
+                             __FILE__, __LINE__, schedule->iteration_levels, schedule->levels);
+  if (schedule->blur_levels > 0 && schedule->blur_levels != schedule->levels)
+    print_error_and_line_num("-nonlinear_blurs has %d values, -nonlinear_schedule has %d levels.",
+                             __FILE__, __LINE__, schedule->blur_levels, schedule->levels);
+
+  orig_data       = globals->features.data[0];
+  orig_model      = globals->features.model[0];
+  iteration_limit = globals->nonlinear.iteration_limit;
+  for(i=0; i<3; i++)
+    lattice_width[i] = globals->lattice_width[i];
+
+  first_level = 0;
+  if (globals->nonlinear.resume && globals->nonlinear.checkpoint_dir != NULL &&
+      read_nonlinear_checkpoint(globals, &checkpoint)) {
+    first_level = checkpoint.level;
+    delete_nonlinear_checkpoint(&checkpoint);
+    if (first_level < 0 || first_level >= schedule->levels)
+      print_error_and_line_num("The checkpoint is for level %d, -nonlinear_schedule has %d levels.",
+                               __FILE__, __LINE__, first_level+1, schedule->levels);
+  }
+
+  status = VIO_OK;
+
+  for(level=0; level<schedule->levels && status==VIO_OK; level++) {
+
+    schedule->current = level;
+
+    set_deformation_grid_step(globals, schedule->step[level]);
+
+    if (level < first_level)    /* fit before the checkpoint */
+      continue;
+
+    for(i=0; i<3; i++)
+      globals->lattice_width[i] = lattice_width[i] * schedule->step[level] / schedule->step[0];
+
+    if (schedule->iteration_levels > 0)
+      globals->nonlinear.iteration_limit = schedule->iterations[level];
+
+    if (schedule->blur_levels > 0 && schedule->blur[level] > 0.0) {
+      globals->features.data[0]  = blur_volume(orig_data,  schedule->blur[level]);
+      globals->features.model[0] = blur_volume(orig_model, schedule->blur[level]);
+    }
+
+    init_lattice(globals->features.data[0], globals->features.model[0],
+                 globals->features.data_mask[0], globals->features.model_mask[0],
+                 globals);
+
+    if (globals->flags.verbose>0)
+      print ("Level %d of %d: step %g mm, %d iterations, blur %g mm\n",
+             level+1, schedule->levels, schedule->step[level],
+             globals->nonlinear.iteration_limit,
+             schedule->blur_levels > 0 ? schedule->blur[level] : 0.0);
+
+    status = do_non_linear_optimization(globals);
+
+    if (globals->features.data[0] != orig_data) {
+      delete_volume(globals->features.data[0]);
+      delete_volume(globals->features.model[0]);
+      globals->features.data[0]  = orig_data;
+      globals->features.model[0] = orig_model;
+    }
+  }
+
+  schedule->current = 0;
+  globals->nonlinear.iteration_limit = iteration_limit;
+  for(i=0; i<3; i++)
+    globals->lattice_width[i] = lattice_width[i];
+
+  return(status);
+}
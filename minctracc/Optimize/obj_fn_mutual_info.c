@@ -93,13 +93,10 @@ static char rcsid[]="$Header: /static-cvsroot/registration/mni_autoreg/minctracc
 #include "objectives.h"
 #include <math.h>
 
-extern Arg_Data *main_args;
-
-                        /* these are defined/alloc'd in optimize.c  */
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
-extern VIO_Real            **prob_hash_table; 
-extern VIO_Real            *prob_fn1;         
-extern VIO_Real            *prob_fn2;         
 
 int point_not_masked(VIO_Volume volume, VIO_Real wx, VIO_Real wy, VIO_Real wz);
 int voxel_point_not_masked(VIO_Volume volume, 
@@ -134,7 +131,7 @@ VIO_BOOL partial_volume_interpolation(VIO_Volume data,
 {
   long ind0, ind1, ind2, max[3];
   int sizes[3];
-  static double f0, f1, f2, r0, r1, r2, r1r2, r1f2, f1r2, f1f2;
+  double f0, f1, f2, r0, r1, r2, r1r2, r1f2, f1r2, f1f2;
   
   /* Check that the coordinate is inside the volume */
   
@@ -318,6 +315,101 @@ static void blur_jpdf (VIO_Real **hist, int blur_size, int pdf_length) {
 }
 
 
+/* derivatives of the fractional values of partial_volume_interpolation()
+   at coord (inside the volume) along the 3 voxel axes */
+
+static void partial_volume_derivatives(VIO_Real coord[], VIO_Real deriv[8][3])
+{
+  VIO_Real
+    f[3], r[3], w[3], sign[3];
+  int
+    i, v, bit;
+
+  for(i=0; i<3; i++) {
+    f[i] = coord[i] - (long)coord[i];
+    r[i] = 1.0 - f[i];
+  }
+
+                                /* bit 2 of v along X, bit 0 along Z */
+  for(v=0; v<8; v++) {
+    for(i=0; i<3; i++) {
+      bit     = (v >> (2-i)) & 1;
+      w[i]    = bit ? f[i] : r[i];
+      sign[i] = bit ? 1.0 : -1.0;
+    }
+    deriv[v][0] = sign[0] * w[1] * w[2];
+    deriv[v][1] = w[0] * sign[1] * w[2];
+    deriv[v][2] = w[0] * w[1] * sign[2];
+  }
+}
+
+
+/* gradient[0..n_params-1] of the -mi or -nmi result, from the
+   normalized histograms (prob_fn1, prob_fn2, prob_hash_table) and
+   the derivatives of the blurred histograms with respect to each
+   parameter, dhist[k][i*groups+j] and dfn2[k][j], before normalization
+   to count2.  Only the second volume moves, so prob_fn1 does not
+   change:
+
+     d I / d p = sum( dp(x,y) (log[ p(x,y) / (p1(x)*p2(y)) ] + 1)
+                      - p(x,y) dp2(y) / p2(y) )
+     d H(Y) / d p = - sum( dp2(y) (log p2(y) + 1) )
+*/
+
+static void mutual_information_gradient(Arg_Data *globals,
+                                        int n_params,
+                                        VIO_Real *dhist,
+                                        VIO_Real *dfn2,
+                                        int count2,
+                                        double Hx, double Hy, double Ixy,
+                                        VIO_Real gradient[])
+{
+  VIO_Real
+    dIxy[12], dHy[12],
+    weight;
+  long
+    bin, n_bins;
+  int
+    i, j, k, groups;
+
+  groups = globals->groups;
+  n_bins = (long)groups * groups;
+
+  for(k=0; k<n_params; k++) {
+    dIxy[k] = dHy[k] = 0.0;
+    gradient[k] = 0.0;
+  }
+
+  if (count2 <= 0)
+    return;
+
+  for(i=0; i<groups; i++) 
+    for(j=0; j<groups; j++) {
+      if ( globals->fit.prob_fn1[i] > 0.0 &&  globals->fit.prob_fn2[j] > 0.0 && globals->fit.prob_hash_table[i][j]>0.0) {
+        weight = log( globals->fit.prob_hash_table[i][j] / (globals->fit.prob_fn1[i] * globals->fit.prob_fn2[j]) ) + 1.0;
+        bin = (long)i * groups + j;
+        for(k=0; k<n_params; k++)
+          dIxy[k] += (dhist[k*n_bins + bin] * weight -
+                      globals->fit.prob_hash_table[i][j] * dfn2[k*groups + j] / globals->fit.prob_fn2[j]) / count2;
+      }
+    }
+
+  for(j=0; j<groups; j++) 
+    if (globals->fit.prob_fn2[j] > 0.0)
+      for(k=0; k<n_params; k++)
+        dHy[k] += -1.0 * dfn2[k*groups + j] * (log(globals->fit.prob_fn2[j]) + 1.0) / count2;
+
+  for(k=0; k<n_params; k++) {
+    if ( globals->obj_function == normalized_mutual_information_objective ) {
+      if ((Hx + Hy) > 0.0)
+        gradient[k] = -1.0 * (dIxy[k] * (Hx + Hy) - Ixy * dHy[k]) / ((Hx + Hy)*(Hx + Hy));
+    }
+    else
+      gradient[k] = -1.0 * dIxy[k];
+  }
+}
+
+
 /* this function will calculate the mutual information similarity
    value based on the paper by Collignon, IPMI95, p 266 
 
@@ -340,32 +432,49 @@ float mutual_information_objective(VIO_Volume d1,
                                           VIO_Volume m2, 
                                           Arg_Data *globals)
 {
+  return( mutual_information_objective_with_gradient(d1, d2, m1, m2, globals,
+                                                     0, NULL, NULL) );
+}
+
+/* mutual_information_objective(), with its gradient with respect to
+   the n_params parameters of the transformation (n_params may be 0).
+   The derivative of the joint histogram comes from that of the
+   fractional values of the partial volume interpolation in d2, with
+   d pos2 / d p = dA/dp (node,1); it is blurred like the histogram. */
+
+float mutual_information_objective_with_gradient(VIO_Volume d1,
+                                                 VIO_Volume d2,
+                                                 VIO_Volume m1,
+                                                 VIO_Volume m2, 
+                                                 Arg_Data *globals,
+                                                 int n_params,
+                                                 VIO_Real dA[][3][4],
+                                                 VIO_Real gradient[])
+{
 
-  VectorR                        /* these variables are used to step through */
-    vector_step;                /* the 3D lattice                           */
   PointR
-    starting_position,
-    slice,
-    row,
-    col,
-    pos2;
-  VIO_Real
-    voxel_coord[3];
+    starting_position;
   int
-    i,j,
-    count1,count2,                /* number of nodes in first vol, second vol */
-    index1[8],
-    index2[8],
-    r,c,s;
+    i,j,t,s,
+    groups,
+    n_threads,
+    count1,count2;                /* number of nodes in first vol, second vol */
   
   VIO_Real
     min_range1, max_range1, range1,
-    min_range2, max_range2, range2,
-    intensity_vals1[8],                /* voxel values to index into histogram */
-    intensity_vals2[8],
-    fractional_vals1[8],        /* fractional values to add to histo */
-    fractional_vals2[8],
-    value1, value2;
+    min_range2, max_range2, range2;
+  VIO_Real                        /* [thread][...] partial histograms        */
+    *thread_fn1,
+    *thread_fn2,
+    *thread_hist,
+    *thread_dfn2,               /* [thread][param][...] their derivatives */
+    *thread_dhist,
+    **rows;
+  long
+    k, n_bins;
+  int
+    *thread_count1,
+    *thread_count2;
   double
     Hy, Hx, Ixy;		/* entropies */
   double
@@ -374,22 +483,51 @@ float mutual_information_objective(VIO_Volume d1,
     mutual_info_result;                        
 
   Voxel_space_struct *vox_space;
-  VIO_Transform          *trans;
+  Lattice_Mapping        mapping;
+  VIO_Real
+    *thread_nodes;              /* [thread] x,y,z in d2 of the nodes of a row */
 
 
                                 /* init any objective function specific
                                    stuff here                           */
   count1 = count2 = 0;
   mutual_info_result = 0.0;
-
-  for(i=0; i<globals->groups; i++) {
-    prob_fn1[i] = 0.0;
-    prob_fn2[i] = 0.0;
+  groups = globals->groups;
+
+                                /* each thread fills its own histograms,
+                                   added below in the order of the
+                                   threads: the result is reproducible for
+                                   a given number of threads */
+  n_threads = objective_threads(globals);
+  if (n_threads > globals->count[SLICE_IND]) n_threads = globals->count[SLICE_IND];
+  if (n_threads < 1) n_threads = 1;
+
+  ALLOC(thread_fn1,    n_threads * groups);
+  ALLOC(thread_fn2,    n_threads * groups);
+  ALLOC(thread_hist,   (long)n_threads * groups * groups);
+  ALLOC(thread_count1, n_threads);
+  ALLOC(thread_count2, n_threads);
+
+  for(i=0; i<n_threads * groups; i++) {
+    thread_fn1[i] = 0.0;
+    thread_fn2[i] = 0.0;
+  }
+  for(i=0; i<n_threads * groups * groups; i++) 
+    thread_hist[i] = 0.0;
+  for(t=0; t<n_threads; t++) 
+    thread_count1[t] = thread_count2[t] = 0;
+
+  n_bins       = (long)groups * groups;
+  thread_dfn2  = NULL;
+  thread_dhist = NULL;
+  if (n_params > 0) {
+    ALLOC(thread_dfn2,  (long)n_threads * n_params * groups);
+    ALLOC(thread_dhist, (long)n_threads * n_params * n_bins);
+    for(k=0; k<(long)n_threads * n_params * groups; k++) 
+      thread_dfn2[k] = 0.0;
+    for(k=0; k<(long)n_threads * n_params * n_bins; k++) 
+      thread_dhist[k] = 0.0;
   }
-
-  for(i=0; i<globals->groups; i++) 
-    for(j=0; j<globals->groups; j++) 
-      prob_hash_table[i][j] = 0.0;
 
   /*
     this was here, but appears to be useless!  dlc 04/2009
@@ -410,14 +548,61 @@ float mutual_information_objective(VIO_Volume d1,
 
   vox_space = new_voxel_space_struct();
   get_into_voxel_space(globals, vox_space, d1, d2);
-  trans = get_linear_transform_ptr(vox_space->voxel_to_voxel_space);
+  get_lattice_mapping(vox_space, &mapping);
+
+  ALLOC(thread_nodes, 3 * n_threads * globals->count[COL_IND]);
 
                                 /* get ready to step though the 3D lattice
                                    */
 
   fill_Point( starting_position, vox_space->start[VIO_X], vox_space->start[VIO_Y], vox_space->start[VIO_Z]);
 
+#ifdef _OPENMP
+#pragma omp parallel num_threads(n_threads) private(s)
+#endif
+  {
+  VectorR                        /* these variables are used to step through */
+    vector_step;                /* the 3D lattice                           */
+  PointR
+    slice,
+    row,
+    col,
+    pos2;
+  VIO_Real
+    voxel_coord[3];
+  int
+    i,j,t,r,c,k,
+    index1[8],
+    index2[8];
+  VIO_Real
+    intensity_vals1[8],                /* voxel values to index into histogram */
+    intensity_vals2[8],
+    fractional_vals1[8],        /* fractional values to add to histo */
+    fractional_vals2[8],
+    deriv2[8][3],               /* and their derivatives in volume 2 */
+    dpos2[12][3],               /* d pos2 / d param */
+    dvalue,
+    value1, value2,
+    *fn1, *fn2, *hist, *dfn2, *dhist,
+    *x2, *y2, *z2;
+
+  t = 0;
+#ifdef _OPENMP
+  t = omp_get_thread_num();
+#endif
+  fn1  = &thread_fn1[t * groups];
+  fn2  = &thread_fn2[t * groups];
+  hist = &thread_hist[(long)t * groups * groups];
+  dfn2  = (n_params > 0) ? &thread_dfn2[(long)t * n_params * groups] : NULL;
+  dhist = (n_params > 0) ? &thread_dhist[(long)t * n_params * n_bins] : NULL;
+  x2 = &thread_nodes[3 * t * globals->count[COL_IND]];
+  y2 = x2 + globals->count[COL_IND];
+  z2 = y2 + globals->count[COL_IND];
+
   /* ---------- step through all slices of lattice ------------- */
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
   for(s=0; s<globals->count[SLICE_IND]; s++) {
 
     SCALE_VECTOR( vector_step, vox_space->directions[SLICE_IND], s);
@@ -430,6 +615,7 @@ float mutual_information_objective(VIO_Volume d1,
       ADD_POINT_VECTOR( row, slice, vector_step );
       
       SCALE_POINT( col, row, 1.0); /* init first col position */
+      map_lattice_line(&mapping, s, r, 0, COL_IND, globals->count[COL_IND], x2, y2, z2);
 
       /* ---------- step through all cols of lattice ------------- */
       for(c=0; c<globals->count[COL_IND]; c++) {
@@ -452,13 +638,11 @@ float mutual_information_objective(VIO_Volume d1,
 
             if (value1 > globals->threshold[0]) { /* is the voxel in the thresholded region? */
 
-              count1++;
+              thread_count1[t]++;
                                 /* transform the node coordinate into
                                    volume 2                             */
 
-              my_homogenous_transform_point(trans,
-                                            Point_x(col), Point_y(col), Point_z(col), 1.0,
-                                            &Point_x(pos2), &Point_y(pos2), &Point_z(pos2));
+              fill_Point( pos2, x2[c], y2[c], z2[c] );
               
               /* get the node value in volume 2,
                  if it falls within the volume    */
@@ -477,19 +661,36 @@ float mutual_information_objective(VIO_Volume d1,
                   
                     if (value2 > globals->threshold[1]) { /* is the voxel in the thresholded region? */
 
-                       count2++;
+                       thread_count2[t]++;
                        
                        for(i=0; i<8; i++) {
                           index1[i] = VIO_ROUND( intensity_vals1[i] );
                           index2[i] = VIO_ROUND( intensity_vals2[i] );
-                          prob_fn1[ index1[i] ] += fractional_vals1[i];
-                          prob_fn2[ index2[i] ] += fractional_vals2[i];
+                          fn1[ index1[i] ] += fractional_vals1[i];
+                          fn2[ index2[i] ] += fractional_vals2[i];
                        }
                        for(i=0; i<8; i++) 
                           for(j=0; j<8; j++) {
-                             prob_hash_table[ index1[i] ][ index2[j] ] += 
+                             hist[ index1[i]*groups + index2[j] ] += 
                                 fractional_vals1[i]*fractional_vals2[j];
                           }
+
+                       if (n_params > 0) {
+                          partial_volume_derivatives(voxel_coord, deriv2);
+                          for(k=0; k<n_params; k++) 
+                             for(i=0; i<3; i++) 
+                                dpos2[k][i] = dA[k][i][0] * Point_x(col) + dA[k][i][1] * Point_y(col) +
+                                              dA[k][i][2] * Point_z(col) + dA[k][i][3];
+                          for(j=0; j<8; j++) 
+                             for(k=0; k<n_params; k++) {
+                                dvalue = deriv2[j][0] * dpos2[k][0] + deriv2[j][1] * dpos2[k][1] +
+                                         deriv2[j][2] * dpos2[k][2];
+                                dfn2[ k*groups + index2[j] ] += dvalue;
+                                for(i=0; i<8; i++) 
+                                   dhist[ k*n_bins + index1[i]*groups + index2[j] ] += 
+                                      fractional_vals1[i]*dvalue;
+                             }
+                       }
                        
                        
                     } /* if value2>thres */
@@ -504,6 +705,58 @@ float mutual_information_objective(VIO_Volume d1,
       } /* for c */
     } /* for r */
   } /* for s */
+  } /* omp parallel */
+
+                                /* add the histograms of the threads */
+  for(i=0; i<groups; i++) {
+    globals->fit.prob_fn1[i] = 0.0;
+    globals->fit.prob_fn2[i] = 0.0;
+    for(t=0; t<n_threads; t++) {
+      globals->fit.prob_fn1[i] += thread_fn1[t * groups + i];
+      globals->fit.prob_fn2[i] += thread_fn2[t * groups + i];
+    }
+  }
+
+  for(i=0; i<groups; i++) 
+    for(j=0; j<groups; j++) {
+      globals->fit.prob_hash_table[i][j] = 0.0;
+      for(t=0; t<n_threads; t++) 
+        globals->fit.prob_hash_table[i][j] += thread_hist[((long)t * groups + i) * groups + j];
+    }
+
+  for(t=0; t<n_threads; t++) {
+    count1 += thread_count1[t];
+    count2 += thread_count2[t];
+  }
+
+                                /* and their derivatives, added into
+                                   those of the 1st thread, blurred like
+                                   the histograms */
+  if (n_params > 0) {
+    for(t=1; t<n_threads; t++) {
+      for(k=0; k<(long)n_params * groups; k++) 
+        thread_dfn2[k] += thread_dfn2[(long)t * n_params * groups + k];
+      for(k=0; k<(long)n_params * n_bins; k++) 
+        thread_dhist[k] += thread_dhist[(long)t * n_params * n_bins + k];
+    }
+
+    ALLOC(rows, groups);
+    for(k=0; k<n_params; k++) {
+      blur_pdf(&thread_dfn2[k * groups], globals->blur_pdf, groups);
+      for(i=0; i<groups; i++) 
+        rows[i] = &thread_dhist[k * n_bins + (long)i * groups];
+      blur_jpdf(rows, globals->blur_pdf, groups);
+    }
+    FREE(rows);
+  }
+
+  FREE(thread_fn1);
+  FREE(thread_fn2);
+  FREE(thread_hist);
+  FREE(thread_count1);
+  FREE(thread_count2);
+  FREE(thread_nodes);
+  delete_voxel_space_struct(vox_space);
 
 
 
@@ -511,9 +764,9 @@ float mutual_information_objective(VIO_Volume d1,
      over the lattice nodes, blur the probability distribution functions
   */
 
-  blur_pdf (prob_fn1,        globals->blur_pdf, globals->groups);
-  blur_pdf (prob_fn2,        globals->blur_pdf, globals->groups);
-  blur_jpdf(prob_hash_table, globals->blur_pdf, globals->groups);  
+  blur_pdf (globals->fit.prob_fn1,        globals->blur_pdf, globals->groups);
+  blur_pdf (globals->fit.prob_fn2,        globals->blur_pdf, globals->groups);
+  blur_jpdf(globals->fit.prob_hash_table, globals->blur_pdf, globals->groups);  
 
   /* now finish the objective function calculation, 
      placing the final objective function value in  'mutual_info_result' */
@@ -530,13 +783,13 @@ float mutual_information_objective(VIO_Volume d1,
 
                                 /* normalize to count2  */
     for(i=0; i<globals->groups; i++) {
-      prob_fn1[i] /= count2;
-      prob_fn2[i] /= count2;
+      globals->fit.prob_fn1[i] /= count2;
+      globals->fit.prob_fn2[i] /= count2;
     }
     
     for(i=0; i<globals->groups; i++) 
       for(j=0; j<globals->groups; j++) 
-        prob_hash_table[i][j] /= count2;
+        globals->fit.prob_hash_table[i][j] /= count2;
     
 
 
@@ -574,16 +827,16 @@ float mutual_information_objective(VIO_Volume d1,
 
 
       for(i=0; i<globals->groups; i++) {	/* compute marginal entropies */
-	if (prob_fn1[i]>0.0) Hx += -1.0 * (double)prob_fn1[i] * log((double)prob_fn1[i]);
-	if (prob_fn2[i]>0.0) Hy += -1.0 * (double)prob_fn2[i] * log((double)prob_fn2[i]);	
+	if (globals->fit.prob_fn1[i]>0.0) Hx += -1.0 * (double)globals->fit.prob_fn1[i] * log((double)globals->fit.prob_fn1[i]);
+	if (globals->fit.prob_fn2[i]>0.0) Hy += -1.0 * (double)globals->fit.prob_fn2[i] * log((double)globals->fit.prob_fn2[i]);	
 	
       }
       
       for(i=0; i<globals->groups; i++) {        /* compute mutual information */
 	for(j=0; j<globals->groups; j++) {
-	  product = prob_fn1[i]*prob_fn2[j] ;
-	  if (prob_hash_table[i][j]>0.0 && product>0.0) 
-	    Ixy += (double)prob_hash_table[i][j] *  log( (double)( prob_hash_table[i][j]/product));
+	  product = globals->fit.prob_fn1[i]*globals->fit.prob_fn2[j] ;
+	  if (globals->fit.prob_hash_table[i][j]>0.0 && product>0.0) 
+	    Ixy += (double)globals->fit.prob_hash_table[i][j] *  log( (double)( globals->fit.prob_hash_table[i][j]/product));
 	}
       }
 	     
@@ -599,16 +852,23 @@ float mutual_information_objective(VIO_Volume d1,
       for(i=0; i<globals->groups; i++) 
 	for(j=0; j<globals->groups; j++) {
 	  
-	  if ( prob_fn1[i] > 0.0 &&  prob_fn2[j] > 0.0 && prob_hash_table[i][j]>0.0)
+	  if ( globals->fit.prob_fn1[i] > 0.0 &&  globals->fit.prob_fn2[j] > 0.0 && globals->fit.prob_hash_table[i][j]>0.0)
 	    /* this is the same as Ixy, just above */
-	    mutual_info_result += prob_hash_table[i][j] * 
-	      log( prob_hash_table[i][j] / (prob_fn1[i] * prob_fn2[j]) );
+	    mutual_info_result += globals->fit.prob_hash_table[i][j] * 
+	      log( globals->fit.prob_hash_table[i][j] / (globals->fit.prob_fn1[i] * globals->fit.prob_fn2[j]) );
 	}
     }
 
     mutual_info_result *= -1.0;
   }
 
+  if (n_params > 0) {
+    mutual_information_gradient(globals, n_params, thread_dhist, thread_dfn2,
+                                count2, Hx, Hy, Ixy, gradient);
+    FREE(thread_dfn2);
+    FREE(thread_dhist);
+  }
+
   if (globals->flags.debug) {
     (void)print ("%7d %7d -> %f ( %f %f %f )\n",count1,count2,mutual_info_result, Hx, Hy, Ixy);
   }
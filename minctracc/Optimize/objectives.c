@@ -118,10 +118,11 @@ static char rcsid[]="$Header: /static-cvsroot/registration/mni_autoreg/minctracc
 #include <Proglib.h>
 #include "vox_space.h"
 #include "interpolation.h"
+#include "objectives.h"
 
-extern Arg_Data *main_args;
-
-extern Segment_Table *segment_table;
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 int point_not_masked(VIO_Volume volume, 
                             VIO_Real wx, VIO_Real wy, VIO_Real wz);
@@ -147,6 +148,264 @@ void dump_iteration_information(int count1,int count2,float result,VIO_Transform
   }*/
 }
 
+/* ----------------------------------------------------------------------------
+   The objective functions below sum over the nodes of the whole 3D
+   lattice, for each evaluation of the transformation.  The nodes are
+   independent, so the lattice is split among -threads threads: each
+   part of the lattice (a slice, or a line for ssc) keeps its own
+   partial sums, which are then added in the order of the lattice.  The
+   result is thus the same for any number of threads.
+---------------------------------------------------------------------------- */
+
+void init_lattice_sums(Lattice_Sums *sums)
+{
+  sums->sum[0] = sums->sum[1] = sums->sum[2] = 0.0;
+  sums->count1 = sums->count2 = sums->count3 = 0;
+}
+
+/* number of threads sharing the lattice (-threads, 0 = all available) */
+
+int objective_threads(Arg_Data *globals)
+{
+#ifdef _OPENMP
+  if (globals->threads > 0)
+    return(globals->threads);
+  else
+    return(omp_get_max_threads());
+#else
+  return(1);
+#endif
+}
+
+
+/* ----------------------------------------------------------------------------
+   The nodes of the lattice in the source volume do not change during a
+   linear optimization: only the transformation does.  For xcorr, the
+   voxel of d1 nearest to each node (not masked by m1, and above
+   threshold[0]) and its value are found once, by
+   prepare_lattice_table(), and each evaluation of the objective
+   function only maps these voxels into d2.  The table belongs to the
+   optimization (globals->fit.lattice_table).
+---------------------------------------------------------------------------- */
+
+typedef struct Lattice_Table_struct Lattice_Table;
+
+struct Lattice_Table_struct {
+  VIO_Volume d1, m1;            /* the source volume and mask of the table  */
+  double     start[3];          /* the lattice and threshold it was built   */
+  double     step[3];           /*   for                                    */
+  int        count[3];
+  VectorR    directions[3];
+  double     threshold;
+  int        n_slices;
+  long       *slice_start;      /* [n_slices+1] first node of each slice    */
+  int        *slice_count1;     /* # of nodes of each slice in vol 1        */
+  VIO_Real   (*voxel)[3];       /* the voxel of d1 nearest to each node     */
+  VIO_Real   *value1;           /* and its value                            */
+};
+
+/* walk slice s of the lattice in d1, counting the nodes in d1 (count1)
+   and returning the # of nodes above threshold, stored in voxel[] and
+   value1[] when not NULL */
+
+static long walk_source_slice(Arg_Data *globals,
+                              Voxel_space_struct *vox_space,
+                              VIO_Volume d1,
+                              VIO_Volume m1,
+                              int s,
+                              int *count1,
+                              VIO_Real (*voxel)[3],
+                              VIO_Real *value1)
+{
+  VectorR
+    vector_step;
+  PointR
+    starting_position,
+    slice, row, col, node;
+  int
+    r,c;
+  long
+    n;
+  VIO_Real
+    value;
+
+  fill_Point( starting_position, vox_space->start[VIO_X], vox_space->start[VIO_Y], vox_space->start[VIO_Z]);
+
+  SCALE_VECTOR( vector_step, vox_space->directions[SLICE_IND], s);
+  ADD_POINT_VECTOR( slice, starting_position, vector_step );
+
+  n = 0;
+  *count1 = 0;
+
+  for(r=0; r<globals->count[ROW_IND]; r++) {
+      
+    SCALE_VECTOR( vector_step, vox_space->directions[ROW_IND], r);
+    ADD_POINT_VECTOR( row, slice, vector_step );
+      
+    SCALE_POINT( col, row, 1.0); /* init first col position */
+
+    for(c=0; c<globals->count[COL_IND]; c++) {
+                
+                                /* use the voxel center closest to this lattice
+                                   node. 
+                                */
+      fill_Point( node, VIO_ROUND(Point_x(col)), VIO_ROUND(Point_y(col)), VIO_ROUND(Point_z(col)) ); 
+
+      if (voxel_point_not_masked(m1, Point_x(node), Point_y(node), Point_z(node))) {
+          
+        if (nearest_neighbour_interpolant( d1, &node, &value )) {
+
+          (*count1)++;
+
+          if (value > globals->threshold[0]) {
+            if (voxel != NULL) {
+              voxel[n][0] = Point_x(node);
+              voxel[n][1] = Point_y(node);
+              voxel[n][2] = Point_z(node);
+              value1[n]   = value;
+            }
+            n++;
+          }
+        }
+      }
+        
+      ADD_POINT_VECTOR( col, col, vox_space->directions[COL_IND] );
+    }
+  }
+
+  return(n);
+}
+
+static Lattice_Table *build_lattice_table(Arg_Data *globals,
+                                          VIO_Volume d1,
+                                          VIO_Volume d2,
+                                          VIO_Volume m1)
+{
+  Lattice_Table
+    *table;
+  Voxel_space_struct
+    *vox_space;
+  int
+    s;
+
+  ALLOC(table, 1);
+  table->d1       = d1;
+  table->m1       = m1;
+  for(s=0; s<3; s++) {
+    table->start[s]      = globals->start[s];
+    table->step[s]       = globals->step[s];
+    table->count[s]      = globals->count[s];
+    table->directions[s] = globals->directions[s];
+  }
+  table->threshold = globals->threshold[0];
+  table->n_slices  = globals->count[SLICE_IND];
+  ALLOC(table->slice_start,  table->n_slices+1);
+  ALLOC(table->slice_count1, table->n_slices);
+
+  vox_space = new_voxel_space_struct();
+  get_into_voxel_space(globals, vox_space, d1, d2);
+
+                                /* count the nodes of each slice, */
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(objective_threads(globals)) schedule(dynamic)
+#endif
+  for(s=0; s<table->n_slices; s++)
+    table->slice_start[s+1] = walk_source_slice(globals, vox_space, d1, m1, s,
+                                                &table->slice_count1[s], NULL, NULL);
+
+  table->slice_start[0] = 0;
+  for(s=0; s<table->n_slices; s++)
+    table->slice_start[s+1] += table->slice_start[s];
+
+                                /* then store them */
+  ALLOC(table->voxel,  table->slice_start[table->n_slices] + 1);
+  ALLOC(table->value1, table->slice_start[table->n_slices] + 1);
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(objective_threads(globals)) schedule(dynamic)
+#endif
+  for(s=0; s<table->n_slices; s++)
+    (void)walk_source_slice(globals, vox_space, d1, m1, s, &table->slice_count1[s],
+                            &table->voxel[table->slice_start[s]],
+                            &table->value1[table->slice_start[s]]);
+
+  delete_voxel_space_struct(vox_space);
+
+  return(table);
+}
+
+static void free_lattice_table(Lattice_Table *table)
+{
+  FREE(table->slice_start);
+  FREE(table->slice_count1);
+  FREE(table->voxel);
+  FREE(table->value1);
+  FREE(table);
+}
+
+/* TRUE if table holds the lattice of globals in d1, masked by m1 */
+
+static VIO_BOOL lattice_table_matches(Lattice_Table *table,
+                                      Arg_Data *globals,
+                                      VIO_Volume d1,
+                                      VIO_Volume m1)
+{
+  int i, j;
+
+  if (table == NULL || table->d1 != d1 || table->m1 != m1 ||
+      table->threshold != globals->threshold[0])
+    return(FALSE);
+
+  for(i=0; i<3; i++) {
+    if (table->start[i] != globals->start[i] ||
+        table->step[i]  != globals->step[i]  ||
+        table->count[i] != globals->count[i])
+      return(FALSE);
+    for(j=0; j<3; j++)
+      if (table->directions[i].coords[j] != globals->directions[i].coords[j])
+        return(FALSE);
+  }
+
+  return(TRUE);
+}
+
+/* keep the source lattice of d1 (masked by m1) in globals->fit until
+   delete_lattice_table(); d2 is only needed to build the voxel space */
+
+void prepare_lattice_table(Arg_Data *globals,
+                           VIO_Volume d1,
+                           VIO_Volume d2,
+                           VIO_Volume m1)
+{
+  delete_lattice_table(globals);
+  globals->fit.lattice_table = build_lattice_table(globals, d1, d2, m1);
+}
+
+void delete_lattice_table(Arg_Data *globals)
+{
+  if (globals->fit.lattice_table != NULL) {
+    free_lattice_table(globals->fit.lattice_table);
+    globals->fit.lattice_table = NULL;
+  }
+}
+
+/* the value of volume at voxel, with the derivatives of the tri-linear
+   interpolant along the voxel axes; the value is that of the
+   interpolant selected by the user */
+
+static int sample_with_gradient(Arg_Data *globals,
+                                VIO_Volume volume, PointR *voxel,
+                                VIO_Real *value, VIO_Real gradient[])
+{
+  VIO_Real tmp;
+
+  if (globals->interpolant == trilinear_interpolant)
+    return( trilinear_interpolant_with_gradient(volume, voxel, value, gradient) );
+
+  (void)trilinear_interpolant_with_gradient(volume, voxel, &tmp, gradient);
+  return( INTERPOLATE_TRUE_VALUE( globals, volume, voxel, value ) );
+}
+
 /* ----------------------------- MNI Header -----------------------------------
 @NAME       : xcorr_objective
 @INPUT      : volumetric data, for use in correlation.  
@@ -215,40 +474,58 @@ float xcorr_objective(VIO_Volume d1,
                       VIO_Volume m2, 
                       Arg_Data *globals)
 {
+  return( xcorr_objective_with_gradient(d1, d2, m1, m2, globals, 0, NULL, NULL) );
+}
 
-  VectorR
-    vector_step;
+/* xcorr_objective(), with its gradient with respect to the n_params
+   parameters of the transformation (n_params may be 0).
 
-  PointR
-    starting_position,
-    slice,
-    row,
-    col,
-    pos2,
-    voxel;
+   With v2 the value of d2 at A x (A the voxel to voxel transformation,
+   x the node), d v2 / d p = grad(v2) . (dA/dp x), so
+
+     d f1 / d p = sum( v1 grad(v2) x' ) : dA/dp
+     d f3 / d p = 2 sum( v2 grad(v2) x' ) : dA/dp
+
+   where ':' is the sum of the products of the elements of the two
+   3x4 matrices.  grad(v2) is that of the tri-linear interpolant; it is
+   an approximation for -tricubic. */
+
+float xcorr_objective_with_gradient(VIO_Volume d1,
+                                    VIO_Volume d2,
+                                    VIO_Volume m1,
+                                    VIO_Volume m2, 
+                                    Arg_Data *globals,
+                                    int n_params,
+                                    VIO_Real dA[][3][4],
+                                    VIO_Real gradient[])
+{
 
   int
-    r,c,s;
+    s;
 
-  VIO_Real
-    value1, value2;
-  
   VIO_Real
     s1,s2,s3;                   /* to store the sums for f1,f2,f3 */
   float 
     result;                                /* the result */
   int 
     count1,count2;
+  Lattice_Sums
+    *slice_sums;                /* the sums of each slice of the lattice */
+  VIO_Real
+    (*slice_grads)[2][3][4],    /* sum(v1 grad(v2) x'), sum(v2 grad(v2) x')
+                                   of each slice, for the gradient         */
+    grads[2][3][4],
+    df1, df3;
+  int
+    i,j,k;
+  Lattice_Table
+    *table, *local_table;
 
 
   Voxel_space_struct *vox_space;
   VIO_Transform          *trans;
 
 
-                                /* prepare counters for this objective
-                                   function */
-  s1 = s2 = s3 = 0.0;
-  count1 = count2 = 0;
                                 /* prepare data for the voxel-to-voxel
                                    space transformation (instead of the
                                    general but inefficient world-world
@@ -261,77 +538,132 @@ float xcorr_objective(VIO_Volume d1,
 
   trans = get_linear_transform_ptr(vox_space->voxel_to_voxel_space);
 
+                                /* the nodes of the lattice in d1, kept
+                                   during an optimization or found now */
+  local_table = NULL;
+  table = globals->fit.lattice_table;
+  if (!lattice_table_matches(table, globals, d1, m1))
+    table = local_table = build_lattice_table(globals, d1, d2, m1);
 
-                                /* loop through all nodes of the lattice */
-                                                                                                                              
-  fill_Point( starting_position, vox_space->start[VIO_X], vox_space->start[VIO_Y], vox_space->start[VIO_Z]);
+  ALLOC(slice_sums, globals->count[SLICE_IND]);
+  slice_grads = NULL;
+  if (n_params > 0)
+    ALLOC(slice_grads, globals->count[SLICE_IND]);
 
   /* ---------- step through all slices of lattice ------------- */
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(objective_threads(globals)) schedule(dynamic)
+#endif
   for(s=0; s<globals->count[SLICE_IND]; s++) { 
 
-    SCALE_VECTOR( vector_step, vox_space->directions[SLICE_IND], s);
-    ADD_POINT_VECTOR( slice, starting_position, vector_step );
-
-    /* ---------- step through all rows of lattice ------------- */
-    for(r=0; r<globals->count[ROW_IND]; r++) {
-      
-      SCALE_VECTOR( vector_step, vox_space->directions[ROW_IND], r);
-      ADD_POINT_VECTOR( row, slice, vector_step );
-      
-      SCALE_POINT( col, row, 1.0); /* init first col position */
-
-      /* ---------- step through all cols of lattice ------------- */
-      for(c=0; c<globals->count[COL_IND]; c++) {
-                
-                                /* use the voxel center closest to this lattice
-                                   node. 
-                                */
-        fill_Point( voxel, VIO_ROUND(Point_x(col)), VIO_ROUND(Point_y(col)), VIO_ROUND(Point_z(col)) ); 
-
-
-        if (voxel_point_not_masked(m1, Point_x(voxel), Point_y(voxel), Point_z(voxel))) {
-          
-          if (nearest_neighbour_interpolant( d1, &voxel, &value1 )) {
-
-            count1++;
-
-            my_homogenous_transform_point(trans,
-                                          Point_x(voxel), Point_y(voxel), Point_z(voxel), 1.0,
-                                          &Point_x(pos2), &Point_y(pos2), &Point_z(pos2));
-
-         
-            fill_Point( voxel, Point_x(pos2), Point_y(pos2), Point_z(pos2) ); /* build the voxel POINT */
-        
-            if (voxel_point_not_masked(m2, Point_x(pos2), Point_y(pos2), Point_z(pos2))) {
+    PointR
+      pos2;
+    long
+      n;
+    int
+      i,j;
+    VIO_Real
+      value1, value2,
+      node[4],
+      grad2[3];
+    Lattice_Sums
+      *sums = &slice_sums[s];
+
+    init_lattice_sums(sums);
+    if (slice_grads != NULL)
+      for(i=0; i<3; i++)
+        for(j=0; j<4; j++)
+          slice_grads[s][0][i][j] = slice_grads[s][1][i][j] = 0.0;
+
+    sums->count1 = table->slice_count1[s];
+    node[3] = 1.0;
+
+    for(n=table->slice_start[s]; n<table->slice_start[s+1]; n++) {
+
+      node[0] = table->voxel[n][0];
+      node[1] = table->voxel[n][1];
+      node[2] = table->voxel[n][2];
+      value1  = table->value1[n];
+
+      my_homogenous_transform_point(trans,
+                                    node[0], node[1], node[2], 1.0,
+                                    &Point_x(pos2), &Point_y(pos2), &Point_z(pos2));
+
+      if (voxel_point_not_masked(m2, Point_x(pos2), Point_y(pos2), Point_z(pos2))) {
               
-              if (INTERPOLATE_TRUE_VALUE( d2, &voxel, &value2 )) {
-
+        if (slice_grads == NULL ?
+            INTERPOLATE_TRUE_VALUE( globals, d2, &pos2, &value2 ) :
+            sample_with_gradient( globals, d2, &pos2, &value2, grad2 )) {
 
-                if (value1 > globals->threshold[0] && value2 > globals->threshold[1] ) {
+          if (value2 > globals->threshold[1] ) {
                   
-                  count2++;
-
-                  s1 += value1*value2;
-                  s2 += value1*value1;
-                  s3 += value2*value2;
+            sums->count2++;
+
+            sums->sum[0] += value1*value2;
+            sums->sum[1] += value1*value1;
+            sums->sum[2] += value2*value2;
+
+            if (slice_grads != NULL) {
+              for(i=0; i<3; i++)
+                for(j=0; j<4; j++) {
+                  slice_grads[s][0][i][j] += value1 * grad2[i] * node[j];
+                  slice_grads[s][1][i][j] += value2 * grad2[i] * node[j];
+                }
+            }
                   
-                } 
+          } 
                 
-              } /* if voxel in d2 */
-            } /* if point in mask volume two */
-          } /* if voxel in d1 */
-        } /* if point in mask volume one */
-        
-        ADD_POINT_VECTOR( col, col, vox_space->directions[COL_IND] );
-        
-      } /* for c */
-    } /* for r */
+        } /* if voxel in d2 */
+      } /* if point in mask volume two */
+    } /* for n */
   } /* for s */
+
+  if (local_table != NULL)
+    free_lattice_table(local_table);
+
+                                /* add the slices, in order */
+  s1 = s2 = s3 = 0.0;
+  count1 = count2 = 0;
+  for(s=0; s<globals->count[SLICE_IND]; s++) {
+    s1 += slice_sums[s].sum[0];
+    s2 += slice_sums[s].sum[1];
+    s3 += slice_sums[s].sum[2];
+    count1 += slice_sums[s].count1;
+    count2 += slice_sums[s].count2;
+  }
   
   result = 1.0 - s1 / (sqrt((double)s2)*sqrt((double)s3));
+
+  if (n_params > 0) {
+    for(i=0; i<3; i++)
+      for(j=0; j<4; j++) {
+        grads[0][i][j] = grads[1][i][j] = 0.0;
+        for(s=0; s<globals->count[SLICE_IND]; s++) {
+          grads[0][i][j] += slice_grads[s][0][i][j];
+          grads[1][i][j] += slice_grads[s][1][i][j];
+        }
+      }
+
+                                /* d/dp of 1 - f1 / sqrt(f2 f3) */
+    for(k=0; k<n_params; k++) {
+      df1 = df3 = 0.0;
+      for(i=0; i<3; i++)
+        for(j=0; j<4; j++) {
+          df1 += grads[0][i][j] * dA[k][i][j];
+          df3 += 2.0 * grads[1][i][j] * dA[k][i][j];
+        }
+      if (s2 > 0.0 && s3 > 0.0)
+        gradient[k] = -df1 / (sqrt(s2)*sqrt(s3)) + 0.5 * s1 * df3 / (sqrt(s2)*s3*sqrt(s3));
+      else
+        gradient[k] = 0.0;
+    }
+
+    FREE(slice_grads);
+  }
   
   if (globals->flags.debug) dump_iteration_information(count1,count2,result,trans);/*(void)print ("%7d %7d -> %10.8f\n",count1,count2,result);*/
 
+  FREE(slice_sums);
   delete_voxel_space_struct(vox_space);
 
   return (result);
@@ -339,29 +671,104 @@ float xcorr_objective(VIO_Volume d1,
 }
 
 
+/* sign changes of (d1-d2) along one line of the lattice, counted from
+   both possible states of 'greater' at the start of the line, so that
+   the lines can be counted concurrently and chained afterwards */
+
+typedef struct {
+  unsigned long crossings[2];   /* # of sign changes, from greater=FALSE,TRUE */
+  int           greater[2];     /* and the state at the end of the line       */
+  int           count1, count2;
+} Sign_Changes;
+
+static void init_sign_changes(Sign_Changes *changes)
+{
+  changes->crossings[FALSE] = changes->crossings[TRUE] = 0;
+  changes->greater[FALSE]   = FALSE;
+  changes->greater[TRUE]    = TRUE;
+  changes->count1 = changes->count2 = 0;
+}
+
+/* compare d1 and d2 at the lattice node col (in voxels of d1), mapped
+   to pos2 in voxels of d2 */
+
+static void count_sign_change(VIO_Volume d1,
+                              VIO_Volume d2,
+                              VIO_Volume m1,
+                              VIO_Volume m2,
+                              Arg_Data *globals,
+                              PointR *col,
+                              PointR pos2,
+                              Sign_Changes *changes)
+{
+  PointR
+    voxel;
+  VIO_Real
+    value1, value2;
+  int
+    k;
+
+                                /* use the voxel center closest to this lattice
+                                   node. 
+                                */
+  fill_Point( voxel, VIO_ROUND(Point_x(*col)), VIO_ROUND(Point_y(*col)), VIO_ROUND(Point_z(*col)) ); 
+        
+  if (voxel_point_not_masked(m1, Point_x(voxel), Point_y(voxel), Point_z(voxel))) {
+          
+    if (INTERPOLATE_TRUE_VALUE( globals, d1, &voxel, &value1 )) {
+
+      changes->count1++;
+
+      fill_Point( voxel, Point_x(pos2), Point_y(pos2), Point_z(pos2) ); /* build the voxel POINT */
+        
+      if (voxel_point_not_masked(m2, Point_x(pos2), Point_y(pos2), Point_z(pos2))) {
+              
+        if (INTERPOLATE_TRUE_VALUE( globals, d2, &voxel, &value2 )) {
+
+          changes->count2++;
+
+          for(k=FALSE; k<=TRUE; k++)
+            if (!((changes->greater[k] && value1>value2) || 
+                  (!changes->greater[k] && value1<value2))) {
+              changes->greater[k] = !changes->greater[k];
+              changes->crossings[k]++;
+            } 
+                
+        } /* if voxel in d2 */
+      } /* if point in mask volume two */
+    } /* if voxel in d1 */
+  } /* if point in mask volume one */
+}
+
+/* follow 'greater' through the n lines, in order, accumulating their
+   sign changes */
+
+static void chain_sign_changes(Sign_Changes changes[], int n,
+                               int *greater, unsigned long *zero_crossings,
+                               int *count1, int *count2)
+{
+  int i;
+
+  for(i=0; i<n; i++) {
+    *zero_crossings += changes[i].crossings[*greater];
+    *greater         = changes[i].greater[*greater];
+    *count1         += changes[i].count1;
+    *count2         += changes[i].count2;
+  }
+}
+
 float ssc_objective(VIO_Volume d1,
                     VIO_Volume d2,
                     VIO_Volume m1,
                     VIO_Volume m2, 
                     Arg_Data *globals)
 {
-  VectorR
-    vector_step;
-
   PointR
-    starting_position,
-    slice,
-    row,
-    col,
-    pos2,
-    voxel;
+    starting_position;
 
   int
-    r,c,s;
+    c,s,n_lines;
 
-  VIO_Real
-    value1, value2;
-  
   float 
     result;                                /* the result */
   int 
@@ -369,8 +776,12 @@ float ssc_objective(VIO_Volume d1,
     greater;
   unsigned  long
     zero_crossings;
+  Sign_Changes
+    *changes;                   /* the sign changes of each line */
   Voxel_space_struct *vox_space;
-  VIO_Transform          *trans;
+  Lattice_Mapping        mapping;
+  VIO_Real
+    *row_nodes;                 /* x,y,z in d2 of the nodes of a row, per slice */
 
                                 /* prepare counters for this objective
                                    function */
@@ -384,15 +795,39 @@ float ssc_objective(VIO_Volume d1,
 
   vox_space = new_voxel_space_struct();
   get_into_voxel_space(globals, vox_space, d1, d2);
-  trans = get_linear_transform_ptr(vox_space->voxel_to_voxel_space);
+  get_lattice_mapping(vox_space, &mapping);
+
+                                /* the nodes of each row, mapped into d2 */
+  ALLOC(row_nodes, 3 * globals->count[SLICE_IND] * globals->count[COL_IND]);
+
+  n_lines = globals->count[SLICE_IND];
+  if (globals->count[COL_IND] > n_lines)
+    n_lines = globals->count[COL_IND];
+  ALLOC(changes, n_lines);
 
   fill_Point( starting_position, vox_space->start[VIO_X], vox_space->start[VIO_Y], vox_space->start[VIO_Z]);
 
   /* ------------------------  count along rows (fastest=col) first ------------------- */
 
 
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(objective_threads(globals)) schedule(dynamic)
+#endif
   for(s=0; s<globals->count[SLICE_IND]; s++) {
 
+    VectorR
+      vector_step;
+    PointR
+      slice, row, col, pos2;
+    int
+      r,c;
+    VIO_Real
+      *x2 = &row_nodes[3 * s * globals->count[COL_IND]],
+      *y2 = x2 + globals->count[COL_IND],
+      *z2 = y2 + globals->count[COL_IND];
+
+    init_sign_changes(&changes[s]);
+
     SCALE_VECTOR( vector_step, vox_space->directions[SLICE_IND], s);
     ADD_POINT_VECTOR( slice, starting_position, vector_step );
 
@@ -402,41 +837,12 @@ float ssc_objective(VIO_Volume d1,
       ADD_POINT_VECTOR( row, slice, vector_step );
       
       SCALE_POINT( col, row, 1.0); /* init first col position */
-      for(c=0; c<globals->count[COL_IND]; c++) {
-        
-                                /* use the voxel center closest to this lattice
-                                   node. 
-                                */
-        fill_Point( voxel, VIO_ROUND(Point_x(col)), VIO_ROUND(Point_y(col)), VIO_ROUND(Point_z(col)) ); 
-        
-        if (voxel_point_not_masked(m1, Point_x(voxel), Point_y(voxel), Point_z(voxel))) {
-          
-          if (INTERPOLATE_TRUE_VALUE( d1, &voxel, &value1 )) {
-
-            count1++;
-
-            my_homogenous_transform_point(trans,
-                                          Point_x(col), Point_y(col), Point_z(col), 1.0,
-                                          &Point_x(pos2), &Point_y(pos2), &Point_z(pos2));
+      map_lattice_line(&mapping, s, r, 0, COL_IND, globals->count[COL_IND], x2, y2, z2);
 
-            
-            fill_Point( voxel, Point_x(pos2), Point_y(pos2), Point_z(pos2) ); /* build the voxel POINT */
+      for(c=0; c<globals->count[COL_IND]; c++) {
         
-            if (voxel_point_not_masked(m2, Point_x(pos2), Point_y(pos2), Point_z(pos2))) {
-              
-              if (INTERPOLATE_TRUE_VALUE( d2, &voxel, &value2 )) {
-
-                count2++;
-
-                if (!((greater && value1>value2) || (!greater && value1<value2))) {
-                  greater = !greater;
-                  zero_crossings++;
-                } 
-                
-              } /* if voxel in d2 */
-            } /* if point in mask volume two */
-          } /* if voxel in d1 */
-        } /* if point in mask volume one */
+        fill_Point( pos2, x2[c], y2[c], z2[c] );
+        count_sign_change(d1, d2, m1, m2, globals, &col, pos2, &changes[s]);
         
         ADD_POINT_VECTOR( col, col, vox_space->directions[COL_IND] );
         
@@ -444,10 +850,25 @@ float ssc_objective(VIO_Volume d1,
     } /* for r */
   } /* for s */
 
+  chain_sign_changes(changes, globals->count[SLICE_IND],
+                     &greater, &zero_crossings, &count1, &count2);
+
   /* ------------------------  count along cols second  --(fastest=row)--------------- */
 
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(objective_threads(globals)) schedule(dynamic)
+#endif
   for(s=0; s<globals->count[SLICE_IND]; s++) {
 
+    VectorR
+      vector_step;
+    PointR
+      slice, row, col, pos2;
+    int
+      r,c;
+
+    init_sign_changes(&changes[s]);
+
     SCALE_VECTOR( vector_step, vox_space->directions[SLICE_IND], s);
     ADD_POINT_VECTOR( slice, starting_position, vector_step );
 
@@ -457,41 +878,12 @@ float ssc_objective(VIO_Volume d1,
       ADD_POINT_VECTOR( col, slice, vector_step );
       
       SCALE_POINT( row, col, 1.0); /* init first row position */
+      map_lattice_line(&mapping, s, 0, c, ROW_IND, 1,
+                       &Point_x(pos2), &Point_y(pos2), &Point_z(pos2));
 
       for(r=0; r<globals->count[ROW_IND]; r++) {
 
-                                /* use the voxel center closest to this lattice
-                                   node. 
-                                */
-        fill_Point( voxel, VIO_ROUND(Point_x(col)), VIO_ROUND(Point_y(col)), VIO_ROUND(Point_z(col)) ); 
-        
-        if (voxel_point_not_masked(m1, Point_x(voxel), Point_y(voxel), Point_z(voxel))) {
-          
-          if (INTERPOLATE_TRUE_VALUE( d1, &voxel, &value1 )) {
-
-            count1++;
-
-            my_homogenous_transform_point(trans,
-                                          Point_x(col), Point_y(col), Point_z(col), 1.0,
-                                          &Point_x(pos2), &Point_y(pos2), &Point_z(pos2));
-            
-            fill_Point( voxel, Point_x(pos2), Point_y(pos2), Point_z(pos2) ); /* build the voxel POINT */
-        
-            if (voxel_point_not_masked(m2,Point_x(pos2), Point_y(pos2), Point_z(pos2))) {
-              
-              if (INTERPOLATE_TRUE_VALUE( d2, &voxel, &value2 )) {
-
-                count2++;
-
-                if (!((greater && value1>value2) || (!greater && value1<value2))) {
-                  greater = !greater;
-                  zero_crossings++;
-                } 
-                
-              } /* if voxel in d2 */
-            } /* if point in mask volume two */
-          } /* if voxel in d1 */
-        } /* if point in mask volume one */
+        count_sign_change(d1, d2, m1, m2, globals, &col, pos2, &changes[s]);
         
         ADD_POINT_VECTOR( row, row, vox_space->directions[ROW_IND] );
         
@@ -499,16 +891,32 @@ float ssc_objective(VIO_Volume d1,
     } /* for r */
   } /* for s */
 
+  chain_sign_changes(changes, globals->count[SLICE_IND],
+                     &greater, &zero_crossings, &count1, &count2);
 
 
 
   /* ------------------------  count along slices last ------------------------ */
 
 
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(objective_threads(globals)) schedule(dynamic)
+#endif
   for(c=0; c<globals->count[COL_IND]; c++) {
     
+    VectorR
+      vector_step;
+    PointR
+      slice, row, col, pos2;
+    int
+      r,s;
+
+    init_sign_changes(&changes[c]);
+
     SCALE_VECTOR( vector_step, vox_space->directions[COL_IND], c);
     ADD_POINT_VECTOR( col, starting_position, vector_step );
+    map_lattice_line(&mapping, 0, 0, c, SLICE_IND, 1,
+                     &Point_x(pos2), &Point_y(pos2), &Point_z(pos2));
 
     for(r=0; r<globals->count[ROW_IND]; r++) {
       
@@ -519,38 +927,7 @@ float ssc_objective(VIO_Volume d1,
 
       for(s=0; s<globals->count[SLICE_IND]; s++) {
         
-                                /* use the voxel center closest to this lattice
-                                   node. 
-                                */
-        fill_Point( voxel, VIO_ROUND(Point_x(col)), VIO_ROUND(Point_y(col)), VIO_ROUND(Point_z(col)) ); 
-        
-        if (voxel_point_not_masked(m1, Point_x(voxel), Point_y(voxel), Point_z(voxel))) {
-          
-          if (INTERPOLATE_TRUE_VALUE( d1, &voxel, &value1 )) {
-
-            count1++;
-
-            my_homogenous_transform_point(trans,
-                                          Point_x(col), Point_y(col), Point_z(col), 1.0,
-                                          &Point_x(pos2), &Point_y(pos2), &Point_z(pos2));
-            
-            fill_Point( voxel, Point_x(pos2), Point_y(pos2), Point_z(pos2) ); /* build the voxel POINT */
-
-            if (voxel_point_not_masked(m2, Point_x(pos2), Point_y(pos2), Point_z(pos2))) {
-              
-              if (INTERPOLATE_TRUE_VALUE( d2, &voxel, &value2 )) {
-
-                count2++;
-
-                if (!((greater && value1>value2) || (!greater && value1<value2))) {
-                  greater = !greater;
-                  zero_crossings++;
-                } 
-                
-              } /* if voxel in d2 */
-            } /* if point in mask volume two */
-          } /* if voxel in d1 */
-        } /* if point in mask volume one */
+        count_sign_change(d1, d2, m1, m2, globals, &col, pos2, &changes[c]);
         
         ADD_POINT_VECTOR( slice, slice, vox_space->directions[SLICE_IND] );
         
@@ -558,11 +935,18 @@ float ssc_objective(VIO_Volume d1,
     } /* for r */
   } /* for s */
 
+  chain_sign_changes(changes, globals->count[COL_IND],
+                     &greater, &zero_crossings, &count1, &count2);
+
 
   result = -1.0 * (float)zero_crossings;
 
   if (globals->flags.debug) (void)print ("%7d %7d -> %10.8f\n",count1,count2,result);
 
+  FREE(changes);
+  FREE(row_nodes);
+  delete_voxel_space_struct(vox_space);
+
   return (result);
   
 }
@@ -573,31 +957,24 @@ float zscore_objective(VIO_Volume d1,
                            VIO_Volume m2, 
                            Arg_Data *globals)
 {
-  VectorR
-    vector_step;
-
   PointR 
-    starting_position,
-    slice,
-    row,
-    col,
-    pos2,
-    voxel;
+    starting_position;
 
   int
-    r,c,s;
+    s;
 
-  VIO_Real
-    value1, value2;
-  
   VIO_Real
     z2_sum;
   float 
     result;                                /* the result */
   int 
     count1,count2,count3;
+  Lattice_Sums
+    *slice_sums;                /* the sums of each slice of the lattice */
   Voxel_space_struct *vox_space;
-  VIO_Transform          *trans;
+  Lattice_Mapping        mapping;
+  VIO_Real
+    *row_nodes;                 /* x,y,z in d2 of the nodes of a row, per slice */
 
 
                                 /* prepare data for the voxel-to-voxel
@@ -607,16 +984,37 @@ float zscore_objective(VIO_Volume d1,
 
   vox_space = new_voxel_space_struct();
   get_into_voxel_space(globals, vox_space, d1, d2);
-  trans = get_linear_transform_ptr(vox_space->voxel_to_voxel_space);
+  get_lattice_mapping(vox_space, &mapping);
 
+                                /* the nodes of each row, mapped into d2 */
+  ALLOC(row_nodes, 3 * globals->count[SLICE_IND] * globals->count[COL_IND]);
 
-  fill_Point( starting_position, vox_space->start[VIO_X], vox_space->start[VIO_Y], vox_space->start[VIO_Z]);
+  ALLOC(slice_sums, globals->count[SLICE_IND]);
 
-  z2_sum = 0.0;
-  count1 = count2 = count3 = 0;
+  fill_Point( starting_position, vox_space->start[VIO_X], vox_space->start[VIO_Y], vox_space->start[VIO_Z]);
 
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(objective_threads(globals)) schedule(dynamic)
+#endif
   for(s=0; s<globals->count[SLICE_IND]; s++) {
 
+    VectorR
+      vector_step;
+    PointR
+      slice, row, col, pos2, voxel;
+    int
+      r,c;
+    VIO_Real
+      value1, value2;
+    VIO_Real
+      *x2 = &row_nodes[3 * s * globals->count[COL_IND]],
+      *y2 = x2 + globals->count[COL_IND],
+      *z2 = y2 + globals->count[COL_IND];
+    Lattice_Sums
+      *sums = &slice_sums[s];
+
+    init_lattice_sums(sums);
+
     SCALE_VECTOR( vector_step, vox_space->directions[SLICE_IND], s);
     ADD_POINT_VECTOR( slice, starting_position, vector_step );
 
@@ -626,6 +1024,8 @@ float zscore_objective(VIO_Volume d1,
       ADD_POINT_VECTOR( row, slice, vector_step );
       
       SCALE_POINT( col, row, 1.0); /* init first col position */
+      map_lattice_line(&mapping, s, r, 0, COL_IND, globals->count[COL_IND], x2, y2, z2);
+
       for(c=0; c<globals->count[COL_IND]; c++) {
         
                                 /* use the voxel center closest to this lattice
@@ -635,25 +1035,23 @@ float zscore_objective(VIO_Volume d1,
         
         if (voxel_point_not_masked(m1, Point_x(voxel), Point_y(voxel), Point_z(voxel))) {
           
-          if (INTERPOLATE_TRUE_VALUE( d1, &voxel, &value1 )) {
+          if (INTERPOLATE_TRUE_VALUE( globals, d1, &voxel, &value1 )) {
 
-            count1++;
+            sums->count1++;
 
-            my_homogenous_transform_point(trans,
-                                          Point_x(col), Point_y(col), Point_z(col), 1.0,
-                                          &Point_x(pos2), &Point_y(pos2), &Point_z(pos2));
+            fill_Point( pos2, x2[c], y2[c], z2[c] );
             
             fill_Point( voxel, Point_x(pos2), Point_y(pos2), Point_z(pos2) ); /* build the voxel POINT */
         
             if (voxel_point_not_masked(m2, Point_x(pos2), Point_y(pos2), Point_z(pos2))) {
               
-              if (INTERPOLATE_TRUE_VALUE( d2, &voxel, &value2 )) {
+              if (INTERPOLATE_TRUE_VALUE( globals, d2, &voxel, &value2 )) {
 
-                count2++;
+                sums->count2++;
 
                 if (fabs(value1) > globals->threshold[0] && fabs(value2) > globals->threshold[1] ) {
-                  count3++;
-                  z2_sum +=  (value1-value2)*(value1-value2);
+                  sums->count3++;
+                  sums->sum[0] +=  (value1-value2)*(value1-value2);
                 } 
         
                 
@@ -668,6 +1066,16 @@ float zscore_objective(VIO_Volume d1,
     } /* for r */
   } /* for s */
 
+                                /* add the slices, in order */
+  z2_sum = 0.0;
+  count1 = count2 = count3 = 0;
+  for(s=0; s<globals->count[SLICE_IND]; s++) {
+    z2_sum += slice_sums[s].sum[0];
+    count1 += slice_sums[s].count1;
+    count2 += slice_sums[s].count2;
+    count3 += slice_sums[s].count3;
+  }
+
   if (count3 > 0)
     result = sqrt((double)z2_sum) / count3;
   else
@@ -675,6 +1083,10 @@ float zscore_objective(VIO_Volume d1,
 
   if (globals->flags.debug) (void)print ("%7d %7d %7d -> %10.8f\n",count1,count2,count3,result);
   
+  FREE(slice_sums);
+  FREE(row_nodes);
+  delete_voxel_space_struct(vox_space);
+
   return (result);
   
 }
@@ -687,26 +1099,13 @@ float vr_objective(VIO_Volume d1,
                           VIO_Volume m2, 
                           Arg_Data *globals)
 {
-  VectorR
-    vector_step;
-
   PointR
-    starting_position,
-    slice,
-    row,
-    col,
-    pos2,
-    voxel;
+    starting_position;
 
   int
-    r,c,s;
+    s;
 
-  VIO_Real
-    value1, value2,
-    voxel_value1;
-  
   float
-    rat,
     total_variance,
     *limits,
     *rat_sum,
@@ -716,23 +1115,41 @@ float vr_objective(VIO_Volume d1,
     total_count,
     *count3;
 
+  VIO_Real                      /* [slice][group] partial sums */
+    *slice_rat_sum,
+    *slice_rat2_sum,
+    sum1, sum2;
+  unsigned long
+    *slice_count3;
+  Lattice_Sums
+    *slice_sums;                /* count1,count2 of each slice */
+
   float 
     result;                                /* the result */
   int 
-    index,i,count1,count2;
+    index,i,groups,count1,count2;
   Voxel_space_struct *vox_space;
-  VIO_Transform          *trans;
+  Lattice_Mapping        mapping;
+  VIO_Real
+    *row_nodes;                 /* x,y,z in d2 of the nodes of a row, per slice */
 
 
 
                                 /* build segmentation info!  */
 
-  ALLOC(rat_sum  ,1+segment_table->groups);
-  ALLOC(rat2_sum ,1+segment_table->groups);
-  ALLOC(var      ,1+segment_table->groups);
-  ALLOC(limits   ,1+segment_table->groups);
+  groups = globals->fit.segment_table->groups;
+
+  ALLOC(rat_sum  ,1+groups);
+  ALLOC(rat2_sum ,1+groups);
+  ALLOC(var      ,1+groups);
+  ALLOC(limits   ,1+groups);
+
+  ALLOC(count3, (groups+1));
 
-  ALLOC(count3, (segment_table->groups+1));
+  ALLOC(slice_rat_sum,  globals->count[SLICE_IND] * (groups+1));
+  ALLOC(slice_rat2_sum, globals->count[SLICE_IND] * (groups+1));
+  ALLOC(slice_count3,   globals->count[SLICE_IND] * (groups+1));
+  ALLOC(slice_sums,     globals->count[SLICE_IND]);
 
                                 /* prepare data for the voxel-to-voxel
                                    space transformation (instead of the
@@ -741,24 +1158,50 @@ float vr_objective(VIO_Volume d1,
 
   vox_space = new_voxel_space_struct();
   get_into_voxel_space(globals, vox_space, d1, d2);
-  trans = get_linear_transform_ptr(vox_space->voxel_to_voxel_space);
+  get_lattice_mapping(vox_space, &mapping);
 
+                                /* the nodes of each row, mapped into d2 */
+  ALLOC(row_nodes, 3 * globals->count[SLICE_IND] * globals->count[COL_IND]);
 
 
-  fill_Point( starting_position, vox_space->start[VIO_X], vox_space->start[VIO_Y], vox_space->start[VIO_Z]);
 
-                                /* init running sums and counters. */
-  for(i=1; i<=segment_table->groups; i++) {
-    rat_sum[i] = 0.0;
-    rat2_sum[i] = 0.0;
-    count3[i]   = 0;
-    var[i] = 0.0;
-  }
-  count1 = count2 = 0;
+  fill_Point( starting_position, vox_space->start[VIO_X], vox_space->start[VIO_Y], vox_space->start[VIO_Z]);
 
                                 /* loop through each node of lattice */
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(objective_threads(globals)) schedule(dynamic)
+#endif
   for(s=0; s<globals->count[SLICE_IND]; s++) {
 
+    VectorR
+      vector_step;
+    PointR
+      slice, row, col, pos2, voxel;
+    int
+      r,c,i,index;
+    VIO_Real
+      value1, value2,
+      voxel_value1,
+      rat,
+      *rat_sum  = &slice_rat_sum[s*(groups+1)],
+      *rat2_sum = &slice_rat2_sum[s*(groups+1)];
+    unsigned long
+      *count3   = &slice_count3[s*(groups+1)];
+    VIO_Real
+      *x2 = &row_nodes[3 * s * globals->count[COL_IND]],
+      *y2 = x2 + globals->count[COL_IND],
+      *z2 = y2 + globals->count[COL_IND];
+    Lattice_Sums
+      *sums     = &slice_sums[s];
+
+                                /* init running sums and counters. */
+    init_lattice_sums(sums);
+    for(i=1; i<=groups; i++) {
+      rat_sum[i]  = 0.0;
+      rat2_sum[i] = 0.0;
+      count3[i]   = 0;
+    }
+
     SCALE_VECTOR( vector_step, vox_space->directions[SLICE_IND], s);
     ADD_POINT_VECTOR( slice, starting_position, vector_step );
 
@@ -768,6 +1211,8 @@ float vr_objective(VIO_Volume d1,
       ADD_POINT_VECTOR( row, slice, vector_step );
       
       SCALE_POINT( col, row, 1.0); /* init first col position */
+      map_lattice_line(&mapping, s, r, 0, COL_IND, globals->count[COL_IND], x2, y2, z2);
+
       for(c=0; c<globals->count[COL_IND]; c++) {
         
                                 /* use the voxel center closest to this lattice
@@ -777,39 +1222,37 @@ float vr_objective(VIO_Volume d1,
         
         if (voxel_point_not_masked(m1, Point_x(voxel), Point_y(voxel), Point_z(voxel))) {
           
-          if (INTERPOLATE_TRUE_VALUE( d1, &voxel, &value1 )) {
+          if (INTERPOLATE_TRUE_VALUE( globals, d1, &voxel, &value1 )) {
 
-            count1++;
+            sums->count1++;
             voxel_value1 = CONVERT_VALUE_TO_VOXEL(d1,value1 );
 
 
-            my_homogenous_transform_point(trans,
-                                          Point_x(col), Point_y(col), Point_z(col), 1.0,
-                                          &Point_x(pos2), &Point_y(pos2), &Point_z(pos2));
+            fill_Point( pos2, x2[c], y2[c], z2[c] );
             
             fill_Point( voxel, Point_x(pos2), Point_y(pos2), Point_z(pos2) ); /* build the voxel POINT */
         
             if (voxel_point_not_masked(m2,Point_x(pos2), Point_y(pos2), Point_z(pos2) )) {
               
-              if (INTERPOLATE_TRUE_VALUE( d2, &voxel, &value2 )) {
+              if (INTERPOLATE_TRUE_VALUE( globals, d2, &voxel, &value2 )) {
 
-                count2++;
+                sums->count2++;
                 /* voxel_value2 = CONVERT_VALUE_TO_VOXEL(d1,value2 ); */
 
                 if (value1 > globals->threshold[0] && value2 > globals->threshold[1]
                     && value2 != 0.0)  {
 
-                  index = (*segment_table->segment)( voxel_value1, segment_table);
+                  index = (*globals->fit.segment_table->segment)( voxel_value1, globals->fit.segment_table);
 
                   if (index>0) {
                     count3[index]++;
-                    rat = value1 / value2;
+                    rat = (float)(value1 / value2);
                     rat_sum[index] += rat;
                     rat2_sum[index] +=  rat*rat;
                   }
                   else {
                     print_error_and_line_num("Cannot segment voxel value %d into one of %d groups.", 
-                                __FILE__, __LINE__, voxel_value1,segment_table->groups );
+                                __FILE__, __LINE__, voxel_value1,globals->fit.segment_table->groups );
                     exit(EXIT_FAILURE);
 
                   }
@@ -827,17 +1270,36 @@ float vr_objective(VIO_Volume d1,
     } /* for r */
   } /* for s */
 
+                                /* add the slices, in order */
+  count1 = count2 = 0;
+  for(s=0; s<globals->count[SLICE_IND]; s++) {
+    count1 += slice_sums[s].count1;
+    count2 += slice_sums[s].count2;
+  }
+  for(i=1; i<=groups; i++) {
+    sum1 = sum2 = 0.0;
+    count3[i] = 0;
+    var[i] = 0.0;
+    for(s=0; s<globals->count[SLICE_IND]; s++) {
+      sum1      += slice_rat_sum[s*(groups+1) + i];
+      sum2      += slice_rat2_sum[s*(groups+1) + i];
+      count3[i] += slice_count3[s*(groups+1) + i];
+    }
+    rat_sum[i]  = sum1;
+    rat2_sum[i] = sum2;
+  }
+
 
   total_variance = 0.0;
   total_count = 0;
 
-  for(index=1; index<=segment_table->groups; index++) {
+  for(index=1; index<=globals->fit.segment_table->groups; index++) {
     if (count3[index] > 1) 
       total_count += count3[index];
   }
 
   if (total_count > 1) {
-    for(index=1; index<=segment_table->groups; index++) {
+    for(index=1; index<=globals->fit.segment_table->groups; index++) {
       if (count3[index] > 1) {
         var[index]  = ((double)count3[index]*rat2_sum[index] - rat_sum[index]*rat_sum[index]) / 
           ((double)count3[index]*((double)count3[index]-1.0));
@@ -860,13 +1322,18 @@ float vr_objective(VIO_Volume d1,
   FREE(var);
   FREE(limits);
   FREE(count3);
+  FREE(slice_rat_sum);
+  FREE(slice_rat2_sum);
+  FREE(slice_count3);
+  FREE(slice_sums);
+  FREE(row_nodes);
+  delete_voxel_space_struct(vox_space);
 
 
 
   return (result);
   
 }
-
 float stub_objective(VIO_Volume d1,
                             VIO_Volume d2,
                             VIO_Volume m1,
@@ -939,7 +1406,7 @@ float stub_objective(VIO_Volume d1,
 
         if (voxel_point_not_masked(m1, Point_x(voxel), Point_y(voxel), Point_z(voxel))) {
           
-          if (INTERPOLATE_TRUE_VALUE( d1, &voxel, &value1 )) {
+          if (INTERPOLATE_TRUE_VALUE( globals, d1, &voxel, &value1 )) {
 
             count1++;
             voxel_value1 = CONVERT_VALUE_TO_VOXEL(d1,value1 );
@@ -958,7 +1425,7 @@ float stub_objective(VIO_Volume d1,
 
             if (voxel_point_not_masked(m2,Point_x(pos2), Point_y(pos2), Point_z(pos2) )) {
               
-              if (INTERPOLATE_TRUE_VALUE( d2, &voxel, &value2 )) {
+              if (INTERPOLATE_TRUE_VALUE( globals, d2, &voxel, &value2 )) {
 
                 count2++;
                 /* voxel_value2 = CONVERT_VALUE_TO_VOXEL(d1,value2 ); */
@@ -0,0 +1,239 @@
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : optical_flow.c
+@DESCRIPTION: sampling of the source and target volumes for the optical
+              flow objective function (-optical_flow).
+
+              Optical flow needs a single sample per node in each
+              volume (no sub-lattice), so the cost of a node was
+              dominated by evaluate_volume_in_world(): the general
+              world to voxel conversion and the derivative machinery
+              of volume_io, twice per node.  Here, the world to voxel
+              transform of each volume is reduced once to a 3x4 matrix,
+              and the sample and its tri-linear derivatives are read
+              directly from the voxels (see get_volume_voxel_buffer()).
+
+              The node loop of do_non_linear_optimization() already
+              spreads the nodes of a slice over the threads; the data
+              prepared here is only read while the nodes are estimated.
+@CREATED    : Oct 18, 2026
+---------------------------------------------------------------------------- */
+
+#include <config.h>
+#include <volume_io.h>
+#include <Proglib.h>
+#include "constants.h"
+#include "interpolation.h"
+#include "nonlinear_context.h"
+
+#define Min_deriv  0.02
+
+/* reduce the world to voxel transform of volume to a matrix, and get
+   direct access to its voxels if possible */
+
+static void init_flow_volume(Flow_Volume *flow, VIO_Volume volume)
+{
+  flow->volume = volume;
+  get_volume_sizes(volume, flow->sizes);
+  get_world_to_voxel_matrix(volume, flow->world_to_voxel);
+
+  (void)get_volume_voxel_buffer(volume, &flow->double_voxels, &flow->float_voxels,
+                                flow->strides);
+}
+
+static double flow_voxel_value(Flow_Volume *flow, int i, int j, int k)
+{
+  long idx;
+
+  if (flow->double_voxels != NULL || flow->float_voxels != NULL) {
+    idx = i*flow->strides[0] + j*flow->strides[1] + k;
+    return( (flow->double_voxels != NULL) ?
+            flow->double_voxels[idx] : (double)flow->float_voxels[idx] );
+  }
+  else
+    return( get_volume_real_value(flow->volume, i, j, k, 0, 0) );
+}
+
+/* tri-linear interpolation of the volume at world (x,y,z).  When
+   deriv != NULL, the derivatives of the interpolant along the world x,
+   y and z axes are returned in deriv[].  Outside of the volume, the
+   value and derivatives are 0. */
+
+static VIO_Real sample_flow_volume(Flow_Volume *flow,
+                                   VIO_Real x, VIO_Real y, VIO_Real z,
+                                   VIO_Real deriv[])
+{
+  VIO_Real
+    pos[3], frac[3], rest[3], grad[3], corner[8],
+    value;
+  int
+    i, v, ind[3], step[3];
+
+  for(i=0; i<3; i++) {
+    pos[i] = flow->world_to_voxel[i][0] * x + flow->world_to_voxel[i][1] * y +
+             flow->world_to_voxel[i][2] * z + flow->world_to_voxel[i][3];
+    if (deriv != NULL) deriv[i] = 0.0;
+  }
+
+  for(i=0; i<3; i++) {
+    step[i] = (flow->sizes[i] > 1) ? 1 : 0;
+    if (!step[i]) {             /* single slice (2D) */
+      if (pos[i] < -0.5 || pos[i] > 0.5)
+        return(0.0);
+      ind[i]  = 0;
+      frac[i] = 0.0;
+      rest[i] = 1.0;
+      continue;
+    }
+    if (pos[i] < 0.0 || pos[i] > flow->sizes[i]-1)
+      return(0.0);
+    ind[i] = (int)pos[i];
+    if (ind[i] >= flow->sizes[i]-1)
+      ind[i] = flow->sizes[i]-1-step[i];
+    frac[i] = pos[i] - ind[i];
+    rest[i] = 1.0 - frac[i];
+  }
+
+                                /* bit 2 of v along the 1st dim, ... */
+  for(v=0; v<8; v++)
+    corner[v] = flow_voxel_value(flow,
+                                 ind[0] + ((v>>2)&1) * step[0],
+                                 ind[1] + ((v>>1)&1) * step[1],
+                                 ind[2] + ( v    &1) * step[2]);
+
+  value = rest[0] * (rest[1]*rest[2] * corner[0] + rest[1]*frac[2] * corner[1] +
+                     frac[1]*rest[2] * corner[2] + frac[1]*frac[2] * corner[3]) +
+          frac[0] * (rest[1]*rest[2] * corner[4] + rest[1]*frac[2] * corner[5] +
+                     frac[1]*rest[2] * corner[6] + frac[1]*frac[2] * corner[7]);
+
+  if (deriv != NULL) {
+    grad[0] = grad[1] = grad[2] = 0.0;
+    if (step[0])
+      grad[0] = rest[1]*rest[2] * (corner[4]-corner[0]) + rest[1]*frac[2] * (corner[5]-corner[1]) +
+                frac[1]*rest[2] * (corner[6]-corner[2]) + frac[1]*frac[2] * (corner[7]-corner[3]);
+    if (step[1])
+      grad[1] = rest[0] * (rest[2] * (corner[2]-corner[0]) + frac[2] * (corner[3]-corner[1])) +
+                frac[0] * (rest[2] * (corner[6]-corner[4]) + frac[2] * (corner[7]-corner[5]));
+    if (step[2])
+      grad[2] = rest[0] * (rest[1] * (corner[1]-corner[0]) + frac[1] * (corner[3]-corner[2])) +
+                frac[0] * (rest[1] * (corner[5]-corner[4]) + frac[1] * (corner[7]-corner[6]));
+
+                                /* from voxel to world derivatives */
+    for(i=0; i<3; i++)
+      deriv[i] = grad[0] * flow->world_to_voxel[0][i] +
+                 grad[1] * flow->world_to_voxel[1][i] +
+                 grad[2] * flow->world_to_voxel[2][i];
+  }
+
+  return(value);
+}
+
+
+/* set up nl->optical_flow[] for the optical flow features of the fit
+   (nl->optical_flow is NULL when there are none).  This is called
+   before each iteration, since the intensities of the source volume
+   are normalized again between iterations. */
+
+void prepare_optical_flow_data(Nonlinear_Context *nl)
+{
+  Arg_Data
+    *globals = nl->globals;
+  Optical_Flow_Data
+    *flow;
+  int
+    f, n_flow;
+
+  n_flow = 0;
+  for(f=0; f<globals->features.number_of_features; f++)
+    if (globals->features.obj_func[f] == NONLIN_OPTICALFLOW)
+      n_flow++;
+
+  if (n_flow == 0) {
+    nl->optical_flow = NULL;
+    return;
+  }
+
+  if (nl->optical_flow == NULL)
+    ALLOC(nl->optical_flow, globals->features.number_of_features);
+
+  for(f=0; f<globals->features.number_of_features; f++) {
+    if (globals->features.obj_func[f] != NONLIN_OPTICALFLOW)
+      continue;
+
+    flow = &(nl->optical_flow[f]);
+    init_flow_volume(&(flow->source), globals->features.data[f]);
+    init_flow_volume(&(flow->target), globals->features.model[f]);
+    get_volume_separations(globals->features.data[f], flow->steps);
+
+    /* should compute a better threshold value here, possibly based on
+       a histogram of the gradient magnitudes across the 3D lattice. */
+    flow->min_deriv = Min_deriv * (get_volume_real_max(globals->features.data[f]) -
+                                   get_volume_real_min(globals->features.data[f]));
+  }
+}
+
+void delete_optical_flow_data(Nonlinear_Context *nl)
+{
+  if (nl->optical_flow != NULL) {
+    FREE(nl->optical_flow);
+    nl->optical_flow = NULL;
+  }
+}
+
+
+/* use optical flow to compute the deformation (def_vector) required
+to warp the source_coord onto the mean_target using the intensities of
+the source_coord in the source volume and the mean_target coord in the
+target volume, as well as the 1st intensity derivatives in the target
+volume.
+
+inputs:
+    flow        (from prepare_optical_flow_data())
+    source_coord
+    mean_target
+    ndim
+
+outputs:
+    def_vector         (in world coords)
+    voxel_displacement (in voxel coords)
+
+returns the magnitude of def_vector.
+
+Based on Horn and Schunck Artificial Intell 17 (1981) 185-203
+*/
+
+VIO_Real get_optical_flow_vector(Optical_Flow_Data *flow,
+                                 VIO_Real source_coord[],
+                                 VIO_Real mean_target[],
+                                 VIO_Real def_vector[],
+                                 VIO_Real voxel_displacement[],
+                                 int ndim)
+{
+  VIO_Real
+    proj_d1, proj_d2,           /* intensity in source and target       */
+    deriv[3];                   /* derivatives in target (world-coord)  */
+  int
+    i;
+
+                                /* intensity and derivatives in target */
+  proj_d2 = sample_flow_volume(&(flow->target),
+                               mean_target[0], mean_target[1], mean_target[2], deriv);
+
+                                /* intensity only in source */
+  proj_d1 = sample_flow_volume(&(flow->source),
+                               source_coord[0], source_coord[1], source_coord[2], NULL);
+
+                                /* compute deformations directly!       */
+  for(i=0; i<3; i++) {
+    if (fabs(deriv[i]) > flow->min_deriv && (i<2 || ndim==3))
+      def_vector[i] = (proj_d1 - proj_d2) / deriv[i];
+    else
+      def_vector[i] = 0.0;
+  }
+
+  for(i=0; i<3; i++)            /* build the real-world displacement */
+    voxel_displacement[i] = def_vector[i] * flow->steps[i];
+
+  return( sqrt(def_vector[0]*def_vector[0] +
+               def_vector[1]*def_vector[1] +
+               def_vector[2]*def_vector[2]) );
+}
@@ -180,28 +180,17 @@ static char rcsid[]="$Header: /static-cvsroot/registration/mni_autoreg/minctracc
 #include "make_rots.h"
 #include "segment_table.h"
 #include "quaternion.h"
+#include "vox_space.h"
 
 #include "local_macros.h"
 
 #ifdef HAVE_LIBLBFGS
 #include <lbfgs.h>
-#define BFGSEPSILON 0.00005
 #endif /*HAVE_LIBLBFGS*/
 
-extern Arg_Data *main_args;
-
-VIO_Volume   Gdata1, Gdata2, Gmask1, Gmask2;
-int      Ginverse_mapping_flag, Gndim;
-
-extern   double   ftol ;        
-extern   double   simplex_size ;
-extern   VIO_Real     initial_corr, final_corr;
-
-         Segment_Table  *segment_table;        /* for variance of ratios */
-
-         VIO_Real            **prob_hash_table;   /* for mutual information */
-         VIO_Real            *prob_fn1;      /*     for vol 1 */
-         VIO_Real            *prob_fn2;      /*     for vol 2 */
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 
 /* external calls: */
@@ -234,6 +223,8 @@ void add_speckle_to_volume(VIO_Volume d1,
 
 VIO_Status do_non_linear_optimization(Arg_Data *globals);
 
+VIO_Status do_non_linear_schedule(Arg_Data *globals);
+
 void normalize_data_to_match_target(VIO_Volume d1, VIO_Volume m1, VIO_Real thresh1,
                                            VIO_Volume d2, VIO_Volume m2, VIO_Real thresh2,
                                            Arg_Data *globals);
@@ -371,47 +362,27 @@ inline static VIO_BOOL in_limits(double x,double lower,double upper)
     return lower <= x && x <= upper;
 }
 
-/* ----------------------------- MNI Header -----------------------------------
-@NAME       : fit_function
-@INPUT      : params - a variable length array of floats
-@OUTPUT     :               
-@RETURNS    : a float value of the user requested objective function,
-              measuring the similarity between two data sets.
-@DESCRIPTION: 
-@METHOD     : 
-@GLOBALS    : 
-@CALLS      : 
-@CREATED    : 
-@MODIFIED   : 
----------------------------------------------------------------------------- */
+/* the transformation parameters at params; those not optimized are
+   taken from args.  FALSE if they are out of bounds. */
 
-float fit_function(Arg_Data *args,float *params) 
+static VIO_BOOL get_fit_parameters(Arg_Data *args, float *params,
+                                   double trans[3], double cent[3], double rots[3],
+                                   double scale[3], double shear[6])
 {
-
-  VIO_Transform *mat;
   int i;
-  float r;
-
 
-  double trans[3];
-  double cent[3];
-  double rots[3];
-  double scale[3];
-  double shear[6];
-
-
-  for(i=0; i<3; i++) {                /* set default values from GLOBAL MAIN_ARGS */
-    shear[i] = main_args->trans_info.shears[i];
-    scale[i] = main_args->trans_info.scales[i];
-    trans[i] = main_args->trans_info.translations[i];
-    rots[i]  = main_args->trans_info.rotations[i];
-    cent[i]  = main_args->trans_info.center[i];
+  for(i=0; i<3; i++) {                /* set default values from args */
+    shear[i] = args->trans_info.shears[i];
+    scale[i] = args->trans_info.scales[i];
+    trans[i] = args->trans_info.translations[i];
+    rots[i]  = args->trans_info.rotations[i];
+    cent[i]  = args->trans_info.center[i];
   }
 
                                 /* modify the parameters to be optimized */
-  vector_to_parameters(trans, rots, scale, shear, params, main_args->trans_info.weights);
+  vector_to_parameters(trans, rots, scale, shear, params, args->trans_info.weights);
   
-  if (main_args->trans_info.transform_type==TRANS_LSQ7) { /* adjust scaley and scalez only */
+  if (args->trans_info.transform_type==TRANS_LSQ7) { /* adjust scaley and scalez only */
                                                          /* if 7 parameter fit.  */
     scale[1] = scale[0];
     scale[2] = scale[0];
@@ -441,26 +412,72 @@ float fit_function(Arg_Data *args,float *params)
        shear[1],in_limits(shear[1], (double)-2.0, (double)2.0)? 'T': 'F' , 
        shear[2],in_limits(shear[2], (double)-2.0, (double)2.0)? 'T': 'F' );
 
-    r = 1e10;
+    return(FALSE);
   }
-  else {
+
+  return(TRUE);
+}
+
+/* build the linear part of the transformation of args from the
+   parameters */
+
+static void build_fit_matrix(Arg_Data *args,
+                             double trans[3], double cent[3], double rots[3],
+                             double scale[3], double shear[6])
+{
+  VIO_Transform *mat;
+
                                 /* get the linear transformation ptr */
 
-    if (get_transform_type(main_args->trans_info.transformation) == CONCATENATED_TRANSFORM) {
-      mat = get_linear_transform_ptr(
-             get_nth_general_transform(main_args->trans_info.transformation,0));
-    }
-    else
-      mat = get_linear_transform_ptr(main_args->trans_info.transformation);
+  if (get_transform_type(args->trans_info.transformation) == CONCATENATED_TRANSFORM) {
+    mat = get_linear_transform_ptr(
+           get_nth_general_transform(args->trans_info.transformation,0));
+  }
+  else
+    mat = get_linear_transform_ptr(args->trans_info.transformation);
     
-    if (Ginverse_mapping_flag)
-      build_inverse_transformation_matrix(mat, cent, trans, scale, shear, rots);
-    else
-      build_transformation_matrix(mat, cent, trans, scale, shear, rots);
+  if (args->fit.inverse_mapping)
+    build_inverse_transformation_matrix(mat, cent, trans, scale, shear, rots);
+  else
+    build_transformation_matrix(mat, cent, trans, scale, shear, rots);
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : fit_function
+@INPUT      : params - a variable length array of floats
+@OUTPUT     :               
+@RETURNS    : a float value of the user requested objective function,
+              measuring the similarity between two data sets.
+@DESCRIPTION: 
+@METHOD     : 
+@GLOBALS    : 
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+
+float fit_function(Arg_Data *args,float *params) 
+{
+
+  float r;
+
+
+  double trans[3];
+  double cent[3];
+  double rots[3];
+  double scale[3];
+  double shear[6];
+
+
+  if (!get_fit_parameters(args, params, trans, cent, rots, scale, shear)) {
+    r = 1e10;
+  }
+  else {
+    build_fit_matrix(args, trans, cent, rots, scale, shear);
     
     /* call the needed objective function */
     
-    r = (main_args->obj_function)(Gdata1,Gdata2,Gmask1,Gmask2,args);
+    r = (args->obj_function)(args->fit.data1,args->fit.data2,args->fit.mask1,args->fit.mask2,args);
   }
 
   return(r);
@@ -469,39 +486,188 @@ float fit_function(Arg_Data *args,float *params)
 
 VIO_Real amoeba_obj_function(void *function_data, float d[])
 {
+  Arg_Data *args = (Arg_Data *)function_data;
   int i;
   float p[13];
 
-  for(i=0; i<Gndim; i++)
+  for(i=0; i<args->fit.ndim; i++)
     p[i+1] = d[i];
   
-  return ( (VIO_Real)fit_function((Arg_Data *)function_data,p) );
+  return ( (VIO_Real)fit_function(args,p) );
 }
 
 #ifdef HAVE_LIBLBFGS
 
-// Objective function for BFGS optimizer
+/* data passed by lbfgs() to bfgs_obj_function() */
+
+typedef struct {
+  Arg_Data *globals;
+  Arg_Data *thread_args;        /* [thread] copies of *globals, each with its
+                                   own transformation, so that the
+                                   objective function can be evaluated at
+                                   several parameters at once              */
+  int      n_threads;
+} BFGS_Data;
+
+/* derivatives dA[0..ndim-1] of the voxel to voxel transformation
+   used by the objective functions (see get_into_voxel_space()) with
+   respect to each optimized parameter.  This transformation is linear
+   in the matrix built by build_transformation_matrix(), so it is
+   differentiated through the rotation, scale and shear parameters by
+   central differences of the matrix alone, without sampling the
+   volumes.  Leaves the matrix of args at params; FALSE if params are
+   out of bounds. */
+
+#define PARAMETER_STEP  0.00001
+
+static VIO_BOOL get_voxel_space_derivatives(Arg_Data *args, float *params,
+                                            VIO_Real dA[][3][4])
+{
+  Voxel_space_struct *vox_space;
+  VIO_Transform *lin;
+  double trans[3], cent[3], rots[3], scale[3], shear[6];
+  double *param, value, A[2][3][4];
+  int w, k, side, i, j;
+
+  if (!get_fit_parameters(args, params, trans, cent, rots, scale, shear))
+    return(FALSE);
+
+  k = 0;
+  for(w=0; w<12; w++) {
+    if (args->trans_info.weights[w] == 0.0)
+      continue;
+
+    if      (w < 3) param = &trans[w];
+    else if (w < 6) param = &rots[w-3];
+    else if (w < 9) param = &scale[w-6];
+    else            param = &shear[w-9];
+    value = *param;
+
+    for(side=0; side<2; side++) {
+      *param = value + ((side==0) ? PARAMETER_STEP : -PARAMETER_STEP);
+      if (args->trans_info.transform_type==TRANS_LSQ7)
+        scale[1] = scale[2] = scale[0];
+
+      build_fit_matrix(args, trans, cent, rots, scale, shear);
+
+      vox_space = new_voxel_space_struct();
+      get_into_voxel_space(args, vox_space, args->fit.data1, args->fit.data2);
+      lin = get_linear_transform_ptr(vox_space->voxel_to_voxel_space);
+      for(i=0; i<3; i++)
+        for(j=0; j<4; j++)
+          A[side][i][j] = Transform_elem(*lin, i, j);
+      delete_voxel_space_struct(vox_space);
+    }
+
+    *param = value;
+    if (args->trans_info.transform_type==TRANS_LSQ7)
+      scale[1] = scale[2] = scale[0];
+
+                                /* params are divided by their weight */
+    for(i=0; i<3; i++)
+      for(j=0; j<4; j++)
+        dA[k][i][j] = (A[0][i][j] - A[1][i][j]) / (2.0*PARAMETER_STEP) *
+          args->trans_info.weights[w];
+    k++;
+  }
+
+  build_fit_matrix(args, trans, cent, rots, scale, shear);
+
+  return(TRUE);
+}
+
+/* TRUE if the objective function of args can return its gradient */
+
+static VIO_BOOL has_analytic_gradient(Arg_Data *args)
+{
+  return( !args->trans_info.bfgs_numerical &&
+          (args->obj_function == xcorr_objective ||
+           args->obj_function == mutual_information_objective ||
+           args->obj_function == normalized_mutual_information_objective) );
+}
+
+/* the objective function at x, with its analytic gradient: a single
+   pass over the lattice */
+
+static lbfgsfloatval_t bfgs_analytic_gradient(Arg_Data *args, const lbfgsfloatval_t *x,
+                                              lbfgsfloatval_t *g)
+{
+  float p[13];
+  VIO_Real dA[12][3][4], gradient[12];
+  lbfgsfloatval_t fx;
+  int i;
+
+  for(i=0; i<args->fit.ndim; i++)
+    p[i+1] = x[i];
+
+  if (!get_voxel_space_derivatives(args, p, dA)) {
+    for(i=0; i<args->fit.ndim; i++)
+      g[i] = 0.0;
+    return(1e10);
+  }
+
+  if (args->obj_function == xcorr_objective)
+    fx = xcorr_objective_with_gradient(args->fit.data1,args->fit.data2,args->fit.mask1,args->fit.mask2,args,
+                                       args->fit.ndim, dA, gradient);
+  else
+    fx = mutual_information_objective_with_gradient(args->fit.data1,args->fit.data2,args->fit.mask1,args->fit.mask2,args,
+                                                    args->fit.ndim, dA, gradient);
+
+  for(i=0; i<args->fit.ndim; i++)
+    g[i] = gradient[i];
+
+  return(fx);
+}
+
+/* Objective function for BFGS optimizer.  xcorr and mutual information
+   return their gradient along with their value.  Otherwise, the value
+   at x and the finite-difference gradient (forward, or central with
+   -bfgs_central) need ndim+1 (2*ndim+1) evaluations of fit_function(),
+   which are independent: they are spread over the threads. */
+
 lbfgsfloatval_t bfgs_obj_function(void *function_data, const lbfgsfloatval_t *x, lbfgsfloatval_t *g, const int n, const lbfgsfloatval_t step) {
-	int i;
-	float p[13];
-	lbfgsfloatval_t fx,fx2;
+	BFGS_Data *data = (BFGS_Data *)function_data;
+	int i, n_evals, central, ndim;
+	float epsilon;
+	lbfgsfloatval_t fx[25];       /* at x, x+epsilon*e_i and x-epsilon*e_i */
 	
-//	fprintf(stderr,"ROBB: in BFGS objective function!\n");
-//	fprintf(stderr,"ROBB: Gndim: %d\n",Gndim);
-	
-	for(i=0; i<Gndim; i++)
-		p[i+1] = x[i];
-  
-	fx = (lbfgsfloatval_t) fit_function((Arg_Data *)function_data,p);
+	if (has_analytic_gradient(data->globals))
+		return bfgs_analytic_gradient(&data->thread_args[0], x, g);
+
+	ndim    = data->globals->fit.ndim;
+	central = data->globals->trans_info.bfgs_central;
+	epsilon = (float)data->globals->trans_info.bfgs_epsilon;
+	n_evals = (central ? 2*ndim : ndim) + 1;
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(data->n_threads) schedule(dynamic)
+#endif
+	for (i=0; i<n_evals; i++) {
+		float p[13];
+		int j, t;
+
+		t = 0;
+#ifdef _OPENMP
+		t = omp_get_thread_num();
+#endif
+		for(j=0; j<ndim; j++)
+			p[j+1] = x[j];
+
+		if (i > 0 && i <= ndim)
+			p[i] += epsilon;
+		else if (i > ndim)
+			p[i-ndim] -= epsilon;
+
+		fx[i] = (lbfgsfloatval_t) fit_function(&data->thread_args[t],p);
+	}
 	
-	for (i=0; i<Gndim; i++) {
-		p[i+1] += BFGSEPSILON;
-		fx2 = (lbfgsfloatval_t) fit_function((Arg_Data *)function_data,p);
-		p[i+1] -= BFGSEPSILON;
-		g[i] = (lbfgsfloatval_t) (fx2-fx) / BFGSEPSILON;
-//		fprintf(stderr,"ROBB In objective function.  Param %d. Fx is %f.  Fx2 is %f.  Grad is %f\n",i,fx,fx2,g[i]);
+	for (i=0; i<ndim; i++) {
+		if (central)
+			g[i] = (fx[i+1]-fx[i+1+ndim]) / (2.0*epsilon);
+		else
+			g[i] = (fx[i+1]-fx[0]) / epsilon;
 	}
-	return fx;
+	return fx[0];
 }
 
 
@@ -514,6 +680,53 @@ int bfgs_progress(void *instance, const lbfgsfloatval_t *x, const lbfgsfloatval_
 	return 0;			
 }
 
+/* print the analytic gradient of the objective function at x next to
+   its central difference estimate with step -bfgs_epsilon, and the
+   largest difference between the two relative to the largest
+   component of the estimate (see -bfgs_check_gradient) */
+
+static void check_bfgs_gradient(BFGS_Data *data, const lbfgsfloatval_t *x)
+{
+	Arg_Data *args;
+	lbfgsfloatval_t g[12];
+	VIO_Real numerical[12], f_plus, f_minus, largest, difference;
+	float p[13], epsilon;
+	int i, j, ndim;
+
+	args = &data->thread_args[0];
+	ndim = args->fit.ndim;
+
+	if (!has_analytic_gradient(args)) {
+		print("BFGS gradient check: no analytic gradient for this objective function\n");
+		return;
+	}
+
+	(void) bfgs_analytic_gradient(args, x, g);
+
+	epsilon = (float)args->trans_info.bfgs_epsilon;
+	largest = 0.0;
+	for(i=0; i<ndim; i++) {
+		for(j=0; j<ndim; j++)
+			p[j+1] = x[j];
+		p[i+1] = x[i] + epsilon;
+		f_plus  = fit_function(args,p);
+		p[i+1] = x[i] - epsilon;
+		f_minus = fit_function(args,p);
+		numerical[i] = (f_plus - f_minus) / (2.0*epsilon);
+		if (fabs(numerical[i]) > largest)
+			largest = fabs(numerical[i]);
+	}
+
+	difference = 0.0;
+	for(i=0; i<ndim; i++) {
+		print("BFGS gradient check: parameter %2d analytic %12.6g central %12.6g\n",
+		      i, g[i], numerical[i]);
+		if (largest > 0.0 && fabs(g[i] - numerical[i]) / largest > difference)
+			difference = fabs(g[i] - numerical[i]) / largest;
+	}
+	print("BFGS gradient check: max relative difference %f\n", difference);
+}
+
 #endif /*HAVE_LIBLBFGS*/
 
 /* ----------------------------- MNI Header -----------------------------------
@@ -600,14 +813,14 @@ float fit_function_quater(Arg_Data *args,float *params)
     else
       mat = get_linear_transform_ptr(args->trans_info.transformation);
     
-    if (Ginverse_mapping_flag)
+    if (args->fit.inverse_mapping)
       build_inverse_transformation_matrix_quater(mat, cent, trans, scale, shear, quats);
     else
       build_transformation_matrix_quater(mat, cent, trans, scale, shear, quats);
     
     /* call the needed objective function */
     
-    r = (args->obj_function)(Gdata1,Gdata2,Gmask1,Gmask2,args);
+    r = (args->obj_function)(args->fit.data1,args->fit.data2,args->fit.mask1,args->fit.mask2,args);
   }
 
   return(r);
@@ -616,13 +829,14 @@ float fit_function_quater(Arg_Data *args,float *params)
 
 VIO_Real amoeba_obj_function_quater(void *function_data, float d[])
 {
+  Arg_Data *args = (Arg_Data *)function_data;
   int i;
   float p[13];
 
-  for(i=0; i<Gndim; i++)
+  for(i=0; i<args->fit.ndim; i++)
     p[i+1] = d[i];
   
-  return ( (VIO_Real)fit_function_quater(function_data,p) );
+  return ( (VIO_Real)fit_function_quater(args,p) );
 }
 
 
@@ -681,16 +895,16 @@ VIO_BOOL optimize_simplex(VIO_Volume d1,
 
   
   stat = TRUE;
-  local_ftol = ftol;
+  local_ftol = globals->ftol;
                                 /* find number of dimensions for optimization */
   ndim = 0;
   for(i=0; i<12; i++)
     if (globals->trans_info.weights[i] != 0.0) ndim++;
 
-                                /* set GLOBALS to communicate with the
+                                /* set globals->fit to communicate with the
                                    function to be fitted!              */
   if (stat && ndim>0) {
-    Gndim = ndim;
+    globals->fit.ndim = ndim;
 
     ALLOC(p,ndim+1+1);                /* my parameters for the simplex 
                                    [1..ndim+1]*/
@@ -711,7 +925,7 @@ VIO_BOOL optimize_simplex(VIO_Volume d1,
       parameters[i] = (VIO_Real)p[i+1];
 
     initialize_amoeba(&the_amoeba, ndim, parameters, 
-                      simplex_size, amoeba_obj_function, 
+                      globals->simplex_size, amoeba_obj_function, 
                       globals, (VIO_Real)local_ftol);
 
     max_iters = 400;
@@ -850,16 +1064,16 @@ VIO_BOOL optimize_simplex_quater(VIO_Volume d1,
 
   
   stat = TRUE;
-  local_ftol = ftol;
+  local_ftol = globals->ftol;
                                 /* find number of dimensions for optimization */
   ndim = 0;
   for(i=0; i<12; i++)
     if (globals->trans_info.weights[i] != 0.0) ndim++;
 
-                                /* set GLOBALS to communicate with the
+                                /* set globals->fit to communicate with the
                                    function to be fitted!              */
   if (stat && ndim>0) {
-    Gndim = ndim;
+    globals->fit.ndim = ndim;
 
     ALLOC(p,ndim+1+1);                /* my parameters for the simplex 
                                         [1..ndim+1]*/
@@ -886,7 +1100,7 @@ VIO_BOOL optimize_simplex_quater(VIO_Volume d1,
 
 
     initialize_amoeba(&the_amoeba, ndim, parameters, 
-                      simplex_size, amoeba_obj_function_quater, 
+                      globals->simplex_size, amoeba_obj_function_quater, 
                       globals, (VIO_Real)local_ftol);
 
     max_iters = 400;
@@ -1008,6 +1222,7 @@ VIO_BOOL optimize_BFGS(VIO_Volume d1,
 	VIO_Transform *mat;
 	
 	lbfgsfloatval_t *parameters;
+	BFGS_Data data;
 	
 	double trans[3];
 	double cent[3];
@@ -1016,7 +1231,7 @@ VIO_BOOL optimize_BFGS(VIO_Volume d1,
 	double shear[6];
 	
 	stat = TRUE;
-	local_ftol = ftol;
+	local_ftol = globals->ftol;
 	
 //	fprintf(stderr,"ROBB: USING BFGS Optimizer *** !\n");
                                 /* find number of dimensions for optimization */
@@ -1024,7 +1239,7 @@ VIO_BOOL optimize_BFGS(VIO_Volume d1,
 	for(i=0; i<12; i++)
 		if (globals->trans_info.weights[i] != 0.0) ndim++;
 		
-	Gndim = ndim;
+	globals->fit.ndim = ndim;
 	
 	ALLOC(p,ndim+1+1);                // Louis parameters (1 based arrays)
 	
@@ -1042,12 +1257,42 @@ VIO_BOOL optimize_BFGS(VIO_Volume d1,
 	for(i=0; i<ndim+1; i++)                /* copy initial guess into parameter list */
 		parameters[i] = (VIO_Real)p[i+1];
 	
+                                /* one copy of the transformation per
+                                   thread; mutual information keeps its
+                                   histograms in globals->fit, so it is
+                                   evaluated by a single thread (its
+                                   lattice walk is threaded instead) */
+	data.globals   = globals;
+	data.n_threads = objective_threads(globals);
+	if (data.n_threads > (globals->trans_info.bfgs_central ? 2*ndim : ndim) + 1)
+		data.n_threads = (globals->trans_info.bfgs_central ? 2*ndim : ndim) + 1;
+	if (globals->obj_function == mutual_information_objective ||
+	    globals->obj_function == normalized_mutual_information_objective)
+		data.n_threads = 1;
+
+	ALLOC(data.thread_args, data.n_threads);
+	for(i=0; i<data.n_threads; i++) {
+		data.thread_args[i] = *globals;
+		ALLOC(data.thread_args[i].trans_info.transformation, 1);
+		copy_general_transform(globals->trans_info.transformation,
+		                       data.thread_args[i].trans_info.transformation);
+	}
+	
+	if (globals->trans_info.bfgs_check_gradient)
+		check_bfgs_gradient(&data, parameters);
+
 	lbfgs_parameter_t param;
 	lbfgs_parameter_init(&param);
 	if (globals->flags.debug)
-		stat = lbfgs(ndim,parameters,NULL,bfgs_obj_function,bfgs_progress,globals,&param);
+		stat = lbfgs(ndim,parameters,NULL,bfgs_obj_function,bfgs_progress,&data,&param);
 	else
-		stat = lbfgs(ndim,parameters,NULL,bfgs_obj_function,NULL,globals,&param);
+		stat = lbfgs(ndim,parameters,NULL,bfgs_obj_function,NULL,&data,&param);
+
+	for(i=0; i<data.n_threads; i++) {
+		delete_general_transform(data.thread_args[i].trans_info.transformation);
+		FREE(data.thread_args[i].trans_info.transformation);
+	}
+	FREE(data.thread_args);
 	if (stat) {
 		fprintf(stderr,"BFGS Status: %d\n",stat);	
 		fprintf(stderr,"LBFGS_SUCCESS %d\n",LBFGS_SUCCESS);
@@ -1262,23 +1507,23 @@ VIO_BOOL optimize_linear_transformation(VIO_Volume d1,
     {
 
       if (globals->smallest_vol == 1) {
-        if (!build_segment_table(&segment_table, d1, globals->groups))
+        if (!build_segment_table(&globals->fit.segment_table, d1, globals->groups))
           print_error_and_line_num(
             "Could not build segment table for SOURCE volume\n",
             __FILE__, __LINE__);
       }
       else {
-        if (!build_segment_table(&segment_table, d2, globals->groups))
+        if (!build_segment_table(&globals->fit.segment_table, d2, globals->groups))
           print_error_and_line_num(
             "Could not build segment table for TARGET volume\n",
             __FILE__, __LINE__);        
       }
       
       if (globals->flags.debug && globals->flags.verbose>1) {
-        print ("groups = %d\n",segment_table->groups);
-        for(i=segment_table->min; i<segment_table->max+1; i++) {
-          print ("%5d: table = %5d, function = %5d\n",i,segment_table->table[i],
-                 (segment_table->segment)(i,segment_table) );
+        print ("groups = %d\n",globals->fit.segment_table->groups);
+        for(i=globals->fit.segment_table->min; i<globals->fit.segment_table->max+1; i++) {
+          print ("%5d: table = %5d, function = %5d\n",i,globals->fit.segment_table->table[i],
+                 (globals->fit.segment_table->segment)(i,globals->fit.segment_table) );
         }
       }
     } else
@@ -1309,9 +1554,9 @@ VIO_BOOL optimize_linear_transformation(VIO_Volume d1,
         }
       }
 
-      ALLOC(   prob_fn1,   globals->groups);
-      ALLOC(   prob_fn2,   globals->groups);
-      VIO_ALLOC2D( prob_hash_table, globals->groups, globals->groups);
+      ALLOC(   globals->fit.prob_fn1,   globals->groups);
+      ALLOC(   globals->fit.prob_fn2,   globals->groups);
+      VIO_ALLOC2D( globals->fit.prob_hash_table, globals->groups, globals->groups);
 
     } else
   if (globals->obj_function == xcorr_objective) {
@@ -1378,16 +1623,21 @@ VIO_BOOL optimize_linear_transformation(VIO_Volume d1,
                                is first (to save on CPU)             ---------*/
 
   if (globals->smallest_vol == 1) {
-    Gdata1 = d1;      Gdata2 = d2;
-    Gmask1 = m1;      Gmask2 = m2;
-    Ginverse_mapping_flag = FALSE;
+    globals->fit.data1 = d1;      globals->fit.data2 = d2;
+    globals->fit.mask1 = m1;      globals->fit.mask2 = m2;
+    globals->fit.inverse_mapping = FALSE;
   }
   else {
-    Gdata1 = d2;      Gdata2 = d1;
-    Gmask1 = m2;      Gmask2 = m1;
-    Ginverse_mapping_flag = TRUE;
+    globals->fit.data1 = d2;      globals->fit.data2 = d1;
+    globals->fit.mask1 = m2;      globals->fit.mask2 = m1;
+    globals->fit.inverse_mapping = TRUE;
   }
 
+                                /* the source lattice does not change
+                                   while the transformation is fit */
+  if (globals->obj_function == xcorr_objective)
+    prepare_lattice_table(globals, globals->fit.data1, globals->fit.data2, globals->fit.mask1);
+
 
            /* ---------------- call the requested obj_function to 
                                establish the initial fitting value  ---------*/
@@ -1402,7 +1652,7 @@ VIO_BOOL optimize_linear_transformation(VIO_Volume d1,
 
 
 
-  initial_corr = fit_function(globals,p);
+  globals->initial_corr = fit_function(globals,p);
 
            /* ---------------- call requested optimization strategy ---------*/
 
@@ -1436,7 +1686,9 @@ VIO_BOOL optimize_linear_transformation(VIO_Volume d1,
                        p,
                        globals->trans_info.weights);
 
-  final_corr = fit_function(globals,p);
+  globals->final_corr = fit_function(globals,p);
+
+  delete_lattice_table(globals);
 
   FREE(p);
 
@@ -1464,14 +1716,14 @@ VIO_BOOL optimize_linear_transformation(VIO_Volume d1,
 
   if (globals->obj_function == vr_objective)
     {
-      stat = stat && free_segment_table(segment_table);
+      stat = stat && free_segment_table(globals->fit.segment_table);
     } else
   if (globals->obj_function == mutual_information_objective || globals->obj_function == normalized_mutual_information_objective )
                                 /* Collignon's mutual information */
     {
-      FREE(   prob_fn1 );
-      FREE(   prob_fn2 );
-      VIO_FREE2D( prob_hash_table);
+      FREE(   globals->fit.prob_fn1 );
+      FREE(   globals->fit.prob_fn2 );
+      VIO_FREE2D( globals->fit.prob_hash_table);
     }
 
 
@@ -1568,23 +1820,23 @@ VIO_BOOL optimize_linear_transformation_quater(VIO_Volume d1,
     {
 
       if (globals->smallest_vol == 1) {
-        if (!build_segment_table(&segment_table, d1, globals->groups))
+        if (!build_segment_table(&globals->fit.segment_table, d1, globals->groups))
           print_error_and_line_num(
             "Could not build segment table for SOURCE volume\n",
             __FILE__, __LINE__);
       }
       else {
-        if (!build_segment_table(&segment_table, d2, globals->groups))
+        if (!build_segment_table(&globals->fit.segment_table, d2, globals->groups))
           print_error_and_line_num(
             "Could not build segment table for TARGET volume\n",
             __FILE__, __LINE__);        
       }
       
       if (globals->flags.debug && globals->flags.verbose>1) {
-        print ("groups = %d\n",segment_table->groups);
-        for(i=segment_table->min; i<segment_table->max+1; i++) {
-          print ("%5d: table = %5d, function = %5d\n",i,segment_table->table[i],
-                 (segment_table->segment)(i,segment_table) );
+        print ("groups = %d\n",globals->fit.segment_table->groups);
+        for(i=globals->fit.segment_table->min; i<globals->fit.segment_table->max+1; i++) {
+          print ("%5d: table = %5d, function = %5d\n",i,globals->fit.segment_table->table[i],
+                 (globals->fit.segment_table->segment)(i,globals->fit.segment_table) );
         }
       }
     } else
@@ -1615,9 +1867,9 @@ VIO_BOOL optimize_linear_transformation_quater(VIO_Volume d1,
         }
       }
 
-      ALLOC(   prob_fn1,   globals->groups);
-      ALLOC(   prob_fn2,   globals->groups);
-      VIO_ALLOC2D( prob_hash_table, globals->groups, globals->groups);
+      ALLOC(   globals->fit.prob_fn1,   globals->groups);
+      ALLOC(   globals->fit.prob_fn2,   globals->groups);
+      VIO_ALLOC2D( globals->fit.prob_hash_table, globals->groups, globals->groups);
 
     } else
   if (globals->obj_function == xcorr_objective) {
@@ -1685,16 +1937,21 @@ VIO_BOOL optimize_linear_transformation_quater(VIO_Volume d1,
                                is first (to save on CPU)             ---------*/
 
   if (globals->smallest_vol == 1) {
-    Gdata1 = d1;      Gdata2 = d2;
-    Gmask1 = m1;      Gmask2 = m2;
-    Ginverse_mapping_flag = FALSE;
+    globals->fit.data1 = d1;      globals->fit.data2 = d2;
+    globals->fit.mask1 = m1;      globals->fit.mask2 = m2;
+    globals->fit.inverse_mapping = FALSE;
   }
   else {
-    Gdata1 = d2;      Gdata2 = d1;
-    Gmask1 = m2;      Gmask2 = m1;
-    Ginverse_mapping_flag = TRUE;
+    globals->fit.data1 = d2;      globals->fit.data2 = d1;
+    globals->fit.mask1 = m2;      globals->fit.mask2 = m1;
+    globals->fit.inverse_mapping = TRUE;
   }
 
+                                /* the source lattice does not change
+                                   while the transformation is fit */
+  if (globals->obj_function == xcorr_objective)
+    prepare_lattice_table(globals, globals->fit.data1, globals->fit.data2, globals->fit.mask1);
+
 
            /* ---------------- call the requested obj_function to 
                                establish the initial fitting value  ---------*/
@@ -1710,7 +1967,7 @@ VIO_BOOL optimize_linear_transformation_quater(VIO_Volume d1,
                               p,
                               globals->trans_info.weights);
 
-  initial_corr = fit_function_quater(globals,p);
+  globals->initial_corr = fit_function_quater(globals,p);
 
            /* ---------------- call requested optimization strategy ---------*/
 
@@ -1732,7 +1989,9 @@ VIO_BOOL optimize_linear_transformation_quater(VIO_Volume d1,
                               p,
                               globals->trans_info.weights);
 
-  final_corr = fit_function_quater(globals,p);
+  globals->final_corr = fit_function_quater(globals,p);
+
+  delete_lattice_table(globals);
 
   FREE(p);
 
@@ -1761,14 +2020,14 @@ VIO_BOOL optimize_linear_transformation_quater(VIO_Volume d1,
 
   if (globals->obj_function == vr_objective)
     {
-      stat = stat && free_segment_table(segment_table);
+      stat = stat && free_segment_table(globals->fit.segment_table);
     } else
   if (globals->obj_function == mutual_information_objective || globals->obj_function == normalized_mutual_information_objective  )
                                 /* Collignon's mutual information */
     {
-      FREE(   prob_fn1 );
-      FREE(   prob_fn2 );
-      VIO_FREE2D( prob_hash_table);
+      FREE(   globals->fit.prob_fn1 );
+      FREE(   globals->fit.prob_fn2 );
+      VIO_FREE2D( globals->fit.prob_hash_table);
     }
 
 
@@ -1847,11 +2106,11 @@ float measure_fit(VIO_Volume d1,
   } else if (globals->obj_function == vr_objective) {
 
     if (globals->smallest_vol == 1) {
-      if (!build_segment_table(&segment_table, d1, globals->groups))
+      if (!build_segment_table(&globals->fit.segment_table, d1, globals->groups))
         print_error_and_line_num("Could not build segment table for source volume\n",__FILE__, __LINE__);
     }
     else {
-      if (!build_segment_table(&segment_table, d2, globals->groups))
+      if (!build_segment_table(&globals->fit.segment_table, d2, globals->groups))
         print_error_and_line_num("Could not build segment table for target volume\n",__FILE__, __LINE__);
     }
 
@@ -1882,9 +2141,9 @@ float measure_fit(VIO_Volume d1,
         }
       }
 
-      ALLOC(   prob_fn1,   globals->groups);
-      ALLOC(   prob_fn2,   globals->groups);
-      VIO_ALLOC2D( prob_hash_table, globals->groups, globals->groups);
+      ALLOC(   globals->fit.prob_fn1,   globals->groups);
+      ALLOC(   globals->fit.prob_fn2,   globals->groups);
+      VIO_ALLOC2D( globals->fit.prob_hash_table, globals->groups, globals->groups);
 
     } 
           /* ---------------- prepare the weighting array for obj func evaluation  ---------*/
@@ -1946,25 +2205,25 @@ if(globals->trans_info.rotation_type == TRANS_ROT)
   for(i=0; i<12; i++)
     if (globals->trans_info.weights[i] != 0.0) ndim++;
 
-                                /* set GLOBALS to communicate with the
+                                /* set globals->fit to communicate with the
                                    function to be fitted!              */
   y = -1e10; 
 
   if (stat) {
-    Gndim = ndim;
+    globals->fit.ndim = ndim;
     if (globals->smallest_vol == 1) {
-      Gdata1 = d1;
-      Gdata2 = d2;
-      Gmask1 = m1;
-      Gmask2 = m2;
-      Ginverse_mapping_flag = FALSE;
+      globals->fit.data1 = d1;
+      globals->fit.data2 = d2;
+      globals->fit.mask1 = m1;
+      globals->fit.mask2 = m2;
+      globals->fit.inverse_mapping = FALSE;
     }
     else {
-      Gdata1 = d2;
-      Gdata2 = d1;
-      Gmask1 = m2;
-      Gmask2 = m1;
-      Ginverse_mapping_flag = TRUE;
+      globals->fit.data1 = d2;
+      globals->fit.data2 = d1;
+      globals->fit.mask1 = m2;
+      globals->fit.mask2 = m1;
+      globals->fit.inverse_mapping = TRUE;
     }
 
     VIO_ALLOC2D(p,ndim+1+1,ndim+1); /* simplex */
@@ -2040,25 +2299,25 @@ if(globals->trans_info.rotation_type == TRANS_ROT)
   for(i=0; i<13; i++)
     if (globals->trans_info.weights[i] != 0.0) ndim++;
 
-                                /* set GLOBALS to communicate with the
+                                /* set globals->fit to communicate with the
                                    function to be fitted!              */
   y = -1e10; 
 
   if (stat) {
-    Gndim = ndim;
+    globals->fit.ndim = ndim;
     if (globals->smallest_vol == 1) {
-      Gdata1 = d1;
-      Gdata2 = d2;
-      Gmask1 = m1;
-      Gmask2 = m2;
-      Ginverse_mapping_flag = FALSE;
+      globals->fit.data1 = d1;
+      globals->fit.data2 = d2;
+      globals->fit.mask1 = m1;
+      globals->fit.mask2 = m2;
+      globals->fit.inverse_mapping = FALSE;
     }
     else {
-      Gdata1 = d2;
-      Gdata2 = d1;
-      Gmask1 = m2;
-      Gmask2 = m1;
-      Ginverse_mapping_flag = TRUE;
+      globals->fit.data1 = d2;
+      globals->fit.data2 = d1;
+      globals->fit.mask1 = m2;
+      globals->fit.mask2 = m1;
+      globals->fit.inverse_mapping = TRUE;
     }
 
     VIO_ALLOC2D(p,ndim+1+1,ndim+1); /* simplex */
@@ -2079,7 +2338,7 @@ if(globals->trans_info.rotation_type == TRANS_ROT)
           /* ----------------finish up parameter/matrix manipulations ------*/
 
   if (globals->obj_function == vr_objective) {
-    if (!free_segment_table(segment_table)) {
+    if (!free_segment_table(globals->fit.segment_table)) {
       (void)fprintf(stderr, "Can't free segment table.\n");
       (void)fprintf(stderr, "Error in line %d, file %s\n",__LINE__, __FILE__);
     }
@@ -2087,9 +2346,9 @@ if(globals->trans_info.rotation_type == TRANS_ROT)
   if (globals->obj_function == mutual_information_objective  || globals->obj_function == normalized_mutual_information_objective )
                                 /* Collignon's mutual information */
     {
-      FREE(   prob_fn1 );
-      FREE(   prob_fn2 );
-      VIO_FREE2D( prob_hash_table);
+      FREE(   globals->fit.prob_fn1 );
+      FREE(   globals->fit.prob_fn2 );
+      VIO_FREE2D( globals->fit.prob_hash_table);
     }
 
 
@@ -2179,22 +2438,22 @@ VIO_BOOL optimize_non_linear_transformation(Arg_Data *globals)
     {
       if (globals->smallest_vol == 1) 
         {
-          if (!build_segment_table(&segment_table, globals->features.data[0], globals->groups))
+          if (!build_segment_table(&globals->fit.segment_table, globals->features.data[0], globals->groups))
             print_error_and_line_num("Could not build segment table for source volume\n",__FILE__, __LINE__);
         }
       else 
         {
-          if (!build_segment_table(&segment_table, globals->features.model[0], globals->groups))
+          if (!build_segment_table(&globals->fit.segment_table, globals->features.model[0], globals->groups))
             print_error_and_line_num("Could not build segment table for target volume\n",__FILE__, __LINE__);
         }
 
       if (globals->flags.debug && globals->flags.verbose>1) 
         {
-          print ("groups = %d\n",segment_table->groups);
-          for(i=segment_table->min; i<segment_table->max+1; i++) 
+          print ("groups = %d\n",globals->fit.segment_table->groups);
+          for(i=globals->fit.segment_table->min; i<globals->fit.segment_table->max+1; i++) 
             {
-              print ("%5d: table = %5d, function = %5d\n",i,segment_table->table[i],
-                     (segment_table->segment)(i,segment_table) );
+              print ("%5d: table = %5d, function = %5d\n",i,globals->fit.segment_table->table[i],
+                     (globals->fit.segment_table->segment)(i,globals->fit.segment_table) );
             }
         }
       
@@ -2222,14 +2481,17 @@ VIO_BOOL optimize_non_linear_transformation(Arg_Data *globals)
            /* ---------------- call requested optimization strategy ---------*/
 
 
-  stat = ( do_non_linear_optimization(globals)==VIO_OK );
+  if (globals->nonlinear.schedule.levels > 0)
+    stat = ( do_non_linear_schedule(globals)==VIO_OK );
+  else
+    stat = ( do_non_linear_optimization(globals)==VIO_OK );
  
   
           /* ----------------finish up parameter/matrix manipulations ------*/
 
   if (stat && globals->obj_function == vr_objective) 
     {
-      stat = free_segment_table(segment_table);
+      stat = free_segment_table(globals->fit.segment_table);
     }
 
 
@@ -0,0 +1,171 @@
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : source_cache.c
+@DESCRIPTION: cache of the source volume samples of the sub-lattice of
+              each node of the deformation grid.
+
+              The source position of a node (the node mapped back
+              through the linear part of the transformation) does not
+              change during a call to do_non_linear_optimization(), so
+              the samples interpolated in the source volume by
+              build_lattices() on the first iteration are the same for
+              all later iterations.  They are kept here, within a
+              memory budget (-source_cache, in Mb).
+
+              Every iteration visits the nodes in the same order, so
+              once the budget is spent, new nodes are simply not cached
+              (evicting old entries would only ensure that none of them
+              is still there when next needed).  Nodes that are not
+              cached are resampled as before.
+@CREATED    : Oct 18, 2026
+---------------------------------------------------------------------------- */
+
+#include <config.h>
+#include <volume_io.h>
+#include <Proglib.h>
+#include "nonlinear_context.h"
+
+/* the samples of one node: for each feature f, a1_features[f][1..len]
+   at values[f*(len+1)+1 ..], then the sqrt_features[] of all
+   features at values[nf*(len+1) ..]; masked_samples[f][1..len] at
+   masked[f*(len+1)+1 ..] */
+
+struct Source_Samples_struct {
+  float         *values;
+  unsigned char *masked;
+};
+
+
+/* prepare an empty cache for a grid of n_nodes nodes, each having a
+   sub-lattice of len samples for each of n_features features.
+   Nothing is cached when max_megabytes <= 0. */
+
+void init_source_sample_cache(Source_Sample_Cache *cache,
+                              long n_nodes, int n_features, int len,
+                              VIO_Real max_megabytes)
+{
+  long i;
+
+  cache->n_nodes    = n_nodes;
+  cache->n_features = n_features;
+  cache->len        = len;
+  cache->n_cached   = 0;
+  cache->n_bytes    = 0;
+  cache->max_bytes  = (max_megabytes > 0.0) ?
+    (long)(max_megabytes * 1024.0 * 1024.0) : 0;
+  cache->nodes      = NULL;
+
+  if (cache->max_bytes > 0 && n_nodes > 0) {
+    ALLOC(cache->nodes, n_nodes);
+    for(i=0; i<n_nodes; i++)
+      cache->nodes[i] = NULL;
+    cache->n_bytes = n_nodes * (long)sizeof(Source_Samples *);
+  }
+}
+
+void delete_source_sample_cache(Source_Sample_Cache *cache)
+{
+  long i;
+
+  if (cache->nodes != NULL) {
+    for(i=0; i<cache->n_nodes; i++)
+      if (cache->nodes[i] != NULL) {
+        FREE(cache->nodes[i]->values);
+        FREE(cache->nodes[i]->masked);
+        FREE(cache->nodes[i]);
+      }
+    FREE(cache->nodes);
+  }
+
+  cache->n_cached = 0;
+  cache->n_bytes  = 0;
+}
+
+
+/* copy the cached source samples of node into *context; return FALSE
+   if they have not been cached */
+
+VIO_BOOL get_cached_source_samples(Source_Sample_Cache *cache,
+                                   long node,
+                                   Node_Context *context)
+{
+  Source_Samples
+    *entry;
+  int
+    f,c,stride;
+
+  if (cache->nodes == NULL || node < 0 || node >= cache->n_nodes ||
+      cache->nodes[node] == NULL || context->len != cache->len)
+    return(FALSE);
+
+  entry  = cache->nodes[node];
+  stride = cache->len + 1;
+
+  for(f=0; f<cache->n_features; f++) {
+    for(c=1; c<=cache->len; c++) {
+      context->a1_features[f][c]    = entry->values[f*stride + c];
+      context->masked_samples[f][c] = (VIO_BOOL)entry->masked[f*stride + c];
+    }
+    context->sqrt_features[f] = entry->values[cache->n_features*stride + f];
+  }
+
+  return(TRUE);
+}
+
+
+/* keep a copy of the source samples of node, found in *context, if
+   the memory budget allows it.  Each node is estimated by a single
+   thread, only the budget is shared. */
+
+void cache_source_samples(Source_Sample_Cache *cache,
+                          long node,
+                          Node_Context *context)
+{
+  Source_Samples
+    *entry;
+  int
+    f,c,stride;
+  long
+    n_values, n_bytes;
+  VIO_BOOL
+    fits;
+
+  if (cache->nodes == NULL || node < 0 || node >= cache->n_nodes ||
+      cache->nodes[node] != NULL || context->len != cache->len)
+    return;
+
+  stride   = cache->len + 1;
+  n_values = (long)cache->n_features * stride;
+  n_bytes  = sizeof(Source_Samples) +
+    (n_values + cache->n_features) * sizeof(float) +
+    n_values * sizeof(unsigned char);
+
+#ifdef _OPENMP
+#pragma omp critical (source_sample_cache)
+#endif
+  {
+    fits = (cache->n_bytes + n_bytes <= cache->max_bytes);
+    if (fits) {
+      cache->n_bytes += n_bytes;
+      cache->n_cached++;
+    }
+  }
+
+  if (!fits)
+    return;
+
+  ALLOC(entry, 1);
+  ALLOC(entry->values, n_values + cache->n_features);
+  ALLOC(entry->masked, n_values);
+
+  for(f=0; f<cache->n_features; f++) {
+    entry->values[f*stride] = 0.0;
+    entry->masked[f*stride] = 0;
+    for(c=1; c<=cache->len; c++) {
+      entry->values[f*stride + c] = context->a1_features[f][c];
+      entry->masked[f*stride + c] = (unsigned char)(context->masked_samples[f][c] != 0);
+    }
+    entry->values[n_values + f] = context->sqrt_features[f];
+  }
+
+  cache->nodes[node] = entry;
+}
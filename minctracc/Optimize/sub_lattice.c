@@ -5,11 +5,14 @@
               local sublattice for non-linear deformation.
 
   these include:
+     build_sub_lattice_template() - to build the sublattice around the origin, once
      build_source_lattice() -       to build the sublattice in the source volume
      go_get_samples_in_source() -   to interpolate values for sublattice positions 
                                     in the source volume
      go_get_samples_with_offset() - to interpolate values for sublattice positions, 
                                     given a vector offset for the lattice.
+     go_get_stencil_samples_with_offset() - the same, for the 27 offsets
+                                    of the quadratic fit stencil, in one pass.
      build_target_lattice() -       map the source sublattice thrugh the current xform
                                     to create a sublattice defined on the target.
      
@@ -84,18 +87,15 @@
 #include "minctracc_arg_data.h"                /* definition of the global data struct      */
 #include "sub_lattice.h"
 #include "init_lattice.h"
+#include "interpolation.h"
 
+                                /* number of sub-lattice nodes interpolated
+                                   together by go_get_samples_with_offset() */
+#define SAMPLE_CHUNK 64
 
-extern Arg_Data *Gglobals;      /* defined in do_nonlinear.c */
-extern VIO_Volume   Gsuper_sampled_vol; /* defined in do_nonlinear.c */
-extern VIO_General_transform 
-                *Glinear_transform;/* defined in do_nonlinear.c */
 
                                 /* prototypes for functions used here: */
 
-extern float
-  *SX, *SY, *SZ;
-
  void  general_transform_point_in_trans_plane(
     VIO_General_transform   *transform,
     VIO_Real                x,
@@ -114,31 +114,35 @@ int voxel_point_not_masked(VIO_Volume volume,
 
 /*********************************************************************** 
    build a regular (2D) 3D lattice of coordinates to represent the
-   local (circular) spherical neighbourhood surrounding the point
-   x,y,z.
+   local (circular) spherical neighbourhood surrounding the origin, ie
+   the offsets of the sub-lattice nodes from the node being estimated.
 
-   - *length coordinates are returned in PX[], PY[], PZ[]. 
+   - the nl->template_len offsets are stored (1..len) in
+     nl->template_world[VIO_X,VIO_Y,VIO_Z], in WORLD coordinates.
    - The radius of the lattice is defined by width_{x,y,z}.
    - The equivalent retangular lattice has (nx)(ny)(nz) samples,
-     but the round lattice returned has *length samples.  
-
-   the coordinate coming in, and those going out are all in WORLD
-   coordinates 
+     but the round lattice returned has template_len samples.  
+   - the same offsets are stored in nl->template_voxel[][feature][],
+     in voxel units of the source volume of each feature.
+
+   The shape of the sub-lattice does not depend on the node, so this
+   is done once per call to do_non_linear_optimization(); each node
+   then simply translates the template (see build_source_lattice() and
+   build_source_voxel_lattice()).
 */
 
 /* make sure that the lattice is defined on the axis of the 2nd data
    volume (and hence the grid transform volume) and NOT the world
    coordinate axis! */
 
-void    build_source_lattice(VIO_Real x, VIO_Real y, VIO_Real z,
-                                    float PX[], float PY[], float PZ[],
-                                    VIO_Real width_x, VIO_Real width_y, VIO_Real width_z, 
-                                    int nx, int ny, int nz,
-                                    int ndim, int *length)
+void    build_sub_lattice_template(Nonlinear_Context *nl,
+                                   VIO_Real width_x, VIO_Real width_y, VIO_Real width_z, 
+                                   int nx, int ny, int nz)
 {
   int 
-    c, 
+    c, f, a,
     tnx, tny, tnz,
+    max_len,
     i,j,k;
   float 
     radius_squared,
@@ -146,27 +150,36 @@ void    build_source_lattice(VIO_Real x, VIO_Real y, VIO_Real z,
   float
     abs_step,
     dir[3][3];
+  VIO_Real
+    origin[VIO_MAX_DIMENSIONS],
+    voxel[VIO_MAX_DIMENSIONS];
+  Feature_volumes
+    *features = &nl->globals->features;
 
-  *length = 0; 
-  c = 1;
   radius_squared = 0.55 * 0.55;        /* a bit bigger than .5^2 */
   
 
   for(i=0; i<3; i++) {
     
-    abs_step = fabs(Gglobals->step[i]);
+    abs_step = fabs(nl->globals->step[i]);
 
-    dir[i][0] = Point_x(Gglobals->directions[i]) / abs_step;
-    dir[i][1] = Point_y(Gglobals->directions[i]) / abs_step;
-    dir[i][2] = Point_z(Gglobals->directions[i]) / abs_step;
+    dir[i][0] = Point_x(nl->globals->directions[i]) / abs_step;
+    dir[i][1] = Point_y(nl->globals->directions[i]) / abs_step;
+    dir[i][2] = Point_z(nl->globals->directions[i]) / abs_step;
   }
 
 
-  if (Gglobals->count[0] > 1) { tnx = nx; }  else {    tnx = 1;  }
-  if (Gglobals->count[1] > 1) { tny = ny; }  else {    tny = 1;  }
-  if (Gglobals->count[2] > 1) { tnz = nz; }  else {    tnz = 1;  }
+  if (nl->globals->count[0] > 1) { tnx = nx; }  else {    tnx = 1;  }
+  if (nl->globals->count[1] > 1) { tny = ny; }  else {    tny = 1;  }
+  if (nl->globals->count[2] > 1) { tnz = nz; }  else {    tnz = 1;  }
 
+  max_len = tnx*tny*tnz + 1;
+  for(a=0; a<3; a++) {
+    ALLOC(nl->template_world[a], max_len);
+    VIO_ALLOC2D(nl->template_voxel[a], features->number_of_features, max_len);
+  }
 
+  c = 1;
   for(i=0; i<tnx; i++) {
     for(j=0; j<tny; j++) {
       for(k=0; k<tnz; k++) {
@@ -182,59 +195,116 @@ void    build_source_lattice(VIO_Real x, VIO_Real y, VIO_Real z,
           ty *= width_y;
           tz *= width_z;
 
-          PX[c] = (float)x + tx*dir[VIO_X][VIO_X] + ty*dir[VIO_Y][VIO_X] + tz*dir[VIO_Z][VIO_X];
-          PY[c] = (float)y + tx*dir[VIO_X][VIO_Y] + ty*dir[VIO_Y][VIO_Y] + tz*dir[VIO_Z][VIO_Y];
-          PZ[c] = (float)z + tx*dir[VIO_X][VIO_Z] + ty*dir[VIO_Y][VIO_Z] + tz*dir[VIO_Z][VIO_Z];
+          nl->template_world[VIO_X][c] = tx*dir[VIO_X][VIO_X] + ty*dir[VIO_Y][VIO_X] + tz*dir[VIO_Z][VIO_X];
+          nl->template_world[VIO_Y][c] = tx*dir[VIO_X][VIO_Y] + ty*dir[VIO_Y][VIO_Y] + tz*dir[VIO_Z][VIO_Y];
+          nl->template_world[VIO_Z][c] = tx*dir[VIO_X][VIO_Z] + ty*dir[VIO_Y][VIO_Z] + tz*dir[VIO_Z][VIO_Z];
 
           c++;
-          (*length)++;
         }
       }
     }
   }
+  nl->template_len = c-1;
+
+                                /* the world to voxel mapping is affine, so
+                                   the voxel offsets are those of the
+                                   template nodes minus that of the origin */
+  for(f=0; f<features->number_of_features; f++) {
+
+    convert_world_to_voxel(features->data[f], 0.0, 0.0, 0.0, origin);
+
+    for(c=1; c<=nl->template_len; c++) {
+      convert_world_to_voxel(features->data[f], 
+                             (VIO_Real)nl->template_world[VIO_X][c],
+                             (VIO_Real)nl->template_world[VIO_Y][c],
+                             (VIO_Real)nl->template_world[VIO_Z][c],
+                             voxel);
+      for(a=0; a<3; a++)
+        nl->template_voxel[a][f][c] = voxel[a] - origin[a];
+    }
+  }
 
+}
 
-  /*
-  if (ndim==2) {
-    for(i=0; i<nx; i++)
-      for(j=0; j<ny; j++) {
-        tx = -0.5 + (float)(i)/(float)(nx-1);
-        ty = -0.5 + (float)(j)/(float)(ny-1);
-        if ((tx*tx + ty*ty) <= radius_squared) {
-          PX[c] = (float)(x + width_x * tx);
-          PY[c] = (float)(y + width_y * ty);
-          PZ[c] = (float)z;
-          c++;
-          (*length)++;
-        }
-      }
+/* free the storage allocated by build_sub_lattice_template() */
+
+void    delete_sub_lattice_template(Nonlinear_Context *nl)
+{
+  int a;
+
+  for(a=0; a<3; a++) {
+    FREE(nl->template_world[a]);
+    VIO_FREE2D(nl->template_voxel[a]);
   }
-  else {
-    for(i=0; i<nx; i++)
-      for(j=0; j<ny; j++)
-        for(k=0; k<nz; k++) {
-          tx = -0.5 + (float)(i)/(float)(nx-1);
-          ty = -0.5 + (float)(j)/(float)(ny-1);
-          tz = -0.5 + (float)(k)/(float)(nz-1);
-          if ((tx*tx + ty*ty + tz*tz) <= radius_squared) {
-            PX[c] = (float)(x + width_x * tx);
-            PY[c] = (float)(y + width_y * ty);
-            PZ[c] = (float)(z + width_z * tz);
-            c++;
-            (*length)++;
-          }
-        }
+  nl->template_len = 0;
+}
+
+/*********************************************************************** 
+   build the sub-lattice surrounding the point x,y,z by translating
+   the template built by build_sub_lattice_template().
+
+   - *length coordinates are returned in PX[], PY[], PZ[]. 
+
+   the coordinate coming in, and those going out are all in WORLD
+   coordinates 
+*/
+
+void    build_source_lattice(Nonlinear_Context *nl,
+                             VIO_Real x, VIO_Real y, VIO_Real z,
+                             float PX[], float PY[], float PZ[],
+                             int *length)
+{
+  int 
+    c;
+  float
+    *OX = nl->template_world[VIO_X],
+    *OY = nl->template_world[VIO_Y],
+    *OZ = nl->template_world[VIO_Z];
+
+  for(c=1; c<=nl->template_len; c++) {
+    PX[c] = (float)x + OX[c];
+    PY[c] = (float)y + OY[c];
+    PZ[c] = (float)z + OZ[c];
   }
-  */
 
+  *length = nl->template_len;
 }
 
 /*********************************************************************** 
-   use the world coordinates stored in x[],y[],z[] to interpolate len
-   samples from the volume 'data' */
+   the same sub-lattice as build_source_lattice(), but in voxel
+   coordinates of the source volume of the given feature, returned in
+   VX[], VY[], VZ[] (in the dimension order of that volume) */
+
+void    build_source_voxel_lattice(Nonlinear_Context *nl, int feature,
+                                   VIO_Real x, VIO_Real y, VIO_Real z,
+                                   float VX[], float VY[], float VZ[])
+{
+  int 
+    c;
+  VIO_Real
+    centre[VIO_MAX_DIMENSIONS];
+  float
+    *OX = nl->template_voxel[0][feature],
+    *OY = nl->template_voxel[1][feature],
+    *OZ = nl->template_voxel[2][feature];
+
+  convert_world_to_voxel(nl->globals->features.data[feature], x, y, z, centre);
+
+  for(c=1; c<=nl->template_len; c++) {
+    VX[c] = (float)centre[0] + OX[c];
+    VY[c] = (float)centre[1] + OY[c];
+    VZ[c] = (float)centre[2] + OZ[c];
+  }
+}
+
+/*********************************************************************** 
+   use the world coordinates stored in x[],y[],z[] (for the mask) and
+   the equivalent voxel coordinates of 'data' stored in vx[],vy[],vz[]
+   to interpolate len samples from the volume 'data' */
 
 void go_get_samples_in_source(VIO_Volume data, VIO_Volume mask,
                                      float x[], float y[], float z[],
+                                     float vx[], float vy[], float vz[],
                                      float samples[], VIO_BOOL masked_samples[],
                                      int len,
                                      int inter_type) 
@@ -242,21 +312,22 @@ void go_get_samples_in_source(VIO_Volume data, VIO_Volume mask,
   int 
     c;
   VIO_Real 
-    val[VIO_MAX_DIMENSIONS];
+    val[VIO_MAX_DIMENSIONS],
+    voxel[VIO_MAX_DIMENSIONS];
   
   for(c=1; c<=len; c++) {  
     if (point_not_masked(mask, (VIO_Real)x[c], (VIO_Real)y[c], (VIO_Real)z[c])){
       masked_samples[c] = FALSE;
       val[0] = 0.0;
-      evaluate_volume_in_world(data,
-                               (VIO_Real)x[c], (VIO_Real)y[c], (VIO_Real)z[c], 
-                               inter_type,
-                               TRUE,
-                               0.0, 
-                               val,
-                               NULL, NULL, NULL, 
-                               NULL, NULL, NULL, 
-                               NULL, NULL, NULL );
+      voxel[0] = (VIO_Real)vx[c];
+      voxel[1] = (VIO_Real)vy[c];
+      voxel[2] = (VIO_Real)vz[c];
+      (void)evaluate_volume(data, voxel, NULL,
+                            inter_type,
+                            TRUE,
+                            0.0, 
+                            val,
+                            NULL, NULL);
       
       samples[c] = (float)val[0];
     }
@@ -269,6 +340,146 @@ void go_get_samples_in_source(VIO_Volume data, VIO_Volume mask,
   
 }
 
+/*********************************************************************** 
+   return the value of voxel [i][j][k] of the 3D volume 'data', read
+   directly from the buffer returned by get_volume_voxel_buffer() when
+   there is one */
+
+static double voxel_value(VIO_Volume data, 
+                          double *double_voxels, float *float_voxels,
+                          long strides[], int i, int j, int k)
+{
+  if (double_voxels != NULL)
+    return( double_voxels[i*strides[0] + j*strides[1] + k] );
+  else if (float_voxels != NULL)
+    return( (double)float_voxels[i*strides[0] + j*strides[1] + k] );
+  else
+    return( get_volume_real_value(data, i, j, k, 0, 0) );
+}
+
+/*********************************************************************** 
+   do the last bits of the similarity function calculation, given the
+   accumulators s1..s5 filled by switch_obj_func.c over the sub-lattice:
+   normalize each obj_func where-ever possible. */
+
+static float similarity_from_sums(int obj_func, float normalization,
+                                  double s1, double s2, double s3,
+                                  double s4, double s5,
+                                  int number_of_nonzero_samples)
+{
+  double
+    r;
+  double mean_s = 0.0;		/* init variables for stats */
+  double mean_t = 0.0;
+  double var_s = 0.0;
+  double var_t = 0.0;
+  double covariance = 0.0;
+
+  r = 0.0;
+
+  switch (obj_func) {
+
+  case NONLIN_XCORR:            /* use standard normalized cross-correlation 
+                                   where 0.0 < r < 1.0, where 1.0 is best*/
+    if ( normalization < 0.001 && s3 < 0.00001) {
+      r = 1.0;
+    }
+    else {
+      if ( normalization < 0.001 || s3 < 0.00001) {
+        r = 0.0;
+      }
+      else {
+        r = s1 / ((sqrt((double)s2))*(sqrt((double)s3)));
+      }
+    }
+    /* r = 1.0 - r;                 now, 0 is best                   */
+    break;
+
+  case NONLIN_DIFF:             /* normalization stores the number of samples in
+                                   the sub-lattice 
+                                   s1 stores the sum of the magnitude of
+                                   the differences*/
+
+     r = -s1 /number_of_nonzero_samples;        /* r = average intensity difference ; with
+                                   -max(intensity range) < r < 0,
+                                   where 0 is best                  */
+    break;
+  case NONLIN_LABEL:
+     r = s1 /number_of_nonzero_samples;           /* r = average label agreement,
+                                    s1 stores the number of similar labels
+                                   0 < r < 1.0                      
+                                   where 1.0 is best                */
+    break;
+  case NONLIN_CHAMFER:
+    if (number_of_nonzero_samples>0) {
+       r = 1.0 - (s1 / (20.0*number_of_nonzero_samples));        
+                                /* r = 1- average distance / 20mm 
+                                       0 < r < ~1.0 
+                                   where 1.0 is best     
+                                       and where 2.0cm is an arbitrary value to
+                                       norm the dist, corresponding to a guess
+                                       at the maximum average cortical variability
+
+                                       so the max(r) could be greater than
+                                       1.0, but when it is, shouldn't
+                                       chamfer have larger weight to drive
+                                       the fit? */
+    }
+    else
+       r = 2.0;                 /* this is simply a value > 1.5, used as a
+                                   flag to indicate that there were no
+                                   samples used for the chamfer */
+    break;
+  case NONLIN_CORRCOEFF:
+      {
+          /* Accumulators:
+           * s1 = sum of source image values
+           * s2 = sum of target image values
+           * s3 = sum of squared source image values
+           * s4 = sum of squared target image values
+           * s5 = sum of source*target values
+           *
+           * normalization = #values considered
+           */
+          if (number_of_nonzero_samples>0) {
+            mean_s = s1 / number_of_nonzero_samples;
+            mean_t = s2 / number_of_nonzero_samples;
+            var_s = s3 / number_of_nonzero_samples - mean_s*mean_s;
+            var_t = s4 / number_of_nonzero_samples - mean_t*mean_t;
+            covariance = s5 / number_of_nonzero_samples - mean_s*mean_t;
+          }
+          else {
+            mean_s = 0.0;
+            mean_t = 0.0;
+            var_s = 0.0;
+            var_t = 0.0;
+            covariance = 0.0;
+          }
+
+
+          if ((var_s < 0.00001) || (var_t < 0.00001) ) {
+            r = 0.0;
+          }
+          else {
+            r = covariance / sqrt( var_s*var_t );            
+          }
+      }
+      break;
+          
+  case NONLIN_SQDIFF:           /* normalization stores the number of samples 
+                                   in the sub-lattice.
+                                   s1 stores the sum of the squared intensity
+                                   differences */
+    r = -s1 /number_of_nonzero_samples;
+    break;
+
+  default:
+    print_error_and_line_num("Objective function %d not supported in go_get_samples_with_offset",__FILE__, __LINE__,obj_func);
+  }
+
+  return(r);
+}
+
 /*********************************************************************** 
    use the list of voxel coordinates stored in x[], y[], z[] and the
    voxel offset stored in dx, dy, dz to interpolate len samples from
@@ -297,9 +508,14 @@ void go_get_samples_in_source(VIO_Volume data, VIO_Volume mask,
    CAVEAT 2: only VIO_Volume data types of UNSIGNED_BYTE, SIGNED_SHORT, and
              UNSIGNED_SHORT are supported.
 
+             *** volumes stored as DOUBLE or FLOAT (-voxel_type) are
+             read directly from their voxel buffer; any other type is
+             read (slowly) through get_volume_real_value().
+
 */
 
 float go_get_samples_with_offset(
+				 Nonlinear_Context *nl,            /* the fit in progress */
 				 VIO_Volume data,                  /* The volume of data */
 				 VIO_Volume mask,                  /* The target mask */  
 				 float *x, float *y, float *z,     /* the positions of the sub-lattice */
@@ -313,28 +529,30 @@ float go_get_samples_with_offset(
 				 VIO_BOOL use_nearest_neighbour)   /* interpolation flag              */
 {
   double
-    sample, r,
+    sample,
     s1,s2,s3,s4,s5,tmp;                   /* accumulators for inner loop */
   int 
     sizes[3],
     ind0, ind1, ind2, 
     offset0, offset1, offset2,
-    c,number_of_nonzero_samples;  
+    c,i,n,chunk,number_of_nonzero_samples;  
   int xs,ys,zs;
   float
     f_trans, f_scale;
 
-  static double v0, v1, v2;
-  static double f0, f1, f2, r0, r1, r2, r1r2, r1f2, f1r2, f1f2;
-  static double v000, v001, v010, v011, v100, v101, v110, v111;
-
-  double ***double_ptr;
-  
-  double mean_s = 0.0;		/* init variables for stats */
-  double mean_t = 0.0;
-  double var_s = 0.0;
-  double var_t = 0.0;
-  double covariance = 0.0;
+  double *double_voxels;                /* the voxels, when stored as       */
+  float  *float_voxels;                 /* NC_DOUBLE or NC_FLOAT            */
+  long   strides[3], corner_offset[8];
+  int    v, corner_step[8][3];
+
+  float  px[SAMPLE_CHUNK], py[SAMPLE_CHUNK], pz[SAMPLE_CHUNK], 
+         pa[SAMPLE_CHUNK];              /* packed non-masked nodes          */
+  int    node_ind[3][SAMPLE_CHUNK],     /* their voxel indices,             */
+         inside[SAMPLE_CHUNK];          /* whether they are in the volume,  */
+  long   node_idx[SAMPLE_CHUNK];        /* their offset in the buffer,      */
+  double frac[3][SAMPLE_CHUNK],         /* the fraction parts,              */
+         corner[8][SAMPLE_CHUNK],       /* the 8 neighbours and             */
+         samples[SAMPLE_CHUNK];         /* the interpolated values          */
   
   number_of_nonzero_samples = 0;
 
@@ -358,7 +576,7 @@ float go_get_samples_with_offset(
     dy += 0.;                        /* ind2 below */
     dz += 0.;
     
-    double_ptr = VOXEL_DATA (data); 
+    (void)get_volume_voxel_buffer(data, &double_voxels, &float_voxels, strides);
       
     /* increment by one as we index from 1...n (but the array is ALLOC'd from 0..n) */
     x++; y++; z++; 
@@ -393,7 +611,7 @@ float go_get_samples_with_offset(
          if (ind0>=0 && ind0<xs &&
              ind1>=0 && ind1<ys &&
              ind2>=0 && ind2<zs) {
-	   sample = (double)(double_ptr[ind0][ind1][ind2]);
+	   sample = voxel_value(data, double_voxels, float_voxels, strides, ind0, ind1, ind2);
          }
          else{
             sample = 0.0;
@@ -414,216 +632,1024 @@ float go_get_samples_with_offset(
   else {                        /* then do fast trilinear interpolation */
     
     /* set up offsets */
-    offset0 = (Gglobals->count[VIO_Z] > 1) ? 1 : 0;
-    offset1 = (Gglobals->count[VIO_Y] > 1) ? 1 : 0;
-    offset2 = (Gglobals->count[VIO_X] > 1) ? 1 : 0;
+    offset0 = (nl->globals->count[VIO_Z] > 1) ? 1 : 0;
+    offset1 = (nl->globals->count[VIO_Y] > 1) ? 1 : 0;
+    offset2 = (nl->globals->count[VIO_X] > 1) ? 1 : 0;
     
-    double_ptr = VOXEL_DATA (data);
+    (void)get_volume_voxel_buffer(data, &double_voxels, &float_voxels, strides);
+
+                                /* offset of each of the 8 neighbours
+                                   used for the interpolation, bit 2 of
+                                   v is the step along the 1st dim, bit
+                                   1 along the 2nd and bit 0 along the
+                                   3rd */
+    for(v=0; v<8; v++) {
+      corner_step[v][0] = ((v>>2)&1) * offset0;
+      corner_step[v][1] = ((v>>1)&1) * offset1;
+      corner_step[v][2] = ( v    &1) * offset2;
+      corner_offset[v]  = corner_step[v][0]*strides[0] + corner_step[v][1]*strides[1] + 
+                          corner_step[v][2];
+    }
         
     /* increment by one as we index from 1...n */
     ++x; ++y; ++z; 
-        
-    /* for each sub-lattice node */
-    for(c=len; c--;) {
-           
-           /*  fast tri-linear interplation */
-           
-      if  (  !(*m1) && (voxel_point_not_masked(mask, (VIO_Real)*x, (VIO_Real)*y, (VIO_Real)*z)) && (!(obj_func==NONLIN_CHAMFER) ||  (*a1>0)) ) {
-              v0 = (VIO_Real) ( *x + dx );
-              v1 = (VIO_Real) ( *y + dy );
-              v2 = (VIO_Real) ( *z + dz );
-              
-              ind0 = (int)v0;
-              ind1 = (int)v1;
-              ind2 = (int)v2;
+
+    /* the sub-lattice is processed SAMPLE_CHUNK nodes at a time: the
+       nodes that pass the mask tests are packed into flat arrays, then
+       the interpolation and the accumulation of the similarity sums are
+       done in loops that the compiler can vectorize */
+
+    for(c=0; c<len; c+=SAMPLE_CHUNK) {
+
+      chunk = (len-c < SAMPLE_CHUNK) ? len-c : SAMPLE_CHUNK;
+      n = 0;
+      for(i=0; i<chunk; i++) {
+        if  (  !m1[c+i] && (voxel_point_not_masked(mask, (VIO_Real)x[c+i], (VIO_Real)y[c+i], (VIO_Real)z[c+i])) && 
+               (!(obj_func==NONLIN_CHAMFER) ||  (a1[c+i]>0)) ) {
+          px[n] = x[c+i];
+          py[n] = y[c+i];
+          pz[n] = z[c+i];
+          pa[n] = a1[c+i];
+          n++;
+        }
+      }
+      
+      /* voxel indices and fraction parts of the packed nodes */
+
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+      for(i=0; i<n; i++) {
+        double v0, v1, v2;
+
+        v0 = (VIO_Real) ( px[i] + dx );
+        v1 = (VIO_Real) ( py[i] + dy );
+        v2 = (VIO_Real) ( pz[i] + dz );
               
-              if (ind0>=0 && ind0<(xs-offset0) &&
-                  ind1>=0 && ind1<(ys-offset1) &&
-                  ind2>=0 && ind2<(zs-offset2)) {
-                 
-                 /* get the data */
-                 v000 = (VIO_Real)(double_ptr[ind0        ][ind1        ][ind2        ]);
-                 v001 = (VIO_Real)(double_ptr[ind0        ][ind1        ][ind2+offset2]);
-                 v010 = (VIO_Real)(double_ptr[ind0        ][ind1+offset1][ind2        ]);
-                 v011 = (VIO_Real)(double_ptr[ind0        ][ind1+offset1][ind2+offset2]);
-                 v100 = (VIO_Real)(double_ptr[ind0+offset0][ind1        ][ind2        ]);
-                 v101 = (VIO_Real)(double_ptr[ind0+offset0][ind1        ][ind2+offset2]);
-                 v110 = (VIO_Real)(double_ptr[ind0+offset0][ind1+offset1][ind2        ]);
-                 v111 = (VIO_Real)(double_ptr[ind0+offset0][ind1+offset1][ind2+offset2]);
-                 
-                 /* Get the fraction parts */
-                 f0 = v0 - ind0;
-                 f1 = v1 - ind1;
-                 f2 = v2 - ind2;
-                 r0 = 1.0 - f0;
-                 r1 = 1.0 - f1;
-                 r2 = 1.0 - f2;
-                 
-                 /* Do the interpolation */
-                 r1r2 = r1 * r2;
-                 r1f2 = r1 * f2;
-                 f1r2 = f1 * r2;
-                 f1f2 = f1 * f2;
+        node_ind[0][i] = (int)v0;
+        node_ind[1][i] = (int)v1;
+        node_ind[2][i] = (int)v2;
+
+        inside[i] = (node_ind[0][i]>=0 && node_ind[0][i]<(xs-offset0) &&
+                     node_ind[1][i]>=0 && node_ind[1][i]<(ys-offset1) &&
+                     node_ind[2][i]>=0 && node_ind[2][i]<(zs-offset2));
+
+                                /* read voxel 0 for positions outside of
+                                   the volume, their sample is 0.0 */
+        node_idx[i] = inside[i] ? 
+          node_ind[0][i]*strides[0] + node_ind[1][i]*strides[1] + node_ind[2][i] : 0;
                  
-                 sample   = 
-                    r0 *  (r1r2 * v000 +
-                           r1f2 * v001 +
-                           f1r2 * v010 +
-                           f1f2 * v011);
-                 sample  +=
-                    f0 *  (r1r2 * v100 +
-                           r1f2 * v101 +
-                           f1r2 * v110 +
-                           f1f2 * v111);
-                 
-                 sample = sample;
+        frac[0][i] = v0 - node_ind[0][i];
+        frac[1][i] = v1 - node_ind[1][i];
+        frac[2][i] = v2 - node_ind[2][i];
+      }
+
+      /* get the 8 neighbours of each node */
+
+      if (double_voxels != NULL) {
+        for(v=0; v<8; v++) {
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+          for(i=0; i<n; i++) 
+            corner[v][i] = double_voxels[ node_idx[i] + corner_offset[v] ];
+        }
+      }
+      else if (float_voxels != NULL) {
+        for(v=0; v<8; v++) {
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+          for(i=0; i<n; i++) 
+            corner[v][i] = (double)float_voxels[ node_idx[i] + corner_offset[v] ];
+        }
+      }
+      else {                    /* other data types, through volume_io */
+        for(v=0; v<8; v++) 
+          for(i=0; i<n; i++) 
+            corner[v][i] = inside[i] ?
+              get_volume_real_value(data, 
+                                    node_ind[0][i] + corner_step[v][0],
+                                    node_ind[1][i] + corner_step[v][1],
+                                    node_ind[2][i] + corner_step[v][2], 0, 0) : 0.0;
+      }
+
+      /*  fast tri-linear interplation of the packed nodes */
+
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+      for(i=0; i<n; i++) {
+        double f0, f1, f2, r0, r1, r2, r1r2, r1f2, f1r2, f1f2;
+
+        f0 = frac[0][i];
+        f1 = frac[1][i];
+        f2 = frac[2][i];
+        r0 = 1.0 - f0;
+        r1 = 1.0 - f1;
+        r2 = 1.0 - f2;
                  
+        r1r2 = r1 * r2;
+        r1f2 = r1 * f2;
+        f1r2 = f1 * r2;
+        f1f2 = f1 * f2;
                  
-              }
-              else{
-		sample = 0.0;
-	      }
-              
-              
-#include "switch_obj_func.c"
+        samples[i] = 
+          r0 *  (r1r2 * corner[0][i] +
+                 r1f2 * corner[1][i] +
+                 f1r2 * corner[2][i] +
+                 f1f2 * corner[3][i]) +
+          f0 *  (r1r2 * corner[4][i] +
+                 r1f2 * corner[5][i] +
+                 f1r2 * corner[6][i] +
+                 f1f2 * corner[7][i]);
+
+        if (!inside[i])
+          samples[i] = 0.0;
+      }
 
+      /* accumulate the sample-to-sample computations required for the
+         non-lin objective function (see switch_obj_func.c) */
+
+      switch (obj_func) {
+   
+      case NONLIN_CORRCOEFF:
+#ifdef _OPENMP
+#pragma omp simd reduction(+:s1,s2,s3,s4,s5)
+#endif
+        for(i=0; i<n; i++) {
+          s1 += pa[i];
+          s2 += samples[i];
+          s3 += pa[i] * pa[i];
+          s4 += samples[i] * samples[i];
+          s5 += pa[i] * samples[i];
+        }
+        number_of_nonzero_samples += n;
+        break;
+   
+      case NONLIN_XCORR:
+#ifdef _OPENMP
+#pragma omp simd reduction(+:s1,s2,s3)
+#endif
+        for(i=0; i<n; i++) {
+          s2 += pa[i] * pa[i];
+          s1 += pa[i] * samples[i]; 
+          s3 += samples[i] * samples[i];
+        }
+        break;
+   
+      case NONLIN_CHAMFER:      /* only nodes with pa[i]>0 were packed */
+#ifdef _OPENMP
+#pragma omp simd reduction(+:s1)
+#endif
+        for(i=0; i<n; i++) 
+          s1 += samples[i];
+        number_of_nonzero_samples += n;
+        break;
+   
+      case NONLIN_SQDIFF:
+#ifdef _OPENMP
+#pragma omp simd reduction(+:s1)
+#endif
+        for(i=0; i<n; i++) {
+          double d = pa[i] - samples[i];
+          s1 += d*d;
+        }
+        number_of_nonzero_samples += n;
+        break;
+   
+      case NONLIN_DIFF:
+#ifdef _OPENMP
+#pragma omp simd reduction(+:s1)
+#endif
+        for(i=0; i<n; i++) 
+          s1 += fabs(pa[i] - samples[i]);
+        number_of_nonzero_samples += n;
+        break;
+   
+      case NONLIN_LABEL:        /* count similar labels */
+#ifdef _OPENMP
+#pragma omp simd reduction(+:s1)
+#endif
+        for(i=0; i<n; i++) 
+          s1 += (fabs(pa[i] - samples[i]) < 0.01) ? 1.0 : 0.0;
+        number_of_nonzero_samples += n;
+        break;
+   
+      default:
+        print_error_and_line_num("Objective function %d not supported in go_get_samples_with_offset",__FILE__, __LINE__,obj_func);
       }
-      
-      /* increment the coordinate, value and mask array pointers */  
-      x++;			/* x,y,z are the coords of the sublattice in the fixed (source) image */
-      y++;
-      z++;
-      a1++;			/* a1 is from the fixed image */
-      m1++;			/* m1 is rom the mask on the fixed image */
-      
     } 
-  
+  }
 
+  return( similarity_from_sums(obj_func, normalization, 
+                               s1, s2, s3, s4, s5, number_of_nonzero_samples) );
+}
 
-                                /* do the last bits of the similarity function
-                                   calculation here - normalizing each obj_func
-                                   where-ever possible: */
-  r = 0.0;
+/*********************************************************************** 
+   TRUE if the target volumes of the features sampled on the
+   sub-lattice (all but the optical flow ones) are at least two, and
+   share the same voxel geometry, so that the interpolation weights of
+   a target sub-lattice are the same for all of them (see
+   go_get_feature_samples_with_offset()).
+*/
 
-  switch (obj_func) {
+VIO_BOOL features_share_geometry(Arg_Data *globals)
+{
+  int
+    f, i, n,
+    sizes[VIO_MAX_DIMENSIONS],
+    first_sizes[VIO_MAX_DIMENSIONS];
 
-  case NONLIN_XCORR:            /* use standard normalized cross-correlation 
-                                   where 0.0 < r < 1.0, where 1.0 is best*/
-    if ( normalization < 0.001 && s3 < 0.00001) {
-      r = 1.0;
+  n = 0;
+  for(f=0; f<globals->features.number_of_features; f++) {
+    if (globals->features.obj_func[f] == NONLIN_OPTICALFLOW)
+      continue;
+
+    if (get_volume_n_dimensions(globals->features.model[f]) != 3)
+      return(FALSE);
+
+    get_volume_sizes(globals->features.model[f], sizes);
+    if (n == 0)
+      for(i=0; i<3; i++) first_sizes[i] = sizes[i];
+    else
+      for(i=0; i<3; i++)
+        if (sizes[i] != first_sizes[i])
+          return(FALSE);
+    n++;
+  }
+
+  return( n > 1 );
+}
+
+/*********************************************************************** 
+   go_get_samples_with_offset() with tri-linear interpolation, for all
+   the features of the fit at once (when features_share_geometry()).
+
+   The voxel index and the 8 interpolation weights of each node of the
+   displaced target sub-lattice (context->TX,TY,TZ + dx,dy,dz) are
+   computed once, then applied to the target volume of each feature.
+   The masks, the source samples and the objective function remain
+   those of each feature: the nodes a feature does not use get a null
+   weight in its sums.
+
+   result[f] is set to the similarity of feature f, as returned by
+   go_get_samples_with_offset() (0 for the optical flow features).
+*/
+
+void go_get_feature_samples_with_offset(Node_Context *context,
+                                        VIO_Real dx, VIO_Real dy, VIO_Real dz,
+                                        float result[])
+{
+  Arg_Data
+    *globals = context->nl->globals;
+  VIO_Volume
+    data, mask;
+  double
+    s1,s2,s3,s4,s5,n_active;
+  int 
+    sizes[3],
+    offset0, offset1, offset2,
+    f, i, v, len, obj_func;
+  long
+    strides[3], corner_offset[8];
+  float
+    *x, *y, *z, *a1;
+  VIO_BOOL
+    *m1;
+  double *double_voxels;                /* the voxels, when stored as       */
+  float  *float_voxels;                 /* NC_DOUBLE or NC_FLOAT            */
+  long   *node_idx = context->target_index;
+  int    *inside   = context->target_inside;
+  double **weight  = context->target_weight,
+         *samples  = context->target_samples,
+         *active   = context->target_active;
+
+  len = context->len;
+  x = context->TX + 1;          /* the sub-lattice is stored in 1..len */
+  y = context->TY + 1;
+  z = context->TZ + 1;
+
+  for(f=0; globals->features.obj_func[f] == NONLIN_OPTICALFLOW; f++);
+  get_volume_sizes(globals->features.model[f], sizes);
+
+  offset0 = (globals->count[VIO_Z] > 1) ? 1 : 0;
+  offset1 = (globals->count[VIO_Y] > 1) ? 1 : 0;
+  offset2 = (globals->count[VIO_X] > 1) ? 1 : 0;
+
+  strides[2] = 1;
+  strides[1] = sizes[2];
+  strides[0] = (long)sizes[1] * sizes[2];
+  for(v=0; v<8; v++)
+    corner_offset[v] = ((v>>2)&1) * offset0 * strides[0] + 
+                       ((v>>1)&1) * offset1 * strides[1] + 
+                       ( v    &1) * offset2;
+
+                                /* voxel index and weights of the 8
+                                   neighbours of each node, common to
+                                   all features */
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+  for(i=0; i<len; i++) {
+    double v0, v1, v2, f0, f1, f2, r0, r1, r2;
+    int    i0, i1, i2;
+
+    v0 = (VIO_Real) ( x[i] + dx );
+    v1 = (VIO_Real) ( y[i] + dy );
+    v2 = (VIO_Real) ( z[i] + dz );
+
+    i0 = (int)v0;
+    i1 = (int)v1;
+    i2 = (int)v2;
+
+    inside[i] = (i0>=0 && i0<(sizes[0]-offset0) &&
+                 i1>=0 && i1<(sizes[1]-offset1) &&
+                 i2>=0 && i2<(sizes[2]-offset2));
+
+                                /* read voxel 0 for positions outside of
+                                   the volume, their sample is 0.0 */
+    node_idx[i] = inside[i] ? i0*strides[0] + i1*strides[1] + i2 : 0;
+
+    f0 = v0 - i0;  r0 = 1.0 - f0;
+    f1 = v1 - i1;  r1 = 1.0 - f1;
+    f2 = v2 - i2;  r2 = 1.0 - f2;
+
+    weight[0][i] = r0 * r1 * r2;
+    weight[1][i] = r0 * r1 * f2;
+    weight[2][i] = r0 * f1 * r2;
+    weight[3][i] = r0 * f1 * f2;
+    weight[4][i] = f0 * r1 * r2;
+    weight[5][i] = f0 * r1 * f2;
+    weight[6][i] = f0 * f1 * r2;
+    weight[7][i] = f0 * f1 * f2;
+  }
+
+  for(f=0; f<globals->features.number_of_features; f++) {
+
+    result[f] = 0.0;
+    obj_func  = globals->features.obj_func[f];
+    if (obj_func == NONLIN_OPTICALFLOW)
+      continue;
+
+    data = globals->features.model[f];
+    mask = globals->features.model_mask[f];
+    a1   = context->a1_features[f] + 1;
+    m1   = context->masked_samples[f] + 1;
+
+                                /* the nodes used by this feature */
+    for(i=0; i<len; i++)
+      active[i] = ( !m1[i] && voxel_point_not_masked(mask, (VIO_Real)x[i], (VIO_Real)y[i], (VIO_Real)z[i]) &&
+                    (!(obj_func==NONLIN_CHAMFER) || (a1[i]>0)) ) ? 1.0 : 0.0;
+
+    (void)get_volume_voxel_buffer(data, &double_voxels, &float_voxels, strides);
+
+    if (double_voxels != NULL) {
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+      for(i=0; i<len; i++) {
+        double sample = 0.0;
+        for(v=0; v<8; v++)
+          sample += weight[v][i] * double_voxels[ node_idx[i] + corner_offset[v] ];
+        samples[i] = inside[i] ? sample : 0.0;
+      }
     }
-    else {
-      if ( normalization < 0.001 || s3 < 0.00001) {
-        r = 0.0;
+    else if (float_voxels != NULL) {
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+      for(i=0; i<len; i++) {
+        double sample = 0.0;
+        for(v=0; v<8; v++)
+          sample += weight[v][i] * (double)float_voxels[ node_idx[i] + corner_offset[v] ];
+        samples[i] = inside[i] ? sample : 0.0;
       }
-      else {
-        r = s1 / ((sqrt((double)s2))*(sqrt((double)s3)));
+    }
+    else {                      /* other data types, through volume_io */
+      for(i=0; i<len; i++) {
+        samples[i] = 0.0;
+        if (inside[i] && active[i] > 0.0) {
+          int i0 = (int)(node_idx[i] / strides[0]),
+              i1 = (int)((node_idx[i] % strides[0]) / strides[1]),
+              i2 = (int)(node_idx[i] % strides[1]);
+          for(v=0; v<8; v++)
+            samples[i] += weight[v][i] *
+              get_volume_real_value(data, 
+                                    i0 + ((v>>2)&1) * offset0,
+                                    i1 + ((v>>1)&1) * offset1,
+                                    i2 + ( v    &1) * offset2, 0, 0);
+        }
       }
     }
-    /* r = 1.0 - r;                 now, 0 is best                   */
-    break;
 
-  case NONLIN_DIFF:             /* normalization stores the number of samples in
-                                   the sub-lattice 
-                                   s1 stores the sum of the magnitude of
-                                   the differences*/
+                                /* accumulate the sums of the objective
+                                   function, as go_get_samples_with_offset()
+                                   does on the nodes it packs */
+    s1 = s2 = s3 = s4 = s5 = n_active = 0.0;
+
+    switch (obj_func) {
+   
+    case NONLIN_CORRCOEFF:
+#ifdef _OPENMP
+#pragma omp simd reduction(+:s1,s2,s3,s4,s5,n_active)
+#endif
+      for(i=0; i<len; i++) {
+        s1 += active[i] * a1[i];
+        s2 += active[i] * samples[i];
+        s3 += active[i] * a1[i] * a1[i];
+        s4 += active[i] * samples[i] * samples[i];
+        s5 += active[i] * a1[i] * samples[i];
+        n_active += active[i];
+      }
+      break;
+   
+    case NONLIN_XCORR:
+#ifdef _OPENMP
+#pragma omp simd reduction(+:s1,s2,s3)
+#endif
+      for(i=0; i<len; i++) {
+        s2 += active[i] * a1[i] * a1[i];
+        s1 += active[i] * a1[i] * samples[i]; 
+        s3 += active[i] * samples[i] * samples[i];
+      }
+      break;
+   
+    case NONLIN_CHAMFER:
+#ifdef _OPENMP
+#pragma omp simd reduction(+:s1,n_active)
+#endif
+      for(i=0; i<len; i++) {
+        s1 += active[i] * samples[i];
+        n_active += active[i];
+      }
+      break;
+   
+    case NONLIN_SQDIFF:
+#ifdef _OPENMP
+#pragma omp simd reduction(+:s1,n_active)
+#endif
+      for(i=0; i<len; i++) {
+        double d = a1[i] - samples[i];
+        s1 += active[i] * d*d;
+        n_active += active[i];
+      }
+      break;
+   
+    case NONLIN_DIFF:
+#ifdef _OPENMP
+#pragma omp simd reduction(+:s1,n_active)
+#endif
+      for(i=0; i<len; i++) {
+        s1 += active[i] * fabs(a1[i] - samples[i]);
+        n_active += active[i];
+      }
+      break;
+   
+    case NONLIN_LABEL:        /* count similar labels */
+#ifdef _OPENMP
+#pragma omp simd reduction(+:s1,n_active)
+#endif
+      for(i=0; i<len; i++) {
+        s1 += (active[i] > 0.0 && fabs(a1[i] - samples[i]) < 0.01) ? 1.0 : 0.0;
+        n_active += active[i];
+      }
+      break;
+   
+    default:
+      print_error_and_line_num("Objective function %d not supported in go_get_feature_samples_with_offset",__FILE__, __LINE__,obj_func);
+    }
 
-     r = -s1 /number_of_nonzero_samples;        /* r = average intensity difference ; with
-                                   -max(intensity range) < r < 0,
-                                   where 0 is best                  */
+    result[f] = similarity_from_sums(obj_func, context->sqrt_features[f], 
+                                     s1, s2, s3, s4, s5, (int)n_active);
+  }
+}
+
+/*********************************************************************** 
+   accumulate the contribution of one interpolated sample to the sums
+   s[0..4] (s1..s5 of switch_obj_func.c) of a single stencil offset.
+   The arithmetic is the same as in switch_obj_func.c, so that
+   go_get_stencil_samples_with_offset() returns what
+   go_get_samples_with_offset() would for the same displacement (up to
+   the order of the summations). */
+
+static void accumulate_similarity_sums(int obj_func, float a1, double sample,
+                                       double s[5], int *count)
+{
+  double tmp;
+
+  switch (obj_func) {
+    
+  case NONLIN_CORRCOEFF:
+    s[0] += a1;
+    s[1] += sample;
+    s[2] += a1 * a1;
+    s[3] += sample * sample;
+    s[4] += a1 * sample;
+    (*count)++;
     break;
-  case NONLIN_LABEL:
-     r = s1 /number_of_nonzero_samples;           /* r = average label agreement,
-                                    s1 stores the number of similar labels
-                                   0 < r < 1.0                      
-                                   where 1.0 is best                */
+    
+  case NONLIN_XCORR:
+    s[1] += a1 * a1;
+    s[0] += a1 * sample; 
+    s[2] += sample * sample;
     break;
+    
   case NONLIN_CHAMFER:
-    if (number_of_nonzero_samples>0) {
-       r = 1.0 - (s1 / (20.0*number_of_nonzero_samples));        
-                                /* r = 1- average distance / 20mm 
-                                       0 < r < ~1.0 
-                                   where 1.0 is best     
-                                       and where 2.0cm is an arbitrary value to
-                                       norm the dist, corresponding to a guess
-                                       at the maximum average cortical variability
-
-                                       so the max(r) could be greater than
-                                       1.0, but when it is, shouldn't
-                                       chamfer have larger weight to drive
-                                       the fit? */
+    if (a1 > 0) {
+      s[0] += sample;
+      (*count)++;
     }
-    else
-       r = 2.0;                 /* this is simply a value > 1.5, used as a
-                                   flag to indicate that there were no
-                                   samples used for the chamfer */
     break;
-  case NONLIN_CORRCOEFF:
-      {
-          /* Accumulators:
-           * s1 = sum of source image values
-           * s2 = sum of target image values
-           * s3 = sum of squared source image values
-           * s4 = sum of squared target image values
-           * s5 = sum of source*target values
-           *
-           * normalization = #values considered
-           */
-          if (number_of_nonzero_samples>0) {
-            mean_s = s1 / number_of_nonzero_samples;
-            mean_t = s2 / number_of_nonzero_samples;
-            var_s = s3 / number_of_nonzero_samples - mean_s*mean_s;
-            var_t = s4 / number_of_nonzero_samples - mean_t*mean_t;
-            covariance = s5 / number_of_nonzero_samples - mean_s*mean_t;
-          }
-          else {
-            mean_s = 0.0;
-            mean_t = 0.0;
-            var_s = 0.0;
-            var_t = 0.0;
-            covariance = 0.0;
-          }
+    
+  case NONLIN_SQDIFF:
+    tmp = a1 - sample;
+    s[0] += tmp*tmp;
+    (*count)++;
+    break;
+    
+  case NONLIN_DIFF:
+    tmp = a1 - sample;
+    if (tmp<0){
+      tmp *= -1.0;
+    }
+    s[0] += tmp;            
+    (*count)++;
+    break;
+    
+  case NONLIN_LABEL:
+    tmp = a1 - sample;
+    if (tmp<0){
+      tmp *= -1.0;
+    }
+    if (tmp < 0.01){
+      s[0] += 1.0;
+    }
+    (*count)++;
+    break;
+    
+  default:
+    print_error_and_line_num("Objective function %d not supported in go_get_stencil_samples_with_offset",__FILE__, __LINE__,obj_func);
+  }
+}
 
+/*********************************************************************** 
+   evaluate, in a single pass over the sub-lattice, the similarity that
+   go_get_samples_with_offset() would return for each of the 27
+   displacements of the 3x3x3 stencil used by the quadratic fit:
+
+      result[a][b][c] is the similarity for a displacement of disp[a]
+      along z[], disp[b] along y[] and disp[c] along x[]
+
+   (the same (dz,dy,dx) = (d[1],d[2],d[3]) ordering as similarity_fn()).
+   When ndim==2, there is no displacement along x[] and only
+   result[a][b][1] is computed.
+
+   The mask tests are done once per sub-lattice node, and when all 27
+   displaced positions fall within the volume and within a 4x4x4 block
+   of voxels (ie, |disp| <= 1 voxel), that block is fetched once and
+   all the interpolations are done from it.  Otherwise, each displaced
+   position is interpolated directly from the volume, as in
+   go_get_samples_with_offset().
+*/
 
-          if ((var_s < 0.00001) || (var_t < 0.00001) ) {
-            r = 0.0;
+void go_get_stencil_samples_with_offset(
+                                 Nonlinear_Context *nl,            /* the fit in progress */
+                                 VIO_Volume data,                  /* The volume of data */
+                                 VIO_Volume mask,                  /* The target mask */  
+                                 float *x, float *y, float *z,     /* the positions of the sub-lattice */
+                                 float disp[3],                    /* the displacements of the stencil */
+                                 int ndim,                         /* ==2 => no displacement along x[] */
+                                 int obj_func,                     /* the type of obj function req'd   */
+                                 int len,                          /* number of sub-lattice nodes      */
+                                 float normalization,              /* normalization factor for obj func*/
+                                 float *a1,                        /* feature value for (x,y,z) nodes  */
+                                 VIO_BOOL *m1,                     /* mask flag for (x,y,z) nodes in source */ 
+                                 VIO_BOOL use_nearest_neighbour,   /* interpolation flag              */
+                                 float result[3][3][3])            /* similarity for each displacement */
+{
+  double
+    sample, v,
+    sums[3][3][3][5];                     /* accumulators s1..s5 for each offset */
+  int 
+    counts[3][3][3],
+    sizes[3], offset[3], base[3], ind[3][3],
+    lo[3], hi[3], top,
+    in_volume, use_block,
+    a, o, c, i, j, k, 
+    i0, i1, i2, 
+    j0, j1, j2;
+  double 
+    frac[3][3],
+    block[4][4][4],
+    f0, f1, f2, r0, r1, r2, r1r2, r1f2, f1r2, f1f2,
+    v000, v001, v010, v011, v100, v101, v110, v111;
+  double 
+    *double_voxels;
+  float
+    *float_voxels;
+  long
+    strides[3];
+  float
+    *coord[3];
+
+  get_volume_sizes(data, sizes);  
+  (void)get_volume_voxel_buffer(data, &double_voxels, &float_voxels, strides);
+
+  if (use_nearest_neighbour) {
+    offset[0] = offset[1] = offset[2] = 0;
+  }
+  else {
+    offset[0] = (nl->globals->count[VIO_Z] > 1) ? 1 : 0;
+    offset[1] = (nl->globals->count[VIO_Y] > 1) ? 1 : 0;
+    offset[2] = (nl->globals->count[VIO_X] > 1) ? 1 : 0;
+  }
+
+                                /* range of stencil offsets along each
+                                   of x[], y[] and z[] */
+  lo[0] = hi[0] = 1;
+  if (ndim != 2) {
+    lo[0] = 0; hi[0] = 2;
+  }
+  lo[1] = lo[2] = 0;
+  hi[1] = hi[2] = 2;
+
+  for(i=0; i<3; i++)
+    for(j=0; j<3; j++)
+      for(k=0; k<3; k++) {
+        counts[i][j][k] = 0;
+        for(a=0; a<5; a++)
+          sums[i][j][k][a] = 0.0;
+      }
+
+  /* for each sub-lattice node (indexed from 1..len) */
+  for(c=1; c<=len; c++) {
+
+    if ( m1[c] || !voxel_point_not_masked(mask, (VIO_Real)x[c], (VIO_Real)y[c], (VIO_Real)z[c]) ||
+         ((obj_func==NONLIN_CHAMFER) && !(a1[c]>0)) )
+      continue;
+
+    coord[0] = &x[c]; coord[1] = &y[c]; coord[2] = &z[c];
+
+                                /* voxel index and fraction of each
+                                   displaced coordinate, along each axis */
+    use_block = TRUE;
+    for(a=0; a<3; a++) {
+      for(o=lo[a]; o<=hi[a]; o++) {
+        v = (VIO_Real) ( *coord[a] + (VIO_Real)disp[o] );
+        ind[a][o]  = (int)v;
+        frac[a][o] = v - ind[a][o];
+        if (ind[a][o] < 0 || ind[a][o] >= (sizes[a]-offset[a]))
+          use_block = FALSE;
+        if (o==lo[a] || ind[a][o] < base[a]) base[a] = ind[a][o];
+        if (o==lo[a] || ind[a][o] > top)     top     = ind[a][o];
+      }
+      if (top + offset[a] - base[a] > 3)
+        use_block = FALSE;
+    }
+
+    if (use_block) {            /* fetch the neighbourhood only once */
+      for(i=0; i<=3 && base[0]+i<sizes[0]; i++)
+        for(j=0; j<=3 && base[1]+j<sizes[1]; j++)
+          for(k=0; k<=3 && base[2]+k<sizes[2]; k++)
+            block[i][j][k] = voxel_value(data, double_voxels, float_voxels, strides,
+                                         base[0]+i, base[1]+j, base[2]+k);
+    }
+
+    for(i=lo[2]; i<=hi[2]; i++)          /* displacement along z[] */
+      for(j=lo[1]; j<=hi[1]; j++)        /* displacement along y[] */
+        for(k=lo[0]; k<=hi[0]; k++) {    /* displacement along x[] */
+
+          i0 = ind[0][k]; i1 = ind[1][j]; i2 = ind[2][i];
+
+          if (use_nearest_neighbour) {
+            if (use_block)
+              sample = block[i0-base[0]][i1-base[1]][i2-base[2]];
+            else if (i0>=0 && i0<sizes[0] &&
+                     i1>=0 && i1<sizes[1] &&
+                     i2>=0 && i2<sizes[2]) 
+              sample = voxel_value(data, double_voxels, float_voxels, strides, i0, i1, i2);
+            else
+              sample = 0.0;
           }
           else {
-            r = covariance / sqrt( var_s*var_t );            
+            in_volume = use_block ||
+              (i0>=0 && i0<(sizes[0]-offset[0]) &&
+               i1>=0 && i1<(sizes[1]-offset[1]) &&
+               i2>=0 && i2<(sizes[2]-offset[2]));
+
+            if (in_volume) {
+              if (use_block) {
+                j0 = i0 - base[0]; j1 = i1 - base[1]; j2 = i2 - base[2];
+                v000 = block[j0          ][j1          ][j2          ];
+                v001 = block[j0          ][j1          ][j2+offset[2]];
+                v010 = block[j0          ][j1+offset[1]][j2          ];
+                v011 = block[j0          ][j1+offset[1]][j2+offset[2]];
+                v100 = block[j0+offset[0]][j1          ][j2          ];
+                v101 = block[j0+offset[0]][j1          ][j2+offset[2]];
+                v110 = block[j0+offset[0]][j1+offset[1]][j2          ];
+                v111 = block[j0+offset[0]][j1+offset[1]][j2+offset[2]];
+              }
+              else {
+                v000 = voxel_value(data, double_voxels, float_voxels, strides,
+                                   i0          , i1          , i2          );
+                v001 = voxel_value(data, double_voxels, float_voxels, strides,
+                                   i0          , i1          , i2+offset[2]);
+                v010 = voxel_value(data, double_voxels, float_voxels, strides,
+                                   i0          , i1+offset[1], i2          );
+                v011 = voxel_value(data, double_voxels, float_voxels, strides,
+                                   i0          , i1+offset[1], i2+offset[2]);
+                v100 = voxel_value(data, double_voxels, float_voxels, strides,
+                                   i0+offset[0], i1          , i2          );
+                v101 = voxel_value(data, double_voxels, float_voxels, strides,
+                                   i0+offset[0], i1          , i2+offset[2]);
+                v110 = voxel_value(data, double_voxels, float_voxels, strides,
+                                   i0+offset[0], i1+offset[1], i2          );
+                v111 = voxel_value(data, double_voxels, float_voxels, strides,
+                                   i0+offset[0], i1+offset[1], i2+offset[2]);
+              }
+
+              f0 = frac[0][k];
+              f1 = frac[1][j];
+              f2 = frac[2][i];
+              r0 = 1.0 - f0;
+              r1 = 1.0 - f1;
+              r2 = 1.0 - f2;
+              
+              r1r2 = r1 * r2;
+              r1f2 = r1 * f2;
+              f1r2 = f1 * r2;
+              f1f2 = f1 * f2;
+              
+              sample   = 
+                r0 *  (r1r2 * v000 +
+                       r1f2 * v001 +
+                       f1r2 * v010 +
+                       f1f2 * v011);
+              sample  +=
+                f0 *  (r1r2 * v100 +
+                       r1f2 * v101 +
+                       f1r2 * v110 +
+                       f1f2 * v111);
+            }
+            else
+              sample = 0.0;
           }
-      }
-      break;
-          
-  case NONLIN_SQDIFF:           /* normalization stores the number of samples 
-                                   in the sub-lattice.
-                                   s1 stores the sum of the squared intensity
-                                   differences */
-    r = -s1 /number_of_nonzero_samples;
-    break;
 
-  default:
-    print_error_and_line_num("Objective function %d not supported in go_get_samples_with_offset",__FILE__, __LINE__,obj_func);
-  }
-  
-  
-  return(r);
+          accumulate_similarity_sums(obj_func, a1[c], sample, 
+                                     sums[i][j][k], &counts[i][j][k]);
+        }
   }
 
+  for(i=lo[2]; i<=hi[2]; i++)
+    for(j=lo[1]; j<=hi[1]; j++)
+      for(k=lo[0]; k<=hi[0]; k++)
+        result[i][j][k] = similarity_from_sums(obj_func, normalization,
+                                               sums[i][j][k][0], sums[i][j][k][1],
+                                               sums[i][j][k][2], sums[i][j][k][3],
+                                               sums[i][j][k][4], counts[i][j][k]);
 }
 
 
+/*********************************************************************** 
+   evaluate the similarity that go_get_samples_with_offset() returns
+   for the displacement (dx,dy,dz), along with its derivatives with
+   respect to the displacement, for the Gauss-Newton local fit
+   (-local_gn).
+
+   The derivative of each interpolated sample is that of the
+   tri-linear interpolant (also used for nearest neighbour
+   interpolation, whose samples do not vary smoothly).
+
+   gradient[] and hessian[][] are those of -similarity (the quantity to
+   minimize), in dx, dy, dz order:
+
+   NONLIN_XCORR, NONLIN_CORRCOEFF: r = S_ab / sqrt(S_aa S_bb), where the
+      sums are over the (centered, for corrcoeff) source values a and
+      target samples b.  1-r is half the squared norm of the residual
+      a/sqrt(S_aa) - b/sqrt(S_bb), and the Gauss-Newton approximation of
+      its hessian is (G - U U'/S_bb) / S_bb, with G = sum(grad b grad b')
+      and U = sum(b grad b).
+   NONLIN_SQDIFF: the hessian is 2 G / N, exactly Gauss-Newton.
+   NONLIN_DIFF: |a-b| is not differentiable at 0, its hessian is
+      approximated by G / (N mean|a-b|), as if |a-b| were
+      (a-b)^2 / (2 mean|a-b|).
+
+   returns FALSE for the other objective functions.  When the similarity
+   is not differentiable (no samples, or no variance), the gradient and
+   hessian are 0.
+*/
+
+VIO_BOOL go_get_samples_and_gradient(
+                                 Nonlinear_Context *nl,            /* the fit in progress */
+                                 VIO_Volume data,                  /* The volume of data */
+                                 VIO_Volume mask,                  /* The target mask */  
+                                 float *x, float *y, float *z,     /* the positions of the sub-lattice */
+                                 VIO_Real  dx, VIO_Real  dy, VIO_Real dz,  /* the local displacement to apply  */
+                                 int obj_func,                     /* the type of obj function req'd   */
+                                 int len,                          /* number of sub-lattice nodes      */
+                                 float normalization,              /* normalization factor for obj func*/
+                                 float *a1,                        /* feature value for (x,y,z) nodes  */
+                                 VIO_BOOL *m1,                     /* mask flag for (x,y,z) nodes in source */ 
+                                 VIO_BOOL use_nearest_neighbour,   /* interpolation flag              */
+                                 VIO_Real *similarity,             /* the similarity                  */
+                                 VIO_Real gradient[3],             /* d(-similarity)/d(dx,dy,dz)      */
+                                 VIO_Real hessian[3][3])           /* and its approximate hessian     */
+{
+  double
+    a, b, diff, r, norm, scale,
+    pos[3], frac[3], grad_b[3], corner[8],
+    sa, sb, saa, sbb, sab, ssq, sabs,
+    sg[3], sag[3], sbg[3], ssg[3], sgg[3][3],
+    P[3], U[3], G[3][3],
+    r0, r1, r2, f0, f1, f2;
+  int
+    sizes[3], offset[3], ind[3],
+    inside, n, c, i, j, v;
+  double 
+    *double_voxels;
+  float
+    *float_voxels;
+  long
+    strides[3];
+
+  if (obj_func != NONLIN_XCORR && obj_func != NONLIN_CORRCOEFF &&
+      obj_func != NONLIN_SQDIFF && obj_func != NONLIN_DIFF)
+    return(FALSE);
+
+  get_volume_sizes(data, sizes);  
+  (void)get_volume_voxel_buffer(data, &double_voxels, &float_voxels, strides);
+
+  offset[0] = (nl->globals->count[VIO_Z] > 1) ? 1 : 0;
+  offset[1] = (nl->globals->count[VIO_Y] > 1) ? 1 : 0;
+  offset[2] = (nl->globals->count[VIO_X] > 1) ? 1 : 0;
+
+  n = 0;
+  sa = sb = saa = sbb = sab = ssq = sabs = 0.0;
+  for(i=0; i<3; i++) {
+    sg[i] = sag[i] = sbg[i] = ssg[i] = 0.0;
+    for(j=0; j<3; j++) sgg[i][j] = 0.0;
+  }
+
+  /* for each sub-lattice node (indexed from 1..len) */
+  for(c=1; c<=len; c++) {
+
+    if ( m1[c] || !voxel_point_not_masked(mask, (VIO_Real)x[c], (VIO_Real)y[c], (VIO_Real)z[c]) )
+      continue;
+
+    pos[0] = (VIO_Real) ( x[c] + dx );
+    pos[1] = (VIO_Real) ( y[c] + dy );
+    pos[2] = (VIO_Real) ( z[c] + dz );
+    for(i=0; i<3; i++) {
+      ind[i]  = (int)pos[i];
+      frac[i] = pos[i] - ind[i];
+    }
+
+    b = 0.0;
+    grad_b[0] = grad_b[1] = grad_b[2] = 0.0;
+
+    inside = (ind[0]>=0 && ind[0]<(sizes[0]-offset[0]) &&
+              ind[1]>=0 && ind[1]<(sizes[1]-offset[1]) &&
+              ind[2]>=0 && ind[2]<(sizes[2]-offset[2]));
+
+    if (inside) {               /* bit 2 of v along the 1st dim, ... */
+      for(v=0; v<8; v++)
+        corner[v] = voxel_value(data, double_voxels, float_voxels, strides,
+                                ind[0] + ((v>>2)&1) * offset[0],
+                                ind[1] + ((v>>1)&1) * offset[1],
+                                ind[2] + ( v    &1) * offset[2]);
+
+      f0 = frac[0]; f1 = frac[1]; f2 = frac[2];
+      r0 = 1.0 - f0; r1 = 1.0 - f1; r2 = 1.0 - f2;
+
+      b = r0 * (r1*r2 * corner[0] + r1*f2 * corner[1] + f1*r2 * corner[2] + f1*f2 * corner[3]) +
+          f0 * (r1*r2 * corner[4] + r1*f2 * corner[5] + f1*r2 * corner[6] + f1*f2 * corner[7]);
+
+      if (offset[0])
+        grad_b[0] = r1*r2 * (corner[4]-corner[0]) + r1*f2 * (corner[5]-corner[1]) +
+                    f1*r2 * (corner[6]-corner[2]) + f1*f2 * (corner[7]-corner[3]);
+      if (offset[1])
+        grad_b[1] = r0 * (r2 * (corner[2]-corner[0]) + f2 * (corner[3]-corner[1])) +
+                    f0 * (r2 * (corner[6]-corner[4]) + f2 * (corner[7]-corner[5]));
+      if (offset[2])
+        grad_b[2] = r0 * (r1 * (corner[1]-corner[0]) + f1 * (corner[3]-corner[2])) +
+                    f0 * (r1 * (corner[5]-corner[4]) + f1 * (corner[7]-corner[6]));
+    }
+
+    if (use_nearest_neighbour) {
+      if (ind[0]>=0 && ind[0]<sizes[0] &&
+          ind[1]>=0 && ind[1]<sizes[1] &&
+          ind[2]>=0 && ind[2]<sizes[2]) 
+        b = voxel_value(data, double_voxels, float_voxels, strides, ind[0], ind[1], ind[2]);
+      else
+        b = 0.0;
+    }
+
+    a    = a1[c];
+    diff = a - b;
+
+    n++;
+    sa   += a;
+    sb   += b;
+    saa  += a * a;
+    sbb  += b * b;
+    sab  += a * b;
+    ssq  += diff * diff;
+    sabs += fabs(diff);
+    for(i=0; i<3; i++) {
+      sg[i]  += grad_b[i];
+      sag[i] += a * grad_b[i];
+      sbg[i] += b * grad_b[i];
+      ssg[i] += (diff > 0.0 ? 1.0 : (diff < 0.0 ? -1.0 : 0.0)) * grad_b[i];
+      for(j=0; j<3; j++)
+        sgg[i][j] += grad_b[i] * grad_b[j];
+    }
+  }
+
+  for(i=0; i<3; i++) {
+    gradient[i] = 0.0;
+    for(j=0; j<3; j++) hessian[i][j] = 0.0;
+  }
+
+  switch (obj_func) {
+
+  case NONLIN_XCORR:
+  case NONLIN_CORRCOEFF:
+    if (obj_func == NONLIN_XCORR) 
+      *similarity = similarity_from_sums(obj_func, normalization, sab, saa, sbb, 0.0, 0.0, n);
+    else
+      *similarity = similarity_from_sums(obj_func, normalization, sa, sb, saa, sbb, sab, n);
+
+                                /* center the sums for corrcoeff */
+    if (obj_func == NONLIN_CORRCOEFF && n > 0) {
+      sab -= sa * sb / n;
+      saa -= sa * sa / n;
+      sbb -= sb * sb / n;
+      for(i=0; i<3; i++) {
+        P[i] = sag[i] - sa * sg[i] / n;
+        U[i] = sbg[i] - sb * sg[i] / n;
+        for(j=0; j<3; j++)
+          G[i][j] = sgg[i][j] - sg[i] * sg[j] / n;
+      }
+    }
+    else {
+      for(i=0; i<3; i++) {
+        P[i] = sag[i];
+        U[i] = sbg[i];
+        for(j=0; j<3; j++)
+          G[i][j] = sgg[i][j];
+      }
+    }
+
+    if (n > 0 && saa > 0.00001 && sbb > 0.00001) {
+      norm = sqrt(saa * sbb);
+      r    = sab / norm;
+      for(i=0; i<3; i++) {
+        gradient[i] = -(P[i] - r * sqrt(saa / sbb) * U[i]) / norm;
+        for(j=0; j<3; j++)
+          hessian[i][j] = (G[i][j] - U[i] * U[j] / sbb) / sbb;
+      }
+    }
+    break;
+
+  case NONLIN_SQDIFF:
+    *similarity = similarity_from_sums(obj_func, normalization, ssq, 0.0, 0.0, 0.0, 0.0, n);
+    if (n > 0) 
+      for(i=0; i<3; i++) {
+        gradient[i] = -2.0 * (sag[i] - sbg[i]) / n;
+        for(j=0; j<3; j++)
+          hessian[i][j] = 2.0 * sgg[i][j] / n;
+      }
+    break;
+
+  case NONLIN_DIFF:
+    *similarity = similarity_from_sums(obj_func, normalization, sabs, 0.0, 0.0, 0.0, 0.0, n);
+    if (n > 0 && sabs > 0.0) {
+      scale = 1.0 / sabs;       /* 1 / (N mean|a-b|) */
+      for(i=0; i<3; i++) {
+        gradient[i] = -ssg[i] / n;
+        for(j=0; j<3; j++)
+          hessian[i][j] = sgg[i][j] * scale;
+      }
+    }
+    break;
+  }
+
+  return(TRUE);
+}
 
 
 /* Build the target lattice by transforming the source points through the
    current non-linear transformation stored in:
 
-        Gglobals->trans_info.transformation                        
+        nl->globals->trans_info.transformation
 
    both input (px,py,pz) and output (tx,ty,tz) coordinate lists are in
    WORLD COORDINATES
 
 */
-void    build_target_lattice(float px[], float py[], float pz[],
+void    build_target_lattice(Nonlinear_Context *nl,
+                             float px[], float py[], float pz[],
 			     float tx[], float ty[], float tz[],
 			     int len, int dim)
 {
@@ -633,7 +1659,7 @@ void    build_target_lattice(float px[], float py[], float pz[],
 
   for(i=1; i<=len; i++) {
 
-    general_transform_point(Gglobals->trans_info.transformation, 
+    general_transform_point(nl->globals->trans_info.transformation, 
                             (VIO_Real)px[i],(VIO_Real) py[i], (VIO_Real)pz[i], 
                             &x, &y, &z);
     
@@ -646,13 +1672,14 @@ void    build_target_lattice(float px[], float py[], float pz[],
 /* Build the target lattice by transforming the source points through the
    current non-linear transformation stored in:
 
-        Glinear_transform and Gsuper_d{x,y,z} deformation volumes  
+        nl->linear_transform and nl->super_sampled_vol
 
    both input (px,py,pz) and output (tx,ty,tz) coordinate lists are in
    WORLD COORDINATES
 
 */
 void    build_target_lattice_using_super_sampled_def(
+                                     Nonlinear_Context *nl,
                                      float px[], float py[], float pz[],
                                      float tx[], float ty[], float tz[],
                                      int len, int dim)
@@ -668,14 +1695,14 @@ void    build_target_lattice_using_super_sampled_def(
   long 
     index[VIO_MAX_DIMENSIONS];
 
-  get_volume_sizes(Gsuper_sampled_vol,sizes);
-  get_volume_XYZV_indices(Gsuper_sampled_vol,xyzv);
+  get_volume_sizes(nl->super_sampled_vol,sizes);
+  get_volume_XYZV_indices(nl->super_sampled_vol,xyzv);
 
   for(i=1; i<=len; i++) {
 
                                 /* apply linear part of the transformation */
 
-    general_transform_point(Glinear_transform,
+    general_transform_point(nl->linear_transform,
                             (VIO_Real)px[i], (VIO_Real)py[i], (VIO_Real)pz[i], 
                             &x, &y, &z);
 
@@ -684,7 +1711,7 @@ void    build_target_lattice_using_super_sampled_def(
                                    the super-sampled deformation
                                    volume. */
 
-    convert_world_to_voxel(Gsuper_sampled_vol, 
+    convert_world_to_voxel(nl->super_sampled_vol, 
                            x,y,z, voxel);
 
     if ((voxel[ xyzv[VIO_X] ] >= -0.5) && (voxel[ xyzv[VIO_X] ] < sizes[xyzv[VIO_X]]-0.5) &&
@@ -695,7 +1722,7 @@ void    build_target_lattice_using_super_sampled_def(
       
       for(index[xyzv[VIO_Z+1]]=0; index[xyzv[VIO_Z+1]]<sizes[xyzv[VIO_Z+1]]; index[xyzv[VIO_Z+1]]++) 
         GET_VALUE_4D(def_vector[ index[ xyzv[VIO_Z+1] ]  ], \
-                     Gsuper_sampled_vol, \
+                     nl->super_sampled_vol, \
                      index[0], index[1], index[2], index[3]);
 
 
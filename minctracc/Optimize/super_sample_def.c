@@ -109,10 +109,17 @@ static char rcsid[]="$Header: /static-cvsroot/registration/mni_autoreg/minctracc
 #include <Proglib.h>
 #include "constants.h"
 #include "minctracc_point_vector.h"
+#include "super_sample_def.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
                                 /* prototypes called: */
 
 void get_volume_XYZV_indices(VIO_Volume data, int xyzv[]);
+VIO_BOOL get_warp_voxel_strides(VIO_Volume volume, long strides[]);
+void get_warp_vectors(VIO_Volume volume, int count[], double *vectors);
 void init_the_volume_to_zero(VIO_Volume volume);
 void interpolate_deformation_slice(VIO_Volume volume, 
                                           VIO_Real wx, VIO_Real wy, VIO_Real wz,
@@ -446,952 +453,435 @@ void create_super_sampled_data_volumes_by2(VIO_General_transform *orig_deformati
 #define MY_CUBIC_05(a1,a2,a3,a4)  \
    ( ( -(a1) + 9*(a2) + 9*(a3) -(a4) ) / 16.0 )
 
-static void interpolate_super_sampled_data_by2_dim3( 
-    VIO_General_transform *orig_deformation,
-    VIO_General_transform *super_sampled )
-{
-  VIO_Volume
-    orig_vol,
-    super_vol;
+/*
+   In 3D, the four levels above are computed in a single pass over
+   flat copies of the data.  Since the interpolation along each axis
+   is the same 1D operator (cubic, or linear in the first and last
+   interval), the 'f' and 'c' voxels are the tensor products of the
+   'e' interpolation: each original X plane is super-sampled along Y
+   and Z into a plane buffer, and the planes of the super-sampled
+   volume are built from (up to) four of these buffers, interpolating
+   along X.  Each thread keeps the last four plane buffers it has
+   built, so that successive planes reuse them, and the threads
+   share the X planes in contiguous slabs.
+*/
 
-  int 
-    i, save_index, save_index1, save_index2,
-    count,
-    index[VIO_MAX_DIMENSIONS],
-    sindex[VIO_MAX_DIMENSIONS],
-    orig_xyzv[VIO_MAX_DIMENSIONS],
-    xyzv[VIO_MAX_DIMENSIONS],
-    orig_count[VIO_MAX_DIMENSIONS],
-    super_count[VIO_MAX_DIMENSIONS];
-  VIO_Real
-    value1, value2, value3, v1,v2,v3,v4,v5,v6;
-  VIO_progress_struct
-    progress;
+/* value half way between samples m and m+1 of the n samples
+   v[0], v[stride], .. v[(n-1)*stride] */
 
+static double midpoint_value(double *v, long stride, int m, int n)
+{
+  if (m == 0 || m == n-2)
+    return( (v[m*stride] + v[(m+1)*stride]) / 2 );
+  else
+    return( MY_CUBIC_05(v[(m-1)*stride], v[m*stride], 
+                        v[(m+1)*stride], v[(m+2)*stride]) );
+}
 
+/* super-sample plane x of the [x][y][z][3] vectors of the original
+   grid (count[] nodes, X, Y, Z order) along Y and Z, into
+   plane[2*count[Y]-1][2*count[Z]-1][3] */
 
-    orig_vol = orig_deformation->displacement_volume;
-    super_vol= super_sampled->displacement_volume;
-    
-    get_volume_sizes(       super_vol, super_count);
-    get_volume_sizes(       orig_vol,  orig_count);
-    get_volume_XYZV_indices(super_vol, xyzv);
-    get_volume_XYZV_indices(orig_vol,  orig_xyzv);
-    
-    init_the_volume_to_zero(super_sampled->displacement_volume);
+static void super_sample_plane_by2(double *vectors, int count[], int x, 
+                                   double *plane)
+{
+  int
+    j, k, c,
+    scount_y, scount_z;
+  long
+    row, srow, srow_size;
+  double
+    *orig;
+
+  scount_y  = 2*count[VIO_Y] - 1;
+  scount_z  = 2*count[VIO_Z] - 1;
+  srow_size = 3L * scount_z;
+  orig      = &vectors[(long)x * count[VIO_Y] * count[VIO_Z] * 3];
+
+                                /* even rows: copy the 'X' nodes and
+                                   interpolate along Z between them */
+  for(j=0; j<count[VIO_Y]; j++) {
+    row  = 3L * j * count[VIO_Z];
+    srow = 2 * j * srow_size;
+    for(k=0; k<scount_z; k++)
+      for(c=0; c<3; c++) {
+        if (k % 2 == 0)
+          plane[srow + 3*k + c] = orig[row + 3*(k/2) + c];
+        else
+          plane[srow + 3*k + c] = midpoint_value(&orig[row + c], 3, k/2, count[VIO_Z]);
+      }
+  }
+                                /* odd rows: interpolate along Y, between
+                                   the even rows */
+  for(j=1; j<scount_y; j+=2)
+    for(k=0; k<srow_size; k++)
+      plane[j*srow_size + k] = midpoint_value(&plane[k], 2*srow_size, j/2, count[VIO_Y]);
+}
 
-    initialize_progress_report(&progress, FALSE, 
-                               super_count[ xyzv[VIO_X] ]*super_count[ xyzv[VIO_Y] ]*
-                               super_count[ xyzv[VIO_Z] ]*super_count[ xyzv[VIO_Z+1] ]+1,
-                               "Super-sampling defs:" );
-    count = 0;
+/* build the super-sampled vectors of super_vol from the [x][y][z][3]
+   vectors of the original grid (count[] nodes, X, Y, Z order).
 
+   When update is NULL, all nodes of super_vol are written; those beyond
+   2*count[]-2 (create_super_sampled_data_volumes() gives 2*count[]
+   nodes along each axis) are set to zero.  Otherwise, only the
+   super-sampled nodes (sx,sy,sz) with update[sx/2][sy/2][sz/2] set are
+   written, the others keep their value. */
 
+static void super_sample_by2_dim3(VIO_Volume super_vol,
+                                  double *vectors, int count[],
+                                  unsigned char *update)
+{
+  int
+    i, n_threads,
+    xyzv[VIO_MAX_DIMENSIONS],
+    sizes[VIO_MAX_DIMENSIONS],
+    super_count[VIO_N_DIMENSIONS];
+  long
+    plane_size,
+    strides[VIO_MAX_DIMENSIONS];
+  double
+    *double_voxels,
+    *planes;
+  float
+    *float_voxels;
+
+  get_volume_sizes(super_vol, sizes);
+  get_volume_XYZV_indices(super_vol, xyzv);
+  for(i=0; i<VIO_N_DIMENSIONS; i++) {
+    super_count[i] = sizes[ xyzv[i] ];
+    if (super_count[i] < 2*count[i]-1)
+      print_error_and_line_num("super_sample_by2_dim3: super-sampled volume too small (%d < %d)",
+                               __FILE__, __LINE__, super_count[i], 2*count[i]-1);
+  }
 
-    /* LEVEL 0: copy original 'corner' nodes, identified as 'X' in desc above */
+  double_voxels = NULL;
+  float_voxels  = NULL;
+  if (get_warp_voxel_strides(super_vol, strides)) {
+    if (get_volume_data_type(super_vol) == VIO_DOUBLE)
+      double_voxels = &((double ****)VOXEL_DATA(super_vol))[0][0][0][0];
+    else
+      float_voxels  = &((float ****)VOXEL_DATA(super_vol))[0][0][0][0];
+  }
 
-    for(i=0; i<VIO_MAX_DIMENSIONS; i++) sindex[i]=index[i]=0;
-    
-    for(index[orig_xyzv[VIO_X]]=0; index[orig_xyzv[VIO_X]]<orig_count[orig_xyzv[VIO_X]]; index[orig_xyzv[VIO_X]]++) {
-      for(index[orig_xyzv[VIO_Y]]=0; index[orig_xyzv[VIO_Y]]<orig_count[orig_xyzv[VIO_Y]]; index[orig_xyzv[VIO_Y]]++) {
-        for(index[orig_xyzv[VIO_Z]]=0; index[orig_xyzv[VIO_Z]]<orig_count[orig_xyzv[VIO_Z]]; index[orig_xyzv[VIO_Z]]++) {
+                                /* room for four plane buffers per thread;
+                                   set_volume_real_value() is only called
+                                   from one thread                        */
+  n_threads = 1;
+#ifdef _OPENMP
+  if (double_voxels != NULL || float_voxels != NULL)
+    n_threads = omp_get_max_threads();
+#endif
+  plane_size = 3L * (2*count[VIO_Y]-1) * (2*count[VIO_Z]-1);
+  ALLOC(planes, n_threads * 4 * plane_size);
 
-          for(i=0; i<VIO_N_DIMENSIONS; i++)
-            sindex[ xyzv[i] ] = 2*index[ orig_xyzv[i] ];
+#ifdef _OPENMP
+#pragma omp parallel num_threads(n_threads)
+#endif
+  {
+    int
+      x, sx, sy, sz, c, p, first, last, last_sx,
+      thread,
+      ring_x[4],
+      index[VIO_MAX_DIMENSIONS];
+    long
+      n, offset, cell_row;
+    double
+      value,
+      *ring[4];
+
+    thread = 0;
+#ifdef _OPENMP
+    thread = omp_get_thread_num();
+#endif
+    for(p=0; p<4; p++) {
+      ring[p]   = &planes[(thread*4 + p) * plane_size];
+      ring_x[p] = -1;
+    }
+    for(p=0; p<VIO_MAX_DIMENSIONS; p++) index[p] = 0;
 
-          for(index[orig_xyzv[VIO_Z+1]]=0; index[orig_xyzv[VIO_Z+1]]<orig_count[xyzv[VIO_Z+1]]; index[orig_xyzv[VIO_Z+1]]++) {
-            sindex[ xyzv[VIO_Z+1] ] = index[ orig_xyzv[VIO_Z+1] ];
-            GET_VOXEL_4D(value1, orig_vol, index[0],index[1],index[2],index[3]);
-            SET_VOXEL_4D(super_vol, sindex[0],sindex[1],sindex[2],sindex[3], value1);
-          }          
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+    for(x=0; x<count[VIO_X]; x++) {
 
-          count += 3;
-        }
+                                /* the super-sampled planes 2x and 2x+1
+                                   need the original planes first..last */
+      if (x == 0 || x >= count[VIO_X]-2) {
+        first = x;
+        last  = (x < count[VIO_X]-1) ? x+1 : x;
+      }
+      else {
+        first = x-1;
+        last  = x+2;
       }
-      update_progress_report( &progress, count+1 );
-    }
 
+      if (update != NULL) {
+        for(n=0; n<(long)count[VIO_Y]*count[VIO_Z]; n++)
+          if (update[(long)x*count[VIO_Y]*count[VIO_Z] + n]) break;
+        if (n == (long)count[VIO_Y]*count[VIO_Z])
+          continue;
+      }
 
-    /* LEVEL 1: edge interpolation, identified as 'e' in desc above */
+      for(p=first; p<=last; p++)
+        if (ring_x[p % 4] != p) {
+          super_sample_plane_by2(vectors, count, p, ring[p % 4]);
+          ring_x[p % 4] = p;
+        }
 
-               /* do edges along the index[ orig_xyzv[VIO_X] ] dir */
+                                /* the last original plane also clears
+                                   the planes beyond it                   */
+      last_sx = (x == count[VIO_X]-1) ? super_count[VIO_X]-1 : 2*x+1;
+      if (update != NULL && last_sx > 2*count[VIO_X]-2)
+        last_sx = 2*count[VIO_X]-2;
+
+      for(sx=2*x; sx<=last_sx; sx++) {
+        index[ xyzv[VIO_X] ] = sx;
+
+        for(sy=0; sy<super_count[VIO_Y]; sy++) {
+          if (update != NULL && sy > 2*count[VIO_Y]-2)
+            break;
+          index[ xyzv[VIO_Y] ] = sy;
+          cell_row = ((long)x*count[VIO_Y] + sy/2) * count[VIO_Z];
+
+          for(sz=0; sz<super_count[VIO_Z]; sz++) {
+            if (update != NULL && (sz > 2*count[VIO_Z]-2 || !update[cell_row + sz/2]))
+              continue;
+            index[ xyzv[VIO_Z] ] = sz;
+            n = (sy*(2L*count[VIO_Z]-1) + sz) * 3;
+
+            for(c=0; c<3; c++) {
+              if (sx > 2*count[VIO_X]-2 || sy > 2*count[VIO_Y]-2 || sz > 2*count[VIO_Z]-2)
+                value = 0.0;
+              else if (sx % 2 == 0)
+                value = ring[x % 4][n+c];
+              else if (x == 0 || x == count[VIO_X]-2)
+                value = (ring[x % 4][n+c] + ring[(x+1) % 4][n+c]) / 2;
+              else
+                value = MY_CUBIC_05(ring[(x-1) % 4][n+c], ring[x % 4][n+c],
+                                    ring[(x+1) % 4][n+c], ring[(x+2) % 4][n+c]);
+
+              index[ xyzv[VIO_Z+1] ] = c;
+              if (double_voxels != NULL || float_voxels != NULL) {
+                offset = index[0]*strides[0] + index[1]*strides[1] + 
+                         index[2]*strides[2] + index[3]*strides[3];
+                if (double_voxels != NULL)
+                  double_voxels[offset] = value;
+                else
+                  float_voxels[offset]  = (float)value;
+              }
+              else
+                set_volume_real_value(super_vol, index[0],index[1],index[2],index[3],index[4],
+                                      value);
+            }
+          }
+        }
+      }
+    }
+  }
 
-    for(i=0; i<VIO_MAX_DIMENSIONS; i++) sindex[i]=index[i]=0;
-    
-                                /* loop over all x-dirs  */
+  FREE(planes);
+}
 
-    for(index[orig_xyzv[VIO_Y]]=0; index[orig_xyzv[VIO_Y]]<orig_count[orig_xyzv[VIO_Y]]; index[orig_xyzv[VIO_Y]]++) {
+/* copy the vectors of the nodes of a deformation grid into a newly
+   allocated [x][y][z][3] buffer, returning the number of nodes along
+   X, Y and Z in count[] */
 
+static double *get_all_warp_vectors(VIO_Volume volume, int count[])
+{
+  int
+    xyzv[VIO_MAX_DIMENSIONS],
+    sizes[VIO_MAX_DIMENSIONS];
+  double
+    *vectors;
 
-      for(index[orig_xyzv[VIO_Z]]=0; index[orig_xyzv[VIO_Z]]<orig_count[orig_xyzv[VIO_Z]]; index[orig_xyzv[VIO_Z]]++) {
+  get_volume_sizes(volume, sizes);
+  get_volume_XYZV_indices(volume, xyzv);
 
-        sindex[ xyzv[VIO_Y] ] = 2*index[ orig_xyzv[VIO_Y] ];
-        sindex[ xyzv[VIO_Z] ] = 2*index[ orig_xyzv[VIO_Z] ];
+  ALLOC(vectors, 3L * sizes[ xyzv[VIO_X] ] * sizes[ xyzv[VIO_Y] ] * sizes[ xyzv[VIO_Z] ]);
+  get_warp_vectors(volume, count, vectors);
 
-        for(index[orig_xyzv[VIO_Z+1]]=0; index[orig_xyzv[VIO_Z+1]]<orig_count[xyzv[VIO_Z+1]]; index[orig_xyzv[VIO_Z+1]]++) {
+  return(vectors);
+}
 
-                                /* do linear interp at ends */
+static void interpolate_super_sampled_data_by2_dim3( 
+    VIO_General_transform *orig_deformation,
+    VIO_General_transform *super_sampled )
+{
+  int
+    count[VIO_N_DIMENSIONS];
+  double
+    *vectors;
 
-          sindex[ xyzv[VIO_X] ] = 1;                             /* beginning end */
-          index[ orig_xyzv[VIO_X] ]=0;             
-          GET_VOXEL_4D(v1, orig_vol, index[0],index[1],index[2],index[3]);
-          index[ orig_xyzv[VIO_X] ]=1;
-          GET_VOXEL_4D(v2, orig_vol, index[0],index[1],index[2],index[3]);
-          value1 = (v1+v2)/2;
+  vectors = get_all_warp_vectors(orig_deformation->displacement_volume, count);
 
-          sindex[ xyzv[VIO_Z+1] ] = index[ orig_xyzv[VIO_Z+1] ];
+  super_sample_by2_dim3(super_sampled->displacement_volume, vectors, count, NULL);
 
-          SET_VOXEL_4D(super_vol, sindex[0],sindex[1],sindex[2],sindex[3], value1);
-          count++;
+  FREE(vectors);
+}
 
-          sindex[ xyzv[VIO_X] ] = 2*orig_count[ orig_xyzv[VIO_X] ] -3;      /* ending end */
-          index[ orig_xyzv[VIO_X] ]= orig_count[ orig_xyzv[VIO_X] ]-2;              
-          GET_VOXEL_4D(v1, orig_vol, index[0],index[1],index[2],index[3]);
-          index[ orig_xyzv[VIO_X] ]= orig_count[ orig_xyzv[VIO_X] ]-1;
-          GET_VOXEL_4D(v2, orig_vol, index[0],index[1],index[2],index[3]);
-          value1 = (v1+v2)/2;
 
-          sindex[ xyzv[VIO_Z+1] ] = index[ orig_xyzv[VIO_Z+1] ];
+void interpolate_super_sampled_data_by2(
+    VIO_General_transform *orig_deformation,
+    VIO_General_transform *super_sampled)
+{
 
-          SET_VOXEL_4D(super_vol, sindex[0],sindex[1],sindex[2],sindex[3], value1);
-          count++;
-                                /* now do the voxels between the two ends */
+  int
+    i,num_dim,
+    xyzv[VIO_MAX_DIMENSIONS],
+    count[VIO_MAX_DIMENSIONS];
+  VIO_Volume
+    orig_vol;
 
 
-          for(index[orig_xyzv[VIO_X]]=1; index[orig_xyzv[VIO_X]]<=orig_count[orig_xyzv[VIO_X]]-3; index[orig_xyzv[VIO_X]]++) {
+  
 
-            save_index = index[ orig_xyzv[VIO_X] ];
-            sindex[ xyzv[VIO_X] ] = index[ orig_xyzv[VIO_X] ]*2 + 1;
+  if (orig_deformation->type != GRID_TRANSFORM || super_sampled->type != GRID_TRANSFORM) {
+    print_error_and_line_num("interpolate_super_sampled_data_by2 not called with GRID_TRANSFORM",
+                             __FILE__, __LINE__);
+  }
 
-            index[ orig_xyzv[VIO_X] ]--;             
-            GET_VOXEL_4D(v1, orig_vol, index[0],index[1],index[2],index[3]);
-            index[ orig_xyzv[VIO_X] ]++;             
-            GET_VOXEL_4D(v2, orig_vol, index[0],index[1],index[2],index[3]);
-            index[ orig_xyzv[VIO_X] ]++;             
-            GET_VOXEL_4D(v3, orig_vol, index[0],index[1],index[2],index[3]);
-            index[ orig_xyzv[VIO_X] ]++;             
-            GET_VOXEL_4D(v4, orig_vol, index[0],index[1],index[2],index[3]);
+  orig_vol = orig_deformation->displacement_volume;
+  get_volume_sizes(       orig_vol,  count);
+  get_volume_XYZV_indices(orig_vol,  xyzv);
 
-            value1 = MY_CUBIC_05(v1,v2,v3,v4);
+  num_dim = 0;
 
-            SET_VOXEL_4D(super_vol, sindex[0],sindex[1],sindex[2],sindex[3], value1);
-            count++;
+  for(i=0; i<VIO_N_DIMENSIONS; i++) {
+    if ( count[xyzv[i]] > 1 ) 
+      num_dim++;
+  }
+  if (num_dim == 3) {
+    interpolate_super_sampled_data_by2_dim3( orig_deformation, super_sampled );
+  } else {
 
-            index[ orig_xyzv[VIO_X] ] = save_index;
-          }
+    if (num_dim == 2){                /* then one dim == 1 */
+      
+      for(i=0; i<VIO_N_DIMENSIONS; i++) {
 
-        }          
+        if ( count[xyzv[i]] == 1 ) {
+          interpolate_super_sampled_data_by2_dim2( orig_deformation, super_sampled,i );
+        }
 
       }
-      update_progress_report( &progress, count+1 );
     }
-               /* do edges along the index[ orig_xyzv[VIO_Y] ] dir */
-
-    for(i=0; i<VIO_MAX_DIMENSIONS; i++) sindex[i]=index[i]=0;
-    
-                                /* loop over all x-dirs  */
-
-    for(index[orig_xyzv[VIO_Z]]=0; index[orig_xyzv[VIO_Z]]<orig_count[orig_xyzv[VIO_Z]]; index[orig_xyzv[VIO_Z]]++) {
-
-
-      for(index[orig_xyzv[VIO_X]]=0; index[orig_xyzv[VIO_X]]<orig_count[orig_xyzv[VIO_X]]; index[orig_xyzv[VIO_X]]++) {
-
-
-        sindex[ xyzv[VIO_Z] ] = 2*index[ orig_xyzv[VIO_Z] ];
-        sindex[ xyzv[VIO_X] ] = 2*index[ orig_xyzv[VIO_X] ];
-
-        for(index[orig_xyzv[VIO_Z+1]]=0; index[orig_xyzv[VIO_Z+1]]<orig_count[xyzv[VIO_Z+1]]; index[orig_xyzv[VIO_Z+1]]++) {
-
-                                /* do linear interp at ends */
-
-          sindex[ xyzv[VIO_Y] ] = 1;                             /* beginning end */
-          index[ orig_xyzv[VIO_Y] ]=0;             
-          GET_VOXEL_4D(v1, orig_vol, index[0],index[1],index[2],index[3]);
-          index[ orig_xyzv[VIO_Y] ]=1;
-          GET_VOXEL_4D(v2, orig_vol, index[0],index[1],index[2],index[3]);
-          value1 = (v1+v2)/2;
-
-          sindex[ xyzv[VIO_Z+1] ] = index[ orig_xyzv[VIO_Z+1] ];
-
-          SET_VOXEL_4D(super_vol, sindex[0],sindex[1],sindex[2],sindex[3], value1);
-          count++;
-
-          sindex[ xyzv[VIO_Y] ] = 2*orig_count[ xyzv[VIO_Y] ] -3;      /* ending end */
-          index[ orig_xyzv[VIO_Y] ]= orig_count[ orig_xyzv[VIO_Y] ]-2;              
-          GET_VOXEL_4D(v1, orig_vol, index[0],index[1],index[2],index[3]);
-          index[ orig_xyzv[VIO_Y] ]= orig_count[ orig_xyzv[VIO_Y] ]-1;
-          GET_VOXEL_4D(v2, orig_vol, index[0],index[1],index[2],index[3]);
-          value1 = (v1+v2)/2;
+  }
+}
 
-          sindex[ xyzv[VIO_Z+1] ] = index[ orig_xyzv[VIO_Z+1] ];
 
-          SET_VOXEL_4D(super_vol, sindex[0],sindex[1],sindex[2],sindex[3], value1);
-          count++;
+/* OR of the flags of the nodes i-1..i+2 along one axis of a [x][y][z]
+   grid of count[] nodes: the super-sampled nodes 2i and 2i+1 only
+   depend on these original nodes */
 
-                                /* now do the voxels between the two ends */
+static void spread_flags_along_axis(unsigned char *in, unsigned char *out, 
+                                    int count[], int axis)
+{
+  int
+    i, j, k, o, pos;
+  long
+    node,
+    strides[VIO_N_DIMENSIONS];
+
+  strides[VIO_Z] = 1;
+  strides[VIO_Y] = count[VIO_Z];
+  strides[VIO_X] = (long)count[VIO_Z] * count[VIO_Y];
+
+  for(i=0; i<count[VIO_X]; i++)
+    for(j=0; j<count[VIO_Y]; j++)
+      for(k=0; k<count[VIO_Z]; k++) {
+        node = i*strides[VIO_X] + j*strides[VIO_Y] + k;
+        pos  = (axis==VIO_X) ? i : ((axis==VIO_Y) ? j : k);
+        out[node] = 0;
+        for(o=-1; o<=2; o++)
+          if (pos+o >= 0 && pos+o < count[axis] && in[node + o*strides[axis]]) {
+            out[node] = 1;
+            break;
+          }
+      }
+}
 
+void interpolate_super_sampled_data_by2_incremental(
+    VIO_General_transform *orig_deformation,
+    VIO_General_transform *super_sampled,
+    Super_Sampled_Source  *previous)
+{
+  int
+    i, num_dim,
+    count[VIO_N_DIMENSIONS],
+    xyzv[VIO_MAX_DIMENSIONS],
+    sizes[VIO_MAX_DIMENSIONS];
+  long
+    n, n_nodes, n_changed;
+  double
+    *vectors;
+  unsigned char
+    *changed,
+    *update;
 
-          for(index[orig_xyzv[VIO_Y]]=1; index[orig_xyzv[VIO_Y]]<=orig_count[orig_xyzv[VIO_Y]]-3; index[orig_xyzv[VIO_Y]]++) {
+  if (orig_deformation->type != GRID_TRANSFORM || super_sampled->type != GRID_TRANSFORM) {
+    print_error_and_line_num("interpolate_super_sampled_data_by2_incremental not called with GRID_TRANSFORM",
+                             __FILE__, __LINE__);
+  }
 
-            save_index = index[ orig_xyzv[VIO_Y] ];
-            sindex[ xyzv[VIO_Y] ] = index[ orig_xyzv[VIO_Y] ]*2 + 1;
+  get_volume_sizes(       orig_deformation->displacement_volume, sizes);
+  get_volume_XYZV_indices(orig_deformation->displacement_volume, xyzv);
 
-            index[ orig_xyzv[VIO_Y] ]--;             
-            GET_VOXEL_4D(v1, orig_vol, index[0],index[1],index[2],index[3]);
-            index[ orig_xyzv[VIO_Y] ]++;             
-            GET_VOXEL_4D(v2, orig_vol, index[0],index[1],index[2],index[3]);
-             index[ orig_xyzv[VIO_Y] ]++;             
-            GET_VOXEL_4D(v3, orig_vol, index[0],index[1],index[2],index[3]);
-            index[ orig_xyzv[VIO_Y] ]++;             
-            GET_VOXEL_4D(v4, orig_vol, index[0],index[1],index[2],index[3]);
+  num_dim = 0;
+  for(i=0; i<VIO_N_DIMENSIONS; i++) {
+    if ( sizes[xyzv[i]] > 1 ) 
+      num_dim++;
+  }
+                                /* only the 3D case is incremental */
+  if (num_dim != 3) {
+    delete_super_sampled_source(previous);
+    interpolate_super_sampled_data_by2(orig_deformation, super_sampled);
+    return;
+  }
 
-            value1 = MY_CUBIC_05(v1,v2,v3,v4);
+  vectors = get_all_warp_vectors(orig_deformation->displacement_volume, count);
+  n_nodes = (long)count[VIO_X] * count[VIO_Y] * count[VIO_Z];
 
-            SET_VOXEL_4D(super_vol, sindex[0],sindex[1],sindex[2],sindex[3], value1);
-            count++;
+  if (previous->vectors == NULL ||
+      previous->count[VIO_X] != count[VIO_X] ||
+      previous->count[VIO_Y] != count[VIO_Y] ||
+      previous->count[VIO_Z] != count[VIO_Z]) {
 
-            index[ orig_xyzv[VIO_Y] ] = save_index;
-          }
+    super_sample_by2_dim3(super_sampled->displacement_volume, vectors, count, NULL);
+  }
+  else {
+    ALLOC(changed, n_nodes);
+    ALLOC(update,  n_nodes);
+
+    n_changed = 0;
+    for(n=0; n<n_nodes; n++) {
+      changed[n] = (vectors[3*n]   != previous->vectors[3*n]   ||
+                    vectors[3*n+1] != previous->vectors[3*n+1] ||
+                    vectors[3*n+2] != previous->vectors[3*n+2]);
+      n_changed += changed[n];
+    }
 
-        }          
+    if (n_changed > 0) {
+      spread_flags_along_axis(changed, update,  count, VIO_Z);
+      spread_flags_along_axis(update,  changed, count, VIO_Y);
+      spread_flags_along_axis(changed, update,  count, VIO_X);
 
-      }
-      update_progress_report( &progress, count+1 );
+      super_sample_by2_dim3(super_sampled->displacement_volume, vectors, count, update);
     }
 
-               /* do edges along the index[ orig_xyzv[VIO_Z] ] dir */
-
-    for(i=0; i<VIO_MAX_DIMENSIONS; i++) sindex[i]=index[i]=0;
-    
-                                /* loop over all Z-dirs  */
-
-    for(index[orig_xyzv[VIO_X]]=0; index[orig_xyzv[VIO_X]]<orig_count[orig_xyzv[VIO_X]]; index[orig_xyzv[VIO_X]]++) {
-
-
-      for(index[orig_xyzv[VIO_Y]]=0; index[orig_xyzv[VIO_Y]]<orig_count[orig_xyzv[VIO_Y]]; index[orig_xyzv[VIO_Y]]++) {
-
-        sindex[ xyzv[VIO_X] ] = 2*index[ orig_xyzv[VIO_X] ];
-        sindex[ xyzv[VIO_Y] ] = 2*index[ orig_xyzv[VIO_Y] ];
-
-        for(index[orig_xyzv[VIO_Z+1]]=0; index[orig_xyzv[VIO_Z+1]]<orig_count[xyzv[VIO_Z+1]]; index[orig_xyzv[VIO_Z+1]]++) {
-
-                                /* do linear interp at ends */
-
-          sindex[ xyzv[VIO_Z] ] = 1;                             /* beginning end */
-          index[ orig_xyzv[VIO_Z] ]=0;             
-          GET_VOXEL_4D(v1, orig_vol, index[0],index[1],index[2],index[3]);
-          index[ orig_xyzv[VIO_Z] ]=1;
-          GET_VOXEL_4D(v2, orig_vol, index[0],index[1],index[2],index[3]);
-          value1 = (v1+v2)/2;
-
-          sindex[ xyzv[VIO_Z+1] ] = index[ orig_xyzv[VIO_Z+1] ];
-
-          SET_VOXEL_4D(super_vol, sindex[0],sindex[1],sindex[2],sindex[3], value1);
-          count++;
-
-          sindex[ xyzv[VIO_Z] ] = 2*orig_count[ xyzv[VIO_Z] ] -3;      /* ending end */
-          index[ orig_xyzv[VIO_Z] ]= orig_count[ orig_xyzv[VIO_Z] ]-2;              
-          GET_VOXEL_4D(v1, orig_vol, index[0],index[1],index[2],index[3]);
-          index[ orig_xyzv[VIO_Z] ]= orig_count[ orig_xyzv[VIO_Z] ]-1;
-          GET_VOXEL_4D(v2, orig_vol, index[0],index[1],index[2],index[3]);
-          value1 = (v1+v2)/2;
-
-          sindex[ xyzv[VIO_Z+1] ] = index[ orig_xyzv[VIO_Z+1] ];
-
-          SET_VOXEL_4D(super_vol, sindex[0],sindex[1],sindex[2],sindex[3], value1);
-          count++;
-
-                                /* now do the voxels between the two ends */
-
-
-          for(index[orig_xyzv[VIO_Z]]=1; index[orig_xyzv[VIO_Z]]<=orig_count[orig_xyzv[VIO_Z]]-3; index[orig_xyzv[VIO_Z]]++) {
-
-            save_index = index[ orig_xyzv[VIO_Z] ];
-            sindex[ xyzv[VIO_Z] ] = index[ orig_xyzv[VIO_Z] ]*2 + 1;
-
-            index[ orig_xyzv[VIO_Z] ]--;             
-            GET_VOXEL_4D(v1, orig_vol, index[0],index[1],index[2],index[3]);
-            index[ orig_xyzv[VIO_Z] ]++;             
-            GET_VOXEL_4D(v2, orig_vol, index[0],index[1],index[2],index[3]);
-            index[ orig_xyzv[VIO_Z] ]++;             
-            GET_VOXEL_4D(v3, orig_vol, index[0],index[1],index[2],index[3]);
-            index[ orig_xyzv[VIO_Z] ]++;             
-            GET_VOXEL_4D(v4, orig_vol, index[0],index[1],index[2],index[3]);
-
-            value1 = MY_CUBIC_05(v1,v2,v3,v4);
-
-            SET_VOXEL_4D(super_vol, sindex[0],sindex[1],sindex[2],sindex[3], value1);
-            count++;
-
-            index[ orig_xyzv[VIO_Z] ] = save_index;
-          }
-
-        }          
-
-      }
-      update_progress_report( &progress, count+1 );
-    }
-
-
-    /* LEVEL 2: face interpolation, identified as 'f' in desc above */
-
-               /* do faces in the plane with index[ orig_xyzv[VIO_X] ]=CONST */
-
-    for(i=0; i<VIO_MAX_DIMENSIONS; i++)  sindex[i]=index[i]=0;
-    
-                                /* loop over all X planes  */
-
-    for(index[orig_xyzv[VIO_X]]=0; index[orig_xyzv[VIO_X]]<orig_count[orig_xyzv[VIO_X]]-1; index[orig_xyzv[VIO_X]]++) {
-
-      sindex[ xyzv[VIO_X] ] = 2*index[ orig_xyzv[VIO_X] ];
-
-      for(index[orig_xyzv[VIO_Z+1]]=0; index[orig_xyzv[VIO_Z+1]]<orig_count[xyzv[VIO_Z+1]]; index[orig_xyzv[VIO_Z+1]]++) {
-
-        sindex[ xyzv[VIO_Z+1] ] = index[ orig_xyzv[VIO_Z+1] ];
-
-
-                                /* do faces near the edge first */
-
-        for(index[orig_xyzv[VIO_Z]]=0; index[orig_xyzv[VIO_Z]]<orig_count[orig_xyzv[VIO_Z]]-1; index[orig_xyzv[VIO_Z]]++) {
-
-          sindex[ xyzv[VIO_Z] ] = index[ orig_xyzv[VIO_Z] ]*2 + 1;
-          
-          sindex[ xyzv[VIO_Y] ] = 0;
-          GET_VOXEL_4D(v1, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_Y] ] = 2;
-          GET_VOXEL_4D(v2, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          
-          value1 = (v1+v2)/2;
-          
-          sindex[ xyzv[VIO_Y] ] = 1;
-          SET_VOXEL_4D(super_vol, sindex[0],sindex[1],sindex[2],sindex[3], value1);
-          count++;
-          
-          sindex[ xyzv[VIO_Y] ] = 2*orig_count[ orig_xyzv[VIO_Y] ] -3;
-          GET_VOXEL_4D(v1, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_Y] ] = 2*orig_count[ orig_xyzv[VIO_Y] ] -1;
-          GET_VOXEL_4D(v2, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          
-          value1 = (v1+v2)/2;
-          
-          sindex[ xyzv[VIO_Y] ] = 2*orig_count[ orig_xyzv[VIO_Y] ] -2;
-          SET_VOXEL_4D(super_vol, sindex[0],sindex[1],sindex[2],sindex[3], value1);
-          count++;
-          
-          
-        }
-        update_progress_report( &progress, count+1 );
-
-        for(index[orig_xyzv[VIO_Y]]=0; index[orig_xyzv[VIO_Y]]<orig_count[orig_xyzv[VIO_Y]]-1; index[orig_xyzv[VIO_Y]]++) {
-
-          sindex[ xyzv[VIO_Y] ] = index[ orig_xyzv[VIO_Y] ]*2 + 1;
-          
-          sindex[ xyzv[VIO_Z] ] = 0;
-          GET_VOXEL_4D(v1, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_Z] ] = 2;
-          GET_VOXEL_4D(v2, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          
-          value1 = (v1+v2)/2;
-          
-          sindex[ xyzv[VIO_Z] ] = 1;
-          SET_VOXEL_4D(super_vol, sindex[0],sindex[1],sindex[2],sindex[3], value1);
-          count++;
-          
-          sindex[ xyzv[VIO_Z] ] = 2*orig_count[ orig_xyzv[VIO_Z] ] -3;
-          GET_VOXEL_4D(v1, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_Z] ] = 2*orig_count[ orig_xyzv[VIO_Z] ] -1;
-          GET_VOXEL_4D(v2, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          
-          value1 = (v1+v2)/2;
-          
-          sindex[ xyzv[VIO_Z] ] = 2*orig_count[ orig_xyzv[VIO_Z] ] -2;
-          SET_VOXEL_4D(super_vol, sindex[0],sindex[1],sindex[2],sindex[3], value1);
-          count++;
-          
-          
-        }
-        update_progress_report( &progress, count+1 );
-      
-                                /* now do faces in the middle */
-
-
-        for(index[orig_xyzv[VIO_Y]]=1; index[orig_xyzv[VIO_Y]]<orig_count[orig_xyzv[VIO_Y]]-2; index[orig_xyzv[VIO_Y]]++) {
-          for(index[orig_xyzv[VIO_Z]]=1; index[orig_xyzv[VIO_Z]]<orig_count[orig_xyzv[VIO_Z]]-2; index[orig_xyzv[VIO_Z]]++) {
-
-            sindex[ xyzv[VIO_Y] ] = index[ orig_xyzv[VIO_Y] ]*2 + 1;
-            sindex[ xyzv[VIO_Z] ] = index[ orig_xyzv[VIO_Z] ]*2 + 1;
-
-            save_index1 =  sindex[ xyzv[VIO_Y] ];
-            save_index2 =  sindex[ xyzv[VIO_Z] ];
-
-
-            sindex[ xyzv[VIO_Y] ] -= 3;
-            GET_VOXEL_4D(v1, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-            sindex[ xyzv[VIO_Y] ] += 2;
-            GET_VOXEL_4D(v2, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-            sindex[ xyzv[VIO_Y] ] += 2;
-            GET_VOXEL_4D(v3, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-            sindex[ xyzv[VIO_Y] ] += 2;
-            GET_VOXEL_4D(v4, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-            sindex[ xyzv[VIO_Y] ] = save_index1 ;
-            value1 = MY_CUBIC_05(v1,v2,v3,v4);
-
-
-            sindex[ xyzv[VIO_Z] ] -= 3;
-            GET_VOXEL_4D(v1, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-            sindex[ xyzv[VIO_Z] ] += 2;
-            GET_VOXEL_4D(v2, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-            sindex[ xyzv[VIO_Z] ] += 2;
-            GET_VOXEL_4D(v3, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-            sindex[ xyzv[VIO_Z] ] += 2;
-            GET_VOXEL_4D(v4, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-            sindex[ xyzv[VIO_Z] ] = save_index2 ;
-            value2 = MY_CUBIC_05(v1,v2,v3,v4);
-
-
-            value1 = (value1 + value2)/2.0;
-
-            SET_VOXEL_4D(super_vol, sindex[0],sindex[1],sindex[2],sindex[3], value1);
-            count++;
-          }
-          update_progress_report( &progress, count+1 );
-        }
-
-      } /* index[ orig_xyzv[VIO_Z+1] ] */
-      
-    }
-                                /* loop over all Y planes  */
-
-    for(index[orig_xyzv[VIO_Y]]=0; index[orig_xyzv[VIO_Y]]<orig_count[orig_xyzv[VIO_Y]]-1; index[orig_xyzv[VIO_Y]]++) {
-
-      sindex[ xyzv[VIO_Y] ] = 2*index[ orig_xyzv[VIO_Y] ];
-
-      for(index[orig_xyzv[VIO_Z+1]]=0; index[orig_xyzv[VIO_Z+1]]<orig_count[xyzv[VIO_Z+1]]; index[orig_xyzv[VIO_Z+1]]++) {
-
-        sindex[ xyzv[VIO_Z+1] ] = index[ orig_xyzv[VIO_Z+1] ];
-
-
-                                /* do faces near the edge first */
-
-        for(index[orig_xyzv[VIO_X]]=0; index[orig_xyzv[VIO_X]]<orig_count[orig_xyzv[VIO_X]]-1; index[orig_xyzv[VIO_X]]++) {
-
-          sindex[ xyzv[VIO_X] ] = index[ orig_xyzv[VIO_X] ]*2 + 1;
-          
-          sindex[ xyzv[VIO_Z] ] = 0;
-          GET_VOXEL_4D(v1, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_Z] ] = 2;
-          GET_VOXEL_4D(v2, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          
-          value1 = (v1+v2)/2;
-          
-          sindex[ xyzv[VIO_Z] ] = 1;
-          SET_VOXEL_4D(super_vol, sindex[0],sindex[1],sindex[2],sindex[3], value1);
-          count++;
-          
-          sindex[ xyzv[VIO_Z] ] = 2*orig_count[ orig_xyzv[VIO_Z] ] -3;
-          GET_VOXEL_4D(v1, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_Z] ] = 2*orig_count[ orig_xyzv[VIO_Z] ] -1;
-          GET_VOXEL_4D(v2, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          
-          value1 = (v1+v2)/2;
-          
-          sindex[ xyzv[VIO_Z] ] = 2*orig_count[ orig_xyzv[VIO_Z] ] -2;
-          SET_VOXEL_4D(super_vol, sindex[0],sindex[1],sindex[2],sindex[3], value1);
-          count++;
-          
-          
-        }
-        update_progress_report( &progress, count+1 );
-
-        for(index[orig_xyzv[VIO_Z]]=0; index[orig_xyzv[VIO_Z]]<orig_count[orig_xyzv[VIO_Z]]-1; index[orig_xyzv[VIO_Z]]++) {
-
-          sindex[ xyzv[VIO_Z] ] = index[ orig_xyzv[VIO_Z] ]*2 + 1;
-          
-          sindex[ xyzv[VIO_X] ] = 0;
-          GET_VOXEL_4D(v1, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_X] ] = 2;
-          GET_VOXEL_4D(v2, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          
-          value1 = (v1+v2)/2;
-          
-          sindex[ xyzv[VIO_X] ] = 1;
-          SET_VOXEL_4D(super_vol, sindex[0],sindex[1],sindex[2],sindex[3], value1);
-          count++;
-          
-          sindex[ xyzv[VIO_X] ] = 2*orig_count[ orig_xyzv[VIO_X] ] -3;
-          GET_VOXEL_4D(v1, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_X] ] = 2*orig_count[ orig_xyzv[VIO_X] ] -1;
-          GET_VOXEL_4D(v2, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          
-          value1 = (v1+v2)/2;
-          
-          sindex[ xyzv[VIO_X] ] = 2*orig_count[ orig_xyzv[VIO_X] ] -2;
-          SET_VOXEL_4D(super_vol, sindex[0],sindex[1],sindex[2],sindex[3], value1);
-          count++;
-          
-          
-        }
-        update_progress_report( &progress, count+1 );
-
-                                /* now do faces in the middle */
-
-
-        for(index[orig_xyzv[VIO_Z]]=1; index[orig_xyzv[VIO_Z]]<orig_count[orig_xyzv[VIO_Z]]-2; index[orig_xyzv[VIO_Z]]++) {
-          for(index[orig_xyzv[VIO_X]]=1; index[orig_xyzv[VIO_X]]<orig_count[orig_xyzv[VIO_X]]-2; index[orig_xyzv[VIO_X]]++) {
-
-            sindex[ xyzv[VIO_Z] ] = index[ orig_xyzv[VIO_Z] ]*2 + 1;
-            sindex[ xyzv[VIO_X] ] = index[ orig_xyzv[VIO_X] ]*2 + 1;
-
-            save_index1 =  sindex[ xyzv[VIO_Z] ];
-            save_index2 =  sindex[ xyzv[VIO_X] ];
-
-
-            sindex[ xyzv[VIO_Z] ] -= 3;
-            GET_VOXEL_4D(v1, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-            sindex[ xyzv[VIO_Z] ] += 2;
-            GET_VOXEL_4D(v2, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-            sindex[ xyzv[VIO_Z] ] += 2;
-            GET_VOXEL_4D(v3, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-            sindex[ xyzv[VIO_Z] ] += 2;
-            GET_VOXEL_4D(v4, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-            sindex[ xyzv[VIO_Z] ] = save_index1 ;
-            value1 = MY_CUBIC_05(v1,v2,v3,v4);
-
-
-            sindex[ xyzv[VIO_X] ] -= 3;
-            GET_VOXEL_4D(v1, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-            sindex[ xyzv[VIO_X] ] += 2;
-            GET_VOXEL_4D(v2, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-            sindex[ xyzv[VIO_X] ] += 2;
-            GET_VOXEL_4D(v3, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-            sindex[ xyzv[VIO_X] ] += 2;
-            GET_VOXEL_4D(v4, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-            sindex[ xyzv[VIO_X] ] = save_index2 ;
-            value2 = MY_CUBIC_05(v1,v2,v3,v4);
-
-
-            value1 = (value1 + value2)/2.0;
-
-            SET_VOXEL_4D(super_vol, sindex[0],sindex[1],sindex[2],sindex[3], value1);
-            count++;
-          }
-          update_progress_report( &progress, count+1 );
-        }
-
-      } /* index[ orig_xyzv[VIO_Z+1] ] */
-      
-    }
-
-                                /* loop over all Z planes  */
-    
-    for(index[orig_xyzv[VIO_Z]]=0; index[orig_xyzv[VIO_Z]]<orig_count[orig_xyzv[VIO_Z]]-1; index[orig_xyzv[VIO_Z]]++) {
-
-      sindex[ xyzv[VIO_Z] ] = 2*index[ orig_xyzv[VIO_Z] ];
-
-      for(index[orig_xyzv[VIO_Z+1]]=0; index[orig_xyzv[VIO_Z+1]]<orig_count[xyzv[VIO_Z+1]]; index[orig_xyzv[VIO_Z+1]]++) {
-
-        sindex[ xyzv[VIO_Z+1] ] = index[ orig_xyzv[VIO_Z+1] ];
-
-
-                                /* do faces near the edge first */
-
-        for(index[orig_xyzv[VIO_Y]]=0; index[orig_xyzv[VIO_Y]]<orig_count[orig_xyzv[VIO_Y]]-1; index[orig_xyzv[VIO_Y]]++) {
-
-          sindex[ xyzv[VIO_Y] ] = index[ orig_xyzv[VIO_Y] ]*2 + 1;
-          
-          sindex[ xyzv[VIO_X] ] = 0;
-          GET_VOXEL_4D(v1, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_X] ] = 2;
-          GET_VOXEL_4D(v2, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          
-          value1 = (v1+v2)/2;
-          
-          sindex[ xyzv[VIO_X] ] = 1;
-          SET_VOXEL_4D(super_vol, sindex[0],sindex[1],sindex[2],sindex[3], value1);
-          count++;
-          
-          sindex[ xyzv[VIO_X] ] = 2*orig_count[ orig_xyzv[VIO_X] ] -3;
-          GET_VOXEL_4D(v1, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_X] ] = 2*orig_count[ orig_xyzv[VIO_X] ] -1;
-          GET_VOXEL_4D(v2, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          
-          value1 = (v1+v2)/2;
-          
-          sindex[ xyzv[VIO_X] ] = 2*orig_count[ orig_xyzv[VIO_X] ] -2;
-          SET_VOXEL_4D(super_vol, sindex[0],sindex[1],sindex[2],sindex[3], value1);
-          count++;
-          
-          
-        }
-        update_progress_report( &progress, count+1 );
-
-        for(index[orig_xyzv[VIO_X]]=0; index[orig_xyzv[VIO_X]]<orig_count[orig_xyzv[VIO_X]]-1; index[orig_xyzv[VIO_X]]++) {
-
-          sindex[ xyzv[VIO_X] ] = index[ orig_xyzv[VIO_X] ]*2 + 1;
-          
-          sindex[ xyzv[VIO_Y] ] = 0;
-          GET_VOXEL_4D(v1, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_Y] ] = 2;
-          GET_VOXEL_4D(v2, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          
-          value1 = (v1+v2)/2;
-          
-          sindex[ xyzv[VIO_Y] ] = 1;
-          SET_VOXEL_4D(super_vol, sindex[0],sindex[1],sindex[2],sindex[3], value1);
-          count++;
-          
-          sindex[ xyzv[VIO_Y] ] = 2*orig_count[ orig_xyzv[VIO_Y] ] -3;
-          GET_VOXEL_4D(v1, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_Y] ] = 2*orig_count[ orig_xyzv[VIO_Y] ] -1;
-          GET_VOXEL_4D(v2, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          
-          value1 = (v1+v2)/2;
-          
-          sindex[ xyzv[VIO_Y] ] = 2*orig_count[ orig_xyzv[VIO_Y] ] -2;
-          SET_VOXEL_4D(super_vol, sindex[0],sindex[1],sindex[2],sindex[3], value1);
-          count++;
-          
-          
-        }
-        update_progress_report( &progress, count+1 );
-
-                                /* now do faces in the middle */
-
-
-        for(index[orig_xyzv[VIO_X]]=1; index[orig_xyzv[VIO_X]]<orig_count[orig_xyzv[VIO_X]]-2; index[orig_xyzv[VIO_X]]++) {
-          for(index[orig_xyzv[VIO_Y]]=1; index[orig_xyzv[VIO_Y]]<orig_count[orig_xyzv[VIO_Y]]-2; index[orig_xyzv[VIO_Y]]++) {
-
-            sindex[ xyzv[VIO_X] ] = index[ orig_xyzv[VIO_X] ]*2 + 1;
-            sindex[ xyzv[VIO_Y] ] = index[ orig_xyzv[VIO_Y] ]*2 + 1;
-
-            save_index1 =  sindex[ xyzv[VIO_X] ];
-            save_index2 =  sindex[ xyzv[VIO_Y] ];
-
-
-            sindex[ xyzv[VIO_X] ] -= 3;
-            GET_VOXEL_4D(v1, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-            sindex[ xyzv[VIO_X] ] += 2;
-            GET_VOXEL_4D(v2, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-            sindex[ xyzv[VIO_X] ] += 2;
-            GET_VOXEL_4D(v3, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-            sindex[ xyzv[VIO_X] ] += 2;
-            GET_VOXEL_4D(v4, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-            sindex[ xyzv[VIO_X] ] = save_index1 ;
-            value1 = MY_CUBIC_05(v1,v2,v3,v4);
-
-
-            sindex[ xyzv[VIO_Y] ] -= 3;
-            GET_VOXEL_4D(v1, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-            sindex[ xyzv[VIO_Y] ] += 2;
-            GET_VOXEL_4D(v2, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-            sindex[ xyzv[VIO_Y] ] += 2;
-            GET_VOXEL_4D(v3, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-            sindex[ xyzv[VIO_Y] ] += 2;
-            GET_VOXEL_4D(v4, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-            sindex[ xyzv[VIO_Y] ] = save_index2 ;
-            value2 = MY_CUBIC_05(v1,v2,v3,v4);
-
-
-            value1 = (value1 + value2)/2.0;
-
-            SET_VOXEL_4D(super_vol, sindex[0],sindex[1],sindex[2],sindex[3], value1);
-            count++;
-          }
-          update_progress_report( &progress, count+1 );
-        }
-
-      } /* index[ orig_xyzv[VIO_Z+1] ] */
-      
-    }
-    /* LEVEL 3: center interpolation, identified as 'c' in desc above */
-
-    for(index[orig_xyzv[VIO_Z+1]]=0; index[orig_xyzv[VIO_Z+1]]<orig_count[xyzv[VIO_Z+1]]; index[orig_xyzv[VIO_Z+1]]++) {
-
-      sindex[ xyzv[VIO_Z+1] ] = index[ orig_xyzv[VIO_Z+1] ];
-
-                         /* do all centers that are 1 sample from
-                            the edge of the super-sampled volume */
-
-                                /* do the two X-planes */
-
-      for(index[orig_xyzv[VIO_Y]]=0; index[orig_xyzv[VIO_Y]]<orig_count[orig_xyzv[VIO_Y]]-2; index[orig_xyzv[VIO_Y]]++) {
-        for(index[orig_xyzv[VIO_Z]]=0; index[orig_xyzv[VIO_Z]]<orig_count[orig_xyzv[VIO_Z]]-2; index[orig_xyzv[VIO_Z]]++) {
-
-          sindex[ xyzv[VIO_Y] ] = index[ orig_xyzv[VIO_Y] ]*2 + 1;
-          sindex[ xyzv[VIO_Z] ] = index[ orig_xyzv[VIO_Z] ]*2 + 1;
-
-          sindex[ xyzv[VIO_X] ] = 1;
-
-          sindex[ xyzv[VIO_X] ] -= 1;
-          GET_VOXEL_4D(v1, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_X] ] += 2;
-          GET_VOXEL_4D(v2, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_X] ] -= 1;
-          
-          sindex[ xyzv[VIO_Y] ] -= 1;
-          GET_VOXEL_4D(v3, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_Y] ] += 2;
-          GET_VOXEL_4D(v4, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_Y] ] -= 1;
-        
-          sindex[ xyzv[VIO_Z] ] -= 1;
-          GET_VOXEL_4D(v5, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_Z] ] += 2;
-          GET_VOXEL_4D(v6, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_Z] ] -= 1;
-        
-          value1 = (v1 + v2 + v3 + v4 + v5 + v6) / 6.0;
-          SET_VOXEL_4D(super_vol, sindex[0],sindex[1],sindex[2],sindex[3], value1);
-          count++;
-        
-          sindex[ xyzv[VIO_X] ] = 2*orig_count[ orig_xyzv[VIO_X] ] -2;
-      
-          sindex[ xyzv[VIO_X] ] -= 1;
-          GET_VOXEL_4D(v1, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_X] ] += 2;
-          GET_VOXEL_4D(v2, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_X] ] -= 1;
-          
-          sindex[ xyzv[VIO_Y] ] -= 1;
-          GET_VOXEL_4D(v3, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_Y] ] += 2;
-          GET_VOXEL_4D(v4, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_Y] ] -= 1;
-          
-          sindex[ xyzv[VIO_Z] ] -= 1;
-          GET_VOXEL_4D(v5, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_Z] ] += 2;
-          GET_VOXEL_4D(v6, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_Z] ] -= 1;
-          
-          value1 = (v1 + v2 + v3 + v4 + v5 + v6) / 6.0;
-          SET_VOXEL_4D(super_vol, sindex[0],sindex[1],sindex[2],sindex[3], value1);
-          count++;
-        }
-      }
-      update_progress_report( &progress, count+1 );
-                                /* do the two Y-planes */
-
-      for(index[orig_xyzv[VIO_X]]=0; index[orig_xyzv[VIO_X]]<orig_count[orig_xyzv[VIO_X]]-2; index[orig_xyzv[VIO_X]]++) {
-        for(index[orig_xyzv[VIO_Z]]=0; index[orig_xyzv[VIO_Z]]<orig_count[orig_xyzv[VIO_Z]]-2; index[orig_xyzv[VIO_Z]]++) {
-
-          sindex[ xyzv[VIO_X] ] = index[ orig_xyzv[VIO_X] ]*2 + 1;
-          sindex[ xyzv[VIO_Z] ] = index[ orig_xyzv[VIO_Z] ]*2 + 1;
-
-          sindex[ xyzv[VIO_Y] ] = 1;
-
-          sindex[ xyzv[VIO_X] ] -= 1;
-          GET_VOXEL_4D(v1, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_X] ] += 2;
-          GET_VOXEL_4D(v2, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_X] ] -= 1;
-          
-          sindex[ xyzv[VIO_Y] ] -= 1;
-          GET_VOXEL_4D(v3, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_Y] ] += 2;
-          GET_VOXEL_4D(v4, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_Y] ] -= 1;
-        
-          sindex[ xyzv[VIO_Z] ] -= 1;
-          GET_VOXEL_4D(v5, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_Z] ] += 2;
-          GET_VOXEL_4D(v6, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_Z] ] -= 1;
-        
-          value1 = (v1 + v2 + v3 + v4 + v5 + v6) / 6.0;
-          SET_VOXEL_4D(super_vol, sindex[0],sindex[1],sindex[2],sindex[3], value1);
-          count++;
-        
-           sindex[ xyzv[VIO_Y] ] = 2*orig_count[ orig_xyzv[VIO_Y] ] -2;
-      
-          sindex[ xyzv[VIO_X] ] -= 1;
-          GET_VOXEL_4D(v1, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_X] ] += 2;
-          GET_VOXEL_4D(v2, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_X] ] -= 1;
-          
-          sindex[ xyzv[VIO_Y] ] -= 1;
-          GET_VOXEL_4D(v3, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_Y] ] += 2;
-          GET_VOXEL_4D(v4, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_Y] ] -= 1;
-          
-          sindex[ xyzv[VIO_Z] ] -= 1;
-          GET_VOXEL_4D(v5, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_Z] ] += 2;
-          GET_VOXEL_4D(v6, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_Z] ] -= 1;
-          
-          value1 = (v1 + v2 + v3 + v4 + v5 + v6) / 6.0;
-          SET_VOXEL_4D(super_vol, sindex[0],sindex[1],sindex[2],sindex[3], value1);
-          count++;
-        }
-      }
-      update_progress_report( &progress, count+1 );
-
-                                /* do the two Z-planes */
-
-      for(index[orig_xyzv[VIO_X]]=0; index[orig_xyzv[VIO_X]]<orig_count[orig_xyzv[VIO_X]]-2; index[orig_xyzv[VIO_X]]++) {
-        for(index[orig_xyzv[VIO_Y]]=0; index[orig_xyzv[VIO_Y]]<orig_count[orig_xyzv[VIO_Y]]-2; index[orig_xyzv[VIO_Y]]++) {
-
-          sindex[ xyzv[VIO_X] ] = index[ orig_xyzv[VIO_X] ]*2 + 1;
-          sindex[ xyzv[VIO_Y] ] = index[ orig_xyzv[VIO_Y] ]*2 + 1;
-
-          sindex[ xyzv[VIO_Z] ] = 1;
-
-          sindex[ xyzv[VIO_X] ] -= 1;
-          GET_VOXEL_4D(v1, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_X] ] += 2;
-          GET_VOXEL_4D(v2, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_X] ] -= 1;
-          
-          sindex[ xyzv[VIO_Y] ] -= 1;
-          GET_VOXEL_4D(v3, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_Y] ] += 2;
-          GET_VOXEL_4D(v4, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_Y] ] -= 1;
-        
-          sindex[ xyzv[VIO_Z] ] -= 1;
-          GET_VOXEL_4D(v5, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_Z] ] += 2;
-          GET_VOXEL_4D(v6, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_Z] ] -= 1;
-        
-          value1 = (v1 + v2 + v3 + v4 + v5 + v6) / 6.0;
-          SET_VOXEL_4D(super_vol, sindex[0],sindex[1],sindex[2],sindex[3], value1);
-          count++;
-        
-          sindex[ xyzv[VIO_Z] ] = 2*orig_count[ orig_xyzv[VIO_Z] ] -2;
-      
-          sindex[ xyzv[VIO_X] ] -= 1;
-          GET_VOXEL_4D(v1, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_X] ] += 2;
-          GET_VOXEL_4D(v2, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_X] ] -= 1;
-          
-          sindex[ xyzv[VIO_Y] ] -= 1;
-          GET_VOXEL_4D(v3, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_Y] ] += 2;
-          GET_VOXEL_4D(v4, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_Y] ] -= 1;
-          
-          sindex[ xyzv[VIO_Z] ] -= 1;
-          GET_VOXEL_4D(v5, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_Z] ] += 2;
-          GET_VOXEL_4D(v6, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-          sindex[ xyzv[VIO_Z] ] -= 1;
-          
-          value1 = (v1 + v2 + v3 + v4 + v5 + v6) / 6.0;
-          SET_VOXEL_4D(super_vol, sindex[0],sindex[1],sindex[2],sindex[3], value1);
-          count++;
-        }
-      }
-      update_progress_report( &progress, count+1 );
-
-                               /* now do all central voxels */
-
-
-      for(index[orig_xyzv[VIO_X]]=1; index[orig_xyzv[VIO_X]]<orig_count[orig_xyzv[VIO_X]]-2; index[orig_xyzv[VIO_X]]++) {
-        for(index[orig_xyzv[VIO_Y]]=1; index[orig_xyzv[VIO_Y]]<orig_count[orig_xyzv[VIO_Y]]-2; index[orig_xyzv[VIO_Y]]++) {
-          for(index[orig_xyzv[VIO_Z]]=1; index[orig_xyzv[VIO_Z]]<orig_count[orig_xyzv[VIO_Z]]-2; index[orig_xyzv[VIO_Z]]++) {
-            
-            sindex[ xyzv[VIO_X] ] = index[ orig_xyzv[VIO_X] ]*2 + 1;
-            sindex[ xyzv[VIO_Y] ] = index[ orig_xyzv[VIO_Y] ]*2 + 1;
-            sindex[ xyzv[VIO_Z] ] = index[ orig_xyzv[VIO_Z] ]*2 + 1;
-
-            sindex[ xyzv[VIO_X] ] -= 3;
-            GET_VOXEL_4D(v1, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-            sindex[ xyzv[VIO_X] ] += 2;
-            GET_VOXEL_4D(v2, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-            sindex[ xyzv[VIO_X] ] += 2;
-            GET_VOXEL_4D(v3, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-            sindex[ xyzv[VIO_X] ] += 2;
-            GET_VOXEL_4D(v4, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-            sindex[ xyzv[VIO_X] ] -= 3;
-            value1 = MY_CUBIC_05(v1,v2,v3,v4);
-            sindex[ xyzv[VIO_Y] ] -= 3;
-            GET_VOXEL_4D(v1, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-            sindex[ xyzv[VIO_Y] ] += 2;
-            GET_VOXEL_4D(v2, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-            sindex[ xyzv[VIO_Y] ] += 2;
-            GET_VOXEL_4D(v3, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-            sindex[ xyzv[VIO_Y] ] += 2;
-            GET_VOXEL_4D(v4, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-            sindex[ xyzv[VIO_Y] ] -= 3;
-             value2 = MY_CUBIC_05(v1,v2,v3,v4);
-            
-            sindex[ xyzv[VIO_Z] ] -= 3;
-            GET_VOXEL_4D(v1, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-            sindex[ xyzv[VIO_Z] ] += 2;
-            GET_VOXEL_4D(v2, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-            sindex[ xyzv[VIO_Z] ] += 2;
-            GET_VOXEL_4D(v3, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-            sindex[ xyzv[VIO_Z] ] += 2;
-            GET_VOXEL_4D(v4, super_vol, sindex[0],sindex[1],sindex[2],sindex[3]);
-              sindex[ xyzv[VIO_Z] ] -= 3;
-            value3 = MY_CUBIC_05(v1,v2,v3,v4);
-            
-            value1 = (value1 + value2 + value3) / 3.0;
-    
-            SET_VOXEL_4D(super_vol, sindex[0],sindex[1],sindex[2],sindex[3], value1);
-            count++;
-
-            update_progress_report( &progress, count+1 );
-          }
-        }
-      }
-    }  /* index[ orig_xyzv[VIO_Z+1] ] */
-
-    terminate_progress_report( &progress );
+    FREE(changed);
+    FREE(update);
+  }
 
+  delete_super_sampled_source(previous);
+  previous->vectors = vectors;
+  for(i=0; i<VIO_N_DIMENSIONS; i++)
+    previous->count[i] = count[i];
 }
 
-
-void interpolate_super_sampled_data_by2(
-    VIO_General_transform *orig_deformation,
-    VIO_General_transform *super_sampled)
+void delete_super_sampled_source(Super_Sampled_Source *source)
 {
-
-  int
-    i,num_dim,
-    xyzv[VIO_MAX_DIMENSIONS],
-    count[VIO_MAX_DIMENSIONS];
-  VIO_Volume
-    orig_vol;
-
-
-  
-
-  if (orig_deformation->type != GRID_TRANSFORM || super_sampled->type != GRID_TRANSFORM) {
-    print_error_and_line_num("interpolate_super_sampled_data_by2 not called with GRID_TRANSFORM",
-                             __FILE__, __LINE__);
-  }
-
-  orig_vol = orig_deformation->displacement_volume;
-  get_volume_sizes(       orig_vol,  count);
-  get_volume_XYZV_indices(orig_vol,  xyzv);
-
-  num_dim = 0;
-
-  for(i=0; i<VIO_N_DIMENSIONS; i++) {
-    if ( count[xyzv[i]] > 1 ) 
-      num_dim++;
-  }
-  if (num_dim == 3) {
-    interpolate_super_sampled_data_by2_dim3( orig_deformation, super_sampled );
-  } else {
-
-    if (num_dim == 2){                /* then one dim == 1 */
-      
-      for(i=0; i<VIO_N_DIMENSIONS; i++) {
-
-        if ( count[xyzv[i]] == 1 ) {
-          interpolate_super_sampled_data_by2_dim2( orig_deformation, super_sampled,i );
-        }
-
-      }
-    }
-  }
+  if (source->vectors != NULL)
+    FREE(source->vectors);
+  source->vectors = NULL;
 }
 
 
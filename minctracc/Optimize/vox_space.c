@@ -298,3 +298,86 @@ void get_into_voxel_space(Arg_Data *globals,
         *z_trans /= w_trans;
     }
 }
+
+
+/* prepare the mapping of the lattice nodes of vox (see
+   get_into_voxel_space()) into the second volume */
+
+void get_lattice_mapping(Voxel_space_struct *vox, Lattice_Mapping *map)
+{
+   VIO_Transform *trans;
+   int i,k;
+
+   trans = get_linear_transform_ptr(vox->voxel_to_voxel_space);
+
+   map->vox    = vox;
+   map->affine = (Transform_elem(*trans,3,0) == 0.0 &&
+                  Transform_elem(*trans,3,1) == 0.0 &&
+                  Transform_elem(*trans,3,2) == 0.0 &&
+                  Transform_elem(*trans,3,3) == 1.0);
+
+   my_homogenous_transform_point(trans,
+                                 vox->start[0], vox->start[1], vox->start[2], 1.0,
+                                 &map->start[0], &map->start[1], &map->start[2]);
+
+   for(i=0; i<3; i++)
+      for(k=0; k<3; k++)
+         map->steps[i][k] = 
+            Transform_elem(*trans,k,0) * vox->directions[i].coords[0] +
+            Transform_elem(*trans,k,1) * vox->directions[i].coords[1] +
+            Transform_elem(*trans,k,2) * vox->directions[i].coords[2];
+}
+
+/* map the n nodes of the lattice starting at node (s,r,c) along
+   direction 'along' (SLICE_IND, ROW_IND or COL_IND) into x[],y[],z[].
+   The first node is found once, the others are equally spaced. */
+
+void map_lattice_line(Lattice_Mapping *map,
+                      int s, int r, int c,
+                      int along, int n,
+                      VIO_Real x[], VIO_Real y[], VIO_Real z[])
+{
+   VIO_Real
+      first[3], step[3], node[3];
+   int
+      index[3], i, k;
+
+   index[SLICE_IND] = s;
+   index[ROW_IND]   = r;
+   index[COL_IND]   = c;
+
+   if (map->affine) {
+
+      for(k=0; k<3; k++) {
+         first[k] = map->start[k] + 
+            index[SLICE_IND] * map->steps[SLICE_IND][k] +
+            index[ROW_IND]   * map->steps[ROW_IND][k] +
+            index[COL_IND]   * map->steps[COL_IND][k];
+         step[k]  = map->steps[along][k];
+      }
+
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+      for(i=0; i<n; i++) {
+         x[i] = first[0] + i * step[0];
+         y[i] = first[1] + i * step[1];
+         z[i] = first[2] + i * step[2];
+      }
+   }
+   else {                       /* map each node */
+
+      for(i=0; i<n; i++) {
+         for(k=0; k<3; k++)
+            node[k] = map->vox->start[k] +
+               index[SLICE_IND] * map->vox->directions[SLICE_IND].coords[k] +
+               index[ROW_IND]   * map->vox->directions[ROW_IND].coords[k] +
+               index[COL_IND]   * map->vox->directions[COL_IND].coords[k];
+
+         my_homogenous_transform_point(get_linear_transform_ptr(map->vox->voxel_to_voxel_space),
+                                       node[0], node[1], node[2], 1.0,
+                                       &x[i], &y[i], &z[i]);
+         index[along]++;
+      }
+   }
+}
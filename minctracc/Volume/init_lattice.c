@@ -500,7 +500,7 @@ void init_lattice(VIO_Volume d1,
         
         if (point_not_masked(m1, Point_x(col), Point_y(col), Point_z(col))) {        
 
-          if (INTERPOLATE_TRUE_VALUE( d1, &voxel, &true_value )) {
+          if (INTERPOLATE_TRUE_VALUE( globals, d1, &voxel, &true_value )) {
             
             if (true_value > globals->threshold[0]) {
 
@@ -609,7 +609,7 @@ void init_lattice(VIO_Volume d1,
         
         if (point_not_masked(m2, Point_x(col), Point_y(col), Point_z(col))) {                        /* should be fill_value  */
           
-          if (INTERPOLATE_TRUE_VALUE( d2, &voxel, &true_value )) {
+          if (INTERPOLATE_TRUE_VALUE( globals, d2, &voxel, &true_value )) {
             
             if (true_value > globals->threshold[1]) {
 
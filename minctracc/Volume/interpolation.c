@@ -71,10 +71,58 @@ static char rcsid[]="$Header: /static-cvsroot/registration/mni_autoreg/minctracc
 #endif
 
 #include <volume_io.h>
+#include <Proglib.h>
 #include "minctracc_point_vector.h"
+#include "interpolation.h"
 
 #define VOL_NDIMS 3
 
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : get_volume_voxel_buffer
+@INPUT      : volume - pointer to a 3D volume
+@OUTPUT     : double_voxels - the voxels when stored as NC_DOUBLE, else NULL
+              float_voxels  - the voxels when stored as NC_FLOAT, else NULL
+              strides       - offsets between neighbours along each of the
+                 three dimensions (the last dimension varies fastest).
+@RETURNS    : TRUE if the voxels can be read directly from one of the two
+              buffers, FALSE otherwise.
+@DESCRIPTION: volumes loaded as NC_DOUBLE or NC_FLOAT (see -voxel_type)
+              hold real values with no scaling, contiguously behind the
+              pointer tables of the multidim array, so that voxel
+              [i][j][k] can be read at i*strides[0] + j*strides[1] + k.
+              Other data types must be read through volume_io.
+@CREATED    : Oct 18, 2026
+---------------------------------------------------------------------------- */
+VIO_BOOL get_volume_voxel_buffer(VIO_Volume volume, 
+                                 double **double_voxels, float **float_voxels,
+                                 long strides[])
+{
+  int sizes[VIO_MAX_DIMENSIONS];
+
+  *double_voxels = NULL;
+  *float_voxels  = NULL;
+
+  if (volume == NULL || get_volume_n_dimensions(volume) != VOL_NDIMS ||
+      VOXEL_DATA(volume) == NULL)
+    return FALSE;
+
+  get_volume_sizes(volume, sizes);
+  strides[0] = (long)sizes[1] * sizes[2];
+  strides[1] = (long)sizes[2];
+  strides[2] = 1;
+
+  switch (get_volume_data_type(volume)) {
+  case VIO_DOUBLE:
+    *double_voxels = &((double ***)VOXEL_DATA(volume))[0][0][0];
+    return TRUE;
+  case VIO_FLOAT:
+    *float_voxels  = &((float ***)VOXEL_DATA(volume))[0][0][0];
+    return TRUE;
+  default:
+    return FALSE;
+  }
+}
+
 /* ----------------------------- MNI Header -----------------------------------
 @NAME       : nearest_neighbour_interpolant
 @INPUT      : volume - pointer to volume data
@@ -96,8 +144,10 @@ int nearest_neighbour_interpolant(VIO_Volume volume,
 {
    long 
      ind0, ind1, ind2, 
-     max[3];
+     max[3], strides[3], idx;
    int sizes[3];
+   double *double_voxels;
+   float  *float_voxels;
 
    /* Check that the coordinate is inside the volume */
    
@@ -121,7 +171,12 @@ int nearest_neighbour_interpolant(VIO_Volume volume,
    ind2 = (long) floor(Point_z( *coord ) + 0.5);
 
    /* Get the value */
-   GET_VALUE_3D( *result ,  volume, ind0  , ind1  , ind2  );
+   if (get_volume_voxel_buffer(volume, &double_voxels, &float_voxels, strides)) {
+     idx = ind0*strides[0] + ind1*strides[1] + ind2;
+     *result = (double_voxels != NULL) ? double_voxels[idx] : (double)float_voxels[idx];
+   }
+   else
+     GET_VALUE_3D( *result ,  volume, ind0  , ind1  , ind2  );
 
    return TRUE;
 
@@ -147,12 +202,36 @@ int nearest_neighbour_interpolant(VIO_Volume volume,
 int trilinear_interpolant(VIO_Volume volume, 
                                  PointR *coord, double *result)
 {
-  long ind0, ind1, ind2, max[3];
+  return( trilinear_interpolant_with_gradient(volume, coord, result, NULL) );
+}
+
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : trilinear_interpolant_with_gradient
+@INPUT      : volume - pointer to volume data
+              coord - point at which volume should be interpolated in voxel 
+                 units (with 0 being first point of the volume).
+@OUTPUT     : result - interpolated TRUE value.
+              gradient - if not NULL, the derivatives of the interpolated
+                 value along the 3 voxel axes (0 where the nearest
+                 neighbour is used, at the border of the volume).
+@RETURNS    : TRUE if coord is within the volume, FALSE otherwise.
+@DESCRIPTION: trilinear_interpolant(), with its derivatives, used for the
+              analytic gradient of the objective functions.
+@CREATED    : Oct 18, 2026
+---------------------------------------------------------------------------- */
+int trilinear_interpolant_with_gradient(VIO_Volume volume, 
+                                        PointR *coord, double *result,
+                                        double gradient[])
+{
+  long ind0, ind1, ind2, max[3], strides[3], idx;
   int sizes[3];
   int flag;
   double temp_result;
-  static double f0, f1, f2, r0, r1, r2, r1r2, r1f2, f1r2, f1f2;
-  static double v000, v001, v010, v011, v100, v101, v110, v111;
+  double *double_voxels;
+  float  *float_voxels;
+  double f0, f1, f2, r0, r1, r2, r1r2, r1f2, f1r2, f1f2;
+  double v000, v001, v010, v011, v100, v101, v110, v111;
   
   /* Check that the coordinate is inside the volume */
   
@@ -167,6 +246,8 @@ int trilinear_interpolant(VIO_Volume volume,
     
     flag = nearest_neighbour_interpolant(volume, coord, &temp_result) ;
     *result = temp_result;
+    if (gradient != NULL)
+      gradient[0] = gradient[1] = gradient[2] = 0.0;
     return(flag);
   }
     
@@ -179,14 +260,39 @@ int trilinear_interpolant(VIO_Volume volume,
   if (ind2 >= max[2]-1) ind2 = max[2]-1;
   
   /* Get the relevant voxels */
-  GET_VALUE_3D( v000 ,  volume, ind0  , ind1  , ind2   ); 
-  GET_VALUE_3D( v001 ,  volume, ind0  , ind1  , ind2+1 ); 
-  GET_VALUE_3D( v010 ,  volume, ind0  , ind1+1, ind2   ); 
-  GET_VALUE_3D( v011 ,  volume, ind0  , ind1+1, ind2+1 ); 
-  GET_VALUE_3D( v100 ,  volume, ind0+1, ind1  , ind2   ); 
-  GET_VALUE_3D( v101 ,  volume, ind0+1, ind1  , ind2+1 ); 
-  GET_VALUE_3D( v110 ,  volume, ind0+1, ind1+1, ind2   ); 
-  GET_VALUE_3D( v111 ,  volume, ind0+1, ind1+1, ind2+1 ); 
+  if (get_volume_voxel_buffer(volume, &double_voxels, &float_voxels, strides)) {
+    idx = ind0*strides[0] + ind1*strides[1] + ind2;
+    if (double_voxels != NULL) {
+      v000 = double_voxels[idx                          ];
+      v001 = double_voxels[idx                       + 1];
+      v010 = double_voxels[idx            + strides[1]   ];
+      v011 = double_voxels[idx            + strides[1]+ 1];
+      v100 = double_voxels[idx+ strides[0]               ];
+      v101 = double_voxels[idx+ strides[0]           + 1];
+      v110 = double_voxels[idx+ strides[0]+ strides[1]   ];
+      v111 = double_voxels[idx+ strides[0]+ strides[1]+ 1];
+    }
+    else {
+      v000 = float_voxels[idx                          ];
+      v001 = float_voxels[idx                       + 1];
+      v010 = float_voxels[idx            + strides[1]   ];
+      v011 = float_voxels[idx            + strides[1]+ 1];
+      v100 = float_voxels[idx+ strides[0]               ];
+      v101 = float_voxels[idx+ strides[0]           + 1];
+      v110 = float_voxels[idx+ strides[0]+ strides[1]   ];
+      v111 = float_voxels[idx+ strides[0]+ strides[1]+ 1];
+    }
+  }
+  else {
+    GET_VALUE_3D( v000 ,  volume, ind0  , ind1  , ind2   ); 
+    GET_VALUE_3D( v001 ,  volume, ind0  , ind1  , ind2+1 ); 
+    GET_VALUE_3D( v010 ,  volume, ind0  , ind1+1, ind2   ); 
+    GET_VALUE_3D( v011 ,  volume, ind0  , ind1+1, ind2+1 ); 
+    GET_VALUE_3D( v100 ,  volume, ind0+1, ind1  , ind2   ); 
+    GET_VALUE_3D( v101 ,  volume, ind0+1, ind1  , ind2+1 ); 
+    GET_VALUE_3D( v110 ,  volume, ind0+1, ind1+1, ind2   ); 
+    GET_VALUE_3D( v111 ,  volume, ind0+1, ind1+1, ind2+1 ); 
+  }
 
   /* Get the fraction parts */
   f0 = Point_x( *coord ) - ind0;
@@ -213,6 +319,14 @@ int trilinear_interpolant(VIO_Volume volume,
            f1r2 * v110 +
            f1f2 * v111);
 
+  if (gradient != NULL) {
+    gradient[0] = (r1r2 * (v100-v000) + r1f2 * (v101-v001) +
+                   f1r2 * (v110-v010) + f1f2 * (v111-v011));
+    gradient[1] = r0 * (r2 * (v010-v000) + f2 * (v011-v001)) +
+                  f0 * (r2 * (v110-v100) + f2 * (v111-v101));
+    gradient[2] = r0 * (r1 * (v001-v000) + f1 * (v011-v010)) +
+                  f0 * (r1 * (v101-v100) + f1 * (v111-v110));
+  }
   
   return TRUE;
   
@@ -368,6 +482,41 @@ int tricubic_interpolant(VIO_Volume volume,
 }
 
 
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : get_world_to_voxel_matrix
+@INPUT      : volume - pointer to a 3D volume
+@OUTPUT     : m - the world to voxel transform of the volume, such that
+                 voxel[i] = m[i][0]*x + m[i][1]*y + m[i][2]*z + m[i][3]
+@RETURNS    : (nothing)
+@DESCRIPTION: the voxel to world transform of a volume is linear, so the
+              world to voxel conversion of many points can be done with
+              a 3x4 matrix instead of a call to convert_world_to_voxel()
+              for each point.
+@CREATED    : Oct 18, 2026
+---------------------------------------------------------------------------- */
+void get_world_to_voxel_matrix(VIO_Volume volume, VIO_Real m[3][4])
+{
+  VIO_Real
+    origin[VIO_MAX_DIMENSIONS],
+    voxel[VIO_MAX_DIMENSIONS];
+  int
+    i,j;
+
+  convert_world_to_voxel(volume, 0.0, 0.0, 0.0, origin);
+  for(i=0; i<3; i++)
+    m[i][3] = origin[i];
+
+  for(j=0; j<3; j++) {
+    convert_world_to_voxel(volume,
+                           (j==0) ? 1.0 : 0.0,
+                           (j==1) ? 1.0 : 0.0,
+                           (j==2) ? 1.0 : 0.0, voxel);
+    for(i=0; i<3; i++)
+      m[i][j] = voxel[i] - origin[i];
+  }
+}
+
+
 /* A point is not masked if it is a point we should consider.
    If the mask volume is NULL, we consider all points.
    Otherwise, consider a point if the mask volume value is > 0.
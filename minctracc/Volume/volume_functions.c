@@ -629,3 +629,90 @@ void normalize_data_to_match_target(VIO_Volume d1, VIO_Volume m1, VIO_Real thres
   
 }
 
+
+
+/* return a copy of d1 blurred with an isotropic gaussian kernel of
+   full-width-half-maximum fwhm (in mm).  The kernel is applied
+   separably along each voxel axis and renormalized where it falls
+   outside the volume, so that the edges are not darkened.  This is
+   used between the levels of -nonlinear_schedule, instead of reading
+   volumes blurred by mincblur. */
+
+VIO_Volume blur_volume(VIO_Volume d1, VIO_Real fwhm)
+{
+  VIO_Volume
+    vol;
+  int
+    sizes[VIO_MAX_DIMENSIONS],
+    axis, radius, n, i,j,k, l;
+  long
+    strides[3], line_start, count;
+  VIO_Real
+    thick[VIO_MAX_DIMENSIONS],
+    sigma, sum, weight_sum;
+  double
+    *values, *line, *kernel;
+
+  get_volume_sizes(d1, sizes);
+  get_volume_separations(d1, thick);
+
+  strides[2] = 1;
+  strides[1] = sizes[2];
+  strides[0] = (long)sizes[1] * sizes[2];
+  count      = strides[0] * sizes[0];
+
+  ALLOC(values, count);
+  for(i=0; i<sizes[0]; i++)
+    for(j=0; j<sizes[1]; j++)
+      for(k=0; k<sizes[2]; k++)
+        values[i*strides[0] + j*strides[1] + k] = 
+          get_volume_real_value(d1, i, j, k, 0, 0);
+
+  for(axis=0; axis<3; axis++) {
+
+    sigma = fwhm / (2.0*sqrt(2.0*log(2.0))) / fabs(thick[axis]);
+    radius = (int)ceil(3.0*sigma);
+    if (sigma <= 0.0 || radius < 1 || sizes[axis] < 2)
+      continue;
+
+    n = sizes[axis];
+    ALLOC(line,   n);
+    ALLOC(kernel, 2*radius+1);
+    for(l=-radius; l<=radius; l++)
+      kernel[l+radius] = exp(-0.5*(l*l)/(sigma*sigma));
+
+                                /* convolve every line along this axis */
+    for(i=0; i<sizes[(axis+1)%3]; i++)
+      for(j=0; j<sizes[(axis+2)%3]; j++) {
+        line_start = i*strides[(axis+1)%3] + j*strides[(axis+2)%3];
+
+        for(k=0; k<n; k++)
+          line[k] = values[line_start + k*strides[axis]];
+
+        for(k=0; k<n; k++) {
+          sum = weight_sum = 0.0;
+          for(l=-radius; l<=radius; l++)
+            if (k+l >= 0 && k+l < n) {
+              sum        += kernel[l+radius] * line[k+l];
+              weight_sum += kernel[l+radius];
+            }
+          values[line_start + k*strides[axis]] = sum / weight_sum;
+        }
+      }
+
+    FREE(kernel);
+    FREE(line);
+  }
+
+  vol = copy_volume_definition(d1, NC_UNSPECIFIED, FALSE, 0.0, 0.0);
+
+  for(i=0; i<sizes[0]; i++)
+    for(j=0; j<sizes[1]; j++)
+      for(k=0; k<sizes[2]; k++)
+        set_volume_real_value(vol, i, j, k, 0, 0,
+                              values[i*strides[0] + j*strides[1] + k]);
+
+  FREE(values);
+
+  return(vol);
+}